@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "cachepix.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+ * cachepix benchmark suite
+ *
+ * Times every bulk operation on every backend the CPU can run, over
+ * synthetic images from L1-resident to DRAM-bound, 8- and 16-bit samples,
+ * with the library's aligned stride and with unaligned rows.
+ * Reports median and p99 time per call, throughput and cycles per pixel,
+ * as a table, CSV or JSON.
+ *
+ *   make bench && ./build/bench [-b backends] [-o ops] [-s sizes] [-d depths]
+ *                               [-a aligned|unaligned|both] [-n samples]
+ *                               [-t seconds] [-c cpu] [-f table|csv|json]
+ */
+
+#define MIN_SAMPLE_NS   20000.0     // batch calls until one sample takes this long
+#define MAX_SAMPLES     1000
+
+typedef struct {
+    const char *name;
+    uint32_t features;
+    int (*scale)(PPM_ptr, float, float);
+    int (*rgb_to_grayscale)(PPM_ptr, const PPM_ptr);
+    int (*convert_maxval)(PPM_ptr, uint16_t);
+    int (*apply_lut)(PPM_ptr, const uint8_t *);
+    int (*planar_unpack)(PPM_planar_ptr, const PPM_ptr);
+    int (*planar_pack)(PPM_ptr, const PPM_planar_ptr);
+    int (*planar_scale)(PPM_planar_ptr, float, float);
+    int (*planar_rgb_to_grayscale)(PPM_planar_ptr, const PPM_planar_ptr);
+    int (*resize)(PPM_ptr, const PPM_ptr, int);
+    int (*stats)(const PPM_ptr, PPM_stats *);
+    int (*histogram)(const PPM_ptr, uint32_t *);
+} bench_backend_t;
+
+static int auto_grayscale(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
+    return ppm_rgb_to_grayscale(dst_ptr, src_ptr);
+}
+
+static int auto_apply_lut(PPM_ptr img_ptr, const uint8_t *map) {
+    PPM_lut lut;
+    ppm_lut_init(&lut, img_ptr->maxval);
+    memcpy(lut.map, map, sizeof(lut.map));
+    return ppm_apply_lut(img_ptr, &lut);
+}
+
+/*
+ * "auto" goes through the public entry points: runtime dispatch, lookup
+ * tables and the thread pool, as applications see them
+ */
+static const bench_backend_t backends[] = {
+    { "auto",   0,            ppm_scale, auto_grayscale, ppm_convert_maxval, auto_apply_lut,
+                ppm_planar_unpack, ppm_planar_pack, ppm_planar_scale, ppm_planar_rgb_to_grayscale,
+                ppm_resize, ppm_stats, ppm_histogram },
+    { "scalar", 0,            ppm_scale_scalar, ppm_rgb_to_grayscale_scalar, ppm_convert_maxval_scalar, ppm_apply_lut_scalar,
+                ppm_planar_unpack_scalar, ppm_planar_pack_scalar, ppm_planar_scale_scalar, ppm_planar_rgb_to_grayscale_scalar,
+                NULL, ppm_stats_scalar, NULL },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2",   PPM_CPU_SSE2, ppm_scale_sse2, ppm_rgb_to_grayscale_sse2, ppm_convert_maxval_sse2, NULL,
+                NULL, NULL, ppm_planar_scale_sse2, ppm_planar_rgb_to_grayscale_sse2,
+                NULL, ppm_stats_sse2, NULL },
+    { "avx512", PPM_CPU_AVX2 | PPM_CPU_AVX512F | PPM_CPU_AVX512BW | PPM_CPU_AVX512VBMI,
+                ppm_scale_avx512, ppm_rgb_to_grayscale_avx512, ppm_convert_maxval_avx512, ppm_apply_lut_avx512,
+                ppm_planar_unpack_avx512, ppm_planar_pack_avx512, ppm_planar_scale_avx512, ppm_planar_rgb_to_grayscale_avx512,
+                NULL, ppm_stats_avx2, NULL },
+    { "avx2",   PPM_CPU_AVX2, ppm_scale_avx2, ppm_rgb_to_grayscale_avx2, ppm_convert_maxval_avx2, ppm_apply_lut_avx2,
+                ppm_planar_unpack_avx2, ppm_planar_pack_avx2, ppm_planar_scale_avx2, ppm_planar_rgb_to_grayscale_avx2,
+                NULL, ppm_stats_avx2, NULL },
+#endif
+#if defined(__aarch64__) || defined(__arm__)
+    { "neon",   PPM_CPU_NEON, ppm_scale_neon, ppm_rgb_to_grayscale_neon, ppm_convert_maxval_neon, ppm_apply_lut_neon,
+                ppm_planar_unpack_neon, ppm_planar_pack_neon, ppm_planar_scale_neon, ppm_planar_rgb_to_grayscale_neon,
+                NULL, ppm_stats_neon, NULL },
+#endif
+};
+
+#define N_BACKENDS (sizeof(backends)/sizeof(backends[0]))
+
+static const char *op_names[] = { "scale", "convert_maxval", "grayscale", "apply_lut",
+                                   "planar_unpack", "planar_pack", "planar_scale", "planar_grayscale",
+                                   "resize", "stats", "histogram" };
+#define N_OPS (sizeof(op_names)/sizeof(op_names[0]))
+
+// Square images, 3 KiB to 48 MiB of 8-bit pixels
+static const uint32_t default_sizes[] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+
+typedef struct {
+    const bench_backend_t *backend;
+    int op;
+    uint32_t size;
+    int depth;
+    int aligned;
+    int n_samples;
+    double median_ns, p99_ns;
+    double gbps;
+    double cycles_per_px;       // < 0 when no cycle counter is available
+} bench_result_t;
+
+/*
+ * Cycle counter: the TSC on x86 (reference cycles), the perf cycle
+ * counter elsewhere when the kernel lets us open it
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static const char *cycle_source = "tsc";
+
+static int cycles_init(void) {
+    return 0;
+}
+
+static uint64_t cycles_now(void) {
+    return __rdtsc();
+}
+#elif defined(__linux__)
+static const char *cycle_source = "perf";
+static int perf_fd = -1;
+
+static int cycles_init(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        cycle_source = "none";
+    return perf_fd < 0 ? -1 : 0;
+}
+
+static uint64_t cycles_now(void) {
+    uint64_t count = 0;
+    if (perf_fd < 0 || read(perf_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+#else
+static const char *cycle_source = "none";
+
+static int cycles_init(void) {
+    return -1;
+}
+
+static uint64_t cycles_now(void) {
+    return 0;
+}
+#endif
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Synthetic image with random samples below maxval
+ * Unaligned images start one byte into the buffer and pack their rows,
+ * so neither the rows nor most of their starts sit on a vector boundary.
+ * data_size keeps the library's value so the kernels accept the image.
+ */
+typedef struct {
+    PPM_img img;
+    char *buffer;
+} bench_image_t;
+
+static int make_image(bench_image_t *b, uint32_t size, uint16_t maxval, int aligned) {
+    size_t bpc = (maxval <= 255) ? 1 : 2;
+    size_t row_bytes = (size_t)size*3*bpc;
+
+    memset(b, 0, sizeof(*b));
+    b->img.width = size;
+    b->img.height = size;
+    b->img.maxval = maxval;
+    b->img.channels = 3;
+    b->img.data_size = ppm_expected_data_size(size, size, maxval);
+    b->img.stride = aligned ? b->img.data_size/size : row_bytes;
+
+    b->buffer = aligned_alloc(PPM_ALIGNMENT, b->img.data_size + PPM_ALIGNMENT);
+    if (b->buffer == NULL)
+        return -1;
+    b->img.data = b->buffer + (aligned ? 0 : 1);
+
+    for (uint32_t y = 0; y < size; ++y) {
+        uint8_t *row = (uint8_t *)b->img.data + y*b->img.stride;
+        for (size_t i = 0; i < size*(size_t)3; ++i) {
+            uint16_t v = (uint16_t)(rand() % (maxval + 1));
+            if (bpc == 2) {
+                row[i*2] = (uint8_t)(v >> 8);
+                row[i*2+1] = (uint8_t)v;
+            } else {
+                row[i] = (uint8_t)v;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * One call of the operation under test
+ * convert_maxval flips between two maxvals of the same depth so that every
+ * call does the same work in place; resize makes a quarter-size thumbnail
+ */
+static uint32_t hist[3*65536];
+
+static int run_op(const bench_backend_t *backend, int op, PPM_ptr img, PPM_ptr dst, PPM_planar_ptr planar,
+                  const uint8_t *map, uint16_t maxval) {
+    switch (op) {
+    case 0:
+        return backend->scale(img, 1.0f, 0.25f);
+    case 1:
+        return backend->convert_maxval(img, img->maxval == maxval ? maxval - 1 : maxval);
+    case 2:
+        return backend->rgb_to_grayscale(dst, img);
+    case 3:
+        return backend->apply_lut(img, map);
+    case 4:
+        return backend->planar_unpack(planar, img);
+    case 5:
+        return backend->planar_pack(img, planar);
+    case 6:
+        return backend->planar_scale(planar, 1.0f, 0.25f);
+    case 7:
+        return backend->planar_rgb_to_grayscale(planar, planar);
+    case 8:
+        return backend->resize(dst, img, PPM_RESIZE_LANCZOS3);
+    case 9: {
+        PPM_stats stats;
+        return backend->stats(img, &stats);
+    }
+    case 10:
+        return backend->histogram(img, hist);
+    }
+    return -1;
+}
+
+static int bench_case(bench_result_t *r, int max_samples, double budget_ns) {
+    const uint16_t maxval = (r->depth == 8) ? 255 : 65535;
+    bench_image_t src, dst;
+    uint8_t map[256];
+
+    for (int v = 0; v < 256; ++v)
+        map[v] = (uint8_t)(255 - v);
+
+    if (make_image(&src, r->size, maxval, r->aligned) < 0)
+        return -1;
+    uint32_t dst_size = (r->op == 8) ? (r->size + 3)/4 : r->size;
+    if (make_image(&dst, dst_size, maxval, r->aligned) < 0) {
+        free(src.buffer);
+        return -1;
+    }
+
+    // Planes are always the library's own, aligned ones
+    PPM_planar_ptr planar = ppm_planar_create(r->size, r->size, maxval);
+    if (planar == NULL || ppm_planar_unpack(planar, &src.img) != 0) {
+        ppm_planar_free(planar);
+        free(src.buffer);
+        free(dst.buffer);
+        return -1;
+    }
+
+    int err = run_op(r->backend, r->op, &src.img, &dst.img, planar, map, maxval);
+
+    // Batch enough calls per sample to get well above the timer resolution
+    double t0 = now_ns();
+    err |= run_op(r->backend, r->op, &src.img, &dst.img, planar, map, maxval);
+    double once = now_ns() - t0;
+    int batch = (once >= MIN_SAMPLE_NS) ? 1 : (int)(MIN_SAMPLE_NS/(once + 1.0)) + 1;
+
+    static double ns[MAX_SAMPLES];
+    static double cyc[MAX_SAMPLES];
+    int n = 0;
+    double start = now_ns();
+
+    while (err == 0 && n < max_samples && (n < 11 || now_ns() - start < budget_ns)) {
+        uint64_t c0 = cycles_now();
+        t0 = now_ns();
+        for (int i = 0; i < batch; ++i)
+            err |= run_op(r->backend, r->op, &src.img, &dst.img, planar, map, maxval);
+        double t1 = now_ns();
+        uint64_t c1 = cycles_now();
+
+        ns[n] = (t1 - t0)/batch;
+        cyc[n] = (double)(c1 - c0)/batch;
+        n++;
+    }
+
+    ppm_planar_free(planar);
+    free(src.buffer);
+    free(dst.buffer);
+    if (err != 0)
+        return err;
+
+    qsort(ns, n, sizeof(double), cmp_double);
+    qsort(cyc, n, sizeof(double), cmp_double);
+
+    double pixels = (double)r->size*r->size;
+    double bytes = pixels*3*(r->depth/8)*2;     // every sample read once and written once
+
+    r->n_samples = n;
+    r->median_ns = ns[n/2];
+    r->p99_ns = ns[(n*99)/100 < n ? (n*99)/100 : n-1];
+    r->gbps = bytes/r->median_ns;
+    r->cycles_per_px = strcmp(cycle_source, "none") == 0 ? -1.0 : cyc[n/2]/pixels;
+
+    return 0;
+}
+
+static void print_result(const bench_result_t *r, const char *format, int first) {
+    const char *align = r->aligned ? "aligned" : "unaligned";
+
+    if (strcmp(format, "csv") == 0) {
+        if (first)
+            printf("backend,op,width,height,depth,stride,samples,median_ns,p99_ns,gbps,cycles_per_px\n");
+        printf("%s,%s,%u,%u,%d,%s,%d,%.1f,%.1f,%.3f,", r->backend->name, op_names[r->op],
+               r->size, r->size, r->depth, align, r->n_samples, r->median_ns, r->p99_ns, r->gbps);
+        if (r->cycles_per_px >= 0)
+            printf("%.4f", r->cycles_per_px);
+        printf("\n");
+    } else if (strcmp(format, "json") == 0) {
+        printf("%s\n    {\"backend\": \"%s\", \"op\": \"%s\", \"width\": %u, \"height\": %u, "
+               "\"depth\": %d, \"stride\": \"%s\", \"samples\": %d, \"median_ns\": %.1f, "
+               "\"p99_ns\": %.1f, \"gbps\": %.3f, \"cycles_per_px\": ",
+               first ? "" : ",", r->backend->name, op_names[r->op], r->size, r->size, r->depth,
+               align, r->n_samples, r->median_ns, r->p99_ns, r->gbps);
+        if (r->cycles_per_px >= 0)
+            printf("%.4f}", r->cycles_per_px);
+        else
+            printf("null}");
+    } else {
+        if (first)
+            printf("%-7s %-16s %11s %5s %-9s %13s %13s %8s %9s\n",
+                   "backend", "op", "size", "depth", "stride", "median ns", "p99 ns", "GB/s", "cyc/px");
+        char size[24];
+        snprintf(size, sizeof(size), "%ux%u", r->size, r->size);
+        printf("%-7s %-16s %11s %5d %-9s %13.1f %13.1f %8.2f ", r->backend->name, op_names[r->op],
+               size, r->depth, align, r->median_ns, r->p99_ns, r->gbps);
+        if (r->cycles_per_px >= 0)
+            printf("%9.3f\n", r->cycles_per_px);
+        else
+            printf("%9s\n", "-");
+    }
+    fflush(stdout);
+}
+
+/*
+ * Comma-separated list filter; NULL selects everything
+ */
+static int selected(const char *list, const char *name) {
+    if (list == NULL)
+        return 1;
+
+    size_t len = strlen(name);
+    for (const char *p = list; *p != '\0'; ) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == len && strncmp(p, name, n) == 0)
+            return 1;
+        if (end == NULL)
+            break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -b LIST   backends (auto,scalar,sse2,avx2,avx512,neon; default: all supported)\n"
+            "  -o LIST   operations (scale,convert_maxval,grayscale,apply_lut,planar_unpack,\n"
+            "            planar_pack,planar_scale,planar_grayscale,resize,stats,histogram; default: all)\n"
+            "  -s LIST   square image sizes in pixels (default: 32,64,...,4096)\n"
+            "  -d LIST   sample depths, 8 and/or 16 (default: both)\n"
+            "  -a MODE   strides: aligned, unaligned or both (default: both)\n"
+            "  -n N      samples per case (default: 200, max %d)\n"
+            "  -t SEC    time budget per case (default: 0.5)\n"
+            "  -c CPU    pin to a core\n"
+            "  -j N      threads for the auto backend (default: 1)\n"
+            "  -f FMT    table, csv or json (default: table)\n",
+            prog, MAX_SAMPLES);
+}
+
+int main(int argc, char **argv) {
+    const char *backend_list = NULL, *op_list = NULL, *size_list = NULL, *depth_list = "8,16";
+    const char *format = "table";
+    int align_mode = 2;     // 0 aligned, 1 unaligned, 2 both
+    int max_samples = 200, threads = 1, cpu = -1;
+    double budget = 0.5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:o:s:d:a:n:t:c:j:f:h")) != -1) {
+        switch (opt) {
+        case 'b': backend_list = optarg; break;
+        case 'o': op_list = optarg; break;
+        case 's': size_list = optarg; break;
+        case 'd': depth_list = optarg; break;
+        case 'a':
+            align_mode = strcmp(optarg, "aligned") == 0 ? 0 : strcmp(optarg, "unaligned") == 0 ? 1 : 2;
+            break;
+        case 'n': max_samples = atoi(optarg); break;
+        case 't': budget = atof(optarg); break;
+        case 'c': cpu = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        case 'f': format = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (max_samples < 1 || max_samples > MAX_SAMPLES)
+        max_samples = MAX_SAMPLES;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity");
+            return 1;
+        }
+    }
+
+    ppm_set_threads(threads);
+    ppm_init();
+    cycles_init();
+    srand(1);
+
+    uint32_t sizes[64];
+    size_t n_sizes = 0;
+    if (size_list == NULL) {
+        n_sizes = sizeof(default_sizes)/sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    } else {
+        for (const char *p = size_list; *p != '\0' && n_sizes < 64; ) {
+            sizes[n_sizes++] = (uint32_t)strtoul(p, (char **)&p, 10);
+            if (*p == ',')
+                p++;
+            else
+                break;
+        }
+    }
+
+    uint32_t features = ppm_cpu_features();
+    int first = 1;
+
+    if (strcmp(format, "json") == 0)
+        printf("{\n  \"dispatch\": \"%s\", \"threads\": %d, \"cycle_source\": \"%s\",\n  \"results\": [",
+               ppm_backend(), ppm_get_threads(), cycle_source);
+    else if (strcmp(format, "table") == 0)
+        printf("# dispatch: %s, threads: %d, cycles: %s\n", ppm_backend(), ppm_get_threads(), cycle_source);
+
+    for (size_t b = 0; b < N_BACKENDS; ++b) {
+        const bench_backend_t *backend = &backends[b];
+        if (!selected(backend_list, backend->name) || (backend->features & features) != backend->features)
+            continue;
+
+        for (size_t op = 0; op < N_OPS; ++op) {
+            if (!selected(op_list, op_names[op]))
+                continue;
+
+            for (size_t s = 0; s < n_sizes; ++s) {
+                for (int depth = 8; depth <= 16; depth += 8) {
+                    char depth_name[4];
+                    snprintf(depth_name, sizeof(depth_name), "%d", depth);
+                    if (!selected(depth_list, depth_name))
+                        continue;
+
+                    // Tables only exist for 8-bit samples
+                    if (op == 3 && (depth != 8 || backend->apply_lut == NULL))
+                        continue;
+
+                    // SSE2 packs and unpacks through the scalar code
+                    if ((op == 4 && backend->planar_unpack == NULL) || (op == 5 && backend->planar_pack == NULL))
+                        continue;
+
+                    // Resizing and histograms only run through their public entry points; pin kernels with CACHEPIX_BACKEND
+                    if ((op == 8 && backend->resize == NULL) || (op == 10 && backend->histogram == NULL))
+                        continue;
+
+                    for (int aligned = 1; aligned >= 0; --aligned) {
+                        if ((align_mode == 0 && !aligned) || (align_mode == 1 && aligned))
+                            continue;
+
+                        bench_result_t r = { .backend = backend, .op = (int)op, .size = sizes[s],
+                                             .depth = depth, .aligned = aligned };
+                        if (bench_case(&r, max_samples, budget*1e9) != 0) {
+                            fprintf(stderr, "%s %s %ux%u %d-bit: failed\n", backend->name, op_names[op],
+                                    sizes[s], sizes[s], depth);
+                            continue;
+                        }
+
+                        print_result(&r, format, first);
+                        first = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    if (strcmp(format, "json") == 0)
+        printf("\n  ]\n}\n");
+
+    return 0;
+}
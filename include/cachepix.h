@@ -1,44 +1,282 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define PPM_ALIGNMENT 64
 #define WHITESPACE_CHAR '\n'
 
 typedef char* data_t;
 
-typedef struct {
+struct ppm_shared;
+
+typedef struct ppm_img {
     uint32_t width, height, data_size;
     uint16_t maxval;
-    char *data;       // aligned
+    uint16_t channels; // samples per pixel: 1 gray, 2 gray+alpha, 3 RGB, 4 RGBA
+    char *data;       // aligned, except in views (see ppm_view)
     size_t stride;
+    void *map_base;   // file mapping backing data, NULL when heap allocated
+    size_t map_size;
+    size_t alloc_size; // bytes obtained from the allocator for data, 0 if not owned
+    int layout;       // PPM_LAYOUT_ROWS or PPM_LAYOUT_TILED
+    struct ppm_shared *shared; // refcounted buffer shared with clones, NULL if not shared
+    struct ppm_img *parent;    // a view's image (see ppm_view), NULL otherwise
+    size_t parent_offset;      // of a view's first pixel in its parent's buffer
 } PPM_img, *PPM_ptr;
 
+#define PPM_MAX_CHANNELS 4
+
+/*
+ * File formats, numbered after their magic number (P1 ... P7)
+ * Loading takes any of them: PBM bitmaps become 1-channel images of maxval 1
+ * (0 black, 1 white), PAM files keep their depth (1 to 4 channels). Saving
+ * writes PGM, PPM or PAM (2 and 4 channels) unless a format is asked for.
+ */
+#define PPM_FORMAT_AUTO         0
+#define PPM_FORMAT_PBM_PLAIN    1
+#define PPM_FORMAT_PGM_PLAIN    2
+#define PPM_FORMAT_PPM_PLAIN    3
+#define PPM_FORMAT_PBM          4
+#define PPM_FORMAT_PGM          5
+#define PPM_FORMAT_PPM          6
+#define PPM_FORMAT_PAM          7
+
+/*
+ * Pixel layouts
+ * ROWS: row-major, rows stride bytes apart
+ * TILED: PPM_TILE_PIXELS x PPM_TILE_PIXELS pixel tiles, each stored
+ * contiguously (row-major inside, stride is the tile row stride) in
+ * row-major tile order; edge tiles are padded to full size
+ */
+#define PPM_LAYOUT_ROWS     0
+#define PPM_LAYOUT_TILED    1
+#define PPM_TILE_PIXELS     64
+
+/*
+ * Pixel buffer allocator
+ * alloc must return PPM_ALIGNMENT-aligned memory; free gets the size passed to alloc
+ */
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} PPM_allocator;
+
+#define PPM_POOL_HUGEPAGES  (1 << 0)    // back large pooled buffers with huge pages
+
+/*
+ * Sequential row-band access to a PPM file on disk
+ * Only one band of rows is resident at a time
+ */
+typedef struct {
+    FILE *fp;
+    uint32_t width, height;
+    uint16_t maxval;
+    uint16_t channels;
+    uint32_t row;       // next row to read or write
+    int writing;
+} PPM_stream, *PPM_stream_ptr;
+
+#define PPM_MMAP_POPULATE   (1 << 0)    // prefault the whole file mapping
+#define PPM_MMAP_VIEW       (1 << 1)    // point into the mapping when it's aligned and stride == row bytes
+
+/*
+ * 256-entry lookup table for point operations on 8-bit samples
+ * map[v] is the output for input sample v
+ */
+typedef struct {
+    uint16_t in_maxval;     // maxval of the images it applies to
+    uint16_t maxval;        // maxval of the output
+    uint8_t map[256];
+} PPM_lut;
+
+/*
+ * User curve for ppm_lut_curve: maps v in [0, maxval] to [0, maxval]
+ */
+typedef uint16_t (*ppm_curve_fn)(void *ctx, uint16_t v, uint16_t maxval);
+
+/*
+ * 1-D convolution kernel of an odd number of taps, centred on the middle one
+ * ppm_convolve applies one along the rows and one down the columns
+ */
+#define PPM_KERNEL_MAX_SIZE 63
+
+typedef struct {
+    uint32_t size;
+    float weights[PPM_KERNEL_MAX_SIZE];
+} PPM_kernel;
+
+/*
+ * Resampling filters for ppm_resize
+ */
+#define PPM_RESIZE_NEAREST  0
+#define PPM_RESIZE_BILINEAR 1
+#define PPM_RESIZE_AREA     2   // box: averages the pixels each output pixel covers
+#define PPM_RESIZE_LANCZOS3 3
+
+/*
+ * Per-channel statistics, one entry per channel of the image (R, G, B)
+ */
+typedef struct {
+    uint64_t count;         // samples per channel
+    uint16_t min[PPM_MAX_CHANNELS], max[PPM_MAX_CHANNELS];
+    uint64_t sum[PPM_MAX_CHANNELS];
+    uint64_t sum_sq[PPM_MAX_CHANNELS];
+    double mean[PPM_MAX_CHANNELS];
+    double variance[PPM_MAX_CHANNELS];  // population variance
+} PPM_stats;
+
+/*
+ * Queued bulk operations, run fused over cache-sized row strips
+ */
+#define PPM_PIPELINE_MAX_STAGES 16
+
+typedef struct {
+    int op;
+    float scale, bias;
+    uint16_t maxval;
+    PPM_lut lut;
+} PPM_stage;
+
+typedef struct {
+    uint32_t n_stages;
+    PPM_stage stages[PPM_PIPELINE_MAX_STAGES];
+} PPM_pipeline, *PPM_pipeline_ptr;
+
+/*
+ * Asynchronous jobs: one bulk operation on an image, run on a worker thread
+ * img_ptr is the image operated on (the destination of grayscale and
+ * resize, whose source is src_ptr). The images, and lut or pipeline, must
+ * stay valid until the job is done. callback, if set, is called on the
+ * worker with the operation's return value before the job counts as done.
+ */
+#define PPM_JOB_SCALE           0
+#define PPM_JOB_CONVERT_MAXVAL  1
+#define PPM_JOB_GRAYSCALE       2
+#define PPM_JOB_APPLY_LUT       3
+#define PPM_JOB_PIPELINE        4
+#define PPM_JOB_RESIZE          5
+
+#define PPM_JOB_NOWAIT  (1 << 0)    // fail with PPM_JOB_EBUSY instead of waiting for room in the queue
+
+#define PPM_JOB_EINVAL  -1          // bad description, or no memory or threads for it
+#define PPM_JOB_EBUSY   -2          // queue full (PPM_JOB_NOWAIT) or shutting down
+
+typedef struct ppm_job *PPM_job_ptr;
+typedef void (*ppm_job_fn)(PPM_job_ptr job, int status, void *ctx);
+
+typedef struct {
+    int op;                         // PPM_JOB_*
+    PPM_ptr img_ptr;
+    PPM_ptr src_ptr;                // grayscale and resize
+    float scale, bias;              // scale
+    uint16_t maxval;                // convert_maxval
+    int filter;                     // resize
+    const PPM_lut *lut;             // apply_lut
+    PPM_pipeline_ptr pipeline;      // pipeline
+    ppm_job_fn callback;
+    void *ctx;
+} PPM_job_desc;
+
+/*
+ * Per-file status reported by ppm_load_batch
+ */
+#define PPM_LOAD_OK          0
+#define PPM_LOAD_EOPEN      -1  // missing, unreadable or not a regular file
+#define PPM_LOAD_EREAD      -2  // I/O error while reading
+#define PPM_LOAD_EHEADER    -3  // not a valid PNM or PAM header
+#define PPM_LOAD_ETRUNCATED -4  // fewer raster bytes than the header promises
+#define PPM_LOAD_ENOMEM     -5
+#define PPM_LOAD_ERASTER    -6  // plain or PBM raster with a byte or sample its format can't have
+
+/*
+ * Planar image: R, G and B each in a plane of their own
+ * Every plane starts PPM_ALIGNMENT-aligned and its rows are stride bytes
+ * apart. Samples are uint8_t, or native-endian uint16_t when maxval > 255
+ * (unlike the big-endian samples of PPM_img).
+ */
+typedef struct {
+    uint32_t width, height;
+    uint16_t maxval;
+    char *planes[3];    // R, G, B
+    size_t stride;      // bytes between rows of a plane
+    size_t plane_size;  // bytes between planes
+    size_t alloc_size;  // bytes obtained from the allocator, 0 if not owned
+} PPM_planar, *PPM_planar_ptr;
+
 #define PIX_AT(i, x, y) i->data[y*i->stride + x*3]
 
 /*
  * Load, Store, Clone, etc.
+ * ppm_save_image_format writes one of the PPM_FORMAT_* formats: PBM needs
+ * a 1-channel image of maxval 1, PGM 1 channel, PPM 3, PAM takes any.
  */
 PPM_ptr ppm_load_image(const char *file_name);
+PPM_ptr ppm_load_image_mmap(const char *file_name, int flags);
 int ppm_save_image(PPM_ptr img_ptr, char *file_name, int force);
+int ppm_save_image_format(PPM_ptr img_ptr, char *file_name, int format, int force);
+int ppm_save_image_direct(PPM_ptr img_ptr, char *file_name, int force);
 void ppm_free(PPM_ptr img_ptr);
 
+/*
+ * Batch loading
+ * Loads many files at once, overlapping their reads across the thread pool
+ * (io_uring when the kernel allows it, pread otherwise). images[i] is NULL
+ * for a file that failed and errors[i] (errors may be NULL) tells why.
+ * Returns the number of images loaded.
+ */
+size_t ppm_load_batch(const char *const *file_names, size_t n_files, PPM_ptr *images, int *errors);
+const char *ppm_load_strerror(int err);
+
+/*
+ * Streaming (row bands)
+ * Files whose samples are stored as they are in memory (PGM, PPM, PAM) can
+ * be read in bands; ppm_stream_create writes PPM.
+ */
+PPM_stream_ptr ppm_stream_open(const char *file_name);
+PPM_stream_ptr ppm_stream_create(const char *file_name, uint32_t width, uint32_t height, uint16_t maxval, int force);
+PPM_ptr ppm_stream_band(const PPM_stream_ptr stream, uint32_t rows);
+int ppm_stream_read(PPM_stream_ptr stream, PPM_ptr band);
+int ppm_stream_write(PPM_stream_ptr stream, const PPM_ptr band);
+int ppm_stream_close(PPM_stream_ptr stream);
+
 PPM_ptr ppm_create(uint32_t width, uint32_t height, uint16_t maxval);
+PPM_ptr ppm_create_layout(uint32_t width, uint32_t height, uint16_t maxval, int layout);
+PPM_ptr ppm_create_channels(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels);
 PPM_ptr ppm_create_empty(void);
-PPM_ptr ppm_clone(PPM_ptr src);
 void ppm_clear(PPM_ptr img_ptr, uint16_t *val);
 
+/*
+ * Clones share the pixel buffer of their source (O(1), refcounted) until
+ * one of them is written: the library's operations then give that image a
+ * buffer of its own, copying just the bands they write as they go. After
+ * ppm_set_pixel, ppm_paste or a view wrote a few bands, the others are only
+ * copied over when the image is next read (by any operation, saving it,
+ * ppm_data or ppm_get_pixel, which copies the band of its pixel). Reading or writing
+ * through the data field or a ppm_tile view bypasses this; call ppm_data
+ * before reading and ppm_unshare before writing.
+ * ppm_is_shared tells whether any other image still uses the buffer.
+ */
+PPM_ptr ppm_clone(PPM_ptr src);
+int ppm_unshare(PPM_ptr img_ptr);
+int ppm_is_shared(const PPM_ptr img_ptr);
+
 /*
  * Metadata access
  */
 uint32_t ppm_width(const PPM_ptr img_ptr);
 uint32_t ppm_height(const PPM_ptr img_ptr);
 uint16_t ppm_maxval(const PPM_ptr img_ptr);
+uint16_t ppm_channels(const PPM_ptr img_ptr);
 size_t ppm_stride(const PPM_ptr img_ptr);
 data_t ppm_data(const PPM_ptr img_ptr);
 
 /*
  * Validation functions
+ * ppm_validate_file checks the header and the size of a file from its first
+ * bytes and fstat, without reading the raster: 0 if it can be loaded, -1 if
+ * it can't be read or its header is invalid, -2 if it is truncated
  */
 int ppm_validate(const PPM_ptr img_ptr);
 int ppm_validate_file(const char *file_name);
@@ -51,40 +289,194 @@ size_t ppm_expected_file_size(uint32_t width, uint32_t height, uint16_t maxval);
 
 /*
  * Single pixel manipulation (not meant for loops because it's slow)
+ * rgb holds one sample per channel of the image
  */
 int ppm_get_pixel(const PPM_ptr img_ptr, uint32_t x, uint32_t y, uint16_t *rgb);
 int ppm_set_pixel(PPM_ptr img_ptr, uint32_t x, uint32_t y, const uint16_t *rgb);
 
 /*
  * Bulk operations (SIMD-friendly core)
+ * Point operations, convolution and resizing work on any number of
+ * channels. Grayscale reads an RGB image and writes its luma to every
+ * channel of an RGB dst, or once per pixel into a 1-channel dst.
  */
 int ppm_copy(PPM_ptr dst_ptr, const PPM_ptr src_ptr);
 int ppm_convert_maxval(PPM_ptr img_ptr, uint16_t new_maxval);
 int ppm_rgb_to_grayscale(PPM_ptr dst_ptr, const PPM_ptr src_ptr);
 int ppm_scale(PPM_ptr img_ptr, float scale, float bias);
+int ppm_apply_lut(PPM_ptr img_ptr, const PPM_lut *lut);
+int ppm_convolve(PPM_ptr img_ptr, const PPM_kernel *kernel_x, const PPM_kernel *kernel_y);
+int ppm_box_blur(PPM_ptr img_ptr, uint32_t size);
+int ppm_gaussian_blur(PPM_ptr img_ptr, float sigma);
+int ppm_resize(PPM_ptr dst_ptr, const PPM_ptr src_ptr, int filter);
+
+/*
+ * Fused pipelines
+ * Queue operations, then ppm_pipeline_run applies all of them to one row
+ * strip at a time while it is in cache, so the image is read and written
+ * once. Consecutive point operations on 8-bit samples are folded into a
+ * single lookup table. Results are identical to calling the bulk operations
+ * one after the other. Grayscale runs in place. Bands from ppm_stream_read
+ * can be run through a pipeline like any image.
+ */
+PPM_pipeline_ptr ppm_pipeline_create(void);
+int ppm_pipeline_convert_maxval(PPM_pipeline_ptr pipe, uint16_t new_maxval);
+int ppm_pipeline_scale(PPM_pipeline_ptr pipe, float scale, float bias);
+int ppm_pipeline_rgb_to_grayscale(PPM_pipeline_ptr pipe);
+int ppm_pipeline_apply_lut(PPM_pipeline_ptr pipe, const PPM_lut *lut);
+int ppm_pipeline_run(const PPM_pipeline_ptr pipe, PPM_ptr img_ptr);
+void ppm_pipeline_free(PPM_pipeline_ptr pipe);
+
+/*
+ * Lookup table compiler (8-bit only)
+ * Start from the identity with ppm_lut_init() and chain steps onto it;
+ * each one maps the output of the previous ones. On backends where it is
+ * faster, ppm_scale and ppm_convert_maxval run 8-bit images through a table.
+ */
+int ppm_lut_init(PPM_lut *lut, uint16_t maxval);
+int ppm_lut_scale(PPM_lut *lut, float scale, float bias);
+int ppm_lut_convert(PPM_lut *lut, uint16_t new_maxval);
+int ppm_lut_gamma(PPM_lut *lut, float gamma);
+int ppm_lut_curve(PPM_lut *lut, ppm_curve_fn curve, void *ctx);
+
+/*
+ * Convolution kernels
+ * Box and Gaussian kernels are normalized to sum to 1; ppm_kernel_gaussian
+ * spans 3 sigma on each side. Weights may be negative (sharpening); results
+ * are rounded to nearest and clamped to [0, maxval]. Edges repeat the
+ * border pixels.
+ */
+int ppm_kernel_init(PPM_kernel *kernel, const float *weights, uint32_t size);
+int ppm_kernel_box(PPM_kernel *kernel, uint32_t size);
+int ppm_kernel_gaussian(PPM_kernel *kernel, float sigma);
+
+/*
+ * Resampling
+ * ppm_resize resamples src into dst, whose width and height set the output
+ * size; both need the same maxval and channels. Filter weights are fixed point, built
+ * once per size pair and filter and cached; ppm_resize_trim frees them.
+ * Results are the same on every backend.
+ */
+void ppm_resize_trim(void);
+
+/*
+ * Statistics
+ * ppm_histogram counts the samples of each channel into hist, which holds
+ * PPM_HISTOGRAM_BINS(maxval) bins for the first channel (R), then as many
+ * for each of the others.
+ * ppm_stats fills every field of stats. Neither modifies the image.
+ */
+#define PPM_HISTOGRAM_BINS(maxval) ((maxval) <= 255 ? 256 : 65536)
+
+int ppm_histogram(const PPM_ptr img_ptr, uint32_t *hist);
+int ppm_stats(const PPM_ptr img_ptr, PPM_stats *stats);
+
+/*
+ * Asynchronous jobs
+ * ppm_async_init starts n_workers threads (<= 0: one per CPU) taking jobs
+ * from a queue of at most max_queued (0: a default) waiting jobs; the first
+ * submission starts them with defaults otherwise. Jobs run concurrently with
+ * each other, so many images move through at once; each one still uses the
+ * thread pool when no other job holds it. ppm_job_submit blocks while the
+ * queue is full unless flags has PPM_JOB_NOWAIT. With job NULL the job frees
+ * itself once done; otherwise poll it with ppm_job_done, or block on
+ * ppm_job_wait for its status, and release it with ppm_job_free (freeing a
+ * pending job detaches it). ppm_async_shutdown runs the queued jobs to
+ * completion and stops the workers.
+ */
+int ppm_async_init(int n_workers, uint32_t max_queued);
+void ppm_async_shutdown(void);
+int ppm_job_submit(const PPM_job_desc *desc, int flags, PPM_job_ptr *job);
+int ppm_job_done(const PPM_job_ptr job);
+int ppm_job_wait(PPM_job_ptr job);
+void ppm_job_free(PPM_job_ptr job);
 
 /*
  * Define workers
+ * They take row-major images; the bulk operations above hand them tiles
+ * The planar workers get planes the same size as the image they pair with
+ * Convolution workers run on rows of floats: convolve_h filters taps samples
+ * step apart, convolve_v combines taps rows into 8-bit or big-endian 16-bit
+ * samples
+ * Resize workers run on rows of 8-bit or native 16-bit samples: resize_h
+ * filters taps pixels of channels samples from start[i] on into pixel i (and
+ * may read a vector past them), resize_v combines taps rows into image samples
+ * Statistics workers fill count, min, max, sum and sum_sq
+ * Text workers classify the 64 bytes of a plain PNM raster at text: the
+ * mask of digits is returned, that of bytes that are neither digits nor
+ * whitespace goes to other (bit i for byte i)
  */
 // Scalar
 int ppm_convert_maxval_scalar(PPM_ptr img_ptr, uint16_t new_maxval);
 int ppm_rgb_to_grayscale_scalar(PPM_ptr dst_ptr, const PPM_ptr src_ptr);
 int ppm_scale_scalar(PPM_ptr img_ptr, float scale, float bias);
+int ppm_apply_lut_scalar(PPM_ptr img_ptr, const uint8_t *map);
+int ppm_planar_unpack_scalar(PPM_planar_ptr dst, const PPM_ptr src_ptr);
+int ppm_planar_pack_scalar(PPM_ptr dst_ptr, const PPM_planar_ptr src);
+int ppm_planar_scale_scalar(PPM_planar_ptr planar, float scale, float bias);
+int ppm_planar_rgb_to_grayscale_scalar(PPM_planar_ptr dst, const PPM_planar_ptr src);
+void ppm_convolve_h_scalar(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step);
+void ppm_convolve_v_scalar(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval);
+void ppm_resize_h_scalar(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels);
+void ppm_resize_v_scalar(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval);
+int ppm_stats_scalar(const PPM_ptr img_ptr, PPM_stats *stats);
+uint64_t ppm_text_mask_scalar(const char *text, uint64_t *other);
 
 // SSE2
 int ppm_convert_maxval_sse2(PPM_ptr img_ptr, uint16_t new_maxval);
 int ppm_rgb_to_grayscale_sse2(PPM_ptr dst_ptr, const PPM_ptr src_ptr);
 int ppm_scale_sse2(PPM_ptr img_ptr, float scale, float bias);
+int ppm_planar_scale_sse2(PPM_planar_ptr planar, float scale, float bias);
+int ppm_planar_rgb_to_grayscale_sse2(PPM_planar_ptr dst, const PPM_planar_ptr src);
+void ppm_convolve_h_sse2(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step);
+void ppm_convolve_v_sse2(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval);
+void ppm_resize_h_sse2(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels);
+void ppm_resize_v_sse2(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval);
+int ppm_stats_sse2(const PPM_ptr img_ptr, PPM_stats *stats);
+uint64_t ppm_text_mask_sse2(const char *text, uint64_t *other);
 
 // AVX2
 int ppm_convert_maxval_avx2(PPM_ptr img_ptr, uint16_t new_maxval);
 int ppm_rgb_to_grayscale_avx2(PPM_ptr dst_ptr, const PPM_ptr src_ptr);
 int ppm_scale_avx2(PPM_ptr img_ptr, float scale, float bias);
+int ppm_apply_lut_avx2(PPM_ptr img_ptr, const uint8_t *map);
+int ppm_planar_unpack_avx2(PPM_planar_ptr dst, const PPM_ptr src_ptr);
+int ppm_planar_pack_avx2(PPM_ptr dst_ptr, const PPM_planar_ptr src);
+int ppm_planar_scale_avx2(PPM_planar_ptr planar, float scale, float bias);
+int ppm_planar_rgb_to_grayscale_avx2(PPM_planar_ptr dst, const PPM_planar_ptr src);
+void ppm_convolve_h_avx2(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step);
+void ppm_convolve_v_avx2(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval);
+void ppm_resize_h_avx2(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels);
+void ppm_resize_v_avx2(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval);
+int ppm_stats_avx2(const PPM_ptr img_ptr, PPM_stats *stats);
+uint64_t ppm_text_mask_avx2(const char *text, uint64_t *other);
+
+// AVX-512 (F, BW and VBMI; convolution, resizing and statistics use the AVX2 workers)
+int ppm_convert_maxval_avx512(PPM_ptr img_ptr, uint16_t new_maxval);
+int ppm_rgb_to_grayscale_avx512(PPM_ptr dst_ptr, const PPM_ptr src_ptr);
+int ppm_scale_avx512(PPM_ptr img_ptr, float scale, float bias);
+int ppm_apply_lut_avx512(PPM_ptr img_ptr, const uint8_t *map);
+int ppm_planar_unpack_avx512(PPM_planar_ptr dst, const PPM_ptr src_ptr);
+int ppm_planar_pack_avx512(PPM_ptr dst_ptr, const PPM_planar_ptr src);
+int ppm_planar_scale_avx512(PPM_planar_ptr planar, float scale, float bias);
+int ppm_planar_rgb_to_grayscale_avx512(PPM_planar_ptr dst, const PPM_planar_ptr src);
+uint64_t ppm_text_mask_avx512(const char *text, uint64_t *other);
 
 // NEON
 int ppm_convert_maxval_neon(PPM_ptr img_ptr, uint16_t new_maxval);
 int ppm_rgb_to_grayscale_neon(PPM_ptr dst_ptr, const PPM_ptr src_ptr);
 int ppm_scale_neon(PPM_ptr img_ptr, float scale, float bias);
+int ppm_apply_lut_neon(PPM_ptr img_ptr, const uint8_t *map);
+int ppm_planar_unpack_neon(PPM_planar_ptr dst, const PPM_ptr src_ptr);
+int ppm_planar_pack_neon(PPM_ptr dst_ptr, const PPM_planar_ptr src);
+int ppm_planar_scale_neon(PPM_planar_ptr planar, float scale, float bias);
+int ppm_planar_rgb_to_grayscale_neon(PPM_planar_ptr dst, const PPM_planar_ptr src);
+void ppm_convolve_h_neon(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step);
+void ppm_convolve_v_neon(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval);
+void ppm_resize_h_neon(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels);
+void ppm_resize_v_neon(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval);
+int ppm_stats_neon(const PPM_ptr img_ptr, PPM_stats *stats);
+uint64_t ppm_text_mask_neon(const char *text, uint64_t *other);
 
 
 /*
@@ -94,9 +486,97 @@ int ppm_realign(PPM_ptr img_ptr, size_t alignment);
 int ppm_set_stride(PPM_ptr img_ptr, size_t stride);
 int ppm_is_contiguous(const PPM_ptr img_ptr);
 
+/*
+ * Tiled layout
+ * Files are always row-major on disk: load, then ppm_set_layout; tiled
+ * images are saved straight from their tiles. The bulk operations and
+ * pipelines run tile by tile. ppm_tile returns tile (tx, ty) of either
+ * layout as a row-major sub-image sharing the pixel buffer.
+ */
+int ppm_layout(const PPM_ptr img_ptr);
+int ppm_set_layout(PPM_ptr img_ptr, int layout);
+PPM_img ppm_tile(const PPM_ptr img_ptr, uint32_t tx, uint32_t ty);
+uint32_t ppm_tiles_x(const PPM_ptr img_ptr);
+uint32_t ppm_tiles_y(const PPM_ptr img_ptr);
+
+/*
+ * Regions of interest
+ * ppm_view returns the rectangle (x, y, width, height) of a row-major image
+ * as an image over the same rows: the parent's stride, data at the first
+ * pixel of the rectangle (so not necessarily aligned), owning nothing. The operations that keep the
+ * sample size run on it in place without touching anything outside it;
+ * those that reallocate (sample size changes, ppm_set_layout, ppm_realign)
+ * fail. Out of range rectangles and tiled parents give an image without
+ * data.
+ * A view stays tied to its parent, which has to outlive it and not be
+ * reallocated meanwhile. Writes go through to the parent: the first one
+ * that finds the parent's buffer shared with clones, made before or after
+ * the view, gets the parent its own copy of the bands under the rectangle,
+ * and the view moves along with it. Clones never see writes through a view
+ * of another image. As with any image, writing through the data field of a
+ * view needs ppm_unshare first.
+ * ppm_copy of a view is a crop; ppm_paste copies src into dst at (x, y).
+ */
+PPM_img ppm_view(PPM_ptr img_ptr, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+int ppm_paste(PPM_ptr dst_ptr, const PPM_ptr src_ptr, uint32_t x, uint32_t y);
+
+/*
+ * Planar images
+ * ppm_planar_unpack splits an RGB image into planes and ppm_planar_pack
+ * interleaves them back; both need the same size and maxval on each side.
+ * The planar operations match their interleaved counterparts sample for
+ * sample. Grayscale may run in place.
+ */
+PPM_planar_ptr ppm_planar_create(uint32_t width, uint32_t height, uint16_t maxval);
+void ppm_planar_free(PPM_planar_ptr planar);
+int ppm_planar_validate(const PPM_planar_ptr planar);
+int ppm_planar_unpack(PPM_planar_ptr dst, const PPM_ptr src_ptr);
+int ppm_planar_pack(PPM_ptr dst_ptr, const PPM_planar_ptr src);
+int ppm_planar_scale(PPM_planar_ptr planar, float scale, float bias);
+int ppm_planar_rgb_to_grayscale(PPM_planar_ptr dst, const PPM_planar_ptr src);
+
+/*
+ * Pixel buffer allocation
+ *
+ * All image buffers come from the current allocator (aligned heap by default).
+ * ppm_pool_enable() switches to a size-class pool that recycles freed buffers.
+ * Switch allocators only while no image from the previous one is alive.
+ */
+void ppm_set_allocator(const PPM_allocator *allocator);
+void *ppm_alloc(size_t size);
+void ppm_dealloc(void *ptr, size_t size);
+
+void ppm_pool_enable(int flags, size_t max_cached);
+void ppm_pool_trim(void);
+size_t ppm_pool_cached(void);
+
 /*
  * CPU platform and features
+ *
+ * ppm_init() picks the fastest backend the running CPU supports.
+ * Set CACHEPIX_BACKEND=scalar|sse2|avx2|avx512|neon in the environment to pin one.
  */
+#define PPM_CPU_SSE2        (1u << 0)
+#define PPM_CPU_SSSE3       (1u << 1)
+#define PPM_CPU_SSE41       (1u << 2)
+#define PPM_CPU_AVX2        (1u << 3)
+#define PPM_CPU_AVX512F     (1u << 4)
+#define PPM_CPU_AVX512BW    (1u << 5)
+#define PPM_CPU_AVX512VBMI  (1u << 6)
+#define PPM_CPU_NEON        (1u << 7)
+
 void ppm_init(void);
 uint32_t ppm_cpu_features(void);
+const char *ppm_backend(void);
+
+/*
+ * Threading
+ *
+ * The bulk operations split the rows into cache-sized tiles and run them on
+ * a persistent pool. ppm_init() sizes it to one thread per CPU (or
+ * CACHEPIX_THREADS) unless ppm_set_threads() was called first; n <= 0 means
+ * one per CPU, 1 disables threading.
+ */
+int ppm_set_threads(int n_threads);
+int ppm_get_threads(void);
 
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cachepix.h"
+
+/*
+ * Pixel buffer allocation
+ *
+ * Every PPM_img pixel buffer goes through the current allocator. The default
+ * one is the aligned heap. The built-in pool keeps freed buffers on per size
+ * class free lists, so processing a stream of same-sized frames recycles the
+ * same buffers without a malloc, mmap or page fault per frame.
+ */
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+#define HUGEPAGE_SIZE   ((size_t)2 << 20)
+
+/*
+ * Size classes: everything up to POOL_MIN_CLASS shares one class, above it
+ * each power of two is split in four steps (at most 25% slack)
+ */
+#define POOL_MIN_CLASS  ((size_t)4096)
+#define POOL_CLASSES    192
+
+/*
+ * Classes from this size up are backed by their own mappings
+ */
+#define POOL_MMAP_MIN   ((size_t)256 << 10)
+
+/*
+ * Large buffers are page aligned, which also satisfies O_DIRECT
+ */
+#define HEAP_PAGE_ALIGN_MIN ((size_t)256 << 10)
+#define HEAP_PAGE_SIZE      ((size_t)4096)
+
+static void *heap_alloc(void *ctx, size_t size) {
+    (void)ctx;
+    if (size >= HEAP_PAGE_ALIGN_MIN)
+        return aligned_alloc(HEAP_PAGE_SIZE, ALIGN_UP(size, HEAP_PAGE_SIZE));
+    return aligned_alloc(PPM_ALIGNMENT, ALIGN_UP(size, PPM_ALIGNMENT));
+}
+
+static void heap_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+static const PPM_allocator heap_allocator = { heap_alloc, heap_free, NULL };
+
+static PPM_allocator allocator = { heap_alloc, heap_free, NULL };
+
+/*
+ * Swap the allocator used for pixel buffers, NULL restores the aligned heap
+ * Only call it while no image allocated by the previous one is alive
+ */
+void ppm_set_allocator(const PPM_allocator *new_allocator) {
+    allocator = (new_allocator != NULL) ? *new_allocator : heap_allocator;
+}
+
+void *ppm_alloc(size_t size) {
+    if (size == 0)
+        return NULL;
+    return allocator.alloc(allocator.ctx, size);
+}
+
+void ppm_dealloc(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return;
+    allocator.free(allocator.ctx, ptr, size);
+}
+
+/*
+ * Built-in buffer pool
+ */
+typedef struct pool_block {
+    struct pool_block *next;    // free blocks are linked through their first bytes
+} pool_block_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pool_block_t *free_lists[POOL_CLASSES];
+    size_t cached, max_cached;
+    int flags;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned size_class(size_t size, size_t *class_bytes) {
+    if (size <= POOL_MIN_CLASS) {
+        *class_bytes = POOL_MIN_CLASS;
+        return 0;
+    }
+
+    // size-1 lies in [2^e, 2^(e+1)), round up to a quarter of 2^e
+    unsigned e = 63 - __builtin_clzll(size - 1);
+    size_t step = (size_t)1 << (e - 2);
+    size_t rounded = ALIGN_UP(size, step);
+
+    *class_bytes = rounded;
+    return 1 + (e - 12)*4 + (unsigned)(rounded/step - 5);
+}
+
+static size_t class_bytes_of(unsigned cls) {
+    if (cls == 0)
+        return POOL_MIN_CLASS;
+
+    unsigned e = 12 + (cls - 1)/4;
+    return (size_t)(5 + (cls - 1)%4) << (e - 2);
+}
+
+/*
+ * Length of the mapping behind a class, chosen from the class alone so that
+ * a block can be unmapped whatever flags were set when it was created
+ */
+static size_t mapping_length(size_t class_bytes) {
+    if (class_bytes >= HUGEPAGE_SIZE)
+        return ALIGN_UP(class_bytes, HUGEPAGE_SIZE);
+    return ALIGN_UP(class_bytes, (size_t)sysconf(_SC_PAGESIZE));
+}
+
+static void *system_alloc(size_t class_bytes) {
+    if (class_bytes < POOL_MMAP_MIN)
+        return aligned_alloc(PPM_ALIGNMENT, class_bytes);
+
+    size_t len = mapping_length(class_bytes);
+    void *ptr = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+    if ((pool.flags & PPM_POOL_HUGEPAGES) && len >= HUGEPAGE_SIZE)
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            return NULL;
+#if defined(MADV_HUGEPAGE)
+        // No reserved hugetlb pages: ask for transparent huge pages instead
+        if ((pool.flags & PPM_POOL_HUGEPAGES) && len >= HUGEPAGE_SIZE)
+            madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    return ptr;
+}
+
+static void system_free(void *ptr, size_t class_bytes) {
+    if (class_bytes < POOL_MMAP_MIN)
+        free(ptr);
+    else
+        munmap(ptr, mapping_length(class_bytes));
+}
+
+static void *pool_alloc(void *ctx, size_t size) {
+    (void)ctx;
+    size_t class_bytes;
+    unsigned cls = size_class(size, &class_bytes);
+
+    if (cls >= POOL_CLASSES)
+        return NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    pool_block_t *block = pool.free_lists[cls];
+    if (block != NULL) {
+        pool.free_lists[cls] = block->next;
+        pool.cached -= class_bytes;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (block != NULL)
+        return block;
+
+    return system_alloc(class_bytes);
+}
+
+static void pool_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    size_t class_bytes;
+    unsigned cls = size_class(size, &class_bytes);
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.cached + class_bytes <= pool.max_cached) {
+        pool_block_t *block = (pool_block_t *)ptr;
+        block->next = pool.free_lists[cls];
+        pool.free_lists[cls] = block;
+        pool.cached += class_bytes;
+        ptr = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (ptr != NULL)
+        system_free(ptr, class_bytes);
+}
+
+static const PPM_allocator pool_allocator = { pool_alloc, pool_free, NULL };
+
+/*
+ * Route pixel buffers through the built-in pool
+ * Keeps up to max_cached bytes of freed buffers for reuse (0: no limit).
+ * PPM_POOL_HUGEPAGES backs buffers of 2 MiB and up with huge pages, through
+ * MAP_HUGETLB when pages are reserved and transparent huge pages otherwise.
+ * Same rule as ppm_set_allocator: no live images from the previous allocator.
+ */
+void ppm_pool_enable(int flags, size_t max_cached) {
+    pthread_mutex_lock(&pool.lock);
+    pool.flags = flags;
+    pool.max_cached = (max_cached != 0) ? max_cached : SIZE_MAX;
+    pthread_mutex_unlock(&pool.lock);
+
+    ppm_set_allocator(&pool_allocator);
+}
+
+/*
+ * Hand every cached buffer back to the system
+ */
+void ppm_pool_trim(void) {
+    pthread_mutex_lock(&pool.lock);
+    for (unsigned cls = 0; cls < POOL_CLASSES; cls++) {
+        pool_block_t *block = pool.free_lists[cls];
+        pool.free_lists[cls] = NULL;
+
+        while (block != NULL) {
+            pool_block_t *next = block->next;
+            system_free(block, class_bytes_of(cls));
+            block = next;
+        }
+    }
+    pool.cached = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+size_t ppm_pool_cached(void) {
+    return pool.cached;
+}
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Asynchronous jobs
+ *
+ * A fixed set of workers takes jobs from a bounded FIFO. Submitters wait on
+ * not_full while the queue is at capacity, which is the backpressure: a
+ * producer can't get more than max_queued jobs ahead of the workers. A
+ * worker runs the bulk operation and the callback, then marks the job done
+ * and wakes whoever waits on it.
+ *
+ * The bulk operations go through ppm_parallel_for as usual. The tile pool
+ * takes one job at a time and the others run on their worker alone, so a
+ * large image still gets every core while small ones overlap.
+ */
+
+#define ASYNC_QUEUE_DEFAULT 64
+
+struct ppm_job {
+    PPM_job_desc desc;
+    struct ppm_job *next;
+    int status;
+    _Atomic int done;
+    int detached;       // freed by its worker once done
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full, finished;
+
+    pthread_t *workers;
+    int n_workers;
+    int stop;           // drain the queue and exit
+
+    struct ppm_job *head, *tail;
+    uint32_t queued, max_queued;
+} async = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+static int run_job(const PPM_job_desc *desc) {
+    switch (desc->op) {
+    case PPM_JOB_SCALE:
+        return ppm_scale(desc->img_ptr, desc->scale, desc->bias);
+    case PPM_JOB_CONVERT_MAXVAL:
+        return ppm_convert_maxval(desc->img_ptr, desc->maxval);
+    case PPM_JOB_GRAYSCALE:
+        return ppm_rgb_to_grayscale(desc->img_ptr, desc->src_ptr);
+    case PPM_JOB_APPLY_LUT:
+        return ppm_apply_lut(desc->img_ptr, desc->lut);
+    case PPM_JOB_PIPELINE:
+        return ppm_pipeline_run(desc->pipeline, desc->img_ptr);
+    case PPM_JOB_RESIZE:
+        return ppm_resize(desc->img_ptr, desc->src_ptr, desc->filter);
+    }
+    return -1;
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&async.lock);
+        while (async.head == NULL && !async.stop)
+            pthread_cond_wait(&async.not_empty, &async.lock);
+
+        struct ppm_job *job = async.head;
+        if (job == NULL) {
+            pthread_mutex_unlock(&async.lock);
+            return NULL;
+        }
+        async.head = job->next;
+        if (async.head == NULL)
+            async.tail = NULL;
+        async.queued--;
+        pthread_cond_signal(&async.not_full);
+        pthread_mutex_unlock(&async.lock);
+
+        job->status = run_job(&job->desc);
+        if (job->desc.callback != NULL)
+            job->desc.callback(job, job->status, job->desc.ctx);
+
+        pthread_mutex_lock(&async.lock);
+        atomic_store(&job->done, 1);
+        int detached = job->detached;
+        pthread_cond_broadcast(&async.finished);
+        pthread_mutex_unlock(&async.lock);
+
+        if (detached)
+            free(job);
+    }
+}
+
+/*
+ * Start the workers; called with the lock held
+ */
+static int start_locked(int n_workers, uint32_t max_queued) {
+
+    if (n_workers <= 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = (n_cpus > 0) ? (int)n_cpus : 1;
+    }
+
+    async.workers = (pthread_t *)calloc(n_workers, sizeof(pthread_t));
+    if (async.workers == NULL)
+        return -1;
+
+    async.max_queued = (max_queued > 0) ? max_queued : ASYNC_QUEUE_DEFAULT;
+
+    // Keep whatever did start if thread creation fails part way
+    for (int i = 0; i < n_workers; i++) {
+        if (pthread_create(&async.workers[i], NULL, worker_main, NULL) != 0)
+            break;
+        async.n_workers = i + 1;
+    }
+
+    if (async.n_workers == 0) {
+        free(async.workers);
+        async.workers = NULL;
+        return -1;
+    }
+
+    return (async.n_workers == n_workers) ? 0 : -1;
+}
+
+int ppm_async_init(int n_workers, uint32_t max_queued) {
+    for (;;) {
+        pthread_mutex_lock(&async.lock);
+        if (async.n_workers == 0 && !async.stop)
+            break;
+        pthread_mutex_unlock(&async.lock);
+
+        ppm_async_shutdown();
+    }
+
+    int err = start_locked(n_workers, max_queued);
+    pthread_mutex_unlock(&async.lock);
+    return err;
+}
+
+void ppm_async_shutdown(void) {
+    pthread_mutex_lock(&async.lock);
+
+    // Another thread is already stopping them; wait for it to finish
+    while (async.stop)
+        pthread_cond_wait(&async.finished, &async.lock);
+
+    if (async.n_workers == 0) {
+        pthread_mutex_unlock(&async.lock);
+        return;
+    }
+
+    async.stop = 1;
+    pthread_cond_broadcast(&async.not_empty);
+    pthread_cond_broadcast(&async.not_full);
+    pthread_mutex_unlock(&async.lock);
+
+    // Only this thread touches the workers until stop is cleared
+    for (int i = 0; i < async.n_workers; i++)
+        pthread_join(async.workers[i], NULL);
+
+    pthread_mutex_lock(&async.lock);
+    free(async.workers);
+    async.workers = NULL;
+    async.n_workers = 0;
+    async.stop = 0;
+    pthread_cond_broadcast(&async.finished);
+    pthread_mutex_unlock(&async.lock);
+}
+
+static int valid_desc(const PPM_job_desc *desc) {
+    if (desc == NULL || desc->img_ptr == NULL)
+        return 0;
+
+    switch (desc->op) {
+    case PPM_JOB_SCALE:
+    case PPM_JOB_CONVERT_MAXVAL:
+        return 1;
+    case PPM_JOB_GRAYSCALE:
+    case PPM_JOB_RESIZE:
+        return desc->src_ptr != NULL;
+    case PPM_JOB_APPLY_LUT:
+        return desc->lut != NULL;
+    case PPM_JOB_PIPELINE:
+        return desc->pipeline != NULL;
+    }
+    return 0;
+}
+
+int ppm_job_submit(const PPM_job_desc *desc, int flags, PPM_job_ptr *job) {
+    if (job != NULL)
+        *job = NULL;
+
+    if (!valid_desc(desc))
+        return PPM_JOB_EINVAL;
+
+    struct ppm_job *new_job = (struct ppm_job *)calloc(1, sizeof(struct ppm_job));
+    if (new_job == NULL)
+        return PPM_JOB_EINVAL;
+
+    new_job->desc = *desc;
+    new_job->detached = (job == NULL);
+
+    pthread_mutex_lock(&async.lock);
+    if (async.n_workers == 0 && !async.stop)
+        start_locked(0, 0);
+
+    if (async.n_workers == 0) {
+        pthread_mutex_unlock(&async.lock);
+        free(new_job);
+        return PPM_JOB_EINVAL;
+    }
+
+    while (async.queued >= async.max_queued && !async.stop) {
+        if (flags & PPM_JOB_NOWAIT)
+            break;
+        pthread_cond_wait(&async.not_full, &async.lock);
+    }
+
+    if (async.queued >= async.max_queued || async.stop) {
+        pthread_mutex_unlock(&async.lock);
+        free(new_job);
+        return PPM_JOB_EBUSY;
+    }
+
+    if (async.tail != NULL)
+        async.tail->next = new_job;
+    else
+        async.head = new_job;
+    async.tail = new_job;
+    async.queued++;
+
+    if (job != NULL)
+        *job = new_job;
+
+    pthread_cond_signal(&async.not_empty);
+    pthread_mutex_unlock(&async.lock);
+    return 0;
+}
+
+int ppm_job_done(const PPM_job_ptr job) {
+    return job != NULL && atomic_load(&job->done);
+}
+
+int ppm_job_wait(PPM_job_ptr job) {
+    if (job == NULL)
+        return PPM_JOB_EINVAL;
+
+    pthread_mutex_lock(&async.lock);
+    while (!atomic_load(&job->done))
+        pthread_cond_wait(&async.finished, &async.lock);
+    pthread_mutex_unlock(&async.lock);
+
+    return job->status;
+}
+
+void ppm_job_free(PPM_job_ptr job) {
+    if (job == NULL)
+        return;
+
+    pthread_mutex_lock(&async.lock);
+    if (!atomic_load(&job->done)) {
+        job->detached = 1;
+        job = NULL;
+    }
+    pthread_mutex_unlock(&async.lock);
+
+    free(job);
+}
@@ -1,177 +1,1332 @@
 
 #include "cachepix.h"
+#include "cachepix_internal.h"
 
 
 #if defined(__AVX2__)
 #include <immintrin.h>
 
+/*
+ * 16-bit samples are big-endian on disk and in memory
+ * Swap them to native order on load and back on store
+ */
+static inline __m128i bswap16_128(__m128i v) {
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    return _mm_shuffle_epi8(v, mask);
+}
+
+static inline __m256i bswap16_256(__m256i v) {
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    return _mm256_shuffle_epi8(v, mask);
+}
+
+/*
+ * 8 samples, widened to u32 lanes in order
+ */
+static inline __m256i load8_u8(const uint8_t *p) {
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p));
+}
+
+static inline __m256i load8_be16(const uint8_t *p) {
+    return _mm256_cvtepu16_epi32(bswap16_128(_mm_loadu_si128((const __m128i*)p)));
+}
+
+/*
+ * Narrow 8 u32 lanes (already in range) and store them in order
+ */
+static inline void store8_u8(uint8_t *p, __m256i v) {
+    __m128i v16 = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    _mm_storel_epi64((__m128i*)p, _mm_packus_epi16(v16, v16));
+}
+
+static inline void store8_be16(uint8_t *p, __m256i v) {
+    __m128i v16 = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    _mm_storeu_si128((__m128i*)p, bswap16_128(v16));
+}
+
+/*
+ * floor(v * new_maxval / old_maxval), capped at new_maxval
+ * When one side is 8-bit the product stays below 2^24 and is exact in float,
+ * and a correctly rounded float quotient always floors to the integer one.
+ * 16 -> 16 products need doubles.
+ */
+static inline __m256i convert8_ps(__m256i v, __m256 vnew, __m256 vold) {
+    __m256 q = _mm256_div_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v), vnew), vold);
+    return _mm256_cvttps_epi32(_mm256_min_ps(q, vnew));
+}
+
+static inline __m256i convert8_pd(__m256i v, __m256d vnew, __m256d vold) {
+    __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+    __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1));
+
+    lo = _mm256_min_pd(_mm256_div_pd(_mm256_mul_pd(lo, vnew), vold), vnew);
+    hi = _mm256_min_pd(_mm256_div_pd(_mm256_mul_pd(hi, vnew), vold), vnew);
+
+    return _mm256_set_m128i(_mm256_cvttpd_epi32(hi), _mm256_cvttpd_epi32(lo));
+}
+
+static inline float clamp_sample(float v, float maxval) {
+    if (!(v > 0.0f))
+        v = 0.0f;
+    if (v > maxval)
+        v = maxval;
+    return v;
+}
+
+/*
+ * x*scale + bias on 16 native u16 samples, clamped to [0, maxval] and truncated
+ */
+static inline __m256i scale16_u16(__m256i v, __m256 vscale, __m256 vbias, __m256 vmax) {
+    const __m256 vzero = _mm256_setzero_ps();
+
+    // u16 -> u32 (in-lane, undone by the in-lane pack below)
+    __m256 f0 = _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(v, _mm256_setzero_si256()));
+    __m256 f1 = _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(v, _mm256_setzero_si256()));
+
+    f0 = _mm256_add_ps(_mm256_mul_ps(f0, vscale), vbias);
+    f1 = _mm256_add_ps(_mm256_mul_ps(f1, vscale), vbias);
+
+    f0 = _mm256_min_ps(_mm256_max_ps(f0, vzero), vmax);
+    f1 = _mm256_min_ps(_mm256_max_ps(f1, vzero), vmax);
+
+    return _mm256_packus_epi32(_mm256_cvttps_epi32(f0), _mm256_cvttps_epi32(f1));
+}
+
+/*
+ * The same on 32 u8 samples
+ */
+static inline __m256i scale32_u8(__m256i v, __m256 vscale, __m256 vbias, __m256 vmax) {
+    const __m256 vzero = _mm256_setzero_ps();
+
+    // widen u8 → u16
+    __m256i lo = _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
+    __m256i hi = _mm256_unpackhi_epi8(v, _mm256_setzero_si256());
+
+    // u16 → u32
+    __m256i lo32a = _mm256_unpacklo_epi16(lo, _mm256_setzero_si256());
+    __m256i lo32b = _mm256_unpackhi_epi16(lo, _mm256_setzero_si256());
+    __m256i hi32a = _mm256_unpacklo_epi16(hi, _mm256_setzero_si256());
+    __m256i hi32b = _mm256_unpackhi_epi16(hi, _mm256_setzero_si256());
+
+    // int → float
+    __m256 f0 = _mm256_cvtepi32_ps(lo32a);
+    __m256 f1 = _mm256_cvtepi32_ps(lo32b);
+    __m256 f2 = _mm256_cvtepi32_ps(hi32a);
+    __m256 f3 = _mm256_cvtepi32_ps(hi32b);
+
+    // math
+    f0 = _mm256_add_ps(_mm256_mul_ps(f0, vscale), vbias);
+    f1 = _mm256_add_ps(_mm256_mul_ps(f1, vscale), vbias);
+    f2 = _mm256_add_ps(_mm256_mul_ps(f2, vscale), vbias);
+    f3 = _mm256_add_ps(_mm256_mul_ps(f3, vscale), vbias);
+
+    // clamp
+    f0 = _mm256_min_ps(_mm256_max_ps(f0, vzero), vmax);
+    f1 = _mm256_min_ps(_mm256_max_ps(f1, vzero), vmax);
+    f2 = _mm256_min_ps(_mm256_max_ps(f2, vzero), vmax);
+    f3 = _mm256_min_ps(_mm256_max_ps(f3, vzero), vmax);
+
+    // float → int (truncating, like the scalar reference)
+    lo32a = _mm256_cvttps_epi32(f0);
+    lo32b = _mm256_cvttps_epi32(f1);
+    hi32a = _mm256_cvttps_epi32(f2);
+    hi32b = _mm256_cvttps_epi32(f3);
+
+    // pack back
+    lo = _mm256_packus_epi32(lo32a, lo32b);
+    hi = _mm256_packus_epi32(hi32a, hi32b);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+/*
+ * The fixed-point form of scale32_u8 (see ppm_scale_fixed)
+ * Unpacking the bytes above a zero byte gives v << 8 for free, and each
+ * mulhi handles 16 samples where a float multiply handles 8
+ */
+static inline __m256i scale32_u8_fixed(__m256i v, __m256i vmul, __m256i vadd, __m256i vsub,
+                                       __m128i vshift, __m256i vmax) {
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, v), vmul);
+    __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, v), vmul);
+
+    lo = _mm256_subs_epu16(_mm256_adds_epu16(lo, vadd), vsub);
+    hi = _mm256_subs_epu16(_mm256_adds_epu16(hi, vadd), vsub);
+
+    lo = _mm256_min_epu16(_mm256_srl_epi16(lo, vshift), vmax);
+    hi = _mm256_min_epu16(_mm256_srl_epi16(hi, vshift), vmax);
+
+    return _mm256_packus_epi16(lo, hi);
+}
+
+static void scale_row8_fixed(uint8_t *row, size_t n_samples, const ppm_scale_fixed_t *fx, uint16_t maxval) {
+    const __m256i vmul = _mm256_set1_epi16((short)fx->mul);
+    const __m256i vadd = _mm256_set1_epi16((short)fx->add);
+    const __m256i vsub = _mm256_set1_epi16((short)fx->sub);
+    const __m128i vshift = _mm_cvtsi32_si128(fx->shift);
+    const __m256i vmax = _mm256_set1_epi16((short)maxval);
+
+    size_t i = 0;
+    for (; i + 32 <= n_samples; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(row + i));
+        _mm256_storeu_si256((__m256i*)(row + i), scale32_u8_fixed(v, vmul, vadd, vsub, vshift, vmax));
+    }
+
+    for (; i < n_samples; ++i)
+        row[i] = ppm_scale_fixed_u8(fx, row[i], maxval);
+}
+
+static void scale_row16(uint8_t *row, size_t n_samples, float scale, float bias, float maxval) {
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vbias  = _mm256_set1_ps(bias);
+    const __m256 vmax   = _mm256_set1_ps(maxval);
+
+    size_t i = 0;
+    for (; i + 16 <= n_samples; i += 16) {
+        __m256i v = bswap16_256(_mm256_loadu_si256((__m256i*)(row + i*2)));
+        v = scale16_u16(v, vscale, vbias, vmax);
+        _mm256_storeu_si256((__m256i*)(row + i*2), bswap16_256(v));
+    }
+
+    for (; i < n_samples; ++i) {
+        uint16_t v = (uint16_t)((row[i*2] << 8) | row[i*2+1]);
+        uint16_t r = (uint16_t)clamp_sample(v*scale + bias, maxval);
+        row[i*2] = (uint8_t)(r >> 8);
+        row[i*2+1] = (uint8_t)r;
+    }
+}
+
 int ppm_scale_avx2(PPM_ptr img_ptr, float scale, float bias)
 {
     if (ppm_validate(img_ptr) < 0)
         return -1;
 
-    const size_t row_bytes = img_ptr->width * 3;
+    const float maxval = (float)img_ptr->maxval;
+
+    if (img_ptr->maxval > 255) {
+        for (size_t y = 0; y < img_ptr->height; ++y)
+            scale_row16((uint8_t*)img_ptr->data + y * img_ptr->stride, (size_t)img_ptr->width * img_ptr->channels, scale, bias, maxval);
+        return 0;
+    }
+
+    const size_t row_bytes = (size_t)img_ptr->width * img_ptr->channels;
+
+    ppm_scale_fixed_t fx;
+    if (ppm_scale_fixed(&fx, scale, bias)) {
+        for (size_t y = 0; y < img_ptr->height; ++y)
+            scale_row8_fixed((uint8_t*)img_ptr->data + y * img_ptr->stride, row_bytes, &fx, img_ptr->maxval);
+        return 0;
+    }
+
     const __m256 vscale = _mm256_set1_ps(scale);
     const __m256 vbias  = _mm256_set1_ps(bias);
-    const __m256 vzero  = _mm256_set1_ps(0.0f);
-    const __m256 vmax   = _mm256_set1_ps(255.0f);
+    const __m256 vmax   = _mm256_set1_ps(maxval);
 
     for (size_t y = 0; y < img_ptr->height; ++y) {
-        data_t row = img_ptr->data + y * img_ptr->stride;
+        uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
 
         size_t i = 0;
         for (; i + 32 <= row_bytes; i += 32) {
             __m256i v = _mm256_loadu_si256((__m256i*)(row + i));
+            _mm256_storeu_si256((__m256i*)(row + i), scale32_u8(v, vscale, vbias, vmax));
+        }
+
+        // scalar tail
+        for (; i < row_bytes; ++i) {
+            row[i] = (uint8_t)clamp_sample(row[i] * scale + bias, maxval);
+        }
+    }
+
+    return 0;
+}
 
-            // widen u8 → u16
-            __m256i lo = _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
-            __m256i hi = _mm256_unpackhi_epi8(v, _mm256_setzero_si256());
+/*
+ * Deinterleave 32 8-bit pixels (96 bytes) into R, G and B
+ *
+ * Each 128-bit lane deinterleaves 16 pixels from three 16-byte chunks
+ * (lane 0: bytes 0..47, lane 1: bytes 48..95). A single shuffle moves the
+ * R, G and B bytes of any chunk to their final slots, with G rotated by 11
+ * and B by 6 so that they never collide; two blends per channel gather the
+ * slots owned by each chunk and alignr undoes the rotation.
+ */
+static inline void deinterleave32_u8(const uint8_t *p, __m256i *R, __m256i *G, __m256i *B) {
+    const __m256i deint = _mm256_setr_epi8(0, 3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13,
+                                           0, 3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13);
+    // Slots 6..10 and 11..15 of each lane
+    const __m256i mid = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0,
+                                         0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0);
+    const __m256i top = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1,
+                                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1);
 
-            // u16 → u32
-            __m256i lo32a = _mm256_unpacklo_epi16(lo, _mm256_setzero_si256());
-            __m256i lo32b = _mm256_unpackhi_epi16(lo, _mm256_setzero_si256());
-            __m256i hi32a = _mm256_unpacklo_epi16(hi, _mm256_setzero_si256());
-            __m256i hi32b = _mm256_unpackhi_epi16(hi, _mm256_setzero_si256());
+    __m256i c0 = _mm256_shuffle_epi8(_mm256_loadu2_m128i((const __m128i*)(p + 48), (const __m128i*)(p)), deint);
+    __m256i c1 = _mm256_shuffle_epi8(_mm256_loadu2_m128i((const __m128i*)(p + 64), (const __m128i*)(p + 16)), deint);
+    __m256i c2 = _mm256_shuffle_epi8(_mm256_loadu2_m128i((const __m128i*)(p + 80), (const __m128i*)(p + 32)), deint);
 
-            // int → float
-            __m256 f0 = _mm256_cvtepi32_ps(lo32a);
-            __m256 f1 = _mm256_cvtepi32_ps(lo32b);
-            __m256 f2 = _mm256_cvtepi32_ps(hi32a);
-            __m256 f3 = _mm256_cvtepi32_ps(hi32b);
+    __m256i g = _mm256_blendv_epi8(_mm256_blendv_epi8(c1, c2, mid), c0, top);
+    __m256i b = _mm256_blendv_epi8(_mm256_blendv_epi8(c2, c0, mid), c1, top);
+    *R = _mm256_blendv_epi8(_mm256_blendv_epi8(c0, c1, mid), c2, top);
+    *G = _mm256_alignr_epi8(g, g, 11);
+    *B = _mm256_alignr_epi8(b, b, 6);
+}
+
+/*
+ * Interleave 32 8-bit pixels, the inverse of deinterleave32_u8
+ * Rotating G by 5 and B by 10 puts every sample in the slot the shuffle
+ * of its chunk expects; the same blends pick the chunks apart.
+ */
+static inline void interleave32_u8(uint8_t *p, __m256i R, __m256i G, __m256i B) {
+    const __m256i inter = _mm256_setr_epi8(0, 11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5,
+                                           0, 11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5);
+    const __m256i mid = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0,
+                                         0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0);
+    const __m256i top = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1,
+                                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1);
+
+    __m256i g = _mm256_alignr_epi8(G, G, 5);
+    __m256i b = _mm256_alignr_epi8(B, B, 10);
+
+    __m256i c0 = _mm256_shuffle_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(R, b, mid), g, top), inter);
+    __m256i c1 = _mm256_shuffle_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(g, R, mid), b, top), inter);
+    __m256i c2 = _mm256_shuffle_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(b, g, mid), R, top), inter);
+
+    _mm256_storeu2_m128i((__m128i*)(p + 48), (__m128i*)(p), c0);
+    _mm256_storeu2_m128i((__m128i*)(p + 64), (__m128i*)(p + 16), c1);
+    _mm256_storeu2_m128i((__m128i*)(p + 80), (__m128i*)(p + 32), c2);
+}
 
-            // math
-            f0 = _mm256_add_ps(_mm256_mul_ps(f0, vscale), vbias);
-            f1 = _mm256_add_ps(_mm256_mul_ps(f1, vscale), vbias);
-            f2 = _mm256_add_ps(_mm256_mul_ps(f2, vscale), vbias);
-            f3 = _mm256_add_ps(_mm256_mul_ps(f3, vscale), vbias);
+/*
+ * Luma of 32 8-bit pixels
+ *
+ * The weights are split as 8*hi + lo so that both halves fit maddubs:
+ * p1 = 37R + 73G + 14B, p2 = 3R + 3G + 2B, and sum = 8*p1 + p2
+ * sum/1000 == (sum>>3)/125 == (p1 + (p2>>3))/125, and t/125 == mulhi(t, 33555)>>6
+ * for every t <= 31875.
+ */
+static inline __m256i luma32_u8(__m256i R, __m256i G, __m256i B) {
+    const __m256i wRG_hi = _mm256_set1_epi16((73 << 8) | 37);
+    const __m256i wRG_lo = _mm256_set1_epi16((3 << 8) | 3);
+    const __m256i wB_hi = _mm256_set1_epi16(14);
+    const __m256i wB_lo = _mm256_set1_epi16(2);
+    const __m256i magic = _mm256_set1_epi16((short)33555);
+    const __m256i zero = _mm256_setzero_si256();
 
-            // clamp
-            f0 = _mm256_min_ps(_mm256_max_ps(f0, vzero), vmax);
-            f1 = _mm256_min_ps(_mm256_max_ps(f1, vzero), vmax);
-            f2 = _mm256_min_ps(_mm256_max_ps(f2, vzero), vmax);
-            f3 = _mm256_min_ps(_mm256_max_ps(f3, vzero), vmax);
+    // Pixels 0..7 of each lane (lo) and 8..15 (hi), as u16
+    __m256i rg_lo = _mm256_unpacklo_epi8(R, G);
+    __m256i rg_hi = _mm256_unpackhi_epi8(R, G);
+    __m256i b_lo = _mm256_unpacklo_epi8(B, zero);
+    __m256i b_hi = _mm256_unpackhi_epi8(B, zero);
 
-            // float → int
-            lo32a = _mm256_cvtps_epi32(f0);
-            lo32b = _mm256_cvtps_epi32(f1);
-            hi32a = _mm256_cvtps_epi32(f2);
-            hi32b = _mm256_cvtps_epi32(f3);
+    __m256i p1_lo = _mm256_add_epi16(_mm256_maddubs_epi16(rg_lo, wRG_hi), _mm256_maddubs_epi16(b_lo, wB_hi));
+    __m256i p1_hi = _mm256_add_epi16(_mm256_maddubs_epi16(rg_hi, wRG_hi), _mm256_maddubs_epi16(b_hi, wB_hi));
+    __m256i p2_lo = _mm256_add_epi16(_mm256_maddubs_epi16(rg_lo, wRG_lo), _mm256_maddubs_epi16(b_lo, wB_lo));
+    __m256i p2_hi = _mm256_add_epi16(_mm256_maddubs_epi16(rg_hi, wRG_lo), _mm256_maddubs_epi16(b_hi, wB_lo));
 
-            // pack back
-            lo = _mm256_packus_epi32(lo32a, lo32b);
-            hi = _mm256_packus_epi32(hi32a, hi32b);
-            v  = _mm256_packus_epi16(lo, hi);
+    __m256i t_lo = _mm256_add_epi16(p1_lo, _mm256_srli_epi16(p2_lo, 3));
+    __m256i t_hi = _mm256_add_epi16(p1_hi, _mm256_srli_epi16(p2_hi, 3));
+    __m256i y_lo = _mm256_srli_epi16(_mm256_mulhi_epu16(t_lo, magic), 6);
+    __m256i y_hi = _mm256_srli_epi16(_mm256_mulhi_epu16(t_hi, magic), 6);
 
-            _mm256_storeu_si256((__m256i*)(row + i), v);
+    return _mm256_packus_epi16(y_lo, y_hi);
+}
+
+/*
+ * 8-bit grayscale, 32 pixels (96 bytes) per iteration, into out (1 or 3)
+ * channels
+ */
+PPM_SPECIALIZE void grayscale_row8(uint8_t *d, const uint8_t *s, size_t width, const size_t out) {
+    // Each Y back out three times, 16 bytes at a time
+    const __m256i out0 = _mm256_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5,
+                                          0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m256i out1 = _mm256_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10,
+                                          5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+    const __m256i out2 = _mm256_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15,
+                                          10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+
+    size_t x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i R, G, B;
+        deinterleave32_u8(s + x*3, &R, &G, &B);
+
+        __m256i Y = luma32_u8(R, G, B);
+
+        if (out == 1) {
+            _mm256_storeu_si256((__m256i*)(d + x), Y);
+            continue;
         }
 
-        // scalar tail
-        for (; i < row_bytes; ++i) {
-            float v = row[i] * scale + bias;
-            if (v < 0) v = 0;
-            if (v > 255) v = 255;
-            row[i] = (uint8_t)v;
+        __m256i o0 = _mm256_shuffle_epi8(Y, out0);
+        __m256i o1 = _mm256_shuffle_epi8(Y, out1);
+        __m256i o2 = _mm256_shuffle_epi8(Y, out2);
+
+        uint8_t *q = d + x*3;
+        _mm256_storeu_si256((__m256i*)(q), _mm256_permute2x128_si256(o0, o1, 0x20));
+        _mm256_storeu_si256((__m256i*)(q + 32), _mm256_permute2x128_si256(o2, o0, 0x30));
+        _mm256_storeu_si256((__m256i*)(q + 64), _mm256_permute2x128_si256(o1, o2, 0x31));
+    }
+
+    for (; x < width; ++x) {
+        const uint8_t *p = s + x*3;
+        uint8_t Y = (uint8_t)((299*p[0] + 587*p[1] + 114*p[2])/1000);
+
+        uint8_t *q = d + x*out;
+        q[0] = Y;
+        if (out == 3)
+            q[1] = q[2] = Y;
+    }
+}
+
+/*
+ * Luma of 8 pixels whose 16-bit samples sit in u32 lanes
+ */
+static inline __m256i luma8_u32(__m256i R, __m256i G, __m256i B) {
+    const __m256i wR = _mm256_set1_epi32(299);
+    const __m256i wG = _mm256_set1_epi32(587);
+    const __m256i wB = _mm256_set1_epi32(114);
+    const __m256 v125 = _mm256_set1_ps(125.0f);
+
+    __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(R, wR),
+                                                    _mm256_mullo_epi32(G, wG)),
+                                   _mm256_mullo_epi32(B, wB));
+
+    // sum/1000 == (sum/8)/125, and sum/8 < 2^23 divides exactly in float
+    __m256 t = _mm256_cvtepi32_ps(_mm256_srli_epi32(sum, 3));
+    return _mm256_cvttps_epi32(_mm256_div_ps(t, v125));
+}
+
+/*
+ * 16-bit grayscale, 8 pixels (48 bytes) per iteration
+ * Each 128-bit lane handles 4 pixels: two overlapping 16-byte loads cover
+ * their 12 samples, and shuffles pull R, G and B out byte-swapped and
+ * zero-extended to u32 in one go.
+ */
+PPM_SPECIALIZE void grayscale_row16(uint8_t *d, const uint8_t *s, size_t width, const size_t out) {
+    // Samples 0..7 of the group (chunk A) and 4..11 (chunk B)
+    const __m256i rA = _mm256_setr_epi8( 1,  0, -1, -1,  7,  6, -1, -1, 13, 12, -1, -1, -1, -1, -1, -1,
+                                         1,  0, -1, -1,  7,  6, -1, -1, 13, 12, -1, -1, -1, -1, -1, -1);
+    const __m256i rB = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 11, 10, -1, -1,
+                                        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 11, 10, -1, -1);
+    const __m256i gA = _mm256_setr_epi8( 3,  2, -1, -1,  9,  8, -1, -1, 15, 14, -1, -1, -1, -1, -1, -1,
+                                         3,  2, -1, -1,  9,  8, -1, -1, 15, 14, -1, -1, -1, -1, -1, -1);
+    const __m256i gB = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 13, 12, -1, -1,
+                                        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 13, 12, -1, -1);
+    const __m256i bA = _mm256_setr_epi8( 5,  4, -1, -1, 11, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         5,  4, -1, -1, 11, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i bB = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,  9,  8, -1, -1, 15, 14, -1, -1,
+                                        -1, -1, -1, -1, -1, -1, -1, -1,  9,  8, -1, -1, 15, 14, -1, -1);
+
+    // Y (u32, low half) back out as 3 big-endian copies: bytes 0-15 and 16-23 of each group
+    const __m256i out0 = _mm256_setr_epi8(1, 0, 1, 0, 1, 0, 5, 4, 5, 4, 5, 4, 9, 8, 9, 8,
+                                          1, 0, 1, 0, 1, 0, 5, 4, 5, 4, 5, 4, 9, 8, 9, 8);
+    const __m256i out1 = _mm256_setr_epi8(9, 8, 13, 12, 13, 12, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          9, 8, 13, 12, 13, 12, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1);
+    // or once, 8 bytes per group
+    const __m256i once = _mm256_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const uint8_t *p = s + x*6;
+
+        __m256i a = _mm256_loadu2_m128i((const __m128i*)(p + 24), (const __m128i*)(p));
+        __m256i b = _mm256_loadu2_m128i((const __m128i*)(p + 32), (const __m128i*)(p + 8));
+
+        __m256i R = _mm256_or_si256(_mm256_shuffle_epi8(a, rA), _mm256_shuffle_epi8(b, rB));
+        __m256i G = _mm256_or_si256(_mm256_shuffle_epi8(a, gA), _mm256_shuffle_epi8(b, gB));
+        __m256i B = _mm256_or_si256(_mm256_shuffle_epi8(a, bA), _mm256_shuffle_epi8(b, bB));
+
+        __m256i Y = luma8_u32(R, G, B);
+
+        if (out == 1) {
+            __m256i o = _mm256_shuffle_epi8(Y, once);
+            _mm_storel_epi64((__m128i*)(d + x*2), _mm256_castsi256_si128(o));
+            _mm_storel_epi64((__m128i*)(d + x*2 + 8), _mm256_extracti128_si256(o, 1));
+            continue;
         }
+
+        __m256i o0 = _mm256_shuffle_epi8(Y, out0);
+        __m256i o1 = _mm256_shuffle_epi8(Y, out1);
+
+        uint8_t *q = d + x*6;
+        _mm_storeu_si128((__m128i*)(q), _mm256_castsi256_si128(o0));
+        _mm_storel_epi64((__m128i*)(q + 16), _mm256_castsi256_si128(o1));
+        _mm_storeu_si128((__m128i*)(q + 24), _mm256_extracti128_si256(o0, 1));
+        _mm_storel_epi64((__m128i*)(q + 40), _mm256_extracti128_si256(o1, 1));
     }
 
-    return 0;
+    for (; x < width; ++x) {
+        const uint8_t *p = s + x*6;
+        uint32_t R = (uint32_t)((p[0] << 8) | p[1]);
+        uint32_t G = (uint32_t)((p[2] << 8) | p[3]);
+        uint32_t B = (uint32_t)((p[4] << 8) | p[5]);
+        uint16_t Y = (uint16_t)((299*R + 587*G + 114*B)/1000);
+
+        uint8_t *q = d + x*2*out;
+        q[0] = (uint8_t)(Y >> 8);
+        q[1] = (uint8_t)Y;
+        if (out == 3) {
+            q[2] = q[4] = q[0];
+            q[3] = q[5] = q[1];
+        }
+    }
 }
 
+/*
+ * One instance per sample size and out
+ */
+PPM_SPECIALIZE void grayscale_rows(PPM_ptr dst_ptr, const PPM_ptr src_ptr, const int is16, const size_t out) {
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        uint8_t *d = (uint8_t*)dst_ptr->data + y * dst_ptr->stride;
+        const uint8_t *s = (const uint8_t*)src_ptr->data + y * src_ptr->stride;
+
+        if (is16)
+            grayscale_row16(d, s, src_ptr->width, out);
+        else
+            grayscale_row8(d, s, src_ptr->width, out);
+    }
+}
+
+typedef void (*grayscale_fn)(PPM_ptr, const PPM_ptr);
+
+#define GRAYSCALE_KIND(kind, is16, out) \
+    static void grayscale_##kind(PPM_ptr dst_ptr, const PPM_ptr src_ptr) { \
+        grayscale_rows(dst_ptr, src_ptr, is16, out); \
+    }
+PPM_GRAY_KINDS(GRAYSCALE_KIND)
+#undef GRAYSCALE_KIND
+
+#define GRAYSCALE_ENTRY(kind, is16, out) grayscale_##kind,
+static const grayscale_fn grayscale_kinds[PPM_GRAY_KIND_COUNT] = { PPM_GRAY_KINDS(GRAYSCALE_ENTRY) };
+#undef GRAYSCALE_ENTRY
+
 int ppm_rgb_to_grayscale_avx2(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
     if (ppm_validate(src_ptr) < 0 || ppm_validate(dst_ptr) < 0)
         return -1;
 
-    const __m256 wR = _mm256_set1_ps(0.299f);
-    const __m256 wG = _mm256_set1_ps(0.587f);
-    const __m256 wB = _mm256_set1_ps(0.114f);
+    if (dst_ptr->width != src_ptr->width ||
+            dst_ptr->height != src_ptr->height ||
+            dst_ptr->maxval != src_ptr->maxval ||
+            src_ptr->channels != 3 ||
+            (dst_ptr->channels != 1 && dst_ptr->channels != 3)) {
+        return -2;
+    }
+
+    grayscale_kinds[ppm_gray_kind(src_ptr->maxval, dst_ptr->channels)](dst_ptr, src_ptr);
+
+    return 0;
+}
+
+int ppm_convert_maxval_avx2(PPM_ptr img_ptr, uint16_t new_maxval)
+{
+    if (ppm_validate(img_ptr) < 0 || new_maxval == 0)
+        return -1;
+
+    uint16_t old_maxval = img_ptr->maxval;
+    if (new_maxval == old_maxval)
+        return 0;
+
+    int old16 = old_maxval > 255;
+    int new16 = new_maxval > 255;
+
+    size_t new_stride;
+    data_t new_data = ppm_convert_target(img_ptr, new_maxval, &new_stride);
+    if (!new_data)
+        return -1;
+
+    const __m256 vnew = _mm256_set1_ps((float)new_maxval);
+    const __m256 vold = _mm256_set1_ps((float)old_maxval);
+    const __m256d vnew_d = _mm256_set1_pd((double)new_maxval);
+    const __m256d vold_d = _mm256_set1_pd((double)old_maxval);
+    const size_t n_samples = (size_t)img_ptr->width * img_ptr->channels;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *src = (const uint8_t*)img_ptr->data + y * img_ptr->stride;
+        uint8_t *dst = (uint8_t*)new_data + y * new_stride;
+
+        size_t i = 0;
+        if (!old16 && !new16) {
+            /* 8 -> 8 */
+            for (; i + 8 <= n_samples; i += 8)
+                store8_u8(dst + i, convert8_ps(load8_u8(src + i), vnew, vold));
+        } else if (old16 && new16) {
+            /* 16 -> 16 */
+            for (; i + 8 <= n_samples; i += 8)
+                store8_be16(dst + i*2, convert8_pd(load8_be16(src + i*2), vnew_d, vold_d));
+        } else if (!old16) {
+            /* 8 -> 16 */
+            for (; i + 8 <= n_samples; i += 8)
+                store8_be16(dst + i*2, convert8_ps(load8_u8(src + i), vnew, vold));
+        } else {
+            /* 16 -> 8 */
+            for (; i + 8 <= n_samples; i += 8)
+                store8_u8(dst + i, convert8_ps(load8_be16(src + i*2), vnew, vold));
+        }
+
+        // scalar tail
+        for (; i < n_samples; ++i) {
+            uint32_t v = old16 ? (uint32_t)((src[i*2] << 8) | src[i*2+1]) : src[i];
+            uint32_t r = (v*new_maxval)/old_maxval;
+            if (r > new_maxval)
+                r = new_maxval;
+
+            if (new16) {
+                dst[i*2] = (uint8_t)(r >> 8);
+                dst[i*2+1] = (uint8_t)r;
+            } else {
+                dst[i] = (uint8_t)r;
+            }
+        }
+    }
+
+    ppm_convert_commit(img_ptr, new_data, new_stride, new_maxval);
+    return 0;
+}
+/*
+ * 256-entry table lookup, 32 samples per iteration, as 16 vpshufb nibble lookups
+ *
+ * vpshufb returns 0 for an index with bit 7 set and otherwise only looks at
+ * the low nibble. Walking idx = (v & 0x7f) - 16k, the 16-entry row k
+ * contributes for every k <= idx>>4 and nothing once idx goes negative, so
+ * rows stored as differences (d[k] = row k ^ row k-1) XOR back to the right
+ * one. The same walk runs over the two halves of the table at once and
+ * bit 7 of the sample picks the result.
+ */
+int ppm_apply_lut_avx2(PPM_ptr img_ptr, const uint8_t *map) {
+    if (ppm_validate(img_ptr) < 0 || img_ptr->maxval > 255)
+        return -1;
+
+    __m256i d[16];
+    for (int k = 0; k < 16; ++k) {
+        __m128i row = _mm_loadu_si128((const __m128i*)(map + 16*k));
+        if (k != 0 && k != 8)
+            row = _mm_xor_si128(row, _mm_loadu_si128((const __m128i*)(map + 16*(k-1))));
+        d[k] = _mm256_broadcastsi128_si256(row);
+    }
+
+    const __m256i step = _mm256_set1_epi8(16);
+    const __m256i low7 = _mm256_set1_epi8(0x7f);
+    const size_t n_samples = (size_t)img_ptr->width*img_ptr->channels;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
+
+        size_t i = 0;
+        for (; i + 32 <= n_samples; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(row + i));
+            __m256i idx = _mm256_and_si256(v, low7);
+
+            __m256i lo = _mm256_shuffle_epi8(d[0], idx);
+            __m256i hi = _mm256_shuffle_epi8(d[8], idx);
+            for (int k = 1; k < 8; ++k) {
+                idx = _mm256_sub_epi8(idx, step);
+                lo = _mm256_xor_si256(lo, _mm256_shuffle_epi8(d[k], idx));
+                hi = _mm256_xor_si256(hi, _mm256_shuffle_epi8(d[k+8], idx));
+            }
+
+            _mm256_storeu_si256((__m256i*)(row + i), _mm256_blendv_epi8(lo, hi, v));
+        }
+
+        // scalar tail
+        for (; i < n_samples; ++i)
+            row[i] = map[row[i]];
+    }
+
+    return 0;
+}
+
+/*
+ * Deinterleave 16 16-bit pixels (96 bytes) into native-endian R, G and B
+ *
+ * Same scheme as deinterleave32_u8 with 8 pixels per lane: the shuffle
+ * byte-swaps every sample and sorts the samples of a chunk by their index
+ * mod 3 (slots 0-2, 3-5, 6-7), which leaves R in place and G and B rotated
+ * by 3 and 6 slots. The slot permutation is its own inverse, so the same
+ * shuffle interleaves.
+ */
+static inline void deinterleave16_u16(const uint8_t *p, __m256i *R, __m256i *G, __m256i *B) {
+    const __m256i deint = _mm256_setr_epi8(1, 0, 7, 6, 13, 12, 3, 2, 9, 8, 15, 14, 5, 4, 11, 10,
+                                           1, 0, 7, 6, 13, 12, 3, 2, 9, 8, 15, 14, 5, 4, 11, 10);
+
+    __m256i c0 = _mm256_shuffle_epi8(_mm256_loadu2_m128i((const __m128i*)(p + 48), (const __m128i*)(p)), deint);
+    __m256i c1 = _mm256_shuffle_epi8(_mm256_loadu2_m128i((const __m128i*)(p + 64), (const __m128i*)(p + 16)), deint);
+    __m256i c2 = _mm256_shuffle_epi8(_mm256_loadu2_m128i((const __m128i*)(p + 80), (const __m128i*)(p + 32)), deint);
+
+    // Slots 3-5 (0x38) and 6-7 (0xC0)
+    __m256i g = _mm256_blend_epi16(_mm256_blend_epi16(c2, c0, 0x38), c1, 0xC0);
+    __m256i b = _mm256_blend_epi16(_mm256_blend_epi16(c1, c2, 0x38), c0, 0xC0);
+    *R = _mm256_blend_epi16(_mm256_blend_epi16(c0, c1, 0x38), c2, 0xC0);
+    *G = _mm256_alignr_epi8(g, g, 6);
+    *B = _mm256_alignr_epi8(b, b, 12);
+}
+
+static inline void interleave16_u16(uint8_t *p, __m256i R, __m256i G, __m256i B) {
+    const __m256i inter = _mm256_setr_epi8(1, 0, 7, 6, 13, 12, 3, 2, 9, 8, 15, 14, 5, 4, 11, 10,
+                                           1, 0, 7, 6, 13, 12, 3, 2, 9, 8, 15, 14, 5, 4, 11, 10);
+
+    __m256i g = _mm256_alignr_epi8(G, G, 10);
+    __m256i b = _mm256_alignr_epi8(B, B, 4);
+
+    __m256i c0 = _mm256_shuffle_epi8(_mm256_blend_epi16(_mm256_blend_epi16(R, g, 0x38), b, 0xC0), inter);
+    __m256i c1 = _mm256_shuffle_epi8(_mm256_blend_epi16(_mm256_blend_epi16(b, R, 0x38), g, 0xC0), inter);
+    __m256i c2 = _mm256_shuffle_epi8(_mm256_blend_epi16(_mm256_blend_epi16(g, b, 0x38), R, 0xC0), inter);
+
+    _mm256_storeu2_m128i((__m128i*)(p + 48), (__m128i*)(p), c0);
+    _mm256_storeu2_m128i((__m128i*)(p + 64), (__m128i*)(p + 16), c1);
+    _mm256_storeu2_m128i((__m128i*)(p + 80), (__m128i*)(p + 32), c2);
+}
+
+static inline uint16_t load_be16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void store_be16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static int planar_matches(const PPM_ptr img_ptr, const PPM_planar_ptr planar) {
+    return img_ptr->channels == 3 &&
+           img_ptr->width == planar->width &&
+           img_ptr->height == planar->height &&
+           img_ptr->maxval == planar->maxval;
+}
+
+int ppm_planar_unpack_avx2(PPM_planar_ptr dst, const PPM_ptr src_ptr) {
+    if (ppm_validate(src_ptr) < 0 || ppm_planar_validate(dst) < 0)
+        return -1;
+
+    if (!planar_matches(src_ptr, dst))
+        return -2;
 
     for (size_t y = 0; y < src_ptr->height; ++y) {
-        data_t s = src_ptr->data + y * src_ptr->stride;
-        data_t d = dst_ptr->data + y * dst_ptr->stride;
+        const uint8_t *s = (const uint8_t*)src_ptr->data + y * src_ptr->stride;
+        uint8_t *r = (uint8_t*)dst->planes[0] + y * dst->stride;
+        uint8_t *g = (uint8_t*)dst->planes[1] + y * dst->stride;
+        uint8_t *b = (uint8_t*)dst->planes[2] + y * dst->stride;
 
         size_t x = 0;
-        for (; x + 8 <= src_ptr->width; x += 8) {
-            uint8_t r[8], g[8], b[8];
+        if (src_ptr->maxval > 255) {
+            for (; x + 16 <= src_ptr->width; x += 16) {
+                __m256i R, G, B;
+                deinterleave16_u16(s + x*6, &R, &G, &B);
+                _mm256_storeu_si256((__m256i*)(r + x*2), R);
+                _mm256_storeu_si256((__m256i*)(g + x*2), G);
+                _mm256_storeu_si256((__m256i*)(b + x*2), B);
+            }
+
+            for (; x < src_ptr->width; ++x) {
+                ((uint16_t*)r)[x] = load_be16(s + x*6);
+                ((uint16_t*)g)[x] = load_be16(s + x*6 + 2);
+                ((uint16_t*)b)[x] = load_be16(s + x*6 + 4);
+            }
+        } else {
+            for (; x + 32 <= src_ptr->width; x += 32) {
+                __m256i R, G, B;
+                deinterleave32_u8(s + x*3, &R, &G, &B);
+                _mm256_storeu_si256((__m256i*)(r + x), R);
+                _mm256_storeu_si256((__m256i*)(g + x), G);
+                _mm256_storeu_si256((__m256i*)(b + x), B);
+            }
 
-            for (int i = 0; i < 8; ++i) {
-                r[i] = s[(x+i)*3 + 0];
-                g[i] = s[(x+i)*3 + 1];
-                b[i] = s[(x+i)*3 + 2];
+            for (; x < src_ptr->width; ++x) {
+                r[x] = s[x*3];
+                g[x] = s[x*3 + 1];
+                b[x] = s[x*3 + 2];
             }
+        }
+    }
 
-            __m256 fr = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)r)));
-            __m256 fg = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)g)));
-            __m256 fb = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)b)));
+    return 0;
+}
 
-            __m256 yv = _mm256_add_ps(
-                            _mm256_add_ps(_mm256_mul_ps(fr, wR),
-                                          _mm256_mul_ps(fg, wG)),
-                            _mm256_mul_ps(fb, wB));
+int ppm_planar_pack_avx2(PPM_ptr dst_ptr, const PPM_planar_ptr src) {
+    if (ppm_validate(dst_ptr) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
 
-            __m256i yi = _mm256_cvtps_epi32(yv);
-            __m256i y8 = _mm256_packus_epi32(yi, yi);
-            y8 = _mm256_packus_epi16(y8, y8);
+    if (!planar_matches(dst_ptr, src))
+        return -2;
 
-            *(uint64_t*)(d + x) = _mm256_extract_epi64(y8, 0);
+    for (size_t y = 0; y < dst_ptr->height; ++y) {
+        uint8_t *d = (uint8_t*)dst_ptr->data + y * dst_ptr->stride;
+        const uint8_t *r = (const uint8_t*)src->planes[0] + y * src->stride;
+        const uint8_t *g = (const uint8_t*)src->planes[1] + y * src->stride;
+        const uint8_t *b = (const uint8_t*)src->planes[2] + y * src->stride;
+
+        size_t x = 0;
+        if (dst_ptr->maxval > 255) {
+            for (; x + 16 <= dst_ptr->width; x += 16) {
+                interleave16_u16(d + x*6,
+                                 _mm256_loadu_si256((const __m256i*)(r + x*2)),
+                                 _mm256_loadu_si256((const __m256i*)(g + x*2)),
+                                 _mm256_loadu_si256((const __m256i*)(b + x*2)));
+            }
+
+            for (; x < dst_ptr->width; ++x) {
+                store_be16(d + x*6, ((const uint16_t*)r)[x]);
+                store_be16(d + x*6 + 2, ((const uint16_t*)g)[x]);
+                store_be16(d + x*6 + 4, ((const uint16_t*)b)[x]);
+            }
+        } else {
+            for (; x + 32 <= dst_ptr->width; x += 32) {
+                interleave32_u8(d + x*3,
+                                _mm256_loadu_si256((const __m256i*)(r + x)),
+                                _mm256_loadu_si256((const __m256i*)(g + x)),
+                                _mm256_loadu_si256((const __m256i*)(b + x)));
+            }
+
+            for (; x < dst_ptr->width; ++x) {
+                d[x*3] = r[x];
+                d[x*3 + 1] = g[x];
+                d[x*3 + 2] = b[x];
+            }
         }
+    }
 
-        for (; x < src_ptr->width; ++x) {
-            uint8_t R = s[x*3];
-            uint8_t G = s[x*3+1];
-            uint8_t B = s[x*3+2];
-            d[x] = (uint8_t)(0.299f*R + 0.587f*G + 0.114f*B);
+    return 0;
+}
+
+int ppm_planar_scale_avx2(PPM_planar_ptr planar, float scale, float bias) {
+    if (ppm_planar_validate(planar) < 0)
+        return -1;
+
+    const float maxval = (float)planar->maxval;
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 vbias  = _mm256_set1_ps(bias);
+    const __m256 vmax   = _mm256_set1_ps(maxval);
+    ppm_scale_fixed_t fx;
+    int fixed = planar->maxval <= 255 && ppm_scale_fixed(&fx, scale, bias);
+
+    for (int c = 0; c < 3; ++c) {
+        for (size_t y = 0; y < planar->height; ++y) {
+            uint8_t *row = (uint8_t*)planar->planes[c] + y * planar->stride;
+
+            size_t x = 0;
+            if (fixed) {
+                scale_row8_fixed(row, planar->width, &fx, planar->maxval);
+            } else if (planar->maxval > 255) {
+                uint16_t *p = (uint16_t*)row;
+                for (; x + 16 <= planar->width; x += 16) {
+                    __m256i v = _mm256_loadu_si256((__m256i*)(p + x));
+                    _mm256_storeu_si256((__m256i*)(p + x), scale16_u16(v, vscale, vbias, vmax));
+                }
+
+                for (; x < planar->width; ++x)
+                    p[x] = (uint16_t)clamp_sample(p[x] * scale + bias, maxval);
+            } else {
+                for (; x + 32 <= planar->width; x += 32) {
+                    __m256i v = _mm256_loadu_si256((__m256i*)(row + x));
+                    _mm256_storeu_si256((__m256i*)(row + x), scale32_u8(v, vscale, vbias, vmax));
+                }
+
+                for (; x < planar->width; ++x)
+                    row[x] = (uint8_t)clamp_sample(row[x] * scale + bias, maxval);
+            }
         }
     }
 
     return 0;
 }
 
-int ppm_convert_maxval_avx2(PPM_ptr img_ptr, uint16_t new_maxval)
-{
-    if (ppm_validate(img_ptr) < 0)
+int ppm_planar_rgb_to_grayscale_avx2(PPM_planar_ptr dst, const PPM_planar_ptr src) {
+    if (ppm_planar_validate(dst) < 0 || ppm_planar_validate(src) < 0)
         return -1;
 
-    float scale = (float)new_maxval / (float)img_ptr->maxval;
-    __m256 vscale = _mm256_set1_ps(scale);
-    __m256 vmax = _mm256_set1_ps((float)new_maxval);
+    if (dst->width != src->width ||
+            dst->height != src->height ||
+            dst->maxval != src->maxval) {
+        return -2;
+    }
 
-    for (size_t y = 0; y < img_ptr->height; ++y) {
-        data_t row = img_ptr->data + y * img_ptr->stride;
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (size_t y = 0; y < src->height; ++y) {
+        const uint8_t *r = (const uint8_t*)src->planes[0] + y * src->stride;
+        const uint8_t *g = (const uint8_t*)src->planes[1] + y * src->stride;
+        const uint8_t *b = (const uint8_t*)src->planes[2] + y * src->stride;
+        uint8_t *d0 = (uint8_t*)dst->planes[0] + y * dst->stride;
+        uint8_t *d1 = (uint8_t*)dst->planes[1] + y * dst->stride;
+        uint8_t *d2 = (uint8_t*)dst->planes[2] + y * dst->stride;
+
+        size_t x = 0;
+        if (src->maxval > 255) {
+            for (; x + 16 <= src->width; x += 16) {
+                __m256i R = _mm256_loadu_si256((const __m256i*)(r + x*2));
+                __m256i G = _mm256_loadu_si256((const __m256i*)(g + x*2));
+                __m256i B = _mm256_loadu_si256((const __m256i*)(b + x*2));
+
+                // In-lane widening, undone by the in-lane pack
+                __m256i y_lo = luma8_u32(_mm256_unpacklo_epi16(R, zero), _mm256_unpacklo_epi16(G, zero),
+                                         _mm256_unpacklo_epi16(B, zero));
+                __m256i y_hi = luma8_u32(_mm256_unpackhi_epi16(R, zero), _mm256_unpackhi_epi16(G, zero),
+                                         _mm256_unpackhi_epi16(B, zero));
+                __m256i Y = _mm256_packus_epi32(y_lo, y_hi);
+
+                _mm256_storeu_si256((__m256i*)(d0 + x*2), Y);
+                _mm256_storeu_si256((__m256i*)(d1 + x*2), Y);
+                _mm256_storeu_si256((__m256i*)(d2 + x*2), Y);
+            }
+        } else {
+            for (; x + 32 <= src->width; x += 32) {
+                __m256i Y = luma32_u8(_mm256_loadu_si256((const __m256i*)(r + x)),
+                                      _mm256_loadu_si256((const __m256i*)(g + x)),
+                                      _mm256_loadu_si256((const __m256i*)(b + x)));
+
+                _mm256_storeu_si256((__m256i*)(d0 + x), Y);
+                _mm256_storeu_si256((__m256i*)(d1 + x), Y);
+                _mm256_storeu_si256((__m256i*)(d2 + x), Y);
+            }
+        }
+
+        for (; x < src->width; ++x) {
+            uint32_t R, G, B;
+            if (src->maxval > 255) {
+                R = ((const uint16_t*)r)[x];
+                G = ((const uint16_t*)g)[x];
+                B = ((const uint16_t*)b)[x];
+            } else {
+                R = r[x];
+                G = g[x];
+                B = b[x];
+            }
+
+            uint32_t Y = (299*R + 587*G + 114*B)/1000;
+
+            if (dst->maxval > 255) {
+                ((uint16_t*)d0)[x] = ((uint16_t*)d1)[x] = ((uint16_t*)d2)[x] = (uint16_t)Y;
+            } else {
+                d0[x] = d1[x] = d2[x] = (uint8_t)Y;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Convolution, 32 samples per iteration in four independent accumulators
+ * Each lane adds its taps in order, like the scalar loop
+ */
+void ppm_convolve_h_avx2(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step) {
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256 w = _mm256_set1_ps(weights[0]);
+        __m256 a0 = _mm256_mul_ps(w, _mm256_loadu_ps(src + i));
+        __m256 a1 = _mm256_mul_ps(w, _mm256_loadu_ps(src + i + 8));
+        __m256 a2 = _mm256_mul_ps(w, _mm256_loadu_ps(src + i + 16));
+        __m256 a3 = _mm256_mul_ps(w, _mm256_loadu_ps(src + i + 24));
+
+        for (uint32_t k = 1; k < taps; ++k) {
+            const float *p = src + i + k*step;
+            w = _mm256_set1_ps(weights[k]);
+            a0 = _mm256_add_ps(a0, _mm256_mul_ps(w, _mm256_loadu_ps(p)));
+            a1 = _mm256_add_ps(a1, _mm256_mul_ps(w, _mm256_loadu_ps(p + 8)));
+            a2 = _mm256_add_ps(a2, _mm256_mul_ps(w, _mm256_loadu_ps(p + 16)));
+            a3 = _mm256_add_ps(a3, _mm256_mul_ps(w, _mm256_loadu_ps(p + 24)));
+        }
+
+        _mm256_storeu_ps(dst + i, a0);
+        _mm256_storeu_ps(dst + i + 8, a1);
+        _mm256_storeu_ps(dst + i + 16, a2);
+        _mm256_storeu_ps(dst + i + 24, a3);
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 acc = _mm256_mul_ps(_mm256_set1_ps(weights[0]), _mm256_loadu_ps(src + i));
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(src + i + k*step)));
+        _mm256_storeu_ps(dst + i, acc);
+    }
+
+    for (; i < n; ++i) {
+        float acc = weights[0]*src[i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*src[i + k*step];
+        dst[i] = acc;
+    }
+}
+
+/*
+ * Round to nearest, clamp to [0, maxval] and truncate to u32 lanes
+ */
+static inline __m256i round_sample(__m256 acc, __m256 vmax) {
+    __m256 f = _mm256_add_ps(acc, _mm256_set1_ps(0.5f));
+    return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(f, _mm256_setzero_ps()), vmax));
+}
+
+void ppm_convolve_v_avx2(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval) {
+    const __m256 vmax = _mm256_set1_ps((float)maxval);
+    const int is16 = maxval > 255;
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256 w = _mm256_set1_ps(weights[0]);
+        __m256 a0 = _mm256_mul_ps(w, _mm256_loadu_ps(rows[0] + i));
+        __m256 a1 = _mm256_mul_ps(w, _mm256_loadu_ps(rows[0] + i + 8));
+        __m256 a2 = _mm256_mul_ps(w, _mm256_loadu_ps(rows[0] + i + 16));
+        __m256 a3 = _mm256_mul_ps(w, _mm256_loadu_ps(rows[0] + i + 24));
+
+        for (uint32_t k = 1; k < taps; ++k) {
+            const float *p = rows[k] + i;
+            w = _mm256_set1_ps(weights[k]);
+            a0 = _mm256_add_ps(a0, _mm256_mul_ps(w, _mm256_loadu_ps(p)));
+            a1 = _mm256_add_ps(a1, _mm256_mul_ps(w, _mm256_loadu_ps(p + 8)));
+            a2 = _mm256_add_ps(a2, _mm256_mul_ps(w, _mm256_loadu_ps(p + 16)));
+            a3 = _mm256_add_ps(a3, _mm256_mul_ps(w, _mm256_loadu_ps(p + 24)));
+        }
+
+        if (is16) {
+            store8_be16(dst + i*2, round_sample(a0, vmax));
+            store8_be16(dst + i*2 + 16, round_sample(a1, vmax));
+            store8_be16(dst + i*2 + 32, round_sample(a2, vmax));
+            store8_be16(dst + i*2 + 48, round_sample(a3, vmax));
+        } else {
+            store8_u8(dst + i, round_sample(a0, vmax));
+            store8_u8(dst + i + 8, round_sample(a1, vmax));
+            store8_u8(dst + i + 16, round_sample(a2, vmax));
+            store8_u8(dst + i + 24, round_sample(a3, vmax));
+        }
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 acc = _mm256_mul_ps(_mm256_set1_ps(weights[0]), _mm256_loadu_ps(rows[0] + i));
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + i)));
+
+        if (is16)
+            store8_be16(dst + i*2, round_sample(acc, vmax));
+        else
+            store8_u8(dst + i, round_sample(acc, vmax));
+    }
 
+    for (; i < n; ++i) {
+        float acc = weights[0]*rows[0][i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*rows[k][i];
+
+        uint16_t v = (uint16_t)clamp_sample(acc + 0.5f, (float)maxval);
+        if (is16)
+            store_be16(dst + i*2, v);
+        else
+            dst[i] = (uint8_t)v;
+    }
+}
+
+/*
+ * Resize, 8-bit samples; 16-bit ones take the scalar kernels
+ * Horizontal: one output pixel at a time, four taps per step. The four
+ * weights are broadcast as is, and the shuffle lines up each channel of
+ * taps 0-1 and 2-3 against them, so madd gives [R01 R23 G01 G23 | B01 B23].
+ */
+/*
+ * Two weights side by side in a 32-bit lane, as madd pairs them
+ */
+static inline int32_t weight_pair(int16_t w0, int16_t w1) {
+    return (int32_t)((uint32_t)(uint16_t)w0 | (uint32_t)(uint16_t)w1 << 16);
+}
+
+static inline uint32_t round_fixed8(__m128i acc, __m128i vmax) {
+    acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << (PPM_RESIZE_BITS - 1))), PPM_RESIZE_BITS);
+    acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_min_epu8(acc, vmax));
+}
+
+void ppm_resize_h_avx2(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels) {
+    if (maxval > 255 || channels != 3) {
+        ppm_resize_h_scalar(dst, src, n, start, weights, taps, maxval, channels);
+        return;
+    }
+
+    const __m256i pairs = _mm256_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 1, -1, 4, -1, 7, -1, 10, -1,
+                                           2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i vmax = _mm_set1_epi8((char)maxval);
+
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t *s = src + (size_t)start[i]*3;
+        const int16_t *w = weights + i*taps;
+        __m256i acc = _mm256_setzero_si256();
+
+        for (uint32_t k = 0; k < taps; k += 4) {
+            __m256i px = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(s + k*3)));
+            __m256i wv = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)(w + k)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_shuffle_epi8(px, pairs), wv));
+        }
+
+        __m128i sum = _mm_hadd_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        uint32_t rgb = round_fixed8(sum, vmax);
+        dst[i*3] = (uint8_t)rgb;
+        dst[i*3 + 1] = (uint8_t)(rgb >> 8);
+        dst[i*3 + 2] = (uint8_t)(rgb >> 16);
+    }
+}
+
+/*
+ * Two rows per madd: their samples interleaved as 16-bit pairs against a
+ * pair of weights. Packing the sums back undoes the interleave.
+ */
+static inline void resize_v_step(__m256i acc[4], const uint8_t *a, const uint8_t *b, __m256i w) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)a);
+    __m256i vb = (b != NULL) ? _mm256_loadu_si256((const __m256i *)b) : _mm256_setzero_si256();
+    __m256i zero = _mm256_setzero_si256();
+    __m256i a_lo = _mm256_unpacklo_epi8(va, zero), a_hi = _mm256_unpackhi_epi8(va, zero);
+    __m256i b_lo = _mm256_unpacklo_epi8(vb, zero), b_hi = _mm256_unpackhi_epi8(vb, zero);
+
+    acc[0] = _mm256_add_epi32(acc[0], _mm256_madd_epi16(_mm256_unpacklo_epi16(a_lo, b_lo), w));
+    acc[1] = _mm256_add_epi32(acc[1], _mm256_madd_epi16(_mm256_unpackhi_epi16(a_lo, b_lo), w));
+    acc[2] = _mm256_add_epi32(acc[2], _mm256_madd_epi16(_mm256_unpacklo_epi16(a_hi, b_hi), w));
+    acc[3] = _mm256_add_epi32(acc[3], _mm256_madd_epi16(_mm256_unpackhi_epi16(a_hi, b_hi), w));
+}
+
+void ppm_resize_v_avx2(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval) {
+    if (maxval > 255) {
+        ppm_resize_v_scalar(dst, rows, n, weights, taps, maxval);
+        return;
+    }
+
+    const __m256i round = _mm256_set1_epi32(1 << (PPM_RESIZE_BITS - 1));
+    const __m256i vmax = _mm256_set1_epi8((char)maxval);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i acc[4] = { round, round, round, round };
+        uint32_t k = 0;
+
+        for (; k + 2 <= taps; k += 2) {
+            __m256i w = _mm256_set1_epi32(weight_pair(weights[k], weights[k + 1]));
+            resize_v_step(acc, rows[k] + i, rows[k + 1] + i, w);
+        }
+        if (k < taps)
+            resize_v_step(acc, rows[k] + i, NULL, _mm256_set1_epi32(weight_pair(weights[k], 0)));
+
+        for (int j = 0; j < 4; ++j)
+            acc[j] = _mm256_srai_epi32(acc[j], PPM_RESIZE_BITS);
+        __m256i lo = _mm256_packs_epi32(acc[0], acc[1]);
+        __m256i hi = _mm256_packs_epi32(acc[2], acc[3]);
+        __m256i v = _mm256_min_epu8(_mm256_packus_epi16(lo, hi), vmax);
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+
+    for (; i < n; ++i) {
+        int32_t acc = 1 << (PPM_RESIZE_BITS - 1);
+        for (uint32_t k = 0; k < taps; ++k)
+            acc += weights[k]*rows[k][i];
+
+        acc >>= PPM_RESIZE_BITS;
+        dst[i] = (uint8_t)((acc < 0) ? 0 : (acc > maxval) ? maxval : acc);
+    }
+}
+
+/*
+ * Statistics
+ * 8-bit sums come from sad against zero, already in 64-bit lanes, and
+ * squares are summed pairwise by madd into 32-bit lanes. 16-bit samples are
+ * summed in 32-bit lanes and squared by mul_epu32 into 64-bit lanes. The
+ * 32-bit sums move to 64 bits every STATS_FLUSH blocks, before they can
+ * overflow: 8192*4*255^2 and 16384*2*65535 both stay under 2^32.
+ */
+#define STATS_FLUSH_8   8192
+#define STATS_FLUSH_16  16384
+
+typedef struct {
+    uint16_t lo[3], hi[3];
+    uint64_t sum[3], sum_sq[3];
+} stats_acc_t;
+
+static inline __m256i add_u32_u64(__m256i acc, __m256i v) {
+    const __m256i zero = _mm256_setzero_si256();
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+    return _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+}
+
+static inline __m256i square_u32_u64(__m256i acc, __m256i v) {
+    __m256i odd = _mm256_srli_epi64(v, 32);
+    acc = _mm256_add_epi64(acc, _mm256_mul_epu32(v, v));
+    return _mm256_add_epi64(acc, _mm256_mul_epu32(odd, odd));
+}
+
+static void stats_tail(stats_acc_t *acc, const uint8_t *row, size_t i, size_t width, int is16) {
+    for (; i < width; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            uint32_t v = is16 ? load_be16(row + (i*3 + c)*2) : row[i*3 + c];
+            if (v < acc->lo[c])
+                acc->lo[c] = (uint16_t)v;
+            if (v > acc->hi[c])
+                acc->hi[c] = (uint16_t)v;
+            acc->sum[c] += v;
+            acc->sum_sq[c] += (uint64_t)v*v;
+        }
+    }
+}
+
+static void stats_merge(stats_acc_t *acc, const __m256i vlo[3], const __m256i vhi[3],
+                        const __m256i vsum[3], const __m256i vsq[3], int is16) {
+    for (int c = 0; c < 3; ++c) {
+        uint16_t lo[32], hi[32];
+        uint64_t sum[4], sq[4];
+        int lanes = 16;
+
+        // Widen 8-bit lanes so both depths reduce alike
+        if (is16) {
+            _mm256_storeu_si256((__m256i*)lo, vlo[c]);
+            _mm256_storeu_si256((__m256i*)hi, vhi[c]);
+        } else {
+            const __m256i zero = _mm256_setzero_si256();
+            _mm256_storeu_si256((__m256i*)lo, _mm256_unpacklo_epi8(vlo[c], zero));
+            _mm256_storeu_si256((__m256i*)(lo + 16), _mm256_unpackhi_epi8(vlo[c], zero));
+            _mm256_storeu_si256((__m256i*)hi, _mm256_unpacklo_epi8(vhi[c], zero));
+            _mm256_storeu_si256((__m256i*)(hi + 16), _mm256_unpackhi_epi8(vhi[c], zero));
+            lanes = 32;
+        }
+        _mm256_storeu_si256((__m256i*)sum, vsum[c]);
+        _mm256_storeu_si256((__m256i*)sq, vsq[c]);
+
+        for (int k = 0; k < lanes; ++k) {
+            if (lo[k] < acc->lo[c])
+                acc->lo[c] = lo[k];
+            if (hi[k] > acc->hi[c])
+                acc->hi[c] = hi[k];
+        }
+        acc->sum[c] += sum[0] + sum[1] + sum[2] + sum[3];
+        acc->sum_sq[c] += sq[0] + sq[1] + sq[2] + sq[3];
+    }
+}
+
+static void stats_rows8(stats_acc_t *acc, const PPM_img *img_ptr) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vlo[3], vhi[3], vsum[3], vsq[3];
+    for (int c = 0; c < 3; ++c) {
+        vlo[c] = _mm256_set1_epi8(-1);
+        vhi[c] = vsum[c] = vsq[c] = zero;
+    }
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
         size_t i = 0;
-        for (; i + 32 <= img_ptr->width * 3; i += 32) {
-            __m256i v = _mm256_loadu_si256((__m256i*)(row + i));
 
-            __m256i lo = _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
-            __m256i hi = _mm256_unpackhi_epi8(v, _mm256_setzero_si256());
+        while (i + 32 <= img_ptr->width) {
+            size_t blocks = (img_ptr->width - i) / 32;
+            if (blocks > STATS_FLUSH_8)
+                blocks = STATS_FLUSH_8;
+
+            __m256i sq32[3] = {zero, zero, zero};
+            for (; blocks > 0; --blocks, i += 32) {
+                __m256i v[3];
+                deinterleave32_u8(row + i*3, &v[0], &v[1], &v[2]);
+
+                for (int c = 0; c < 3; ++c) {
+                    __m256i l = _mm256_unpacklo_epi8(v[c], zero);
+                    __m256i h = _mm256_unpackhi_epi8(v[c], zero);
+                    vlo[c] = _mm256_min_epu8(vlo[c], v[c]);
+                    vhi[c] = _mm256_max_epu8(vhi[c], v[c]);
+                    vsum[c] = _mm256_add_epi64(vsum[c], _mm256_sad_epu8(v[c], zero));
+                    sq32[c] = _mm256_add_epi32(sq32[c], _mm256_add_epi32(_mm256_madd_epi16(l, l), _mm256_madd_epi16(h, h)));
+                }
+            }
+
+            for (int c = 0; c < 3; ++c)
+                vsq[c] = add_u32_u64(vsq[c], sq32[c]);
+        }
+
+        stats_tail(acc, row, i, img_ptr->width, 0);
+    }
+
+    stats_merge(acc, vlo, vhi, vsum, vsq, 0);
+}
+
+static void stats_rows16(stats_acc_t *acc, const PPM_img *img_ptr) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vlo[3], vhi[3], vsum[3], vsq[3];
+    for (int c = 0; c < 3; ++c) {
+        vlo[c] = _mm256_set1_epi16(-1);
+        vhi[c] = vsum[c] = vsq[c] = zero;
+    }
 
-            __m256 f0 = _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(lo, _mm256_setzero_si256()));
-            __m256 f1 = _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(lo, _mm256_setzero_si256()));
-            __m256 f2 = _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(hi, _mm256_setzero_si256()));
-            __m256 f3 = _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(hi, _mm256_setzero_si256()));
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
+        size_t i = 0;
 
-            f0 = _mm256_min_ps(_mm256_mul_ps(f0, vscale), vmax);
-            f1 = _mm256_min_ps(_mm256_mul_ps(f1, vscale), vmax);
-            f2 = _mm256_min_ps(_mm256_mul_ps(f2, vscale), vmax);
-            f3 = _mm256_min_ps(_mm256_mul_ps(f3, vscale), vmax);
+        while (i + 16 <= img_ptr->width) {
+            size_t blocks = (img_ptr->width - i) / 16;
+            if (blocks > STATS_FLUSH_16)
+                blocks = STATS_FLUSH_16;
 
-            __m256i lo32a = _mm256_cvtps_epi32(f0);
-            __m256i lo32b = _mm256_cvtps_epi32(f1);
-            __m256i hi32a = _mm256_cvtps_epi32(f2);
-            __m256i hi32b = _mm256_cvtps_epi32(f3);
+            __m256i sum32[3] = {zero, zero, zero};
+            for (; blocks > 0; --blocks, i += 16) {
+                __m256i v[3];
+                deinterleave16_u16(row + i*6, &v[0], &v[1], &v[2]);
 
-            lo = _mm256_packus_epi32(lo32a, lo32b);
-            hi = _mm256_packus_epi32(hi32a, hi32b);
-            v  = _mm256_packus_epi16(lo, hi);
+                for (int c = 0; c < 3; ++c) {
+                    __m256i l = _mm256_unpacklo_epi16(v[c], zero);
+                    __m256i h = _mm256_unpackhi_epi16(v[c], zero);
+                    vlo[c] = _mm256_min_epu16(vlo[c], v[c]);
+                    vhi[c] = _mm256_max_epu16(vhi[c], v[c]);
+                    sum32[c] = _mm256_add_epi32(sum32[c], _mm256_add_epi32(l, h));
+                    vsq[c] = square_u32_u64(square_u32_u64(vsq[c], l), h);
+                }
+            }
 
-            _mm256_storeu_si256((__m256i*)(row + i), v);
+            for (int c = 0; c < 3; ++c)
+                vsum[c] = add_u32_u64(vsum[c], sum32[c]);
         }
 
-        for (; i < img_ptr->width * 3; ++i)
-            row[i] = (uint8_t)(row[i] * scale);
+        stats_tail(acc, row, i, img_ptr->width, 1);
+    }
+
+    stats_merge(acc, vlo, vhi, vsum, vsq, 1);
+}
+
+int ppm_stats_avx2(const PPM_ptr img_ptr, PPM_stats *stats) {
+
+    if (ppm_validate(img_ptr) < 0 || stats == NULL) {
+        return -1;
+    }
+
+    // The shuffles below are for RGB
+    if (img_ptr->channels != 3)
+        return ppm_stats_scalar(img_ptr, stats);
+
+    stats_acc_t acc = {
+        .lo = {UINT16_MAX, UINT16_MAX, UINT16_MAX},
+    };
+
+    if (img_ptr->maxval > 255)
+        stats_rows16(&acc, img_ptr);
+    else
+        stats_rows8(&acc, img_ptr);
+
+    stats->count = (uint64_t)img_ptr->width*img_ptr->height;
+    for (int c = 0; c < 3; ++c) {
+        stats->min[c] = acc.lo[c];
+        stats->max[c] = acc.hi[c];
+        stats->sum[c] = acc.sum[c];
+        stats->sum_sq[c] = acc.sum_sq[c];
     }
 
-    img_ptr->maxval = new_maxval;
     return 0;
 }
+
+/*
+ * Digits and whitespace ('\t'..'\r' and ' ') as unsigned range checks:
+ * min_epu8 against the top of the range equals the offset byte when it's in
+ */
+static inline uint32_t text_class32(__m256i v, uint32_t *rest) {
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i c = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    __m256i is_w = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(c, _mm256_set1_epi8('\r' - '\t')), c),
+                                   _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+
+    *rest = ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(is_d, is_w));
+    return (uint32_t)_mm256_movemask_epi8(is_d);
+}
+
+uint64_t ppm_text_mask_avx2(const char *text, uint64_t *other) {
+    uint32_t rest_lo, rest_hi;
+    uint64_t lo = text_class32(_mm256_loadu_si256((const __m256i*)text), &rest_lo);
+    uint64_t hi = text_class32(_mm256_loadu_si256((const __m256i*)(text + 32)), &rest_hi);
+
+    *other = ((uint64_t)rest_hi << 32) | rest_lo;
+    return (hi << 32) | lo;
+}
+
 #endif
@@ -0,0 +1,736 @@
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+
+#if defined(__AVX512BW__) && defined(__AVX512VBMI__)
+#include <immintrin.h>
+
+/*
+ * AVX-512 backend (F + BW + VBMI)
+ *
+ * 64-byte vectors, with row tails run through the same code under a lane
+ * mask: masked loads don't fault past the end of a row, and masked stores
+ * leave the bytes after it alone. RGB (de)interleaving uses the VBMI byte
+ * permutes, which index across the whole register and across two of them.
+ * Convolution, resizing and statistics use the AVX2 kernels.
+ */
+
+/*
+ * Mask of the first n lanes
+ */
+static inline __mmask64 mask64(size_t n) {
+    return (n >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << n) - 1);
+}
+
+static inline __mmask32 mask32(size_t n) {
+    return (n >= 32) ? ~(__mmask32)0 : (((__mmask32)1 << n) - 1);
+}
+
+static inline __mmask16 mask16(size_t n) {
+    return (n >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << n) - 1);
+}
+
+/*
+ * Mask of the bytes [64*chunk, 64*(chunk + 1)) that are below n_bytes
+ */
+static inline __mmask64 chunk_mask(size_t n_bytes, int chunk) {
+    size_t begin = (size_t)chunk*64;
+    return (n_bytes > begin) ? mask64(n_bytes - begin) : 0;
+}
+
+/*
+ * 16-bit samples are big-endian in memory, swap them to native order and back
+ */
+static inline __m512i bswap16_512(__m512i v) {
+    const __m512i mask = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+    return _mm512_shuffle_epi8(v, mask);
+}
+
+/*
+ * Permute indices for 64 8-bit pixels (192 bytes in three vectors)
+ *
+ * Channel c of pixel k is byte 3k + c. vpermt2b looks up the first two
+ * vectors with the low 7 bits of that index, and a masked vpermb fills the
+ * lanes whose index has bit 7 set from the third one with the low 6 bits.
+ * Going the other way, byte p of the interleaved run is channel p%3 of pixel
+ * p/3: its index holds p/3 + 64*(p%3), so that R and G come from the
+ * two-vector permute, B (bit 7) from the masked one, and the low 6 bits are
+ * the pixel for either.
+ */
+static const uint8_t deint8_index[64] = {
+      0,   3,   6,   9,  12,  15,  18,  21,  24,  27,  30,  33,  36,  39,  42,  45,
+     48,  51,  54,  57,  60,  63,  66,  69,  72,  75,  78,  81,  84,  87,  90,  93,
+     96,  99, 102, 105, 108, 111, 114, 117, 120, 123, 126, 129, 132, 135, 138, 141,
+    144, 147, 150, 153, 156, 159, 162, 165, 168, 171, 174, 177, 180, 183, 186, 189,
+};
+
+static const uint8_t inter8_index[192] = {
+      0,  64, 128,   1,  65, 129,   2,  66, 130,   3,  67, 131,   4,  68, 132,   5,
+     69, 133,   6,  70, 134,   7,  71, 135,   8,  72, 136,   9,  73, 137,  10,  74,
+    138,  11,  75, 139,  12,  76, 140,  13,  77, 141,  14,  78, 142,  15,  79, 143,
+     16,  80, 144,  17,  81, 145,  18,  82, 146,  19,  83, 147,  20,  84, 148,  21,
+     85, 149,  22,  86, 150,  23,  87, 151,  24,  88, 152,  25,  89, 153,  26,  90,
+    154,  27,  91, 155,  28,  92, 156,  29,  93, 157,  30,  94, 158,  31,  95, 159,
+     32,  96, 160,  33,  97, 161,  34,  98, 162,  35,  99, 163,  36, 100, 164,  37,
+    101, 165,  38, 102, 166,  39, 103, 167,  40, 104, 168,  41, 105, 169,  42, 106,
+    170,  43, 107, 171,  44, 108, 172,  45, 109, 173,  46, 110, 174,  47, 111, 175,
+     48, 112, 176,  49, 113, 177,  50, 114, 178,  51, 115, 179,  52, 116, 180,  53,
+    117, 181,  54, 118, 182,  55, 119, 183,  56, 120, 184,  57, 121, 185,  58, 122,
+    186,  59, 123, 187,  60, 124, 188,  61, 125, 189,  62, 126, 190,  63, 127, 191,
+};
+
+/*
+ * The same for 32 16-bit pixels: 3k + c and p/3 + 32*(p%3), bit 6 marking
+ * the third vector
+ */
+static const uint16_t deint16_index[32] = {
+      0,   3,   6,   9,  12,  15,  18,  21,  24,  27,  30,  33,  36,  39,  42,  45,
+     48,  51,  54,  57,  60,  63,  66,  69,  72,  75,  78,  81,  84,  87,  90,  93,
+};
+
+static const uint16_t inter16_index[96] = {
+      0,  32,  64,   1,  33,  65,   2,  34,  66,   3,  35,  67,   4,  36,  68,   5,
+     37,  69,   6,  38,  70,   7,  39,  71,   8,  40,  72,   9,  41,  73,  10,  42,
+     74,  11,  43,  75,  12,  44,  76,  13,  45,  77,  14,  46,  78,  15,  47,  79,
+     16,  48,  80,  17,  49,  81,  18,  50,  82,  19,  51,  83,  20,  52,  84,  21,
+     53,  85,  22,  54,  86,  23,  55,  87,  24,  56,  88,  25,  57,  89,  26,  58,
+     90,  27,  59,  91,  28,  60,  92,  29,  61,  93,  30,  62,  94,  31,  63,  95,
+};
+
+static inline __m512i deinterleave64_u8(__m512i c0, __m512i c1, __m512i c2, int c) {
+    __m512i idx = _mm512_add_epi8(_mm512_loadu_si512(deint8_index), _mm512_set1_epi8((char)c));
+    __m512i v = _mm512_permutex2var_epi8(c0, idx, c1);
+    return _mm512_mask_permutexvar_epi8(v, _mm512_movepi8_mask(idx), idx, c2);
+}
+
+/*
+ * Chunk j (bytes 64j..64j+63) of 64 interleaved 8-bit pixels
+ */
+static inline __m512i interleave64_u8(__m512i R, __m512i G, __m512i B, int j) {
+    __m512i idx = _mm512_loadu_si512(inter8_index + 64*j);
+    __m512i v = _mm512_permutex2var_epi8(R, idx, G);
+    return _mm512_mask_permutexvar_epi8(v, _mm512_movepi8_mask(idx), idx, B);
+}
+
+static inline __m512i deinterleave32_u16(__m512i c0, __m512i c1, __m512i c2, int c) {
+    __m512i idx = _mm512_add_epi16(_mm512_loadu_si512(deint16_index), _mm512_set1_epi16((short)c));
+    __m512i v = _mm512_permutex2var_epi16(c0, idx, c1);
+    return _mm512_mask_permutexvar_epi16(v, _mm512_test_epi16_mask(idx, _mm512_set1_epi16(64)), idx, c2);
+}
+
+static inline __m512i interleave32_u16(__m512i R, __m512i G, __m512i B, int j) {
+    __m512i idx = _mm512_loadu_si512(inter16_index + 32*j);
+    __m512i v = _mm512_permutex2var_epi16(R, idx, G);
+    return _mm512_mask_permutexvar_epi16(v, _mm512_test_epi16_mask(idx, _mm512_set1_epi16(64)), idx, B);
+}
+
+/*
+ * x*scale + bias on 16 u32 lanes, clamped to [0, maxval] and truncated
+ * NaN takes the 0 from max, like the scalar clamp
+ */
+static inline __m512i scale16_u32(__m512i v, __m512 vscale, __m512 vbias, __m512 vmax) {
+    __m512 f = _mm512_add_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(v), vscale), vbias);
+    f = _mm512_min_ps(_mm512_max_ps(f, _mm512_setzero_ps()), vmax);
+    return _mm512_cvttps_epi32(f);
+}
+
+/*
+ * The same on 32 native u16 samples
+ */
+static inline __m512i scale32_u16(__m512i v, __m512 vscale, __m512 vbias, __m512 vmax) {
+    __m512i lo = scale16_u32(_mm512_cvtepu16_epi32(_mm512_castsi512_si256(v)), vscale, vbias, vmax);
+    __m512i hi = scale16_u32(_mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(v, 1)), vscale, vbias, vmax);
+
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi32_epi16(lo)), _mm512_cvtepi32_epi16(hi), 1);
+}
+
+/*
+ * And on 64 u8 samples
+ */
+static inline __m512i scale64_u8(__m512i v, __m512 vscale, __m512 vbias, __m512 vmax) {
+    __m128i q0 = _mm512_cvtepi32_epi8(scale16_u32(_mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 0)), vscale, vbias, vmax));
+    __m128i q1 = _mm512_cvtepi32_epi8(scale16_u32(_mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 1)), vscale, vbias, vmax));
+    __m128i q2 = _mm512_cvtepi32_epi8(scale16_u32(_mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 2)), vscale, vbias, vmax));
+    __m128i q3 = _mm512_cvtepi32_epi8(scale16_u32(_mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(v, 3)), vscale, vbias, vmax));
+
+    __m512i r = _mm512_castsi128_si512(q0);
+    r = _mm512_inserti32x4(r, q1, 1);
+    r = _mm512_inserti32x4(r, q2, 2);
+    return _mm512_inserti32x4(r, q3, 3);
+}
+
+/*
+ * The fixed-point form on 64 u8 samples (see ppm_scale_fixed)
+ */
+static inline __m512i scale64_u8_fixed(__m512i v, __m512i vmul, __m512i vadd, __m512i vsub,
+                                       __m128i vshift, __m512i vmax) {
+    const __m512i zero = _mm512_setzero_si512();
+
+    // bytes above a zero byte: v << 8
+    __m512i lo = _mm512_mulhi_epu16(_mm512_unpacklo_epi8(zero, v), vmul);
+    __m512i hi = _mm512_mulhi_epu16(_mm512_unpackhi_epi8(zero, v), vmul);
+
+    lo = _mm512_subs_epu16(_mm512_adds_epu16(lo, vadd), vsub);
+    hi = _mm512_subs_epu16(_mm512_adds_epu16(hi, vadd), vsub);
+
+    lo = _mm512_min_epu16(_mm512_srl_epi16(lo, vshift), vmax);
+    hi = _mm512_min_epu16(_mm512_srl_epi16(hi, vshift), vmax);
+
+    return _mm512_packus_epi16(lo, hi);
+}
+
+static void scale_row8_fixed(uint8_t *row, size_t n_samples, const ppm_scale_fixed_t *fx, uint16_t maxval) {
+    const __m512i vmul = _mm512_set1_epi16((short)fx->mul);
+    const __m512i vadd = _mm512_set1_epi16((short)fx->add);
+    const __m512i vsub = _mm512_set1_epi16((short)fx->sub);
+    const __m128i vshift = _mm_cvtsi32_si128(fx->shift);
+    const __m512i vmax = _mm512_set1_epi16((short)maxval);
+
+    for (size_t i = 0; i < n_samples; i += 64) {
+        __mmask64 m = mask64(n_samples - i);
+        __m512i v = _mm512_maskz_loadu_epi8(m, row + i);
+        _mm512_mask_storeu_epi8(row + i, m, scale64_u8_fixed(v, vmul, vadd, vsub, vshift, vmax));
+    }
+}
+
+static void scale_row8(uint8_t *row, size_t n_samples, float scale, float bias, float maxval) {
+    const __m512 vscale = _mm512_set1_ps(scale);
+    const __m512 vbias  = _mm512_set1_ps(bias);
+    const __m512 vmax   = _mm512_set1_ps(maxval);
+
+    for (size_t i = 0; i < n_samples; i += 64) {
+        __mmask64 m = mask64(n_samples - i);
+        __m512i v = _mm512_maskz_loadu_epi8(m, row + i);
+        _mm512_mask_storeu_epi8(row + i, m, scale64_u8(v, vscale, vbias, vmax));
+    }
+}
+
+/*
+ * 16-bit samples, big-endian (image rows) or native (planes)
+ */
+static void scale_row16(uint8_t *row, size_t n_samples, float scale, float bias, float maxval, int big_endian) {
+    const __m512 vscale = _mm512_set1_ps(scale);
+    const __m512 vbias  = _mm512_set1_ps(bias);
+    const __m512 vmax   = _mm512_set1_ps(maxval);
+
+    for (size_t i = 0; i < n_samples; i += 32) {
+        __mmask32 m = mask32(n_samples - i);
+        __m512i v = _mm512_maskz_loadu_epi16(m, row + i*2);
+
+        if (big_endian) {
+            v = bswap16_512(scale32_u16(bswap16_512(v), vscale, vbias, vmax));
+        } else {
+            v = scale32_u16(v, vscale, vbias, vmax);
+        }
+
+        _mm512_mask_storeu_epi16(row + i*2, m, v);
+    }
+}
+
+int ppm_scale_avx512(PPM_ptr img_ptr, float scale, float bias)
+{
+    if (ppm_validate(img_ptr) < 0)
+        return -1;
+
+    const size_t n_samples = (size_t)img_ptr->width * img_ptr->channels;
+    const float maxval = (float)img_ptr->maxval;
+
+    ppm_scale_fixed_t fx;
+    int fixed = img_ptr->maxval <= 255 && ppm_scale_fixed(&fx, scale, bias);
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
+
+        if (fixed)
+            scale_row8_fixed(row, n_samples, &fx, img_ptr->maxval);
+        else if (img_ptr->maxval > 255)
+            scale_row16(row, n_samples, scale, bias, maxval, 1);
+        else
+            scale_row8(row, n_samples, scale, bias, maxval);
+    }
+
+    return 0;
+}
+
+/*
+ * Luma of 64 8-bit pixels, the 512-bit form of luma32_u8 in avx2.c:
+ * p1 = 37R + 73G + 14B and p2 = 3R + 3G + 2B through maddubs,
+ * Y = (p1 + (p2>>3))/125 with t/125 == mulhi(t, 33555)>>6 for t <= 31875
+ */
+static inline __m512i luma64_u8(__m512i R, __m512i G, __m512i B) {
+    const __m512i wRG_hi = _mm512_set1_epi16((73 << 8) | 37);
+    const __m512i wRG_lo = _mm512_set1_epi16((3 << 8) | 3);
+    const __m512i wB_hi = _mm512_set1_epi16(14);
+    const __m512i wB_lo = _mm512_set1_epi16(2);
+    const __m512i magic = _mm512_set1_epi16((short)33555);
+    const __m512i zero = _mm512_setzero_si512();
+
+    __m512i rg_lo = _mm512_unpacklo_epi8(R, G);
+    __m512i rg_hi = _mm512_unpackhi_epi8(R, G);
+    __m512i b_lo = _mm512_unpacklo_epi8(B, zero);
+    __m512i b_hi = _mm512_unpackhi_epi8(B, zero);
+
+    __m512i p1_lo = _mm512_add_epi16(_mm512_maddubs_epi16(rg_lo, wRG_hi), _mm512_maddubs_epi16(b_lo, wB_hi));
+    __m512i p1_hi = _mm512_add_epi16(_mm512_maddubs_epi16(rg_hi, wRG_hi), _mm512_maddubs_epi16(b_hi, wB_hi));
+    __m512i p2_lo = _mm512_add_epi16(_mm512_maddubs_epi16(rg_lo, wRG_lo), _mm512_maddubs_epi16(b_lo, wB_lo));
+    __m512i p2_hi = _mm512_add_epi16(_mm512_maddubs_epi16(rg_hi, wRG_lo), _mm512_maddubs_epi16(b_hi, wB_lo));
+
+    __m512i t_lo = _mm512_add_epi16(p1_lo, _mm512_srli_epi16(p2_lo, 3));
+    __m512i t_hi = _mm512_add_epi16(p1_hi, _mm512_srli_epi16(p2_hi, 3));
+    __m512i y_lo = _mm512_srli_epi16(_mm512_mulhi_epu16(t_lo, magic), 6);
+    __m512i y_hi = _mm512_srli_epi16(_mm512_mulhi_epu16(t_hi, magic), 6);
+
+    return _mm512_packus_epi16(y_lo, y_hi);
+}
+
+/*
+ * Luma of 16 pixels whose 16-bit samples sit in u32 lanes
+ * sum/1000 == (sum/8)/125, and sum/8 < 2^23 divides exactly in float
+ */
+static inline __m512i luma16_u32(__m512i R, __m512i G, __m512i B) {
+    __m512i sum = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(R, _mm512_set1_epi32(299)),
+                                                    _mm512_mullo_epi32(G, _mm512_set1_epi32(587))),
+                                   _mm512_mullo_epi32(B, _mm512_set1_epi32(114)));
+
+    __m512 t = _mm512_cvtepi32_ps(_mm512_srli_epi32(sum, 3));
+    return _mm512_cvttps_epi32(_mm512_div_ps(t, _mm512_set1_ps(125.0f)));
+}
+
+/*
+ * Luma of 32 pixels of native u16 samples
+ */
+static inline __m512i luma32_u16(__m512i R, __m512i G, __m512i B) {
+    __m512i lo = luma16_u32(_mm512_cvtepu16_epi32(_mm512_castsi512_si256(R)),
+                            _mm512_cvtepu16_epi32(_mm512_castsi512_si256(G)),
+                            _mm512_cvtepu16_epi32(_mm512_castsi512_si256(B)));
+    __m512i hi = luma16_u32(_mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(R, 1)),
+                            _mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(G, 1)),
+                            _mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(B, 1)));
+
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi32_epi16(lo)), _mm512_cvtepi32_epi16(hi), 1);
+}
+
+/*
+ * Grayscale of one row, 64 8-bit or 32 16-bit pixels (192 bytes) at a time,
+ * into out (1 or 3) channels
+ * The last block loads and stores only the bytes left in the row
+ */
+PPM_SPECIALIZE void grayscale_row(uint8_t *d, const uint8_t *s, size_t width, const int is16, const size_t out) {
+    const size_t px_bytes = is16 ? 6 : 3;
+    const size_t block = is16 ? 32 : 64;
+
+    for (size_t x = 0; x < width; x += block) {
+        size_t n_bytes = (width - x)*px_bytes;
+        const uint8_t *p = s + x*px_bytes;
+        uint8_t *q = d + x*px_bytes;
+        __mmask64 m_once = mask64((width - x)*(is16 ? 2 : 1));
+
+        __mmask64 m0 = chunk_mask(n_bytes, 0);
+        __mmask64 m1 = chunk_mask(n_bytes, 1);
+        __mmask64 m2 = chunk_mask(n_bytes, 2);
+
+        __m512i c0 = _mm512_maskz_loadu_epi8(m0, p);
+        __m512i c1 = _mm512_maskz_loadu_epi8(m1, p + 64);
+        __m512i c2 = _mm512_maskz_loadu_epi8(m2, p + 128);
+
+        __m512i o0, o1, o2;
+        if (is16) {
+            c0 = bswap16_512(c0);
+            c1 = bswap16_512(c1);
+            c2 = bswap16_512(c2);
+
+            __m512i Y = luma32_u16(deinterleave32_u16(c0, c1, c2, 0),
+                                   deinterleave32_u16(c0, c1, c2, 1),
+                                   deinterleave32_u16(c0, c1, c2, 2));
+
+            // Every Y three times: the low 5 bits of an interleave index are the pixel
+            Y = bswap16_512(Y);
+            if (out == 1) {
+                _mm512_mask_storeu_epi8(d + x*2, m_once, Y);
+                continue;
+            }
+            o0 = _mm512_permutexvar_epi16(_mm512_loadu_si512(inter16_index), Y);
+            o1 = _mm512_permutexvar_epi16(_mm512_loadu_si512(inter16_index + 32), Y);
+            o2 = _mm512_permutexvar_epi16(_mm512_loadu_si512(inter16_index + 64), Y);
+        } else {
+            __m512i Y = luma64_u8(deinterleave64_u8(c0, c1, c2, 0),
+                                  deinterleave64_u8(c0, c1, c2, 1),
+                                  deinterleave64_u8(c0, c1, c2, 2));
+
+            if (out == 1) {
+                _mm512_mask_storeu_epi8(d + x, m_once, Y);
+                continue;
+            }
+
+            // and the low 6 bits here
+            o0 = _mm512_permutexvar_epi8(_mm512_loadu_si512(inter8_index), Y);
+            o1 = _mm512_permutexvar_epi8(_mm512_loadu_si512(inter8_index + 64), Y);
+            o2 = _mm512_permutexvar_epi8(_mm512_loadu_si512(inter8_index + 128), Y);
+        }
+
+        _mm512_mask_storeu_epi8(q, m0, o0);
+        _mm512_mask_storeu_epi8(q + 64, m1, o1);
+        _mm512_mask_storeu_epi8(q + 128, m2, o2);
+    }
+}
+
+/*
+ * One instance per sample size and out
+ */
+PPM_SPECIALIZE void grayscale_rows(PPM_ptr dst_ptr, const PPM_ptr src_ptr, const int is16, const size_t out) {
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        grayscale_row((uint8_t*)dst_ptr->data + y * dst_ptr->stride,
+                      (const uint8_t*)src_ptr->data + y * src_ptr->stride,
+                      src_ptr->width, is16, out);
+    }
+}
+
+typedef void (*grayscale_fn)(PPM_ptr, const PPM_ptr);
+
+#define GRAYSCALE_KIND(kind, is16, out) \
+    static void grayscale_##kind(PPM_ptr dst_ptr, const PPM_ptr src_ptr) { \
+        grayscale_rows(dst_ptr, src_ptr, is16, out); \
+    }
+PPM_GRAY_KINDS(GRAYSCALE_KIND)
+#undef GRAYSCALE_KIND
+
+#define GRAYSCALE_ENTRY(kind, is16, out) grayscale_##kind,
+static const grayscale_fn grayscale_kinds[PPM_GRAY_KIND_COUNT] = { PPM_GRAY_KINDS(GRAYSCALE_ENTRY) };
+#undef GRAYSCALE_ENTRY
+
+int ppm_rgb_to_grayscale_avx512(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
+    if (ppm_validate(src_ptr) < 0 || ppm_validate(dst_ptr) < 0)
+        return -1;
+
+    if (dst_ptr->width != src_ptr->width ||
+            dst_ptr->height != src_ptr->height ||
+            dst_ptr->maxval != src_ptr->maxval ||
+            src_ptr->channels != 3 ||
+            (dst_ptr->channels != 1 && dst_ptr->channels != 3)) {
+        return -2;
+    }
+
+    grayscale_kinds[ppm_gray_kind(src_ptr->maxval, dst_ptr->channels)](dst_ptr, src_ptr);
+
+    return 0;
+}
+
+/*
+ * 16 samples, widened to u32 lanes; the mask covers the samples left
+ */
+static inline __m512i load16_u8(const uint8_t *p, __mmask16 m) {
+    return _mm512_cvtepu8_epi32(_mm512_castsi512_si128(_mm512_maskz_loadu_epi8(m, p)));
+}
+
+static inline __m512i load16_be16(const uint8_t *p, __mmask16 m) {
+    __m512i v = bswap16_512(_mm512_maskz_loadu_epi16(m, p));
+    return _mm512_cvtepu16_epi32(_mm512_castsi512_si256(v));
+}
+
+/*
+ * Narrow 16 u32 lanes (already in range) and store them
+ * Swapping the two low bytes of each lane makes the 16-bit store big-endian
+ */
+static inline void store16_u8(uint8_t *p, __mmask16 m, __m512i v) {
+    _mm512_mask_cvtepi32_storeu_epi8(p, m, v);
+}
+
+static inline void store16_be16(uint8_t *p, __mmask16 m, __m512i v) {
+    v = _mm512_or_si512(_mm512_slli_epi32(_mm512_and_si512(v, _mm512_set1_epi32(0xFF)), 8),
+                        _mm512_srli_epi32(v, 8));
+    _mm512_mask_cvtepi32_storeu_epi16(p, m, v);
+}
+
+/*
+ * floor(v * new_maxval / old_maxval), capped at new_maxval, as in avx2.c:
+ * float is exact when one side is 8-bit, 16 -> 16 needs doubles
+ */
+static inline __m512i convert16_ps(__m512i v, __m512 vnew, __m512 vold) {
+    __m512 q = _mm512_div_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(v), vnew), vold);
+    return _mm512_cvttps_epi32(_mm512_min_ps(q, vnew));
+}
+
+static inline __m512i convert16_pd(__m512i v, __m512d vnew, __m512d vold) {
+    __m512d lo = _mm512_cvtepi32_pd(_mm512_castsi512_si256(v));
+    __m512d hi = _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(v, 1));
+
+    lo = _mm512_min_pd(_mm512_div_pd(_mm512_mul_pd(lo, vnew), vold), vnew);
+    hi = _mm512_min_pd(_mm512_div_pd(_mm512_mul_pd(hi, vnew), vold), vnew);
+
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvttpd_epi32(lo)), _mm512_cvttpd_epi32(hi), 1);
+}
+
+int ppm_convert_maxval_avx512(PPM_ptr img_ptr, uint16_t new_maxval)
+{
+    if (ppm_validate(img_ptr) < 0 || new_maxval == 0)
+        return -1;
+
+    uint16_t old_maxval = img_ptr->maxval;
+    if (new_maxval == old_maxval)
+        return 0;
+
+    int old16 = old_maxval > 255;
+    int new16 = new_maxval > 255;
+
+    size_t new_stride;
+    data_t new_data = ppm_convert_target(img_ptr, new_maxval, &new_stride);
+    if (!new_data)
+        return -1;
+
+    const __m512 vnew = _mm512_set1_ps((float)new_maxval);
+    const __m512 vold = _mm512_set1_ps((float)old_maxval);
+    const __m512d vnew_d = _mm512_set1_pd((double)new_maxval);
+    const __m512d vold_d = _mm512_set1_pd((double)old_maxval);
+    const size_t n_samples = (size_t)img_ptr->width * img_ptr->channels;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *src = (const uint8_t*)img_ptr->data + y * img_ptr->stride;
+        uint8_t *dst = (uint8_t*)new_data + y * new_stride;
+
+        for (size_t i = 0; i < n_samples; i += 16) {
+            __mmask16 m = mask16(n_samples - i);
+
+            if (!old16 && !new16) {
+                /* 8 -> 8 */
+                store16_u8(dst + i, m, convert16_ps(load16_u8(src + i, m), vnew, vold));
+            } else if (old16 && new16) {
+                /* 16 -> 16 */
+                store16_be16(dst + i*2, m, convert16_pd(load16_be16(src + i*2, m), vnew_d, vold_d));
+            } else if (!old16) {
+                /* 8 -> 16 */
+                store16_be16(dst + i*2, m, convert16_ps(load16_u8(src + i, m), vnew, vold));
+            } else {
+                /* 16 -> 8 */
+                store16_u8(dst + i, m, convert16_ps(load16_be16(src + i*2, m), vnew, vold));
+            }
+        }
+    }
+
+    ppm_convert_commit(img_ptr, new_data, new_stride, new_maxval);
+    return 0;
+}
+
+/*
+ * 256-entry table lookup, 64 samples per iteration
+ * The table fills four vectors: vpermt2b looks up the low 7 bits in each
+ * half and bit 7 of the sample picks the half.
+ */
+int ppm_apply_lut_avx512(PPM_ptr img_ptr, const uint8_t *map) {
+    if (ppm_validate(img_ptr) < 0 || img_ptr->maxval > 255)
+        return -1;
+
+    const __m512i t0 = _mm512_loadu_si512(map);
+    const __m512i t1 = _mm512_loadu_si512(map + 64);
+    const __m512i t2 = _mm512_loadu_si512(map + 128);
+    const __m512i t3 = _mm512_loadu_si512(map + 192);
+    const size_t n_samples = (size_t)img_ptr->width*img_ptr->channels;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
+
+        for (size_t i = 0; i < n_samples; i += 64) {
+            __mmask64 m = mask64(n_samples - i);
+            __m512i v = _mm512_maskz_loadu_epi8(m, row + i);
+
+            __m512i lo = _mm512_permutex2var_epi8(t0, v, t1);
+            __m512i hi = _mm512_permutex2var_epi8(t2, v, t3);
+
+            _mm512_mask_storeu_epi8(row + i, m, _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), lo, hi));
+        }
+    }
+
+    return 0;
+}
+
+static int planar_matches(const PPM_ptr img_ptr, const PPM_planar_ptr planar) {
+    return img_ptr->channels == 3 &&
+           img_ptr->width == planar->width &&
+           img_ptr->height == planar->height &&
+           img_ptr->maxval == planar->maxval;
+}
+
+int ppm_planar_unpack_avx512(PPM_planar_ptr dst, const PPM_ptr src_ptr) {
+    if (ppm_validate(src_ptr) < 0 || ppm_planar_validate(dst) < 0)
+        return -1;
+
+    if (!planar_matches(src_ptr, dst))
+        return -2;
+
+    const int is16 = src_ptr->maxval > 255;
+    const size_t px_bytes = is16 ? 6 : 3;
+    const size_t block = is16 ? 32 : 64;
+
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        const uint8_t *s = (const uint8_t*)src_ptr->data + y * src_ptr->stride;
+        uint8_t *r = (uint8_t*)dst->planes[0] + y * dst->stride;
+        uint8_t *g = (uint8_t*)dst->planes[1] + y * dst->stride;
+        uint8_t *b = (uint8_t*)dst->planes[2] + y * dst->stride;
+
+        for (size_t x = 0; x < src_ptr->width; x += block) {
+            size_t n = src_ptr->width - x;
+            size_t n_bytes = n*px_bytes;
+            const uint8_t *p = s + x*px_bytes;
+
+            __m512i c0 = _mm512_maskz_loadu_epi8(chunk_mask(n_bytes, 0), p);
+            __m512i c1 = _mm512_maskz_loadu_epi8(chunk_mask(n_bytes, 1), p + 64);
+            __m512i c2 = _mm512_maskz_loadu_epi8(chunk_mask(n_bytes, 2), p + 128);
+
+            if (is16) {
+                c0 = bswap16_512(c0);
+                c1 = bswap16_512(c1);
+                c2 = bswap16_512(c2);
+
+                __mmask32 m = mask32(n);
+                _mm512_mask_storeu_epi16(r + x*2, m, deinterleave32_u16(c0, c1, c2, 0));
+                _mm512_mask_storeu_epi16(g + x*2, m, deinterleave32_u16(c0, c1, c2, 1));
+                _mm512_mask_storeu_epi16(b + x*2, m, deinterleave32_u16(c0, c1, c2, 2));
+            } else {
+                __mmask64 m = mask64(n);
+                _mm512_mask_storeu_epi8(r + x, m, deinterleave64_u8(c0, c1, c2, 0));
+                _mm512_mask_storeu_epi8(g + x, m, deinterleave64_u8(c0, c1, c2, 1));
+                _mm512_mask_storeu_epi8(b + x, m, deinterleave64_u8(c0, c1, c2, 2));
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_pack_avx512(PPM_ptr dst_ptr, const PPM_planar_ptr src) {
+    if (ppm_validate(dst_ptr) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (!planar_matches(dst_ptr, src))
+        return -2;
+
+    const int is16 = dst_ptr->maxval > 255;
+    const size_t px_bytes = is16 ? 6 : 3;
+    const size_t block = is16 ? 32 : 64;
+
+    for (size_t y = 0; y < dst_ptr->height; ++y) {
+        uint8_t *d = (uint8_t*)dst_ptr->data + y * dst_ptr->stride;
+        const uint8_t *r = (const uint8_t*)src->planes[0] + y * src->stride;
+        const uint8_t *g = (const uint8_t*)src->planes[1] + y * src->stride;
+        const uint8_t *b = (const uint8_t*)src->planes[2] + y * src->stride;
+
+        for (size_t x = 0; x < dst_ptr->width; x += block) {
+            size_t n = dst_ptr->width - x;
+            size_t n_bytes = n*px_bytes;
+            uint8_t *q = d + x*px_bytes;
+
+            __m512i o0, o1, o2;
+            if (is16) {
+                __mmask32 m = mask32(n);
+                __m512i R = _mm512_maskz_loadu_epi16(m, r + x*2);
+                __m512i G = _mm512_maskz_loadu_epi16(m, g + x*2);
+                __m512i B = _mm512_maskz_loadu_epi16(m, b + x*2);
+
+                o0 = bswap16_512(interleave32_u16(R, G, B, 0));
+                o1 = bswap16_512(interleave32_u16(R, G, B, 1));
+                o2 = bswap16_512(interleave32_u16(R, G, B, 2));
+            } else {
+                __mmask64 m = mask64(n);
+                __m512i R = _mm512_maskz_loadu_epi8(m, r + x);
+                __m512i G = _mm512_maskz_loadu_epi8(m, g + x);
+                __m512i B = _mm512_maskz_loadu_epi8(m, b + x);
+
+                o0 = interleave64_u8(R, G, B, 0);
+                o1 = interleave64_u8(R, G, B, 1);
+                o2 = interleave64_u8(R, G, B, 2);
+            }
+
+            _mm512_mask_storeu_epi8(q, chunk_mask(n_bytes, 0), o0);
+            _mm512_mask_storeu_epi8(q + 64, chunk_mask(n_bytes, 1), o1);
+            _mm512_mask_storeu_epi8(q + 128, chunk_mask(n_bytes, 2), o2);
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_scale_avx512(PPM_planar_ptr planar, float scale, float bias) {
+    if (ppm_planar_validate(planar) < 0)
+        return -1;
+
+    const float maxval = (float)planar->maxval;
+    ppm_scale_fixed_t fx;
+    int fixed = planar->maxval <= 255 && ppm_scale_fixed(&fx, scale, bias);
+
+    for (int c = 0; c < 3; ++c) {
+        for (size_t y = 0; y < planar->height; ++y) {
+            uint8_t *row = (uint8_t*)planar->planes[c] + y * planar->stride;
+
+            if (fixed)
+                scale_row8_fixed(row, planar->width, &fx, planar->maxval);
+            else if (planar->maxval > 255)
+                scale_row16(row, planar->width, scale, bias, maxval, 0);
+            else
+                scale_row8(row, planar->width, scale, bias, maxval);
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_rgb_to_grayscale_avx512(PPM_planar_ptr dst, const PPM_planar_ptr src) {
+    if (ppm_planar_validate(dst) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (dst->width != src->width ||
+            dst->height != src->height ||
+            dst->maxval != src->maxval) {
+        return -2;
+    }
+
+    const int is16 = src->maxval > 255;
+
+    for (size_t y = 0; y < src->height; ++y) {
+        const uint8_t *r = (const uint8_t*)src->planes[0] + y * src->stride;
+        const uint8_t *g = (const uint8_t*)src->planes[1] + y * src->stride;
+        const uint8_t *b = (const uint8_t*)src->planes[2] + y * src->stride;
+        uint8_t *d0 = (uint8_t*)dst->planes[0] + y * dst->stride;
+        uint8_t *d1 = (uint8_t*)dst->planes[1] + y * dst->stride;
+        uint8_t *d2 = (uint8_t*)dst->planes[2] + y * dst->stride;
+
+        if (is16) {
+            for (size_t x = 0; x < src->width; x += 32) {
+                __mmask32 m = mask32(src->width - x);
+                __m512i Y = luma32_u16(_mm512_maskz_loadu_epi16(m, r + x*2),
+                                       _mm512_maskz_loadu_epi16(m, g + x*2),
+                                       _mm512_maskz_loadu_epi16(m, b + x*2));
+
+                _mm512_mask_storeu_epi16(d0 + x*2, m, Y);
+                _mm512_mask_storeu_epi16(d1 + x*2, m, Y);
+                _mm512_mask_storeu_epi16(d2 + x*2, m, Y);
+            }
+        } else {
+            for (size_t x = 0; x < src->width; x += 64) {
+                __mmask64 m = mask64(src->width - x);
+                __m512i Y = luma64_u8(_mm512_maskz_loadu_epi8(m, r + x),
+                                      _mm512_maskz_loadu_epi8(m, g + x),
+                                      _mm512_maskz_loadu_epi8(m, b + x));
+
+                _mm512_mask_storeu_epi8(d0 + x, m, Y);
+                _mm512_mask_storeu_epi8(d1 + x, m, Y);
+                _mm512_mask_storeu_epi8(d2 + x, m, Y);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * One unsigned compare per class over all 64 bytes
+ */
+uint64_t ppm_text_mask_avx512(const char *text, uint64_t *other) {
+    __m512i v = _mm512_loadu_si512(text);
+    __mmask64 digits = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(v, _mm512_set1_epi8('0')), _mm512_set1_epi8(10));
+    __mmask64 space = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(v, _mm512_set1_epi8('\t')), _mm512_set1_epi8(5)) |
+                      _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(' '));
+
+    *other = ~(uint64_t)(digits | space);
+    return digits;
+}
+
+#endif
@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Batch loading
+ *
+ * Each file is read in two steps: the first PPM_HEADER_MAX bytes for the
+ * header, then the raster scattered straight into the strided rows of the
+ * image with vectored reads, so there is neither a file-sized staging buffer
+ * nor a row copy. Plain and PBM rasters, which have to be decoded, are read
+ * whole with pread once the header is in. The files are split into one group per pool thread.
+ * With io_uring, each worker keeps up to BATCH_QUEUE_DEPTH files of its group
+ * in flight on a ring of its own and parses headers as their reads complete;
+ * without it (or with CACHEPIX_IO=pread) it reads them one by one with
+ * pread/preadv.
+ */
+
+#define BATCH_QUEUE_DEPTH   32
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct {
+    int fd;
+    size_t file_size;
+    size_t raster_offset;
+    size_t row_bytes;
+    uint32_t next_row;          // first row not yet requested
+    PPM_ptr img_ptr;
+    struct iovec *iov;          // one per row
+    char header[PPM_HEADER_MAX];
+} batch_file_t;
+
+typedef struct {
+    const char *const *file_names;
+    PPM_ptr *images;
+    int *errors;
+} batch_job_t;
+
+#define BATCH_ERROR(job, i) (((job)->errors != NULL) ? &(job)->errors[i] : NULL)
+
+const char *ppm_load_strerror(int err) {
+    switch (err) {
+    case PPM_LOAD_OK:           return "ok";
+    case PPM_LOAD_EOPEN:        return "could not open file";
+    case PPM_LOAD_EREAD:        return "could not read file";
+    case PPM_LOAD_EHEADER:      return "invalid header, only PNM (P1-P6) and PAM (P7) are supported";
+    case PPM_LOAD_ETRUNCATED:   return "file is truncated";
+    case PPM_LOAD_ENOMEM:       return "out of memory";
+    case PPM_LOAD_ERASTER:      return "invalid raster";
+    }
+    return "unknown error";
+}
+
+static int batch_open(batch_file_t *file, const char *file_name) {
+    memset(file, 0, sizeof(*file));
+
+    file->fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0)
+        return PPM_LOAD_EOPEN;
+
+    struct stat st;
+    if (fstat(file->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(file->fd);
+        file->fd = -1;
+        return PPM_LOAD_EOPEN;
+    }
+
+    file->file_size = (size_t)st.st_size;
+    return PPM_LOAD_OK;
+}
+
+/*
+ * Read the rest of the file and decode it into img_ptr
+ */
+static int batch_decode(batch_file_t *file, PPM_ptr img_ptr, int format) {
+    size_t size = file->file_size - file->raster_offset;
+    char *raster = (char *)malloc(size);
+    if (raster == NULL)
+        return PPM_LOAD_ENOMEM;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = pread(file->fd, raster + done, size - done, (off_t)(file->raster_offset + done));
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            free(raster);
+            return PPM_LOAD_EREAD;
+        }
+        done += (size_t)r;
+    }
+
+    int err = ppm_decode_raster(img_ptr, format, raster, size);
+    free(raster);
+
+    if (err == -2)
+        return PPM_LOAD_ETRUNCATED;
+    return (err < 0) ? PPM_LOAD_ERASTER : PPM_LOAD_OK;
+}
+
+/*
+ * Parse the n header bytes that were read, allocate the image and point
+ * one iovec at each of its rows, or decode the whole raster for formats
+ * that aren't stored as rows
+ */
+static int batch_header(batch_file_t *file, size_t n) {
+    if (n <= 3)
+        return PPM_LOAD_EHEADER;
+
+    PPM_img meta = {0};
+    int format;
+    int header_size = token_consume_header(&meta, &format, file->header, n);
+    if (header_size < 0)
+        return PPM_LOAD_EHEADER;
+
+    if (file->file_size < (size_t)header_size || file->file_size - header_size < ppm_raster_size(&meta, format))
+        return PPM_LOAD_ETRUNCATED;
+
+    PPM_ptr img_ptr = ppm_create_channels(meta.width, meta.height, meta.maxval, meta.channels);
+    if (img_ptr == NULL)
+        return PPM_LOAD_ENOMEM;
+
+    file->raster_offset = (size_t)header_size;
+
+    if (!ppm_format_direct(format)) {
+        int err = batch_decode(file, img_ptr, format);
+        if (err != PPM_LOAD_OK) {
+            ppm_free(img_ptr);
+            return err;
+        }
+        file->img_ptr = img_ptr;
+        file->next_row = img_ptr->height;
+        return PPM_LOAD_OK;
+    }
+
+    struct iovec *iov = (struct iovec *)malloc(sizeof(struct iovec)*meta.height);
+    if (iov == NULL) {
+        ppm_free(img_ptr);
+        return PPM_LOAD_ENOMEM;
+    }
+
+    file->row_bytes = (size_t)meta.width*ppm_pixel_bytes(meta.maxval, meta.channels);
+    for (uint32_t y = 0; y < meta.height; ++y) {
+        iov[y].iov_base = img_ptr->data + y*img_ptr->stride;
+        iov[y].iov_len = file->row_bytes;
+    }
+
+    file->img_ptr = img_ptr;
+    file->iov = iov;
+    return PPM_LOAD_OK;
+}
+
+static uint32_t batch_chunk_rows(const batch_file_t *file) {
+    uint32_t rows = file->img_ptr->height - file->next_row;
+    return (rows > IOV_MAX) ? IOV_MAX : rows;
+}
+
+static off_t batch_row_offset(const batch_file_t *file, uint32_t row) {
+    return (off_t)(file->raster_offset + (size_t)row*file->row_bytes);
+}
+
+/*
+ * Finish rows [row, row + rows) of which the first done bytes already arrived
+ */
+static int batch_read_rows(batch_file_t *file, uint32_t row, uint32_t rows, size_t done) {
+    struct iovec *iov = file->iov + row;
+    off_t offset = batch_row_offset(file, row) + (off_t)done;
+
+    while (rows > 0) {
+        if (done >= file->row_bytes) {
+            done -= file->row_bytes;
+            iov++;
+            rows--;
+            continue;
+        }
+
+        // Partially filled row: finish it on its own
+        if (done > 0) {
+            ssize_t r = pread(file->fd, (char *)iov->iov_base + done, file->row_bytes - done, offset);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return PPM_LOAD_EREAD;
+            done += (size_t)r;
+            offset += r;
+            continue;
+        }
+
+        ssize_t r = preadv(file->fd, iov, (int)rows, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return PPM_LOAD_EREAD;
+        done = (size_t)r;
+        offset += r;
+    }
+
+    return PPM_LOAD_OK;
+}
+
+static void batch_finish(batch_file_t *file, int err, PPM_ptr *image, int *error) {
+    if (file->fd >= 0)
+        close(file->fd);
+    free(file->iov);
+    file->iov = NULL;
+
+    if (err != PPM_LOAD_OK && file->img_ptr != NULL) {
+        ppm_free(file->img_ptr);
+        file->img_ptr = NULL;
+    }
+
+    *image = file->img_ptr;
+    if (error != NULL)
+        *error = err;
+}
+
+/*
+ * Whatever is left of a file, with pread/preadv
+ */
+static int batch_read_sync(batch_file_t *file) {
+    int err = PPM_LOAD_OK;
+
+    if (file->img_ptr == NULL) {
+        ssize_t n = pread(file->fd, file->header, PPM_HEADER_MAX, 0);
+        err = (n < 0) ? PPM_LOAD_EREAD : batch_header(file, (size_t)n);
+    }
+
+    while (err == PPM_LOAD_OK && file->next_row < file->img_ptr->height) {
+        uint32_t rows = batch_chunk_rows(file);
+        err = batch_read_rows(file, file->next_row, rows, 0);
+        file->next_row += rows;
+    }
+
+    return err;
+}
+
+static void batch_load_pread(batch_job_t *job, size_t first, size_t last) {
+    batch_file_t *file = (batch_file_t *)malloc(sizeof(batch_file_t));
+
+    for (size_t i = first; i < last; ++i) {
+        int *error = BATCH_ERROR(job, i);
+
+        if (file == NULL) {
+            job->images[i] = NULL;
+            if (error != NULL)
+                *error = PPM_LOAD_ENOMEM;
+            continue;
+        }
+
+        int err = batch_open(file, job->file_names[i]);
+        if (err == PPM_LOAD_OK)
+            err = batch_read_sync(file);
+
+        batch_finish(file, err, &job->images[i], error);
+    }
+
+    free(file);
+}
+
+/*
+ * Queue the header read, or the next chunk of rows
+ */
+static void batch_queue(ppm_ring_t *ring, batch_file_t *file, uint64_t i) {
+    if (file->img_ptr == NULL) {
+        ppm_ring_queue(ring, PPM_RING_READ, file->fd, file->header, PPM_HEADER_MAX, 0, i);
+        return;
+    }
+
+    uint32_t rows = batch_chunk_rows(file);
+    ppm_ring_queue(ring, PPM_RING_READV, file->fd, file->iov + file->next_row, rows,
+                   (uint64_t)batch_row_offset(file, file->next_row), i);
+}
+
+/*
+ * Returns 1 once the file is complete, 0 if another read was queued
+ */
+static int batch_complete(ppm_ring_t *ring, batch_file_t *file, uint64_t i, int res, int *err) {
+    if (res < 0) {
+        *err = PPM_LOAD_EREAD;
+        return 1;
+    }
+
+    if (file->img_ptr == NULL) {
+        *err = batch_header(file, (size_t)res);
+    } else {
+        uint32_t rows = batch_chunk_rows(file);
+        // Short reads are rare on regular files; the rest is read synchronously
+        if ((size_t)res < (size_t)rows*file->row_bytes)
+            *err = batch_read_rows(file, file->next_row, rows, (size_t)res);
+        file->next_row += rows;
+    }
+
+    if (*err != PPM_LOAD_OK || file->next_row == file->img_ptr->height)
+        return 1;
+
+    batch_queue(ring, file, i);
+    return 0;
+}
+
+/*
+ * Files [first, last) through one ring
+ * Returns -1 if no ring could be set up; nothing was touched then
+ */
+static int batch_load_uring(batch_job_t *job, size_t first, size_t last) {
+    ppm_ring_t ring;
+    if (ppm_ring_open(&ring, BATCH_QUEUE_DEPTH) < 0)
+        return -1;
+
+    batch_file_t *files = (batch_file_t *)malloc(sizeof(batch_file_t)*BATCH_QUEUE_DEPTH);
+    if (files == NULL) {
+        ppm_ring_close(&ring);
+        return -1;
+    }
+
+    size_t slot_file[BATCH_QUEUE_DEPTH];
+    int free_slots[BATCH_QUEUE_DEPTH];
+    int n_free = BATCH_QUEUE_DEPTH;
+    for (int s = 0; s < BATCH_QUEUE_DEPTH; ++s)
+        free_slots[s] = BATCH_QUEUE_DEPTH - 1 - s;
+
+    size_t next = first;
+    int in_flight = 0;
+    int failed = 0;
+
+    while (next < last || in_flight > 0) {
+        // One read in flight per file, so the ring never overflows
+        while (next < last && n_free > 0) {
+            int s = free_slots[--n_free];
+            int err = batch_open(&files[s], job->file_names[next]);
+
+            if (err != PPM_LOAD_OK) {
+                batch_finish(&files[s], err, &job->images[next], BATCH_ERROR(job, next));
+                free_slots[n_free++] = s;
+                next++;
+                continue;
+            }
+
+            slot_file[s] = next++;
+            batch_queue(&ring, &files[s], (uint64_t)s);
+            in_flight++;
+        }
+
+        if (in_flight == 0)
+            break;
+
+        if (ppm_ring_submit_and_wait(&ring) < 0) {
+            failed = 1;
+            break;
+        }
+
+        uint64_t user_data;
+        int32_t res;
+        while (ppm_ring_reap(&ring, &user_data, &res)) {
+            int s = (int)user_data;
+            size_t i = slot_file[s];
+            int err = PPM_LOAD_OK;
+
+            if (batch_complete(&ring, &files[s], user_data, res, &err)) {
+                batch_finish(&files[s], err, &job->images[i], BATCH_ERROR(job, i));
+                free_slots[n_free++] = s;
+                in_flight--;
+            }
+        }
+    }
+
+    // Closing the ring cancels what is still queued
+    ppm_ring_close(&ring);
+
+    // The ring broke down: finish the open files and the rest with pread
+    if (failed) {
+        int busy[BATCH_QUEUE_DEPTH];
+        for (int s = 0; s < BATCH_QUEUE_DEPTH; ++s)
+            busy[s] = 1;
+        for (int k = 0; k < n_free; ++k)
+            busy[free_slots[k]] = 0;
+
+        for (int s = 0; s < BATCH_QUEUE_DEPTH; ++s) {
+            if (busy[s]) {
+                size_t i = slot_file[s];
+                batch_finish(&files[s], batch_read_sync(&files[s]), &job->images[i], BATCH_ERROR(job, i));
+            }
+        }
+
+        batch_load_pread(job, next, last);
+    }
+
+    free(files);
+    return 0;
+}
+
+/*
+ * One contiguous group of files per worker
+ */
+typedef struct {
+    batch_job_t *job;
+    size_t n_files;
+    size_t group_size;
+    int use_uring;
+} batch_groups_t;
+
+static void batch_group_tile(void *ctx, uint32_t group) {
+    batch_groups_t *groups = (batch_groups_t *)ctx;
+    size_t first = (size_t)group*groups->group_size;
+    size_t last = first + groups->group_size;
+    if (last > groups->n_files)
+        last = groups->n_files;
+
+    if (groups->use_uring && batch_load_uring(groups->job, first, last) == 0)
+        return;
+
+    batch_load_pread(groups->job, first, last);
+}
+
+/*
+ * Load n_files PNM or PAM images
+ * images[i] receives the image or NULL; errors[i] (if errors is not NULL)
+ * the PPM_LOAD_* status of that file. Nothing is printed.
+ * Set CACHEPIX_IO=pread in the environment to skip io_uring.
+ * Returns the number of images loaded
+ */
+size_t ppm_load_batch(const char *const *file_names, size_t n_files, PPM_ptr *images, int *errors) {
+    if (file_names == NULL || images == NULL || n_files == 0)
+        return 0;
+
+    batch_job_t job = { .file_names = file_names, .images = images, .errors = errors };
+
+    const char *io = getenv("CACHEPIX_IO");
+    size_t n_groups = (size_t)ppm_get_threads();
+    if (n_groups > n_files)
+        n_groups = n_files;
+
+    batch_groups_t groups = {
+        .job = &job, .n_files = n_files,
+        .group_size = (n_files + n_groups - 1) / n_groups,
+        .use_uring = (io == NULL || strcmp(io, "pread") != 0),
+    };
+    n_groups = (n_files + groups.group_size - 1) / groups.group_size;
+
+    if (n_groups > 1)
+        ppm_parallel_for((uint32_t)n_groups, batch_group_tile, &groups);
+    else
+        batch_group_tile(&groups, 0);
+
+    size_t loaded = 0;
+    for (size_t i = 0; i < n_files; ++i)
+        loaded += (images[i] != NULL);
+
+    return loaded;
+}
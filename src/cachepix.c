@@ -1,23 +1,74 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <math.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 #include "cachepix.h"
+#include "cachepix_internal.h"
 
-typedef struct {
-    int (*scale)(PPM_ptr, float, float);
-    int (*rgb_to_grayscale)(const PPM_ptr, PPM_ptr);
-    int (*convert_maxval)(PPM_ptr, uint16_t);
-} ppm_ops_t;
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/*
+ * Every backend is built into the library with its own target flags.
+ * Listed in priority order, ppm_init() takes the first one the CPU supports.
+ */
+static const ppm_ops_t backends[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    // vpermb/vpermt2b do the byte shuffles across whole registers and look up a 256-entry table in 4 vectors
+    { "avx512", PPM_CPU_AVX2 | PPM_CPU_AVX512F | PPM_CPU_AVX512BW | PPM_CPU_AVX512VBMI,
+                ppm_scale_avx512, ppm_rgb_to_grayscale_avx512, ppm_convert_maxval_avx512, ppm_apply_lut_avx512, 1,
+                ppm_planar_unpack_avx512, ppm_planar_pack_avx512, ppm_planar_scale_avx512, ppm_planar_rgb_to_grayscale_avx512,
+                ppm_convolve_h_avx2, ppm_convolve_v_avx2,
+                ppm_resize_h_avx2, ppm_resize_v_avx2,
+                ppm_stats_avx2, ppm_text_mask_avx512 },
+    { "avx2",   PPM_CPU_AVX2, ppm_scale_avx2, ppm_rgb_to_grayscale_avx2, ppm_convert_maxval_avx2, ppm_apply_lut_avx2, 0,
+                ppm_planar_unpack_avx2, ppm_planar_pack_avx2, ppm_planar_scale_avx2, ppm_planar_rgb_to_grayscale_avx2,
+                ppm_convolve_h_avx2, ppm_convolve_v_avx2,
+                ppm_resize_h_avx2, ppm_resize_v_avx2,
+                ppm_stats_avx2, ppm_text_mask_avx2 },
+    // SSE2 has no byte shuffle to look up tables or (de)interleave with
+    { "sse2",   PPM_CPU_SSE2, ppm_scale_sse2, ppm_rgb_to_grayscale_sse2, ppm_convert_maxval_sse2, ppm_apply_lut_scalar, 0,
+                ppm_planar_unpack_scalar, ppm_planar_pack_scalar, ppm_planar_scale_sse2, ppm_planar_rgb_to_grayscale_sse2,
+                ppm_convolve_h_sse2, ppm_convolve_v_sse2,
+                ppm_resize_h_sse2, ppm_resize_v_sse2,
+                ppm_stats_sse2, ppm_text_mask_sse2 },
+#endif
+#if defined(__aarch64__) || defined(__arm__)
+    { "neon",   PPM_CPU_NEON, ppm_scale_neon, ppm_rgb_to_grayscale_neon, ppm_convert_maxval_neon, ppm_apply_lut_neon, 1,
+                ppm_planar_unpack_neon, ppm_planar_pack_neon, ppm_planar_scale_neon, ppm_planar_rgb_to_grayscale_neon,
+                ppm_convolve_h_neon, ppm_convolve_v_neon,
+                ppm_resize_h_neon, ppm_resize_v_neon,
+                ppm_stats_neon, ppm_text_mask_neon },
+#endif
+    { "scalar", 0,            ppm_scale_scalar, ppm_rgb_to_grayscale_scalar, ppm_convert_maxval_scalar, ppm_apply_lut_scalar, 1,
+                ppm_planar_unpack_scalar, ppm_planar_pack_scalar, ppm_planar_scale_scalar, ppm_planar_rgb_to_grayscale_scalar,
+                ppm_convolve_h_scalar, ppm_convolve_v_scalar,
+                ppm_resize_h_scalar, ppm_resize_v_scalar,
+                ppm_stats_scalar, ppm_text_mask_scalar },
+};
+
+#define N_BACKENDS (sizeof(backends)/sizeof(backends[0]))
 
 static ppm_ops_t ops;
 
-static int file_empty(const char *path) {
+int file_empty(const char *path) {
     struct stat st;
     if (stat(path, &st) != 0) {
         return -1;      // file doesn't exist or error
@@ -45,348 +96,1174 @@ static int decimal_length_uint16(uint16_t x) {
 }
 
 /*
- * Parse header function
- * Returns the header size if header is valid
- * Sets the values of width, height and maxval in the PPM_img structure
- * Returns a negative integer if header is invalid
+ * Whitespace as the PPM format (and isspace in the C locale) defines it
  */
-static int token_consume_header(PPM_ptr img_ptr, data_t file_buf, size_t file_size) {
-    // Verify correct file signature
-    if (!(file_buf[0] == 'P' && file_buf[1] == '6' && isspace(file_buf[2]))) {
+static inline int header_space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Skip whitespace and comments ("#" to the end of the line) from p[i]
+ */
+static size_t skip_separators(const unsigned char *p, size_t i, size_t n) {
+    while (i < n && (header_space(p[i]) || p[i] == '#')) {
+        if (p[i] == '#') {
+            while (i < n && p[i] != '\n' && p[i] != '\r')
+                i++;
+        } else {
+            i++;
+        }
+    }
+    return i;
+}
+
+/*
+ * A non-zero decimal number at p[*i], cut off at 10 digits so it can't overflow
+ */
+static int read_number(const unsigned char *p, size_t *i, size_t n, uint64_t *value) {
+    uint64_t v = 0;
+    size_t digits = 0;
+    size_t k = *i;
+
+    for (; k < n && (unsigned)(p[k] - '0') < 10u; ++k) {
+        if (++digits > 10) {
+            return -1;
+        }
+        v = v*10 + (p[k] - '0');
+    }
+    if (digits == 0 || v == 0) {
         return -1;
     }
 
-    int header_size = 0;
-    char *end;
-    for (size_t i = 2; i < file_size; i++) {
-        if (isspace(file_buf[i])) {
-            continue;
+    *i = k;
+    *value = v;
+    return 0;
+}
+
+/*
+ * PAM header lines after "P7": a keyword and its value per line, up to and
+ * including the ENDHDR line. WIDTH, HEIGHT, DEPTH and MAXVAL each have to
+ * appear once; TUPLTYPE is ignored, the depth tells the channels apart.
+ */
+static int pam_header(const unsigned char *p, size_t *pos, size_t n, uint64_t fields[4]) {
+    static const char *const keys[4] = { "WIDTH", "HEIGHT", "DEPTH", "MAXVAL" };
+    size_t i = *pos;
+    int seen = 0;
+
+    if (i == n || !header_space(p[i])) {
+        return -1;
+    }
+
+    for (;;) {
+        i = skip_separators(p, i, n);
+        size_t key = i;
+        while (i < n && !header_space(p[i]))
+            i++;
+        if (i == n) {
+            return -1;
         }
+        size_t key_len = i - key;
 
-        if (file_buf[i] == '#') {
-            while (file_buf[i] != '\n') {
+        if (key_len == 6 && memcmp(p + key, "ENDHDR", 6) == 0) {
+            while (i < n && p[i] != '\n' && header_space(p[i]))
                 i++;
+            if (i == n || p[i] != '\n' || seen != 0xF) {
+                return -1;
             }
+            *pos = i + 1;
+            return 0;
+        }
+
+        if (key_len == 8 && memcmp(p + key, "TUPLTYPE", 8) == 0) {
+            while (i < n && p[i] != '\n')
+                i++;
             continue;
         }
 
-        if (isdigit(file_buf[i])) {
-            if (img_ptr->width == 0) {
-                img_ptr->width = (uint32_t)strtol(file_buf+i, &end, 10);
-                i = end - file_buf;
-                continue;
-            }
-            if (img_ptr->height == 0) {
-                img_ptr->height = (uint32_t)strtol(file_buf+i, &end, 10);
-                i = end - file_buf;
-                continue;
-            }
-            if (img_ptr->maxval == 0) {
-                img_ptr->maxval = (uint16_t)strtol(file_buf+i-1, &end, 10);
-                header_size = end - file_buf;
-                break;
-            }
+        int f = 0;
+        while (f < 4 && !(key_len == strlen(keys[f]) && memcmp(p + key, keys[f], key_len) == 0))
+            f++;
+        if (f == 4 || (seen & (1 << f))) {
+            return -1;
         }
-        if (i == file_size-1) {
-            header_size = -1;
-            break;
+
+        while (i < n && (p[i] == ' ' || p[i] == '\t'))
+            i++;
+        if (read_number(p, &i, n, &fields[f]) < 0) {
+            return -1;
         }
+        while (i < n && p[i] != '\n' && header_space(p[i]))
+            i++;
+        if (i == n || p[i] != '\n') {
+            return -1;
+        }
+        seen |= 1 << f;
     }
-
-    return header_size;
 }
 
 /*
- * Copy a valid PPM image data and metadata from disk into PPM structure
- * Discards any header comments
+ * Parse header function
+ * One pass over at most PPM_HEADER_MAX bytes, never past file_size. PNM
+ * headers are the magic number, then width, height and (except for PBM)
+ * maxval, each preceded by whitespace and comments; numbers are cut off at
+ * 10 digits so they can't overflow. PAM headers are keyword lines. Sizes
+ * whose pixel buffer wouldn't fit in data_size are rejected here, so
+ * nothing downstream has to check width*height*bpp again.
+ * Returns the header size (offset of the first raster byte) if header is valid
+ * Sets the values of width, height, maxval and channels in the PPM_img structure
+ * Returns a negative integer if header is invalid
  */
-PPM_ptr ppm_load_image(const char *file_name) {
+int token_consume_header(PPM_ptr img_ptr, int *format, const char *file_buf, size_t file_size) {
+    const unsigned char *p = (const unsigned char *)file_buf;
+    size_t n = (file_size < PPM_HEADER_MAX) ? file_size : PPM_HEADER_MAX;
 
-    PPM_ptr img_ptr = ppm_create_empty();
-
-    FILE *fp = fopen(file_name, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "%s: Could not open file.\n", file_name);
-        return NULL;
+    // Verify correct file signature
+    if (n < 2 || p[0] != 'P' || p[1] < '1' || p[1] > '7') {
+        return -1;
     }
 
-    fseek(fp, 0L, SEEK_END);
-    size_t file_size = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
+    int fmt = p[1] - '0';
+    uint64_t fields[4] = { 0, 0, 1, 1 };    // width, height, channels, maxval
+    size_t i = 2;
 
-    data_t entire_file = (data_t)malloc(sizeof(char)*file_size);
-    fread(entire_file, sizeof(char), file_size, fp);
+    if (fmt == PPM_FORMAT_PAM) {
+        if (pam_header(p, &i, n, fields) < 0) {
+            return -1;
+        }
+    } else {
+        int is_pbm = (fmt == PPM_FORMAT_PBM_PLAIN || fmt == PPM_FORMAT_PBM);
+        int order[3] = { 0, 1, 3 };
+
+        for (int f = 0; f < (is_pbm ? 2 : 3); ++f) {
+            size_t start = i;
+            i = skip_separators(p, i, n);
+            if (i == start || i == n || read_number(p, &i, n, &fields[order[f]]) < 0) {
+                return -1;
+            }
+        }
 
-    fclose(fp);
-    int header_size = token_consume_header(img_ptr, entire_file, file_size);
-    
-    if (header_size < 0) {
-        fprintf(stderr, "%s: error parsing header: Could not read file format. Only PPM is supported.\n", file_name);
-        return NULL;
+        // Exactly one whitespace character separates the header from the raster
+        if (i == n || !header_space(p[i])) {
+            return -1;
+        }
+        i++;
+
+        if (fmt == PPM_FORMAT_PPM_PLAIN || fmt == PPM_FORMAT_PPM)
+            fields[2] = 3;
     }
 
-    size_t data_size = ppm_expected_data_size(img_ptr->width, img_ptr->height, img_ptr->maxval);
-    data_t data = (data_t)malloc(sizeof(uint8_t)*data_size);
+    if (fields[0] > UINT32_MAX || fields[1] > UINT32_MAX || fields[2] > PPM_MAX_CHANNELS || fields[3] > UINT16_MAX) {
+        return -1;
+    }
 
-    int bytes_per_pixel = 3;
-    if (img_ptr->maxval > 255)
-        bytes_per_pixel = 6;
+    // The raster has to be addressable; whether it fits in one image is up
+    // to whoever allocates it (streams take any size). Half of SIZE_MAX, so
+    // that the text of a plain raster can't overflow ppm_raster_size either.
+    uint64_t stride = (fields[0]*ppm_pixel_bytes((uint16_t)fields[3], (uint16_t)fields[2]) + PPM_ALIGNMENT-1)
+                      & ~((uint64_t)(PPM_ALIGNMENT-1));
+    if (fields[1] > (SIZE_MAX/2) / stride) {
+        return -1;
+    }
 
-    size_t row_bytes = img_ptr->width*bytes_per_pixel;
-    img_ptr->stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+    img_ptr->width = (uint32_t)fields[0];
+    img_ptr->height = (uint32_t)fields[1];
+    img_ptr->channels = (uint16_t)fields[2];
+    img_ptr->maxval = (uint16_t)fields[3];
+    *format = fmt;
 
-    for (int y = 0; y < img_ptr->height; ++y) {
-        data_t dst_row = data + y * img_ptr->stride;
-        data_t src_row = entire_file + header_size + y * row_bytes;
+    return (int)i;
+}
 
-        memcpy(dst_row, src_row, row_bytes);
+/*
+ * Bytes of raster a file with this header must have after it
+ * Plain rasters need a digit per sample, and whitespace between the
+ * samples of PGM and PPM
+ */
+size_t ppm_raster_size(const PPM_img *img_ptr, int format) {
+    size_t pixels = (size_t)img_ptr->width*img_ptr->height;
+
+    switch (format) {
+    case PPM_FORMAT_PBM_PLAIN:
+        return pixels;
+    case PPM_FORMAT_PGM_PLAIN:
+    case PPM_FORMAT_PPM_PLAIN:
+        return 2*pixels*img_ptr->channels - 1;
+    case PPM_FORMAT_PBM:
+        return (size_t)((img_ptr->width + 7)/8)*img_ptr->height;
     }
 
-    free(entire_file);
+    return pixels*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+}
+
+/*
+ * Allocate the strided pixel buffer
+ * The metadata (width, height, maxval, channels) must already be set
+ */
+static int alloc_rows(PPM_ptr img_ptr) {
+
+    size_t data_size = ppm_data_size(img_ptr->width, img_ptr->height, img_ptr->maxval, img_ptr->channels);
+    if (data_size > PPM_DATA_SIZE_MAX)
+        return -1;
+
+    data_t data = (data_t)ppm_alloc(data_size);
+    if (data == NULL)
+        return -1;
+
+    size_t row_bytes = img_ptr->width*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+    img_ptr->stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
 
     img_ptr->data_size = data_size; 
     img_ptr->data = data;
+    img_ptr->alloc_size = data_size;
 
-    return img_ptr;
+    return 0;
 }
 
 /*
- * Write the PPM_img structure from memory to disk as a PPM image file
- * Stops if the file it's writing to already exists, isn't empty and force option isn't enabled
- * Overwrites existing file only if force option is enabled
+ * Allocate the strided pixel buffer and fill it from the raster: a copy of
+ * the packed rows, or a decode for the formats that need one
+ * The metadata (width, height, maxval, channels) must already be set
  */
-int ppm_save_image(PPM_ptr img_ptr, char *file_name, int force) {
-
-    if (!file_empty(file_name) && !force) {
-        fprintf(stderr, "ERR: save_ppm_image: file already exists and is not empty. (toggle the force option to overwrite it)\n");
-        return 0;
-    }
+static int copy_packed_rows(PPM_ptr img_ptr, int format, const char *raster, size_t raster_size) {
 
-    FILE *fp = fopen(file_name, "w");
-    
-    if (fp == NULL) {
-        perror(file_name);
+    if (alloc_rows(img_ptr) < 0)
         return -1;
-    }
-
-    // Calculate ts (stackoverflow pull)
-    int width_str_len = decimal_length_unsigned(img_ptr->width); //(int)((ceil(log10(img_ptr->width))+1)*sizeof(char));
-    int height_str_len = decimal_length_unsigned(img_ptr->height); //(int)((ceil(log10(img_ptr->height))+1)*sizeof(char));
-    int maxval_str_len = decimal_length_uint16(img_ptr->maxval); //(int)((ceil(log10(img_ptr->maxval))+1)*sizeof(char));
-
-    char *width_str = (char*)malloc(sizeof(char)*width_str_len);
-    char *height_str = (char*)malloc(sizeof(char)*height_str_len);
-    char *maxval_str = (char*)malloc(sizeof(char)*maxval_str_len);
 
-    sprintf(width_str, "%d", img_ptr->width);
-    sprintf(height_str, "%d", img_ptr->height);
-    sprintf(maxval_str, "%d", img_ptr->maxval);
+    if (!ppm_format_direct(format))
+        return ppm_decode_raster(img_ptr, format, raster, raster_size);
 
-    size_t file_size = ppm_expected_file_size(img_ptr->width, img_ptr->height, img_ptr->maxval);
-    data_t entire_file = (data_t)malloc((file_size)*sizeof(char));
+    size_t row_bytes = img_ptr->width*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        data_t dst_row = img_ptr->data + y * img_ptr->stride;
+        const char *src_row = raster + y * row_bytes;
 
-    // Construct fixed header
-    entire_file[0] = 'P';
-    entire_file[1] = '6';
-    entire_file[2] = WHITESPACE_CHAR;
-    int offset = 3;
-    for (int i = 0; i < width_str_len; i++) {
-        entire_file[i+offset] = width_str[i];
+        memcpy(dst_row, src_row, row_bytes);
     }
 
-    offset += width_str_len;
-    entire_file[offset] = ' ';
-    offset++;
+    return 0;
+}
 
-    for (int i = 0; i < height_str_len; i++) {
-        entire_file[i+offset] = height_str[i];
-    }
+static void report_raster_error(const char *file_name, int err) {
+    if (err == -2)
+        fprintf(stderr, "%s: file is truncated.\n", file_name);
+    else
+        fprintf(stderr, "%s: invalid raster.\n", file_name);
+}
 
-    offset += height_str_len;
-    entire_file[offset] = WHITESPACE_CHAR;
-    offset++;
+/*
+ * Copy a valid PNM or PAM image data and metadata from disk into PPM structure
+ * Discards any header comments
+ * The header and the file size are checked before anything else is read or
+ * allocated; the rows are then read straight into place, or the rest of the
+ * file is read and decoded for plain and PBM files.
+ */
+PPM_ptr ppm_load_image(const char *file_name) {
 
-    for (int i = 0; i < maxval_str_len; i++) {
-        entire_file[i+offset] = maxval_str[i];
+    FILE *fp = fopen(file_name, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: Could not open file.\n", file_name);
+        return NULL;
     }
-    offset += maxval_str_len;
-    entire_file[offset] = WHITESPACE_CHAR;
-    //offset++;
-    
-    // Finally copy the data
 
-    // WRITEWITHSTRIDE
-    int bytes_per_pixel = 3;
-    if (img_ptr->maxval > 255)
-        bytes_per_pixel = 6;
-
-    size_t row_bytes = img_ptr->width*bytes_per_pixel;
-    img_ptr->stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)PPM_ALIGNMENT-1);
+    struct stat st;
+    char header[PPM_HEADER_MAX];
+    size_t n = 0;
+    if (fstat(fileno(fp), &st) == 0)
+        n = fread(header, sizeof(char), sizeof(header), fp);
+    if (n == 0) {
+        fprintf(stderr, "%s: Could not read file.\n", file_name);
+        fclose(fp);
+        return NULL;
+    }
 
-    for (int y = 0; y < img_ptr->height; ++y) {
-        data_t src_row = img_ptr->data + y * img_ptr->stride;
-        data_t dst_row = entire_file + offset + y * row_bytes;
+    PPM_ptr img_ptr = ppm_create_empty();
+    if (img_ptr == NULL) {
+        fclose(fp);
+        return NULL;
+    }
 
-        memcpy(dst_row, src_row, row_bytes);
-    } 
+    int format;
+    int header_size = token_consume_header(img_ptr, &format, header, n);
+    
+    if (header_size < 0) {
+        fprintf(stderr, "%s: error parsing header: Could not read file format. Only PNM (P1-P6) and PAM (P7) are supported.\n", file_name);
+        fclose(fp);
+        free(img_ptr);
+        return NULL;
+    }
 
-    //memcpy(entire_file+offset, img_ptr->data, ppm_expected_data_size(img_ptr->width, img_ptr->height, img_ptr->maxval));
+    size_t file_size = (size_t)st.st_size;
+    size_t raster_size = ppm_raster_size(img_ptr, format);
+    if (file_size < (size_t)header_size || file_size - header_size < raster_size) {
+        fprintf(stderr, "%s: file is truncated.\n", file_name);
+        fclose(fp);
+        free(img_ptr);
+        return NULL;
+    }
 
-    size_t n_bytes = fwrite(entire_file, sizeof(char), file_size, fp);
+    if (alloc_rows(img_ptr) < 0 || fseeko(fp, header_size, SEEK_SET) != 0) {
+        fclose(fp);
+        ppm_free(img_ptr);
+        return NULL;
+    }
 
-    free(entire_file);
-    fclose(fp);
+    if (!ppm_format_direct(format)) {
+        size_t size = file_size - header_size;
+        char *raster = (char *)malloc(size);
+        int err = -3;
+        if (raster != NULL && fread(raster, sizeof(char), size, fp) == size)
+            err = ppm_decode_raster(img_ptr, format, raster, size);
+        free(raster);
+        fclose(fp);
+
+        if (err < 0) {
+            if (err == -3)
+                fprintf(stderr, "%s: Could not read file.\n", file_name);
+            else
+                report_raster_error(file_name, err);
+            ppm_free(img_ptr);
+            return NULL;
+        }
+        return img_ptr;
+    }
 
-    if (n_bytes < img_ptr->data_size) {
-        fprintf(stderr, "ERROR: couldn't write all bytes to stream. %zu bytes written.\n", n_bytes);
-        return -1;
+    // Packed rows that already have the library stride come in with one read
+    size_t row_bytes = raster_size / img_ptr->height;
+    size_t rows_per_read = (row_bytes == img_ptr->stride) ? img_ptr->height : 1;
+    for (size_t y = 0; y < img_ptr->height; y += rows_per_read) {
+        if (fread(img_ptr->data + y*img_ptr->stride, row_bytes, rows_per_read, fp) != rows_per_read) {
+            fprintf(stderr, "%s: Could not read file.\n", file_name);
+            fclose(fp);
+            ppm_free(img_ptr);
+            return NULL;
+        }
     }
 
-    printf("STAT: PPM image saved to %s successfully.\n", file_name);
-    return 0;
+    fclose(fp);
+    return img_ptr;
 }
 
-void ppm_free(PPM_ptr img_ptr) {
-    free(img_ptr->data);
-    free(img_ptr);
-}
+/*
+ * Load an image through a private file mapping instead of a read buffer
+ * The header is parsed in place and the rows are copied (or decoded)
+ * straight from the page cache into the aligned pixel buffer, so there is
+ * no file-sized staging copy.
+ *
+ * PPM_MMAP_POPULATE prefaults the whole mapping in one go.
+ * PPM_MMAP_VIEW keeps the mapping and points the image at it when that
+ * gives a valid image: the raster starts PPM_ALIGNMENT-aligned in the file
+ * and its packed rows can serve as strided ones (row bytes a multiple of
+ * PPM_ALIGNMENT, so stride == row bytes).
+ * The file is never modified: pages written by in-place operations become
+ * private copies. Other images are copied as usual.
+ */
+PPM_ptr ppm_load_image_mmap(const char *file_name, int flags) {
 
-PPM_ptr ppm_create(uint32_t width, uint32_t height, uint16_t maxval) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Could not open file.\n", file_name);
+        return NULL;
+    }
 
-    if (width == 0 || height == 0 || maxval == 0) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "%s: Could not read file.\n", file_name);
+        close(fd);
         return NULL;
     }
 
-    uint32_t bytes_per_channel = 1;
-    if (maxval > 255)
-        bytes_per_channel = 2;
+    size_t file_size = (size_t)st.st_size;
+    int map_flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+    if (flags & PPM_MMAP_POPULATE)
+        map_flags |= MAP_POPULATE;
+#endif
 
-    PPM_ptr img_ptr = (PPM_ptr)malloc(sizeof(PPM_img));
-    data_t data = (data_t)malloc(sizeof(uint8_t)*ppm_expected_data_size(width, height, maxval));
+    char *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, map_flags, fd, 0);
+    close(fd);
 
-    img_ptr->width = width;
-    img_ptr->height = height;
-    img_ptr->maxval = maxval;
-    img_ptr->data_size = ppm_expected_data_size(width, height,maxval);
-    img_ptr->data = data;
-    
-    size_t row_bytes = img_ptr->width*bytes_per_channel*3;
-    img_ptr->stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+    if (map == MAP_FAILED) {
+        perror(file_name);
+        return NULL;
+    }
 
-    return img_ptr;
-}
+    // Advice values are not flags: each one takes its own call
+    madvise(map, file_size, MADV_WILLNEED);
 
-PPM_ptr ppm_create_empty() {
+    PPM_ptr img_ptr = ppm_create_empty();
+    if (img_ptr == NULL) {
+        munmap(map, file_size);
+        return NULL;
+    }
 
-    PPM_ptr img_ptr = (PPM_ptr)malloc(sizeof(PPM_img));
+    int format;
+    int header_size = token_consume_header(img_ptr, &format, map, file_size);
 
-    img_ptr->width = 0;
-    img_ptr->height = 0;
-    img_ptr->maxval = 0;
-    img_ptr->data_size = 0;
-    img_ptr->data = NULL;
-    img_ptr->stride = 0;
+    if (header_size < 0) {
+        fprintf(stderr, "%s: error parsing header: Could not read file format. Only PNM (P1-P6) and PAM (P7) are supported.\n", file_name);
+        munmap(map, file_size);
+        free(img_ptr);
+        return NULL;
+    }
 
-    return img_ptr;
-}
+    if (file_size - header_size < ppm_raster_size(img_ptr, format)) {
+        fprintf(stderr, "%s: file is truncated.\n", file_name);
+        munmap(map, file_size);
+        free(img_ptr);
+        return NULL;
+    }
 
-PPM_ptr ppm_clone(PPM_ptr src_ptr) {
-    PPM_ptr dst_ptr = (PPM_ptr)malloc(sizeof(PPM_img));
+    size_t row_bytes = img_ptr->width*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
 
-    dst_ptr->width = src_ptr->width;
-    dst_ptr->height = src_ptr->height;
-    dst_ptr->maxval = src_ptr->maxval;
-    dst_ptr->data_size = src_ptr->data_size;
-    dst_ptr->data = src_ptr->data;
-    dst_ptr->stride = src_ptr->stride;
+    if ((flags & PPM_MMAP_VIEW) && ppm_format_direct(format) && (row_bytes % PPM_ALIGNMENT) == 0 &&
+            ((uintptr_t)(map + header_size) % PPM_ALIGNMENT) == 0) {
+        img_ptr->stride = row_bytes;
+        img_ptr->data_size = ppm_data_size(img_ptr->width, img_ptr->height, img_ptr->maxval, img_ptr->channels);
+        img_ptr->data = map + header_size;
+        img_ptr->map_base = map;
+        img_ptr->map_size = file_size;
+        return img_ptr;
+    }
 
-    return dst_ptr;
-}
+    // Rows are consumed front to back exactly once. A view keeps the default
+    // readahead, as it is read in whatever order its users like.
+    madvise(map, file_size, MADV_SEQUENTIAL);
 
-void ppm_clear(PPM_ptr img_ptr, uint16_t *val) {
-    for (size_t i = 0; i < (img_ptr->data_size/3); i+=3) {
-        img_ptr->data[i] = val[0];
-        img_ptr->data[i+1] = val[1];
-        img_ptr->data[i+2] = val[2];
+    int err = copy_packed_rows(img_ptr, format, map + header_size, file_size - header_size);
+    munmap(map, file_size);
+
+    if (err < 0) {
+        if (img_ptr->data != NULL)
+            report_raster_error(file_name, err);
+        ppm_free(img_ptr);
+        return NULL;
     }
+
+    return img_ptr;
 }
 
 /*
- * Metadata access
+ * Create (or truncate) the file a save writes to
+ * Returns the descriptor, -2 if the file has content and force is off,
+ * -1 on error (errno is kept for the caller)
  */
-uint32_t ppm_width(const PPM_ptr img_ptr) {
-    return img_ptr->width;
-}
-
-uint32_t ppm_height(const PPM_ptr img_ptr) {
-    return img_ptr->height;
-}
-
-uint16_t ppm_maxval(const PPM_ptr img_ptr) {
-    return img_ptr->maxval;
-}
+static int open_for_save(const char *file_name, int force, int flags) {
+    if (!file_empty(file_name) && !force) {
+        fprintf(stderr, "ERR: save_ppm_image: file already exists and is not empty. (toggle the force option to overwrite it)\n");
+        return -2;
+    }
 
-size_t ppm_stride(const PPM_ptr img_ptr) {
-    return img_ptr->stride;
+    return open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | flags, 0666);
 }
 
-data_t ppm_data(const PPM_ptr img_ptr) {
-    return img_ptr->data;
+/*
+ * The format an AUTO save writes: PGM for gray, PPM for RGB, PAM for the
+ * images with alpha
+ */
+static int save_format(const PPM_img *img_ptr, int format) {
+    if (format != PPM_FORMAT_AUTO)
+        return format;
+    if (img_ptr->channels == 1)
+        return PPM_FORMAT_PGM;
+    return (img_ptr->channels == 3) ? PPM_FORMAT_PPM : PPM_FORMAT_PAM;
 }
 
 /*
- * Validation functions
+ * Whether a file of format can hold the image's channels and maxval
  */
-int ppm_validate(const PPM_ptr img_ptr) {
-    if (img_ptr == NULL || 
-            img_ptr->data == NULL   || 
-            img_ptr->width == 0     || 
-            img_ptr->height == 0    || 
-            img_ptr->maxval == 0    ||
-            img_ptr->data_size != ppm_expected_data_size(img_ptr->width, img_ptr->height, img_ptr->maxval)) {
-        return -1;
+static int format_holds(const PPM_img *img_ptr, int format) {
+    switch (format) {
+    case PPM_FORMAT_PBM_PLAIN:
+    case PPM_FORMAT_PBM:
+        return img_ptr->channels == 1 && img_ptr->maxval == 1;
+    case PPM_FORMAT_PGM_PLAIN:
+    case PPM_FORMAT_PGM:
+        return img_ptr->channels == 1;
+    case PPM_FORMAT_PPM_PLAIN:
+    case PPM_FORMAT_PPM:
+        return img_ptr->channels == 3;
+    case PPM_FORMAT_PAM:
+        return 1;
     }
-
     return 0;
 }
 
-size_t ppm_expected_data_size(uint32_t width, uint32_t height, uint16_t maxval) {
-    size_t bytes_per_pixel = (maxval <= 255) ? 3 : 6;
-    size_t row_bytes = width*bytes_per_pixel;
-    size_t stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
-
-    return (size_t)(stride*height);
-}
+static int format_header(char *buf, size_t size, const PPM_img *img_ptr, int format) {
+    static const char *const tuple_types[] = { "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
 
-size_t ppm_expected_file_size(uint32_t width, uint32_t height, uint16_t maxval) {
-    int width_str_len = decimal_length_unsigned(width); //(int)((ceil(log10(width))+1)*sizeof(char));
-    int height_str_len = decimal_length_unsigned(height); //(int)((ceil(log10(height))+1)*sizeof(char));
-    int maxval_str_len = decimal_length_uint16(maxval); //(int)((ceil(log10(maxval))+1)*sizeof(char));
+    if (format == PPM_FORMAT_PAM) {
+        const char *tuple_type = tuple_types[img_ptr->channels - 1];
+        if (img_ptr->maxval == 1 && img_ptr->channels <= 2)
+            tuple_type = (img_ptr->channels == 1) ? "BLACKANDWHITE" : "BLACKANDWHITE_ALPHA";
 
-    size_t bytes_per_pixel = (maxval <= 255) ? 3 : 6;
+        return snprintf(buf, size, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL %u\nTUPLTYPE %s\nENDHDR\n",
+                        img_ptr->width, img_ptr->height, img_ptr->channels, img_ptr->maxval, tuple_type);
+    }
 
-    return (size_t)(width*height*bytes_per_pixel + width_str_len + height_str_len + maxval_str_len + 7);
+    if (format == PPM_FORMAT_PBM_PLAIN || format == PPM_FORMAT_PBM) {
+        return snprintf(buf, size, "P%d%c%u %u%c", format, WHITESPACE_CHAR, img_ptr->width, img_ptr->height,
+                        WHITESPACE_CHAR);
+    }
 
+    return snprintf(buf, size, "P%d%c%u %u%c%u%c", format, WHITESPACE_CHAR, img_ptr->width, img_ptr->height,
+                    WHITESPACE_CHAR, img_ptr->maxval, WHITESPACE_CHAR);
 }
 
 /*
- * Pixel manipulation 
+ * writev the whole vector, resuming after short writes
  */
+static int writev_all(int fd, struct iovec *iov, int n_iov) {
+    while (n_iov > 0) {
+        ssize_t n = writev(fd, iov, n_iov);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
 
-int ppm_get_pixel(const PPM_ptr img_ptr, uint32_t x, uint32_t y, uint16_t *rgb) {
-    
-    if (img_ptr == NULL || rgb == NULL) {
-        return -1;
-    }
-
-    if (x >= img_ptr->width || y >= img_ptr->height) {
-        return -1;
+        while (n_iov > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
 
-    data_t pix_addr = &PIX_AT(img_ptr, x, y);
-    rgb[0] = *pix_addr;
-    rgb[1] = *(pix_addr+1);
-    rgb[2] = *(pix_addr+2);
+    return 0;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the PPM_img structure from memory to disk as a PGM, PPM or PAM
+ * image file, whichever holds its channels
+ * Stops if the file it's writing to already exists, isn't empty and force option isn't enabled
+ * Overwrites existing file only if force option is enabled
+ */
+int ppm_save_image(PPM_ptr img_ptr, char *file_name, int force) {
+    return ppm_save_image_format(img_ptr, file_name, PPM_FORMAT_AUTO, force);
+}
+
+/*
+ * Write the image as a file of the given format
+ * The header and the rows go out with writev straight from the strided
+ * buffer (a single iovec for the raster when the image is contiguous),
+ * without staging the file in memory. Plain and PBM rasters are encoded
+ * into one buffer first.
+ */
+#define SAVE_IOV 1024
+
+int ppm_save_image_format(PPM_ptr img_ptr, char *file_name, int format, int force) {
+
+    if (ppm_validate(img_ptr) < 0) {
+        return -1;
+    }
+
+    format = save_format(img_ptr, format);
+    if (!format_holds(img_ptr, format)) {
+        fprintf(stderr, "ERROR: %s: a P%d file can't hold a %u-channel image of maxval %u.\n",
+                file_name, format, img_ptr->channels, img_ptr->maxval);
+        return -2;
+    }
+
+    char *encoded = NULL;
+    size_t encoded_size = 0;
+    if (!ppm_format_direct(format)) {
+        encoded = ppm_encode_raster(img_ptr, format, &encoded_size);
+        if (encoded == NULL)
+            return -1;
+    }
+
+    int fd = open_for_save(file_name, force, 0);
+    if (fd == -2) {
+        free(encoded);
+        return 0;
+    }
+    if (fd < 0) {
+        perror(file_name);
+        free(encoded);
+        return -1;
+    }
+
+    char header[128];
+    int header_size = format_header(header, sizeof(header), img_ptr, format);
+
+    size_t row_bytes = img_ptr->width*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+    int contiguous = ppm_is_contiguous(img_ptr);
+
+    struct iovec iov[SAVE_IOV];
+    int n_iov = 0;
+    iov[n_iov].iov_base = header;
+    iov[n_iov++].iov_len = (size_t)header_size;
+
+    int err = 0;
+    if (encoded != NULL) {
+        iov[n_iov].iov_base = encoded;
+        iov[n_iov++].iov_len = encoded_size;
+        err = writev_all(fd, iov, n_iov);
+    } else if (contiguous) {
+        iov[n_iov].iov_base = img_ptr->data;
+        iov[n_iov++].iov_len = row_bytes*img_ptr->height;
+        err = writev_all(fd, iov, n_iov);
+    } else {
+        // A row of a tiled image is one piece per tile it crosses
+        uint32_t pieces = (img_ptr->layout == PPM_LAYOUT_TILED) ? ppm_tiles_x(img_ptr) : 1;
+
+        for (uint32_t y = 0; y < img_ptr->height && err == 0; ++y) {
+            for (uint32_t tx = 0; tx < pieces && err == 0; ++tx) {
+                if (pieces == 1) {
+                    iov[n_iov].iov_base = img_ptr->data + y*img_ptr->stride;
+                    iov[n_iov++].iov_len = row_bytes;
+                } else {
+                    PPM_img tile = ppm_tile(img_ptr, tx, y / PPM_TILE_PIXELS);
+                    iov[n_iov].iov_base = tile.data + (y % PPM_TILE_PIXELS)*tile.stride;
+                    iov[n_iov++].iov_len = tile.width*(row_bytes/img_ptr->width);
+                }
+
+                if (n_iov == SAVE_IOV) {
+                    err = writev_all(fd, iov, n_iov);
+                    n_iov = 0;
+                }
+            }
+        }
+
+        if (err == 0 && n_iov > 0)
+            err = writev_all(fd, iov, n_iov);
+    }
+
+    free(encoded);
+
+    if (err < 0) {
+        fprintf(stderr, "ERROR: %s: couldn't write the image: %s.\n", file_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (close(fd) < 0) {
+        perror(file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Direct I/O save
+ *
+ * O_DIRECT needs the buffer, the length and the file offset aligned to the
+ * file system's direct I/O alignment. The header is padded with a comment to
+ * one alignment unit, so the raster starts on an aligned offset and is
+ * written from the image buffer as is, in SAVE_DIRECT_CHUNK pieces kept in
+ * flight on an io_uring (pwrite without one). The unaligned tail of the
+ * raster goes through the page cache.
+ */
+#define SAVE_DIRECT_HEADER  4096
+#define SAVE_DIRECT_CHUNK   ((size_t)4 << 20)
+#define SAVE_DIRECT_DEPTH   8
+
+static void direct_alignment(int fd, size_t *mem_align, size_t *offset_align) {
+    *mem_align = SAVE_DIRECT_HEADER;
+    *offset_align = SAVE_DIRECT_HEADER;
+
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+            (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0) {
+        *mem_align = stx.stx_dio_mem_align;
+        *offset_align = stx.stx_dio_offset_align;
+    }
+#else
+    (void)fd;
+#endif
+}
+
+static int direct_write_chunks(int fd, const char *data, size_t len, off_t offset) {
+    ppm_ring_t ring;
+    if (ppm_ring_open(&ring, SAVE_DIRECT_DEPTH) < 0)
+        return pwrite_all(fd, data, len, offset);
+
+    size_t n_chunks = (len + SAVE_DIRECT_CHUNK - 1) / SAVE_DIRECT_CHUNK;
+    size_t next = 0;
+    int in_flight = 0;
+    int err = 0;
+
+    while ((next < n_chunks && err == 0) || in_flight > 0) {
+        while (err == 0 && next < n_chunks && in_flight < SAVE_DIRECT_DEPTH) {
+            size_t pos = next*SAVE_DIRECT_CHUNK;
+            size_t chunk = (len - pos < SAVE_DIRECT_CHUNK) ? len - pos : SAVE_DIRECT_CHUNK;
+            ppm_ring_queue(&ring, PPM_RING_WRITE, fd, (void *)(data + pos), (uint32_t)chunk,
+                           (uint64_t)(offset + pos), next);
+            next++;
+            in_flight++;
+        }
+
+        if (ppm_ring_submit_and_wait(&ring) < 0) {
+            err = -1;
+            break;
+        }
+
+        uint64_t k;
+        int32_t res;
+        while (ppm_ring_reap(&ring, &k, &res)) {
+            size_t pos = k*SAVE_DIRECT_CHUNK;
+            size_t chunk = (len - pos < SAVE_DIRECT_CHUNK) ? len - pos : SAVE_DIRECT_CHUNK;
+            in_flight--;
+
+            if (res < 0) {
+                errno = -res;
+                err = -1;
+            } else if ((size_t)res < chunk && err == 0) {
+                err = pwrite_all(fd, data + pos + res, chunk - res, offset + pos + res);
+            }
+        }
+    }
+
+    ppm_ring_close(&ring);
+    return err;
+}
+
+/*
+ * Same as ppm_save_image, bypassing the page cache for the raster
+ * Only contiguous images whose buffer meets the direct I/O alignment qualify;
+ * others, and file systems without O_DIRECT, take the ppm_save_image path.
+ * The file carries a padding comment in its header.
+ */
+int ppm_save_image_direct(PPM_ptr img_ptr, char *file_name, int force) {
+
+    if (ppm_validate(img_ptr) < 0) {
+        return -1;
+    }
+
+    if (!ppm_is_contiguous(img_ptr)) {
+        return ppm_save_image(img_ptr, file_name, force);
+    }
+
+    int fd = open_for_save(file_name, force, O_DIRECT);
+    if (fd == -2) {
+        return 0;
+    }
+    if (fd < 0) {
+        if (errno == EINVAL)
+            return ppm_save_image(img_ptr, file_name, force);
+        perror(file_name);
+        return -1;
+    }
+
+    size_t mem_align, offset_align;
+    direct_alignment(fd, &mem_align, &offset_align);
+
+    char rest[128];
+    int rest_size = format_header(rest, sizeof(rest), img_ptr, save_format(img_ptr, PPM_FORMAT_AUTO)) - 3;
+    size_t header_size = ((size_t)rest_size + 5 + offset_align - 1) / offset_align * offset_align;
+
+    if (header_size > SAVE_DIRECT_HEADER || ((uintptr_t)img_ptr->data % mem_align) != 0 ||
+            (SAVE_DIRECT_HEADER % mem_align) != 0) {
+        close(fd);
+        return ppm_save_image(img_ptr, file_name, 1);
+    }
+
+    // "P6\n#   ...   \nW H\nMAXVAL\n", exactly header_size bytes
+    _Alignas(SAVE_DIRECT_HEADER) char header[SAVE_DIRECT_HEADER];
+    memcpy(header, rest, 3);
+    header[3] = '#';
+    memset(header + 4, ' ', header_size - rest_size - 5);
+    header[header_size - rest_size - 1] = '\n';
+    memcpy(header + header_size - rest_size, rest + 3, rest_size);
+
+    size_t raster_size = img_ptr->width*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels)*(size_t)img_ptr->height;
+    size_t direct_size = raster_size / offset_align * offset_align;
+
+    int err = pwrite_all(fd, header, header_size, 0);
+    if (err == 0)
+        err = direct_write_chunks(fd, img_ptr->data, direct_size, (off_t)header_size);
+
+    // Unaligned tail through the page cache
+    if (err == 0 && direct_size < raster_size) {
+        int fl = fcntl(fd, F_GETFL);
+        err = (fl < 0 || fcntl(fd, F_SETFL, fl & ~O_DIRECT) < 0) ? -1 :
+              pwrite_all(fd, img_ptr->data + direct_size, raster_size - direct_size,
+                         (off_t)(header_size + direct_size));
+    }
+
+    if (err < 0) {
+        fprintf(stderr, "ERROR: %s: couldn't write the image: %s.\n", file_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (close(fd) < 0) {
+        perror(file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Release the pixel buffer, whichever way it was obtained
+ */
+void ppm_release_data(PPM_ptr img_ptr) {
+    if (img_ptr->shared != NULL) {
+        ppm_shared_drop(img_ptr->shared);
+        img_ptr->shared = NULL;
+    } else if (img_ptr->map_base != NULL) {
+        munmap(img_ptr->map_base, img_ptr->map_size);
+        img_ptr->map_base = NULL;
+        img_ptr->map_size = 0;
+    } else if (img_ptr->alloc_size != 0) {
+        ppm_dealloc(img_ptr->data, img_ptr->alloc_size);
+    }
+    img_ptr->data = NULL;
+    img_ptr->alloc_size = 0;
+}
+
+int ppm_owns_data(const PPM_img *img_ptr) {
+    return img_ptr->alloc_size != 0 || img_ptr->map_base != NULL || img_ptr->shared != NULL;
+}
+
+/*
+ * Destination rows for a maxval conversion
+ * Same sample size converts in place, a depth change gets a fresh buffer
+ * with the new stride. Finish with ppm_convert_commit.
+ */
+data_t ppm_convert_target(PPM_ptr img_ptr, uint16_t new_maxval, size_t *new_stride) {
+    size_t old_bpc = (img_ptr->maxval <= 255) ? 1 : 2;
+    size_t new_bpc = (new_maxval <= 255) ? 1 : 2;
+
+    if (old_bpc == new_bpc) {
+        *new_stride = img_ptr->stride;
+        return img_ptr->data;
+    }
+
+    size_t new_row_bytes = img_ptr->width * img_ptr->channels * new_bpc;
+    *new_stride = (new_row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT - 1));
+    if (*new_stride*img_ptr->height > PPM_DATA_SIZE_MAX)
+        return NULL;
+
+    return (data_t)ppm_alloc(*new_stride*img_ptr->height);
+}
+
+void ppm_convert_commit(PPM_ptr img_ptr, data_t new_data, size_t new_stride, uint16_t new_maxval) {
+    if (new_data != img_ptr->data) {
+        ppm_release_data(img_ptr);
+        img_ptr->data = new_data;
+        img_ptr->stride = new_stride;
+        img_ptr->data_size = new_stride*img_ptr->height;
+        img_ptr->alloc_size = img_ptr->data_size;
+    }
+    img_ptr->maxval = new_maxval;
+}
+
+void ppm_free(PPM_ptr img_ptr) {
+    ppm_release_data(img_ptr);
+    free(img_ptr);
+}
+
+PPM_ptr ppm_create(uint32_t width, uint32_t height, uint16_t maxval) {
+    return ppm_create_image(width, height, maxval, 3, PPM_LAYOUT_ROWS);
+}
+
+PPM_ptr ppm_create_layout(uint32_t width, uint32_t height, uint16_t maxval, int layout) {
+    return ppm_create_image(width, height, maxval, 3, layout);
+}
+
+PPM_ptr ppm_create_channels(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels) {
+    return ppm_create_image(width, height, maxval, channels, PPM_LAYOUT_ROWS);
+}
+
+PPM_ptr ppm_create_image(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels, int layout) {
+
+    if (width == 0 || height == 0 || maxval == 0 || channels == 0 || channels > PPM_MAX_CHANNELS) {
+        return NULL;
+    }
+
+    if (layout != PPM_LAYOUT_ROWS && layout != PPM_LAYOUT_TILED) {
+        return NULL;
+    }
+
+    size_t pixel_bytes = ppm_pixel_bytes(maxval, channels);
+
+    size_t data_size = (layout == PPM_LAYOUT_TILED) ? ppm_tiled_data_size(width, height, maxval, channels)
+                                                     : ppm_data_size(width, height, maxval, channels);
+    if (data_size > PPM_DATA_SIZE_MAX) {
+        return NULL;
+    }
+
+    data_t data = (data_t)ppm_alloc(data_size);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    PPM_ptr img_ptr = (PPM_ptr)malloc(sizeof(PPM_img));
+    if (img_ptr == NULL) {
+        ppm_dealloc(data, data_size);
+        return NULL;
+    }
+
+    img_ptr->width = width;
+    img_ptr->height = height;
+    img_ptr->maxval = maxval;
+    img_ptr->channels = channels;
+    img_ptr->data_size = data_size;
+    img_ptr->data = data;
+    img_ptr->map_base = NULL;
+    img_ptr->map_size = 0;
+    img_ptr->alloc_size = data_size;
+    img_ptr->layout = layout;
+    img_ptr->shared = NULL;
+    img_ptr->parent = NULL;
+    img_ptr->parent_offset = 0;
+    
+    size_t row_bytes = img_ptr->width*pixel_bytes;
+    img_ptr->stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+    if (layout == PPM_LAYOUT_TILED)
+        img_ptr->stride = (size_t)PPM_TILE_PIXELS*pixel_bytes;
+
+    return img_ptr;
+}
+
+PPM_ptr ppm_create_empty() {
+
+    PPM_ptr img_ptr = (PPM_ptr)malloc(sizeof(PPM_img));
+    if (img_ptr == NULL) {
+        return NULL;
+    }
+
+    img_ptr->width = 0;
+    img_ptr->height = 0;
+    img_ptr->maxval = 0;
+    img_ptr->channels = 3;
+    img_ptr->data_size = 0;
+    img_ptr->data = NULL;
+    img_ptr->stride = 0;
+    img_ptr->map_base = NULL;
+    img_ptr->map_size = 0;
+    img_ptr->alloc_size = 0;
+    img_ptr->layout = PPM_LAYOUT_ROWS;
+    img_ptr->shared = NULL;
+    img_ptr->parent = NULL;
+    img_ptr->parent_offset = 0;
+
+    return img_ptr;
+}
+
+void ppm_clear(PPM_ptr img_ptr, uint16_t *val) {
+    if (ppm_unshare(img_ptr) < 0)
+        return;
+
+    for (size_t i = 0; i < (img_ptr->data_size/3); i+=3) {
+        img_ptr->data[i] = val[0];
+        img_ptr->data[i+1] = val[1];
+        img_ptr->data[i+2] = val[2];
+    }
+}
+
+/*
+ * Metadata access
+ */
+uint32_t ppm_width(const PPM_ptr img_ptr) {
+    return img_ptr->width;
+}
+
+uint32_t ppm_height(const PPM_ptr img_ptr) {
+    return img_ptr->height;
+}
+
+uint16_t ppm_maxval(const PPM_ptr img_ptr) {
+    return img_ptr->maxval;
+}
+
+uint16_t ppm_channels(const PPM_ptr img_ptr) {
+    return img_ptr->channels;
+}
+
+size_t ppm_stride(const PPM_ptr img_ptr) {
+    return img_ptr->stride;
+}
+
+data_t ppm_data(const PPM_ptr img_ptr) {
+    ppm_cow_sync(img_ptr);
+    return img_ptr->data;
+}
+
+/*
+ * Validation functions
+ */
+/*
+ * The checks of ppm_validate alone, for images about to be written in
+ * part, which only need the bands they write (see ppm_cow_write)
+ */
+static int image_valid(const PPM_img *img_ptr) {
+    if (img_ptr == NULL || 
+            img_ptr->data == NULL   || 
+            img_ptr->width == 0     || 
+            img_ptr->height == 0    || 
+            img_ptr->maxval == 0    ||
+            img_ptr->channels == 0  ||
+            img_ptr->channels > PPM_MAX_CHANNELS) {
+        return -1;
+    }
+
+    size_t expected = (img_ptr->layout == PPM_LAYOUT_TILED)
+                      ? ppm_tiled_data_size(img_ptr->width, img_ptr->height, img_ptr->maxval, img_ptr->channels)
+                      : ppm_data_size(img_ptr->width, img_ptr->height, img_ptr->maxval, img_ptr->channels);
+    if (img_ptr->data_size != expected) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int ppm_validate(const PPM_ptr img_ptr) {
+    if (image_valid(img_ptr) < 0)
+        return -1;
+
+    // Whatever checks the image goes on to read it
+    ppm_cow_sync(img_ptr);
+    return 0;
+}
+
+/*
+ * Header and size checks without reading the raster: the first
+ * PPM_HEADER_MAX bytes and fstat
+ */
+int ppm_validate_file(const char *file_name) {
+    if (file_name == NULL) {
+        return -1;
+    }
+
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    char header[PPM_HEADER_MAX];
+    ssize_t n = -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        n = pread(fd, header, sizeof(header), 0);
+    }
+    close(fd);
+
+    if (n <= 0) {
+        return -1;
+    }
+
+    PPM_img meta = {0};
+    int format;
+    int header_size = token_consume_header(&meta, &format, header, (size_t)n);
+    if (header_size < 0) {
+        return -1;
+    }
+
+    if ((size_t)st.st_size < (size_t)header_size || (size_t)st.st_size - header_size < ppm_raster_size(&meta, format)) {
+        return -2;
+    }
+
+    return 0;
+}
+
+size_t ppm_expected_data_size(uint32_t width, uint32_t height, uint16_t maxval) {
+    return ppm_data_size(width, height, maxval, 3);
+}
+
+size_t ppm_data_size(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels) {
+    size_t row_bytes = width*ppm_pixel_bytes(maxval, channels);
+    size_t stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+
+    return (size_t)(stride*height);
+}
+
+size_t ppm_expected_file_size(uint32_t width, uint32_t height, uint16_t maxval) {
+    int width_str_len = decimal_length_unsigned(width); //(int)((ceil(log10(width))+1)*sizeof(char));
+    int height_str_len = decimal_length_unsigned(height); //(int)((ceil(log10(height))+1)*sizeof(char));
+    int maxval_str_len = decimal_length_uint16(maxval); //(int)((ceil(log10(maxval))+1)*sizeof(char));
+
+    size_t bytes_per_pixel = (maxval <= 255) ? 3 : 6;
+
+    return (size_t)width*height*bytes_per_pixel + width_str_len + height_str_len + maxval_str_len + 6;
+
+}
+
+/*
+ * Pixel manipulation 
+ */
+
+/*
+ * Address of pixel (x, y) in either layout
+ */
+static uint8_t *pixel_at(const PPM_ptr img_ptr, uint32_t x, uint32_t y) {
+    size_t bytes_per_pixel = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+
+    if (img_ptr->layout == PPM_LAYOUT_TILED) {
+        PPM_img tile = ppm_tile(img_ptr, x / PPM_TILE_PIXELS, y / PPM_TILE_PIXELS);
+        x %= PPM_TILE_PIXELS;
+        y %= PPM_TILE_PIXELS;
+        return (uint8_t *)tile.data + y*tile.stride + x*bytes_per_pixel;
+    }
+
+    return (uint8_t *)img_ptr->data + y*img_ptr->stride + x*bytes_per_pixel;
+}
+
+/*
+ * Bytes of the buffer under the rectangle (x, y, width, height): from its
+ * first pixel past its last, or the run of tiles between theirs
+ */
+static void rect_span(const PPM_ptr img_ptr, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                      size_t *offset, size_t *bytes) {
+    if (img_ptr->layout == PPM_LAYOUT_TILED) {
+        size_t tiles_x = ppm_tiles_x(img_ptr);
+        size_t first = (size_t)(y / PPM_TILE_PIXELS)*tiles_x + x / PPM_TILE_PIXELS;
+        size_t last = (size_t)((y + height - 1) / PPM_TILE_PIXELS)*tiles_x + (x + width - 1) / PPM_TILE_PIXELS;
+        size_t tile_bytes = ppm_tile_bytes(img_ptr->maxval, img_ptr->channels);
+        *offset = first*tile_bytes;
+        *bytes = (last - first + 1)*tile_bytes;
+        return;
+    }
+
+    size_t bytes_per_pixel = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+    *offset = (size_t)y*img_ptr->stride + x*bytes_per_pixel;
+    *bytes = (size_t)(height - 1)*img_ptr->stride + width*bytes_per_pixel;
+}
+
+int ppm_get_pixel(const PPM_ptr img_ptr, uint32_t x, uint32_t y, uint16_t *rgb) {
+    
+    if (img_ptr == NULL || rgb == NULL) {
+        return -1;
+    }
+
+    if (x >= img_ptr->width || y >= img_ptr->height) {
+        return -1;
+    }
+
+    size_t offset, bytes;
+    rect_span(img_ptr, x, y, 1, 1, &offset, &bytes);
+    ppm_cow_read(img_ptr, offset, bytes);
+
+    const uint8_t *pix_addr = pixel_at(img_ptr, x, y);
+    for (int c = 0; c < img_ptr->channels; ++c) {
+        if (img_ptr->maxval <= 255)
+            rgb[c] = pix_addr[c];
+        else
+            rgb[c] = (uint16_t)((pix_addr[2*c] << 8) | pix_addr[2*c+1]);
+    }
 
     return 0;
 }
@@ -401,14 +1278,45 @@ int ppm_set_pixel(PPM_ptr img_ptr, uint32_t x, uint32_t y, const uint16_t *rgb)
         return -1;
     }
 
-    data_t pix_addr = &PIX_AT(img_ptr, x, y);
-    *pix_addr = rgb[0];
-    *(pix_addr+1) = rgb[1];
-    *(pix_addr+2) = rgb[2];
+    size_t offset, bytes;
+    rect_span(img_ptr, x, y, 1, 1, &offset, &bytes);
+    if (ppm_cow_write(img_ptr, offset, bytes) < 0) {
+        return -1;
+    }
+
+    uint8_t *pix_addr = pixel_at(img_ptr, x, y);
+    for (int c = 0; c < img_ptr->channels; ++c) {
+        if (img_ptr->maxval <= 255) {
+            pix_addr[c] = (uint8_t)rgb[c];
+        } else {
+            pix_addr[2*c] = (uint8_t)(rgb[c] >> 8);
+            pix_addr[2*c+1] = (uint8_t)rgb[c];
+        }
+    }
 
     return 0;
 }
 
+/*
+ * Copy every pixel of src to dst at (x, y), in runs that are contiguous in
+ * both images (rows, or rows within a tile)
+ */
+static void copy_pixels(PPM_ptr dst_ptr, uint32_t x, uint32_t y, const PPM_ptr src_ptr) {
+    size_t bytes_per_pixel = ppm_pixel_bytes(src_ptr->maxval, src_ptr->channels);
+
+    for (uint32_t row = 0; row < src_ptr->height; ++row) {
+        for (uint32_t col = 0; col < src_ptr->width;) {
+            uint32_t src_run, dst_run;
+            const uint8_t *src = ppm_pixel_run(src_ptr, col, row, &src_run);
+            uint8_t *dst = ppm_pixel_run(dst_ptr, x + col, y + row, &dst_run);
+            uint32_t run = (src_run < dst_run) ? src_run : dst_run;
+
+            memcpy(dst, src, run*bytes_per_pixel);
+            col += run;
+        }
+    }
+}
+
 /*
  * Bulk operations
  */
@@ -418,16 +1326,41 @@ int ppm_copy(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
         return -1;
     }
 
-    data_t dst_data = (data_t)malloc(src_ptr->data_size);
+    data_t dst_data = (data_t)ppm_alloc(src_ptr->data_size);
+    if (dst_data == NULL) {
+        return -1;
+    }
+
+    // A view's rows are further apart than its own would be
+    size_t stride = src_ptr->stride;
+    int gather = 0;
+    if (src_ptr->layout == PPM_LAYOUT_ROWS) {
+        stride = src_ptr->data_size / src_ptr->height;
+        gather = (stride != src_ptr->stride);
+    }
+
+    // Recycle whatever dst held before
+    ppm_release_data(dst_ptr);
 
     dst_ptr->width = src_ptr->width;
     dst_ptr->height = src_ptr->height;
     dst_ptr->maxval = src_ptr->maxval;
+    dst_ptr->channels = src_ptr->channels;
     dst_ptr->data_size = src_ptr->data_size;
     dst_ptr->data = dst_data;
-    dst_ptr->stride = src_ptr->stride;
-
-    memcpy(dst_data, src_ptr->data, src_ptr->data_size);
+    dst_ptr->stride = stride;
+    dst_ptr->map_base = NULL;
+    dst_ptr->map_size = 0;
+    dst_ptr->alloc_size = src_ptr->data_size;
+    dst_ptr->layout = src_ptr->layout;
+    dst_ptr->shared = NULL;
+    dst_ptr->parent = NULL;
+    dst_ptr->parent_offset = 0;
+
+    if (gather)
+        copy_pixels(dst_ptr, 0, 0, src_ptr);
+    else
+        memcpy(dst_data, src_ptr->data, src_ptr->data_size);
 
     return 0;
 }
@@ -436,7 +1369,7 @@ int ppm_copy(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
  * Alignment and performance
  */
 int ppm_realign(PPM_ptr img_ptr, size_t alignment) {
-    if (ppm_validate(img_ptr) < 0) {
+    if (ppm_validate(img_ptr) < 0 || img_ptr->layout != PPM_LAYOUT_ROWS || !ppm_owns_data(img_ptr)) {
         return -1;
     }
 
@@ -444,7 +1377,7 @@ int ppm_realign(PPM_ptr img_ptr, size_t alignment) {
     if ((alignment & (alignment - 1)) != 0)
         return -1;
 
-    size_t bpp = (img_ptr->maxval <= 255) ? 3 : 6;
+    size_t bpp = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
     size_t row_bytes = img_ptr->width * bpp;
 
     size_t new_stride = (row_bytes + alignment - 1) & ~(alignment - 1);
@@ -452,7 +1385,8 @@ int ppm_realign(PPM_ptr img_ptr, size_t alignment) {
     if (img_ptr->stride == new_stride)
         return 0;
 
-    data_t new_data = (data_t)malloc(new_stride + img_ptr->height);
+    size_t new_size = new_stride * img_ptr->height;
+    data_t new_data = (data_t)ppm_alloc(new_size);
 
     if (!new_data)
         return -1;
@@ -464,41 +1398,503 @@ int ppm_realign(PPM_ptr img_ptr, size_t alignment) {
         memcpy(dst_row, src_row, row_bytes);
     }
 
-    free(img_ptr->data);
+    ppm_release_data(img_ptr);
     img_ptr->data = new_data;
     img_ptr->stride = new_stride;
+    img_ptr->data_size = new_size;
+    img_ptr->alloc_size = new_size;
 
     return 0;
 }
 
 int ppm_is_contiguous(const PPM_ptr img_ptr) {
-    size_t bpp = (img_ptr->maxval <= 255) ? 3 : 6;
-    
+    size_t bpp = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+
+    if (img_ptr->layout != PPM_LAYOUT_ROWS)
+        return 0;
+
     return (img_ptr->stride == img_ptr->width*bpp);
 }
 
+/*
+ * CPU platform and features
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t xgetbv0(void) {
+    uint32_t eax, edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+uint32_t ppm_cpu_features(void) {
+    uint32_t features = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    if (edx & bit_SSE2)
+        features |= PPM_CPU_SSE2;
+    if (ecx & bit_SSSE3)
+        features |= PPM_CPU_SSSE3;
+    if (ecx & bit_SSE4_1)
+        features |= PPM_CPU_SSE41;
+
+    // The OS has to save the wide registers too, otherwise AVX faults
+    int os_avx = 0, os_avx512 = 0;
+    if (ecx & bit_OSXSAVE) {
+        uint64_t xcr0 = xgetbv0();
+        os_avx = (xcr0 & 0x06) == 0x06;                 // XMM | YMM
+        os_avx512 = os_avx && (xcr0 & 0xe0) == 0xe0;    // opmask | ZMM_Hi256 | Hi16_ZMM
+    }
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        if (os_avx && (ebx & bit_AVX2))
+            features |= PPM_CPU_AVX2;
+        if (os_avx512 && (ebx & bit_AVX512F))
+            features |= PPM_CPU_AVX512F;
+        if (os_avx512 && (ebx & bit_AVX512BW))
+            features |= PPM_CPU_AVX512BW;
+        if (os_avx512 && (ecx & bit_AVX512VBMI))
+            features |= PPM_CPU_AVX512VBMI;
+    }
+#elif defined(__aarch64__)
+    // Advanced SIMD is mandatory on AArch64
+    features |= PPM_CPU_NEON;
+#elif defined(__arm__) && defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+        features |= PPM_CPU_NEON;
+#endif
+
+    return features;
+}
+
+/*
+ * Select the backend for the bulk operations
+ * CACHEPIX_BACKEND pins a backend by name, as long as the CPU can run it
+ */
 void ppm_init(void)
 {
-    /* Default to scalar */
-    ops.scale   = ppm_scale_scalar;
-    ops.rgb_to_grayscale    = ppm_rgb_to_grayscale_scalar;
-    ops.convert_maxval = ppm_convert_maxval_scalar;
-
-#if defined(__AVX2__)
-    ops.scale   = ppm_scale_avx2;
-    ops.rgb_to_grayscale    = ppm_rgb_to_grayscale_avx2;
-    ops.convert_maxval = ppm_convert_maxval_avx2;
-
-#elif defined(__SSE2__)
-    ops.scale   = ppm_scale_sse2;
-    ops.rgb_to_grayscale    = ppm_rgb_to_grayscale_sse2;
-    ops.convert_maxval = ppm_convert_maxval_sse2;
-
-#elif defined(__ARM_NEON)
-    ops.scale   = ppm_scale_neon;
-    ops.rgb_to_grayscale    = ppm_rgb_to_grayscale_neon;
-    ops.convert_maxval = ppm_convert_maxval_neon;
-#endif
+    uint32_t features = ppm_cpu_features();
+    const char *pinned = getenv("CACHEPIX_BACKEND");
+
+    /* Scalar is last and always runnable */
+    size_t selected = N_BACKENDS - 1;
+    for (size_t i = 0; i < N_BACKENDS; i++) {
+        if ((backends[i].features & features) == backends[i].features) {
+            selected = i;
+            break;
+        }
+    }
+
+    if (pinned != NULL && *pinned != '\0') {
+        size_t i;
+        for (i = 0; i < N_BACKENDS; i++) {
+            if (strcmp(backends[i].name, pinned) == 0)
+                break;
+        }
+
+        if (i == N_BACKENDS) {
+            fprintf(stderr, "WARN: ppm_init: unknown backend '%s', using %s.\n", pinned, backends[selected].name);
+        } else if ((backends[i].features & features) != backends[i].features) {
+            fprintf(stderr, "WARN: ppm_init: backend '%s' not supported by this CPU, using %s.\n", pinned, backends[selected].name);
+        } else {
+            selected = i;
+        }
+    }
+
+    ops = backends[selected];
+
+    ppm_threads_init();
+}
+
+const char *ppm_backend(void) {
+    return ops.name;
+}
+
+const ppm_ops_t *ppm_ops(void) {
+    return &ops;
+}
+
+/*
+ * Row tiling for the thread pool
+ */
+typedef struct {
+    PPM_ptr dst_ptr, src_ptr;
+    uint32_t tile_rows;
+    float scale, bias;
+    uint16_t new_maxval;
+    const uint8_t *map;
+    data_t out_data;        // tiled depth change: tiles of the result
+    size_t out_stride;
+    ppm_cow_t cow;          // copy-on-write of the image being written
+    _Atomic int err;
+} tile_job_t;
+
+/*
+ * Rows per tile, or 0 if the image isn't worth splitting
+ * Tiled images always go tile by tile (the kernels only see row-major tiles)
+ * A shared image is split even on one thread, so that each tile is copied
+ * out of the shared buffer just before it's written
+ */
+static uint32_t tile_rows_for(const PPM_ptr img_ptr) {
+    if (img_ptr->layout == PPM_LAYOUT_TILED)
+        return PPM_TILE_PIXELS;
+
+    if ((ppm_get_threads() == 1 || img_ptr->data_size < PPM_PARALLEL_MIN_BYTES) && !ppm_is_shared(img_ptr))
+        return 0;
+
+    size_t rows = PPM_TILE_BYTES / img_ptr->stride;
+    if (rows == 0)
+        rows = 1;
+    if (rows >= img_ptr->height)
+        return 0;
+
+    return (uint32_t)rows;
+}
+
+/*
+ * Sub-image over the rows of one tile, sharing the parent's pixel buffer
+ * Tiled images are split along their own tiles instead
+ */
+PPM_img ppm_tile_band(const PPM_ptr img_ptr, uint32_t tile, uint32_t tile_rows) {
+    if (img_ptr->layout == PPM_LAYOUT_TILED) {
+        uint32_t tiles_x = ppm_tiles_x(img_ptr);
+        return ppm_tile(img_ptr, tile % tiles_x, tile / tiles_x);
+    }
+
+    PPM_img band = *img_ptr;
+    uint32_t y0 = tile*tile_rows;
+    uint32_t rows = img_ptr->height - y0;
+    if (rows > tile_rows)
+        rows = tile_rows;
+
+    band.height = rows;
+    band.data = img_ptr->data + (size_t)y0*img_ptr->stride;
+    band.data_size = ppm_data_size(band.width, rows, band.maxval, band.channels);
+    band.map_base = NULL;
+    band.map_size = 0;
+    band.alloc_size = 0;
+    band.shared = NULL;
+    band.parent = NULL;
+    band.parent_offset = 0;
+
+    return band;
+}
+
+/*
+ * Tiled layout
+ */
+size_t ppm_tile_bytes(uint16_t maxval, uint16_t channels) {
+    return (size_t)PPM_TILE_PIXELS*PPM_TILE_PIXELS*ppm_pixel_bytes(maxval, channels);
+}
+
+size_t ppm_tiled_data_size(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels) {
+    size_t tiles_x = (width + PPM_TILE_PIXELS - 1) / PPM_TILE_PIXELS;
+    size_t tiles_y = (height + PPM_TILE_PIXELS - 1) / PPM_TILE_PIXELS;
+    return tiles_x*tiles_y*ppm_tile_bytes(maxval, channels);
+}
+
+uint32_t ppm_tiles_x(const PPM_ptr img_ptr) {
+    return (img_ptr->width + PPM_TILE_PIXELS - 1) / PPM_TILE_PIXELS;
+}
+
+uint32_t ppm_tiles_y(const PPM_ptr img_ptr) {
+    return (img_ptr->height + PPM_TILE_PIXELS - 1) / PPM_TILE_PIXELS;
+}
+
+uint32_t ppm_tile_count(const PPM_ptr img_ptr) {
+    return ppm_tiles_x(img_ptr)*ppm_tiles_y(img_ptr);
+}
+
+int ppm_layout(const PPM_ptr img_ptr) {
+    return img_ptr->layout;
+}
+
+/*
+ * Tile (tx, ty) as a row-major image over the parent's buffer
+ * Edge tiles are narrower or shorter; out of range gives an image without data
+ */
+PPM_img ppm_tile(const PPM_ptr img_ptr, uint32_t tx, uint32_t ty) {
+    PPM_img tile = {0};
+    if (tx >= ppm_tiles_x(img_ptr) || ty >= ppm_tiles_y(img_ptr))
+        return tile;
+
+    tile = *img_ptr;
+    uint32_t x0 = tx*PPM_TILE_PIXELS;
+    uint32_t y0 = ty*PPM_TILE_PIXELS;
+    size_t bytes_per_pixel = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+
+    tile.width = img_ptr->width - x0;
+    if (tile.width > PPM_TILE_PIXELS)
+        tile.width = PPM_TILE_PIXELS;
+    tile.height = img_ptr->height - y0;
+    if (tile.height > PPM_TILE_PIXELS)
+        tile.height = PPM_TILE_PIXELS;
+
+    if (img_ptr->layout == PPM_LAYOUT_TILED)
+        tile.data = img_ptr->data + ((size_t)ty*ppm_tiles_x(img_ptr) + tx)*ppm_tile_bytes(img_ptr->maxval, img_ptr->channels);
+    else
+        tile.data = img_ptr->data + (size_t)y0*img_ptr->stride + x0*bytes_per_pixel;
+
+    tile.data_size = ppm_data_size(tile.width, tile.height, tile.maxval, tile.channels);
+    tile.map_base = NULL;
+    tile.map_size = 0;
+    tile.alloc_size = 0;
+    tile.shared = NULL;
+    tile.parent = NULL;
+    tile.parent_offset = 0;
+    tile.layout = PPM_LAYOUT_ROWS;
+
+    return tile;
+}
+
+/*
+ * Pixel (x, y) and the number of pixels stored after it in the same row
+ * (to the end of the row, or of the tile on tiled images)
+ */
+uint8_t *ppm_pixel_run(const PPM_img *img_ptr, uint32_t x, uint32_t y, uint32_t *run) {
+    size_t bytes_per_pixel = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+
+    if (img_ptr->layout == PPM_LAYOUT_TILED) {
+        PPM_img tile = ppm_tile((PPM_ptr)img_ptr, x / PPM_TILE_PIXELS, y / PPM_TILE_PIXELS);
+        uint32_t tx = x % PPM_TILE_PIXELS;
+        *run = tile.width - tx;
+        return (uint8_t *)tile.data + (y % PPM_TILE_PIXELS)*tile.stride + tx*bytes_per_pixel;
+    }
+
+    *run = img_ptr->width - x;
+    return (uint8_t *)img_ptr->data + (size_t)y*img_ptr->stride + x*bytes_per_pixel;
+}
+
+/*
+ * Regions of interest
+ * A view has the data_size its own rows would have, like a tile, so that
+ * it validates and the kernels see an ordinary image; only the stride
+ * tells it apart. It keeps its place in the image it was cut from (the
+ * parent of that one, for a view of a view), so that copy-on-write can
+ * follow the parent's buffer: see ppm_cow_write.
+ */
+PPM_img ppm_view(PPM_ptr img_ptr, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    PPM_img view = {0};
+    if (image_valid(img_ptr) < 0 || img_ptr->layout != PPM_LAYOUT_ROWS)
+        return view;
+
+    if (width == 0 || height == 0 || x >= img_ptr->width || y >= img_ptr->height ||
+            width > img_ptr->width - x || height > img_ptr->height - y)
+        return view;
+
+    size_t bytes_per_pixel = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+    PPM_ptr parent = (img_ptr->parent != NULL) ? img_ptr->parent : img_ptr;
+
+    view = *img_ptr;
+    view.width = width;
+    view.height = height;
+    view.data_size = ppm_data_size(width, height, img_ptr->maxval, img_ptr->channels);
+    view.map_base = NULL;
+    view.map_size = 0;
+    view.alloc_size = 0;
+    view.shared = NULL;
+    view.parent = parent;
+    view.parent_offset = img_ptr->parent_offset + (size_t)y*img_ptr->stride + x*bytes_per_pixel;
+    view.data = parent->data + view.parent_offset;
+
+    return view;
+}
+
+int ppm_paste(PPM_ptr dst_ptr, const PPM_ptr src_ptr, uint32_t x, uint32_t y) {
+    if (image_valid(dst_ptr) < 0 || ppm_validate(src_ptr) < 0)
+        return -1;
+
+    if (dst_ptr->maxval != src_ptr->maxval || dst_ptr->channels != src_ptr->channels)
+        return -2;
+
+    if (x >= dst_ptr->width || y >= dst_ptr->height ||
+            src_ptr->width > dst_ptr->width - x || src_ptr->height > dst_ptr->height - y)
+        return -1;
+
+    size_t offset, bytes;
+    rect_span(dst_ptr, x, y, src_ptr->width, src_ptr->height, &offset, &bytes);
+    if (ppm_cow_write(dst_ptr, offset, bytes) < 0)
+        return -1;
+
+    copy_pixels(dst_ptr, x, y, src_ptr);
+    return 0;
+}
+
+/*
+ * Copy one tile between a row-major image and a tiled one
+ */
+typedef struct {
+    PPM_ptr rows_ptr, tiled_ptr;
+    int to_tiled;
+} layout_job_t;
+
+static void layout_tile(void *ctx, uint32_t tile) {
+    layout_job_t *job = (layout_job_t *)ctx;
+    uint32_t tiles_x = ppm_tiles_x(job->rows_ptr);
+    PPM_img src = ppm_tile(job->rows_ptr, tile % tiles_x, tile / tiles_x);
+    PPM_img dst = ppm_tile(job->tiled_ptr, tile % tiles_x, tile / tiles_x);
+    size_t row_bytes = src.width*ppm_pixel_bytes(src.maxval, src.channels);
+
+    if (job->to_tiled) {
+        for (uint32_t y = 0; y < src.height; ++y)
+            memcpy(dst.data + y*dst.stride, src.data + y*src.stride, row_bytes);
+    } else {
+        for (uint32_t y = 0; y < src.height; ++y)
+            memcpy(src.data + y*src.stride, dst.data + y*dst.stride, row_bytes);
+    }
+}
+
+/*
+ * Convert an image between layouts, reallocating its buffer
+ */
+int ppm_set_layout(PPM_ptr img_ptr, int layout) {
+    if (ppm_validate(img_ptr) < 0 || !ppm_owns_data(img_ptr))
+        return -1;
+
+    if (layout == img_ptr->layout)
+        return 0;
+
+    PPM_ptr new_ptr = ppm_create_image(img_ptr->width, img_ptr->height, img_ptr->maxval, img_ptr->channels, layout);
+    if (new_ptr == NULL)
+        return -1;
+
+    layout_job_t job = {
+        .rows_ptr = (layout == PPM_LAYOUT_ROWS) ? new_ptr : img_ptr,
+        .tiled_ptr = (layout == PPM_LAYOUT_TILED) ? new_ptr : img_ptr,
+        .to_tiled = (layout == PPM_LAYOUT_TILED),
+    };
+
+    uint32_t count = ppm_tile_count(img_ptr);
+    if (ppm_get_threads() > 1 && img_ptr->data_size >= PPM_PARALLEL_MIN_BYTES) {
+        ppm_parallel_for(count, layout_tile, &job);
+    } else {
+        for (uint32_t tile = 0; tile < count; ++tile)
+            layout_tile(&job, tile);
+    }
+
+    ppm_release_data(img_ptr);
+    img_ptr->data = new_ptr->data;
+    img_ptr->stride = new_ptr->stride;
+    img_ptr->data_size = new_ptr->data_size;
+    img_ptr->alloc_size = new_ptr->alloc_size;
+    img_ptr->layout = layout;
+    free(new_ptr);
+
+    return 0;
+}
+
+static void scale_tile(void *ctx, uint32_t tile) {
+    tile_job_t *job = (tile_job_t *)ctx;
+    PPM_img band = ppm_tile_band(job->src_ptr, tile, job->tile_rows);
+
+    ppm_cow_band(&job->cow, job->src_ptr, &band);
+    int err = ops.scale(&band, job->scale, job->bias);
+    if (err != 0)
+        atomic_store(&job->err, err);
+}
+
+static void convert_maxval_tile(void *ctx, uint32_t tile) {
+    tile_job_t *job = (tile_job_t *)ctx;
+    PPM_img band = ppm_tile_band(job->src_ptr, tile, job->tile_rows);
+
+    ppm_cow_band(&job->cow, job->src_ptr, &band);
+    int err = ops.convert_maxval(&band, job->new_maxval);
+    if (err != 0)
+        atomic_store(&job->err, err);
+}
+
+/*
+ * Sample size change: the kernel leaves the band or tile in a buffer of its
+ * own, copied to its place in the new rows or tiles
+ */
+static void convert_depth_tile(void *ctx, uint32_t tile) {
+    tile_job_t *job = (tile_job_t *)ctx;
+    PPM_img band = ppm_tile_band(job->src_ptr, tile, job->tile_rows);
+    data_t src_rows = band.data;
+
+    int err = ops.convert_maxval(&band, job->new_maxval);
+    if (err != 0) {
+        atomic_store(&job->err, err);
+        if (band.data != src_rows)
+            ppm_release_data(&band);
+        return;
+    }
+
+    data_t out_rows = (job->src_ptr->layout == PPM_LAYOUT_TILED)
+                      ? job->out_data + (size_t)tile*ppm_tile_bytes(job->new_maxval, band.channels)
+                      : job->out_data + (size_t)tile*job->tile_rows*job->out_stride;
+    size_t row_bytes = band.width*ppm_pixel_bytes(job->new_maxval, band.channels);
+    for (uint32_t y = 0; y < band.height; ++y)
+        memcpy(out_rows + y*job->out_stride, band.data + y*band.stride, row_bytes);
+    ppm_release_data(&band);
+}
+
+static void lut_tile(void *ctx, uint32_t tile) {
+    tile_job_t *job = (tile_job_t *)ctx;
+    PPM_img band = ppm_tile_band(job->src_ptr, tile, job->tile_rows);
+
+    ppm_cow_band(&job->cow, job->src_ptr, &band);
+    int err = ops.apply_lut(&band, job->map);
+    if (err != 0)
+        atomic_store(&job->err, err);
+}
+
+static void grayscale_tile(void *ctx, uint32_t tile) {
+    tile_job_t *job = (tile_job_t *)ctx;
+    PPM_img src_band = ppm_tile_band(job->src_ptr, tile, job->tile_rows);
+    PPM_img dst_band = ppm_tile_band(job->dst_ptr, tile, job->tile_rows);
+
+    ppm_cow_band(&job->cow, job->dst_ptr, &dst_band);
+    int err = ops.rgb_to_grayscale(&dst_band, &src_band);
+    if (err != 0)
+        atomic_store(&job->err, err);
+}
+
+static uint32_t n_tiles(const PPM_ptr img_ptr, uint32_t tile_rows) {
+    if (img_ptr->layout == PPM_LAYOUT_TILED)
+        return ppm_tile_count(img_ptr);
+
+    return (img_ptr->height + tile_rows - 1) / tile_rows;
+}
+
+/*
+ * All tiles of a job, on the pool if the image is big enough to split
+ */
+static int run_tiles(const PPM_ptr img_ptr, uint32_t tile_rows, ppm_tile_fn fn, tile_job_t *job) {
+    uint32_t count = n_tiles(img_ptr, tile_rows);
+
+    if (ppm_get_threads() > 1 && img_ptr->data_size >= PPM_PARALLEL_MIN_BYTES && count > 1) {
+        ppm_parallel_for(count, fn, job);
+    } else {
+        for (uint32_t tile = 0; tile < count; ++tile)
+            fn(job, tile);
+    }
+
+    return atomic_load(&job->err);
+}
+
+/*
+ * Tiles of a job that writes img_ptr, which is split in tiles even when
+ * there is just one (the whole image) so that the tile functions only ever
+ * see bands; keep as in ppm_cow_begin
+ */
+static int run_writing(PPM_ptr img_ptr, ppm_tile_fn fn, tile_job_t *job, int keep) {
+    uint32_t tile_rows = tile_rows_for(img_ptr);
+    if (tile_rows == 0)
+        tile_rows = img_ptr->height;
+
+    if (ppm_cow_begin(img_ptr, &job->cow, keep) < 0)
+        return -1;
+
+    job->tile_rows = tile_rows;
+    int err = run_tiles(img_ptr, tile_rows, fn, job);
+    ppm_cow_end(img_ptr, &job->cow, err);
+    return err;
 }
 
 /*
@@ -507,14 +1903,162 @@ void ppm_init(void)
  *
  */
 
+/*
+ * Run a table over every sample of an 8-bit image, leaving maxval alone
+ */
+static int run_lut(PPM_ptr img_ptr, const uint8_t *map) {
+    tile_job_t job = { .src_ptr = img_ptr, .map = map };
+    return run_writing(img_ptr, lut_tile, &job, 1);
+}
+
+int ppm_apply_lut(PPM_ptr img_ptr, const PPM_lut *lut) {
+    if (ppm_validate(img_ptr) < 0 || lut == NULL || img_ptr->maxval > 255)
+        return -1;
+
+    if (img_ptr->maxval != lut->in_maxval)
+        return -2;
+
+    int err = run_lut(img_ptr, lut->map);
+    if (err != 0)
+        return err;
+
+    img_ptr->maxval = lut->maxval;
+    return 0;
+}
+
+/*
+ * 8-bit images only have 256 possible samples: backends whose table lookup
+ * beats their arithmetic kernels compile the operation into a table once
+ * instead of evaluating it per sample
+ */
 int ppm_scale(PPM_ptr img_ptr, float scale, float bias) {
-    return ops.scale(img_ptr, scale, bias);
+    if (ppm_validate(img_ptr) < 0)
+        return -1;
+
+    if (img_ptr->maxval <= 255 && ops.lut_8bit) {
+        PPM_lut lut;
+        ppm_lut_init(&lut, img_ptr->maxval);
+        ppm_lut_scale(&lut, scale, bias);
+        return ppm_apply_lut(img_ptr, &lut);
+    }
+
+    tile_job_t job = { .src_ptr = img_ptr, .scale = scale, .bias = bias };
+    return run_writing(img_ptr, scale_tile, &job, 1);
+}
+
+static int convert_depth_tiled(PPM_ptr img_ptr, uint16_t new_maxval) {
+    size_t new_size = ppm_tiled_data_size(img_ptr->width, img_ptr->height, new_maxval, img_ptr->channels);
+    data_t new_data = (data_t)ppm_alloc(new_size);
+    if (new_data == NULL)
+        return -1;
+
+    tile_job_t job = {
+        .src_ptr = img_ptr, .new_maxval = new_maxval, .out_data = new_data,
+        .out_stride = (size_t)PPM_TILE_PIXELS*ppm_pixel_bytes(new_maxval, img_ptr->channels),
+    };
+
+    int err = run_tiles(img_ptr, 0, convert_depth_tile, &job);
+    if (err != 0) {
+        ppm_dealloc(new_data, new_size);
+        return err;
+    }
+
+    ppm_release_data(img_ptr);
+    img_ptr->data = new_data;
+    img_ptr->stride = job.out_stride;
+    img_ptr->data_size = new_size;
+    img_ptr->alloc_size = new_size;
+    img_ptr->maxval = new_maxval;
+    return 0;
+}
+
+/*
+ * Sample size change on a row-major image: the bands are converted on the
+ * pool into the rows from ppm_convert_target. Images too small to split
+ * convert in one go, without the copy out of the band buffers.
+ */
+static int convert_depth_rows(PPM_ptr img_ptr, uint16_t new_maxval) {
+    uint32_t tile_rows = tile_rows_for(img_ptr);
+    if (ppm_get_threads() == 1 || img_ptr->data_size < PPM_PARALLEL_MIN_BYTES || tile_rows == 0)
+        return ops.convert_maxval(img_ptr, new_maxval);
+
+    size_t new_stride;
+    data_t new_data = ppm_convert_target(img_ptr, new_maxval, &new_stride);
+    if (new_data == NULL)
+        return -1;
+
+    tile_job_t job = {
+        .src_ptr = img_ptr, .tile_rows = tile_rows, .new_maxval = new_maxval,
+        .out_data = new_data, .out_stride = new_stride,
+    };
+
+    int err = run_tiles(img_ptr, tile_rows, convert_depth_tile, &job);
+    if (err != 0) {
+        ppm_dealloc(new_data, new_stride*img_ptr->height);
+        return err;
+    }
+
+    ppm_convert_commit(img_ptr, new_data, new_stride, new_maxval);
+    return 0;
 }
 
 int ppm_convert_maxval(PPM_ptr img_ptr, uint16_t new_maxval) {
-    return ops.convert_maxval(img_ptr, new_maxval);
+    if (ppm_validate(img_ptr) < 0 || new_maxval == 0)
+        return -1;
+
+    if (img_ptr->maxval <= 255 && new_maxval <= 255 && ops.lut_8bit) {
+        if (new_maxval == img_ptr->maxval)
+            return 0;
+
+        PPM_lut lut;
+        ppm_lut_init(&lut, img_ptr->maxval);
+        ppm_lut_convert(&lut, new_maxval);
+        return ppm_apply_lut(img_ptr, &lut);
+    }
+
+    // Changing the sample size reallocates the image (and only reads a shared
+    // buffer), so only same-size conversions are split, and views can't
+    int same_depth = (img_ptr->maxval <= 255) == (new_maxval <= 255);
+
+    if (!same_depth && !ppm_owns_data(img_ptr))
+        return -1;
+
+    if (!same_depth && img_ptr->layout == PPM_LAYOUT_TILED)
+        return convert_depth_tiled(img_ptr, new_maxval);
+
+    if (!same_depth)
+        return convert_depth_rows(img_ptr, new_maxval);
+
+    tile_job_t job = { .src_ptr = img_ptr, .new_maxval = new_maxval };
+    int err = run_writing(img_ptr, convert_maxval_tile, &job, 1);
+    if (err != 0)
+        return err;
+
+    img_ptr->maxval = new_maxval;
+    return 0;
 }
 
 int ppm_rgb_to_grayscale(PPM_ptr dst_ptr, PPM_ptr src_ptr) {
-    return ops.rgb_to_grayscale(dst_ptr, src_ptr);
+    if (ppm_validate(src_ptr) < 0 || ppm_validate(dst_ptr) < 0)
+        return -1;
+
+    // Tiles only line up between images of the same layout and size
+    if (dst_ptr->layout != src_ptr->layout)
+        return -1;
+    if (src_ptr->layout == PPM_LAYOUT_TILED &&
+            (dst_ptr->width != src_ptr->width || dst_ptr->height != src_ptr->height))
+        return -1;
+
+    // RGB in, RGB or gray out
+    if (src_ptr->channels != 3 || (dst_ptr->channels != 1 && dst_ptr->channels != 3))
+        return -1;
+
+    // Tiles of dst and src only match for equal sizes; the kernel rejects the others
+    if (dst_ptr->width != src_ptr->width || dst_ptr->height != src_ptr->height ||
+            dst_ptr->maxval != src_ptr->maxval)
+        return ops.rgb_to_grayscale(dst_ptr, src_ptr);
+
+    // Every sample of dst is overwritten, so a shared dst needs no copy unless it is also src
+    tile_job_t job = { .dst_ptr = dst_ptr, .src_ptr = src_ptr };
+    return run_writing(dst_ptr, grayscale_tile, &job, dst_ptr == src_ptr);
 }
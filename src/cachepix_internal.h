@@ -0,0 +1,276 @@
+#pragma once
+#include "cachepix.h"
+
+/*
+ * Library internals shared between the core and the backends
+ */
+
+/*
+ * Bytes of one pixel of these samples
+ */
+static inline size_t ppm_pixel_bytes(uint16_t maxval, uint16_t channels) {
+    return (size_t)channels*((maxval <= 255) ? 1 : 2);
+}
+
+/*
+ * Kernel specialization
+ * A kernel body is written once, as a PPM_SPECIALIZE function taking the
+ * sample size (is16) and channel count as arguments that are constants at
+ * every call. PPM_PIXEL_KINDS(X) expands X(kind, is16, channels) for each
+ * kind of pixel, so that a kernel instantiates its body once per kind with
+ * loops, strides and tails folded for it; ppm_pixel_kind indexes the table
+ * of instances in the same order. The kind is picked once per call and the
+ * loops don't branch on either.
+ */
+#define PPM_SPECIALIZE static inline __attribute__((always_inline))
+
+#define PPM_PIXEL_KINDS(X) \
+    X(u8x1,  0, 1) X(u8x2,  0, 2) X(u8x3,  0, 3) X(u8x4,  0, 4) \
+    X(u16x1, 1, 1) X(u16x2, 1, 2) X(u16x3, 1, 3) X(u16x4, 1, 4)
+
+#define PPM_PIXEL_KIND_COUNT (2*PPM_MAX_CHANNELS)
+
+static inline unsigned ppm_pixel_kind(uint16_t maxval, uint16_t channels) {
+    return ((maxval <= 255) ? 0u : PPM_MAX_CHANNELS) + channels - 1u;
+}
+
+/*
+ * Grayscale reads RGB and writes gray or RGB: PPM_GRAY_KINDS(X) expands
+ * X(kind, is16, out) for each sample size and output channel count, in the
+ * order ppm_gray_kind indexes them
+ */
+#define PPM_GRAY_KINDS(X) \
+    X(u8x1,  0, 1) X(u8x3,  0, 3) \
+    X(u16x1, 1, 1) X(u16x3, 1, 3)
+
+#define PPM_GRAY_KIND_COUNT 4
+
+static inline unsigned ppm_gray_kind(uint16_t maxval, uint16_t out) {
+    return ((maxval <= 255) ? 0u : 2u) + (out == 3);
+}
+
+/*
+ * Bytes of a row-major buffer of images with these samples, and a new
+ * image of any channels and layout
+ * PPM_img.data_size is 32-bit, so no whole-image buffer is allocated over
+ * PPM_DATA_SIZE_MAX; files are parsed and streamed at any size.
+ */
+#define PPM_DATA_SIZE_MAX ((size_t)UINT32_MAX)
+
+size_t ppm_data_size(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels);
+PPM_ptr ppm_create_image(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels, int layout);
+
+/*
+ * Release the pixel buffer of an image, whichever way it was obtained
+ * (heap allocation or file mapping). Leaves img_ptr->data NULL.
+ */
+void ppm_release_data(PPM_ptr img_ptr);
+
+/*
+ * Whether the image holds its buffer (allocation, mapping or a reference to
+ * a shared one); views, bands and tiles don't, and can't be reallocated
+ */
+int ppm_owns_data(const PPM_img *img_ptr);
+
+/*
+ * Copy-on-write (cow.c)
+ * ppm_cow_begin gets an image ready to be written: if its buffer is shared
+ * with other images it gets a private one, and with keep set each band has
+ * to be copied over with ppm_cow_band before it is written (the whole image
+ * counts as one band). Without keep the old samples are never read, for
+ * destinations that are overwritten whole. ppm_cow_end drops the shared
+ * buffer, or on err returns the image to it unchanged.
+ * Writes to part of an image call ppm_cow_write with the bytes of its buffer
+ * they cover instead, so that only those bands are copied; the others are
+ * copied when read: ppm_cow_read before reading some bytes, ppm_cow_sync for
+ * the whole image (ppm_validate does it).
+ * On a view all of these act on the parent's rows under it, and point the
+ * view at wherever the parent's buffer is now.
+ */
+typedef struct {
+    struct ppm_shared *shared;  // NULL: nothing to do
+    const char *src;            // rows to copy from, NULL without keep
+    size_t alloc_size;          // of the private buffer
+} ppm_cow_t;
+
+int ppm_cow_begin(PPM_ptr img_ptr, ppm_cow_t *cow, int keep);
+void ppm_cow_band(const ppm_cow_t *cow, const PPM_img *img_ptr, const PPM_img *band);
+void ppm_cow_end(PPM_ptr img_ptr, ppm_cow_t *cow, int err);
+void ppm_shared_drop(struct ppm_shared *shared);
+int ppm_cow_write(PPM_ptr img_ptr, size_t offset, size_t bytes);
+void ppm_cow_read(PPM_ptr img_ptr, size_t offset, size_t bytes);
+void ppm_cow_sync(PPM_ptr img_ptr);
+
+/*
+ * Destination rows for a maxval conversion: the image's own buffer when the
+ * sample size stays the same, a fresh one with the new stride otherwise
+ * ppm_convert_commit swaps it in (if needed) and sets the new maxval
+ */
+data_t ppm_convert_target(PPM_ptr img_ptr, uint16_t new_maxval, size_t *new_stride);
+void ppm_convert_commit(PPM_ptr img_ptr, data_t new_data, size_t new_stride, uint16_t new_maxval);
+
+/*
+ * Parse a PNM (P1 to P6) or PAM (P7) header at the start of file_buf
+ * Returns the offset of the first raster byte and fills width, height,
+ * maxval and channels, and format with the PPM_FORMAT_* of the magic
+ * number, or a negative integer if the header is invalid
+ * Only the first PPM_HEADER_MAX bytes are looked at: a header has to end
+ * within them (a page, room for any sensible comment). ppm_raster_size is
+ * what has to follow the header in the file: the exact size where the
+ * samples are stored as in memory or packed in bits, the least the text of
+ * a plain format can take otherwise.
+ */
+#define PPM_HEADER_MAX 4096
+
+int token_consume_header(PPM_ptr img_ptr, int *format, const char *file_buf, size_t file_size);
+size_t ppm_raster_size(const PPM_img *img_ptr, int format);
+
+/*
+ * PGM, PPM and PAM rasters are the image's rows without their padding, and
+ * are read and written in place; the others go through the codecs below
+ */
+static inline int ppm_format_direct(int format) {
+    return format == PPM_FORMAT_PGM || format == PPM_FORMAT_PPM || format == PPM_FORMAT_PAM;
+}
+
+/*
+ * Raster codecs for plain (text) formats and PBM bitmaps (formats.c)
+ * ppm_decode_raster fills the allocated rows of img_ptr from the size bytes
+ * of raster; returns -2 if they end before the last sample, -1 on a byte or
+ * sample a raster of that format can't have.
+ * ppm_encode_raster returns the raster of img_ptr in format as a malloc'ed
+ * buffer of *size bytes, NULL when out of memory.
+ */
+int ppm_decode_raster(PPM_ptr img_ptr, int format, const char *raster, size_t size);
+char *ppm_encode_raster(const PPM_img *img_ptr, int format, size_t *size);
+
+/*
+ * Returns 1 if the file is empty, 0 if it has content, -1 if it can't be stat'ed
+ */
+int file_empty(const char *path);
+
+/*
+ * Kernels of one backend; ppm_ops() returns the one ppm_init selected
+ */
+typedef struct {
+    const char *name;
+    uint32_t features;      // CPU features required to run this backend
+    int (*scale)(PPM_ptr, float, float);
+    int (*rgb_to_grayscale)(const PPM_ptr, PPM_ptr);
+    int (*convert_maxval)(PPM_ptr, uint16_t);
+    int (*apply_lut)(PPM_ptr, const uint8_t *);
+    int lut_8bit;           // 8-bit scale/convert_maxval are faster through apply_lut
+    int (*planar_unpack)(PPM_planar_ptr, const PPM_ptr);
+    int (*planar_pack)(PPM_ptr, const PPM_planar_ptr);
+    int (*planar_scale)(PPM_planar_ptr, float, float);
+    int (*planar_rgb_to_grayscale)(PPM_planar_ptr, const PPM_planar_ptr);
+    void (*convolve_h)(float *, const float *, size_t, const float *, uint32_t, uint32_t);
+    void (*convolve_v)(uint8_t *, const float *const *, size_t, const float *, uint32_t, uint16_t);
+    void (*resize_h)(uint8_t *, const uint8_t *, size_t, const int32_t *, const int16_t *, uint32_t, uint16_t, uint16_t);
+    void (*resize_v)(uint8_t *, const uint8_t *const *, size_t, const int16_t *, uint32_t, uint16_t);
+    int (*stats)(const PPM_ptr, PPM_stats *);
+    uint64_t (*text_mask)(const char *, uint64_t *);
+} ppm_ops_t;
+
+const ppm_ops_t *ppm_ops(void);
+
+/*
+ * Fraction bits of the resize weights; they sum to 1 << PPM_RESIZE_BITS
+ */
+#define PPM_RESIZE_BITS 14
+
+/*
+ * 8-bit scale in fixed point (lut.c)
+ * For v in [0, 255] the result is min(sat(sat(mulhi(v << 8, mul) + add) - sub)
+ * >> shift, maxval): x*scale + bias in units of 2^-shift, in 16-bit lanes.
+ * ppm_scale_fixed returns 1 and fills fx when the rounding of mul, add and
+ * sub plus the truncation of mulhi stay under half an LSB, so the result is
+ * within 1 of the float expression; 0 when the float path has to be used
+ * (negative, huge or non-finite scale, non-finite bias).
+ * All backends and ppm_lut_scale take the same path, so they still agree
+ * exactly with each other.
+ */
+typedef struct {
+    uint16_t mul;
+    uint16_t add;
+    uint16_t sub;
+    uint16_t shift;
+} ppm_scale_fixed_t;
+
+int ppm_scale_fixed(ppm_scale_fixed_t *fx, float scale, float bias);
+
+static inline uint8_t ppm_scale_fixed_u8(const ppm_scale_fixed_t *fx, uint8_t v, uint16_t maxval) {
+    uint32_t t = ((uint32_t)v*fx->mul) >> 8;
+    t += fx->add;
+    if (t > 0xFFFF)
+        t = 0xFFFF;
+    t = (t > fx->sub) ? t - fx->sub : 0;
+    t >>= fx->shift;
+    return (uint8_t)((t > maxval) ? maxval : t);
+}
+
+/*
+ * Row tiling: tiles are sized to stay in L2, and images under
+ * PPM_PARALLEL_MIN_BYTES run on one thread
+ * ppm_tile_band returns the sub-image over the rows of one tile, sharing
+ * the parent's pixel buffer
+ */
+#define PPM_TILE_BYTES          (256*1024)
+#define PPM_PARALLEL_MIN_BYTES  (1024*1024)
+
+PPM_img ppm_tile_band(const PPM_ptr img_ptr, uint32_t tile, uint32_t tile_rows);
+
+/*
+ * Tiled layout: bytes of one tile and of a whole tiled buffer
+ * On a tiled image ppm_tile_band ignores tile_rows and returns the tile of
+ * that index; ppm_tile_count is the number of tiles
+ */
+size_t ppm_tile_bytes(uint16_t maxval, uint16_t channels);
+size_t ppm_tiled_data_size(uint32_t width, uint32_t height, uint16_t maxval, uint16_t channels);
+uint32_t ppm_tile_count(const PPM_ptr img_ptr);
+
+/*
+ * Pixel (x, y) of either layout and, in run, how many pixels of its row are
+ * stored contiguously from there
+ */
+uint8_t *ppm_pixel_run(const PPM_img *img_ptr, uint32_t x, uint32_t y, uint32_t *run);
+
+/*
+ * Thread pool (threads.c)
+ * ppm_parallel_for runs fn once per tile index in [0, n_tiles) and returns
+ * once all of them are done
+ */
+typedef void (*ppm_tile_fn)(void *ctx, uint32_t tile);
+
+void ppm_parallel_for(uint32_t n_tiles, ppm_tile_fn fn, void *ctx);
+void ppm_threads_init(void);
+
+/*
+ * io_uring (uring.c)
+ * ppm_ring_open returns -1 where io_uring is unavailable (old kernel,
+ * seccomp, non-Linux builds); callers then use plain reads and writes.
+ * Requests complete with the byte count or -errno in res.
+ */
+enum {
+    PPM_RING_READ,
+    PPM_RING_READV,         // addr is an iovec array, len its length
+    PPM_RING_WRITE,
+};
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned to_submit;
+    void *sq_ring, *cq_ring, *sqes;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+} ppm_ring_t;
+
+int ppm_ring_open(ppm_ring_t *ring, unsigned entries);
+void ppm_ring_close(ppm_ring_t *ring);
+void ppm_ring_queue(ppm_ring_t *ring, int op, int fd, void *addr, uint32_t len,
+                    uint64_t offset, uint64_t user_data);
+int ppm_ring_submit_and_wait(ppm_ring_t *ring);
+int ppm_ring_reap(ppm_ring_t *ring, uint64_t *user_data, int32_t *res);
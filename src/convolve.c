@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Separable convolution
+ *
+ * The image is cut into blocks: bands of rows by slices of columns. A block
+ * runs the horizontal pass one source row at a time into a ring holding one
+ * float row per vertical tap, and the vertical pass combines the ring into
+ * each output row as soon as the rows it needs are in. Slices are narrow
+ * enough for the ring to stay in L2, so the intermediate rows never go back
+ * to memory and every source row is read once per block.
+ *
+ * Both passes accumulate tap by tap in the same order on every backend, so
+ * the results are bit-exact between them. The output goes to a new buffer
+ * that replaces the image's own once every block is done.
+ */
+
+#define CONV_BAND_ROWS  64
+
+typedef struct {
+    const PPM_img *src_ptr;
+    PPM_img *dst_ptr;
+    const PPM_kernel *kx, *ky;
+    uint32_t band_rows;
+    uint32_t slice_px;
+    uint32_t slices;
+    _Atomic int err;
+} conv_job_t;
+
+int ppm_kernel_init(PPM_kernel *kernel, const float *weights, uint32_t size) {
+    if (kernel == NULL || weights == NULL || size == 0 || size > PPM_KERNEL_MAX_SIZE || size % 2 == 0)
+        return -1;
+
+    kernel->size = size;
+    for (uint32_t k = 0; k < size; ++k)
+        kernel->weights[k] = weights[k];
+
+    return 0;
+}
+
+int ppm_kernel_box(PPM_kernel *kernel, uint32_t size) {
+    if (kernel == NULL || size == 0 || size > PPM_KERNEL_MAX_SIZE || size % 2 == 0)
+        return -1;
+
+    kernel->size = size;
+    for (uint32_t k = 0; k < size; ++k)
+        kernel->weights[k] = 1.0f / (float)size;
+
+    return 0;
+}
+
+int ppm_kernel_gaussian(PPM_kernel *kernel, float sigma) {
+    if (kernel == NULL || !(sigma > 0.0f))
+        return -1;
+
+    uint32_t radius = (uint32_t)ceilf(3.0f*sigma);
+    if (radius > PPM_KERNEL_MAX_SIZE/2)
+        radius = PPM_KERNEL_MAX_SIZE/2;
+
+    double sum = 0.0;
+    double w[PPM_KERNEL_MAX_SIZE];
+    for (uint32_t k = 0; k <= 2*radius; ++k) {
+        double x = (double)k - (double)radius;
+        w[k] = exp(-x*x / (2.0*(double)sigma*(double)sigma));
+        sum += w[k];
+    }
+
+    kernel->size = 2*radius + 1;
+    for (uint32_t k = 0; k < kernel->size; ++k)
+        kernel->weights[k] = (float)(w[k] / sum);
+
+    return 0;
+}
+
+static void widen(float *dst, const uint8_t *src, size_t n_samples, int is16) {
+    if (is16) {
+        for (size_t i = 0; i < n_samples; ++i)
+            dst[i] = (float)((src[i*2] << 8) | src[i*2+1]);
+    } else {
+        for (size_t i = 0; i < n_samples; ++i)
+            dst[i] = (float)src[i];
+    }
+}
+
+/*
+ * Samples of row y over pixels [x_begin, x_end) as floats, x clamped to the image
+ */
+static void load_row(float *dst, const PPM_img *img_ptr, uint32_t y, int64_t x_begin, int64_t x_end) {
+    const int is16 = img_ptr->maxval > 255;
+    const uint16_t channels = img_ptr->channels;
+    const int64_t width = img_ptr->width;
+    int64_t x = x_begin;
+
+    while (x < x_end) {
+        float *out = dst + (x - x_begin)*channels;
+        uint32_t run;
+
+        if (x < 0 || x >= width) {
+            widen(out, ppm_pixel_run(img_ptr, (x < 0) ? 0 : (uint32_t)(width - 1), y, &run), channels, is16);
+            x++;
+            continue;
+        }
+
+        const uint8_t *p = ppm_pixel_run(img_ptr, (uint32_t)x, y, &run);
+        int64_t n = (x_end - x < run) ? x_end - x : run;
+        widen(out, p, (size_t)n*channels, is16);
+        x += n;
+    }
+}
+
+static void conv_block(void *ctx, uint32_t block) {
+    conv_job_t *job = (conv_job_t *)ctx;
+    const ppm_ops_t *ops = ppm_ops();
+    const PPM_img *src_ptr = job->src_ptr;
+    const uint32_t taps_x = job->kx->size, taps_y = job->ky->size;
+    const int64_t rx = taps_x/2, ry = taps_y/2;
+    const uint16_t channels = src_ptr->channels;
+
+    uint32_t y0 = (block / job->slices)*job->band_rows;
+    uint32_t y1 = y0 + job->band_rows;
+    if (y1 > src_ptr->height)
+        y1 = src_ptr->height;
+    uint32_t x0 = (block % job->slices)*job->slice_px;
+    uint32_t x1 = x0 + job->slice_px;
+    if (x1 > src_ptr->width)
+        x1 = src_ptr->width;
+
+    // One padded source row, then the ring of filtered rows
+    size_t n_samples = (size_t)(x1 - x0)*channels;
+    size_t ring_stride = (n_samples + 15) & ~(size_t)15;
+    size_t padded = ((size_t)(x1 - x0) + taps_x - 1)*channels;
+    size_t bytes = (padded + ring_stride*taps_y)*sizeof(float);
+    float *scratch = (float *)ppm_alloc(bytes);
+    if (scratch == NULL) {
+        atomic_store(&job->err, -1);
+        return;
+    }
+    float *row = scratch;
+    float *ring = scratch + ((padded + 15) & ~(size_t)15);
+
+    // Source row j goes to slot (j + ry) % taps_y; rows above and below the image repeat the edge
+    int64_t next = (int64_t)y0 - ry;
+    const float *rows[PPM_KERNEL_MAX_SIZE];
+
+    for (uint32_t y = y0; y < y1; ++y) {
+        for (; next <= (int64_t)y + ry; ++next) {
+            int64_t sy = next < 0 ? 0 : next >= src_ptr->height ? src_ptr->height - 1 : next;
+            load_row(row, src_ptr, (uint32_t)sy, (int64_t)x0 - rx, (int64_t)x1 + rx);
+            ops->convolve_h(ring + ((next + ry) % taps_y)*ring_stride, row, n_samples,
+                            job->kx->weights, taps_x, channels);
+        }
+
+        // Output pixels go out in runs that are contiguous in the destination
+        for (uint32_t x = x0; x < x1; ) {
+            uint32_t run;
+            uint8_t *out = ppm_pixel_run(job->dst_ptr, x, y, &run);
+            if (run > x1 - x)
+                run = x1 - x;
+
+            for (uint32_t k = 0; k < taps_y; ++k)
+                rows[k] = ring + ((y + k) % taps_y)*ring_stride + (size_t)(x - x0)*channels;
+
+            ops->convolve_v(out, rows, (size_t)run*channels, job->ky->weights, taps_y, src_ptr->maxval);
+            x += run;
+        }
+    }
+
+    ppm_dealloc(scratch, bytes);
+}
+
+int ppm_convolve(PPM_ptr img_ptr, const PPM_kernel *kernel_x, const PPM_kernel *kernel_y) {
+    if (ppm_validate(img_ptr) < 0 || kernel_x == NULL || kernel_y == NULL)
+        return -1;
+
+    if (kernel_x->size == 0 || kernel_x->size > PPM_KERNEL_MAX_SIZE || kernel_x->size % 2 == 0 ||
+            kernel_y->size == 0 || kernel_y->size > PPM_KERNEL_MAX_SIZE || kernel_y->size % 2 == 0)
+        return -1;
+
+    PPM_ptr dst_ptr = ppm_create_image(img_ptr->width, img_ptr->height, img_ptr->maxval, img_ptr->channels, img_ptr->layout);
+    if (dst_ptr == NULL)
+        return -1;
+
+    int parallel = ppm_get_threads() > 1 && img_ptr->data_size >= PPM_PARALLEL_MIN_BYTES;
+
+    // Slices keep the ring in L2; bands only exist to feed the pool and each repeats taps_y - 1 rows
+    size_t slice_px = PPM_TILE_BYTES / ((size_t)kernel_y->size*img_ptr->channels*sizeof(float));
+    slice_px -= slice_px % PPM_TILE_PIXELS;
+    if (slice_px < PPM_TILE_PIXELS)
+        slice_px = PPM_TILE_PIXELS;
+    if (slice_px > img_ptr->width)
+        slice_px = img_ptr->width;
+
+    uint32_t band_rows = img_ptr->height;
+    if (parallel) {
+        band_rows = CONV_BAND_ROWS;
+        if (band_rows < 4*(kernel_y->size - 1))
+            band_rows = 4*(kernel_y->size - 1);
+    }
+
+    conv_job_t job = {
+        .src_ptr = img_ptr, .dst_ptr = dst_ptr, .kx = kernel_x, .ky = kernel_y,
+        .band_rows = band_rows, .slice_px = (uint32_t)slice_px,
+        .slices = (uint32_t)((img_ptr->width + slice_px - 1) / slice_px),
+    };
+    uint32_t count = job.slices*((img_ptr->height + band_rows - 1) / band_rows);
+
+    if (parallel && count > 1) {
+        ppm_parallel_for(count, conv_block, &job);
+    } else {
+        for (uint32_t block = 0; block < count; ++block)
+            conv_block(&job, block);
+    }
+
+    int err = atomic_load(&job.err);
+    if (err == 0 && !ppm_owns_data(img_ptr) && ppm_unshare(img_ptr) < 0)
+        err = -1;
+
+    if (err == 0 && !ppm_owns_data(img_ptr)) {
+        // A view keeps its place in the parent: the result goes back into its rows
+        size_t row_bytes = img_ptr->width*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+        for (uint32_t y = 0; y < img_ptr->height; ++y)
+            memcpy(img_ptr->data + y*img_ptr->stride, dst_ptr->data + y*dst_ptr->stride, row_bytes);
+    } else if (err == 0) {
+        ppm_release_data(img_ptr);
+        img_ptr->data = dst_ptr->data;
+        img_ptr->stride = dst_ptr->stride;
+        img_ptr->data_size = dst_ptr->data_size;
+        img_ptr->alloc_size = dst_ptr->alloc_size;
+        dst_ptr->data = NULL;
+        dst_ptr->alloc_size = 0;
+    }
+
+    ppm_free(dst_ptr);
+    return err;
+}
+
+int ppm_box_blur(PPM_ptr img_ptr, uint32_t size) {
+    PPM_kernel kernel;
+    if (ppm_kernel_box(&kernel, size) < 0)
+        return -1;
+
+    return ppm_convolve(img_ptr, &kernel, &kernel);
+}
+
+int ppm_gaussian_blur(PPM_ptr img_ptr, float sigma) {
+    PPM_kernel kernel;
+    if (ppm_kernel_gaussian(&kernel, sigma) < 0)
+        return -1;
+
+    return ppm_convolve(img_ptr, &kernel, &kernel);
+}
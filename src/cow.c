@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Copy-on-write pixel buffers
+ *
+ * The first ppm_clone of an image moves the ownership of its buffer (heap
+ * allocation or file mapping) into a refcounted ppm_shared; the image and
+ * its clones then all point at it, and whichever drops the last reference
+ * frees the buffer. A clone costs a struct and an atomic increment.
+ *
+ * Writers go through ppm_cow_begin. An image that is the last user of its
+ * buffer simply takes it back. Otherwise it gets a private buffer, and the
+ * operation copies each band or tile across with ppm_cow_band right before
+ * writing it, so the copy reads the shared rows while the kernel is about
+ * to pull the same lines into cache anyway, and an operation that fails
+ * part way hasn't copied more than it wrote. Destinations whose samples are
+ * all overwritten skip the copy.
+ *
+ * Writes to a few pixels (ppm_set_pixel, ppm_paste, views) go through
+ * ppm_cow_write instead, which copies only the bands they touch: the image
+ * gets a private buffer whose other bands are still in the shared one (its
+ * base), with a bitmap of those already copied. Reads fill in the bands
+ * they cover first (ppm_cow_read), and once every band is there the base is
+ * dropped. A band is a tile of a tiled image, or the rows of a row tile
+ * (about PPM_TILE_BYTES) of a row-major one.
+ */
+
+struct ppm_shared {
+    _Atomic uint32_t refs;
+    char *data;
+    size_t alloc_size;      // as in PPM_img: from the allocator, or
+    void *map_base;         // the file mapping backing data
+    size_t map_size;
+    struct ppm_shared *_Atomic base;    // bands not copied yet are still here, NULL once all are
+    pthread_mutex_t lock;   // held to copy bands from base
+    size_t band_bytes;
+    uint32_t n_bands, missing;
+    uint64_t *copied;       // bit per band already in data
+};
+
+static struct ppm_shared *shared_new(void) {
+    struct ppm_shared *shared = (struct ppm_shared *)malloc(sizeof(struct ppm_shared));
+    if (shared == NULL)
+        return NULL;
+
+    atomic_init(&shared->refs, 1);
+    atomic_init(&shared->base, NULL);
+    pthread_mutex_init(&shared->lock, NULL);
+    shared->copied = NULL;
+    return shared;
+}
+
+static void shared_free(struct ppm_shared *shared) {
+    struct ppm_shared *base = atomic_load(&shared->base);
+    if (base != NULL)
+        ppm_shared_drop(base);
+    free(shared->copied);
+    pthread_mutex_destroy(&shared->lock);
+    free(shared);
+}
+
+void ppm_shared_drop(struct ppm_shared *shared) {
+    if (atomic_fetch_sub(&shared->refs, 1) != 1)
+        return;
+
+    if (shared->map_base != NULL)
+        munmap(shared->map_base, shared->map_size);
+    else if (shared->alloc_size != 0)
+        ppm_dealloc(shared->data, shared->alloc_size);
+    shared_free(shared);
+}
+
+/*
+ * Copy the bands of [offset, offset + bytes) of the buffer that are still
+ * in the base; with all of them in, the base goes
+ */
+static void copy_bands(struct ppm_shared *shared, size_t data_size, size_t offset, size_t bytes) {
+    if (atomic_load(&shared->base) == NULL || bytes == 0)
+        return;
+
+    pthread_mutex_lock(&shared->lock);
+
+    struct ppm_shared *base = atomic_load(&shared->base);
+    if (base != NULL) {
+        uint32_t last = (uint32_t)((offset + bytes - 1) / shared->band_bytes);
+        if (last >= shared->n_bands)
+            last = shared->n_bands - 1;
+
+        for (uint32_t band = (uint32_t)(offset / shared->band_bytes); band <= last; ++band) {
+            uint64_t bit = (uint64_t)1 << (band % 64);
+            if (shared->copied[band / 64] & bit)
+                continue;
+
+            size_t start = (size_t)band*shared->band_bytes;
+            size_t n = (data_size - start < shared->band_bytes) ? data_size - start : shared->band_bytes;
+            memcpy(shared->data + start, base->data + start, n);
+            shared->copied[band / 64] |= bit;
+            shared->missing--;
+        }
+
+        if (shared->missing == 0) {
+            atomic_store(&shared->base, NULL);
+            ppm_shared_drop(base);
+            free(shared->copied);
+            shared->copied = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/*
+ * The image is the only user of its buffer again: it takes it back
+ */
+static void take_back(PPM_ptr img_ptr) {
+    struct ppm_shared *shared = img_ptr->shared;
+
+    img_ptr->alloc_size = shared->alloc_size;
+    img_ptr->map_base = shared->map_base;
+    img_ptr->map_size = shared->map_size;
+    img_ptr->shared = NULL;
+    shared_free(shared);
+}
+
+/*
+ * Bytes from the first pixel of the image to past its last one
+ */
+static size_t image_span(const PPM_img *img_ptr) {
+    if (img_ptr->layout == PPM_LAYOUT_TILED)
+        return img_ptr->data_size;
+
+    return (size_t)(img_ptr->height - 1)*img_ptr->stride +
+           img_ptr->width*ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+}
+
+/*
+ * Images that don't own their buffer (bands, tiles, images without data)
+ * have nothing to share; their clones alias the same rows, owning nothing
+ * either. The clone of a view is one more view of its parent.
+ */
+PPM_ptr ppm_clone(PPM_ptr src_ptr) {
+    if (src_ptr == NULL)
+        return NULL;
+
+    PPM_ptr dst_ptr = (PPM_ptr)malloc(sizeof(PPM_img));
+    if (dst_ptr == NULL)
+        return NULL;
+
+    // Clones share whole buffers only
+    ppm_cow_sync(src_ptr);
+
+    if (src_ptr->shared == NULL && ppm_owns_data(src_ptr)) {
+        struct ppm_shared *shared = shared_new();
+        if (shared == NULL) {
+            free(dst_ptr);
+            return NULL;
+        }
+
+        shared->data = src_ptr->data;
+        shared->alloc_size = src_ptr->alloc_size;
+        shared->map_base = src_ptr->map_base;
+        shared->map_size = src_ptr->map_size;
+
+        src_ptr->shared = shared;
+        src_ptr->alloc_size = 0;
+        src_ptr->map_base = NULL;
+        src_ptr->map_size = 0;
+    }
+
+    *dst_ptr = *src_ptr;
+    if (dst_ptr->shared != NULL)
+        atomic_fetch_add(&dst_ptr->shared->refs, 1);
+
+    return dst_ptr;
+}
+
+int ppm_is_shared(const PPM_ptr img_ptr) {
+    return img_ptr != NULL && img_ptr->shared != NULL && atomic_load(&img_ptr->shared->refs) > 1;
+}
+
+int ppm_cow_begin(PPM_ptr img_ptr, ppm_cow_t *cow, int keep) {
+    struct ppm_shared *shared = img_ptr->shared;
+    cow->shared = NULL;
+    cow->src = NULL;
+    cow->alloc_size = 0;
+
+    // The rest of the parent's rows under a view have to be kept either way
+    if (img_ptr->parent != NULL)
+        return ppm_cow_write(img_ptr, 0, image_span(img_ptr));
+
+    if (shared == NULL)
+        return 0;
+
+    // Nobody else left: the buffer is ours again, once the bands still in a
+    // base are in (unless they are about to be overwritten)
+    if (atomic_load(&shared->refs) == 1) {
+        if (keep)
+            copy_bands(shared, img_ptr->data_size, 0, img_ptr->data_size);
+        take_back(img_ptr);
+        return 0;
+    }
+
+    data_t data = (data_t)ppm_alloc(img_ptr->data_size);
+    if (data == NULL)
+        return -1;
+
+    cow->shared = shared;
+    cow->src = keep ? img_ptr->data : NULL;
+    cow->alloc_size = img_ptr->data_size;
+
+    img_ptr->data = data;
+    img_ptr->alloc_size = img_ptr->data_size;
+    img_ptr->shared = NULL;
+    return 0;
+}
+
+/*
+ * A band is a run of whole rows of a row-major image, or one tile of a
+ * tiled image (copied with its padding)
+ */
+void ppm_cow_band(const ppm_cow_t *cow, const PPM_img *img_ptr, const PPM_img *band) {
+    if (cow->src == NULL)
+        return;
+
+    size_t offset = (size_t)(band->data - img_ptr->data);
+    size_t bytes = (img_ptr->layout == PPM_LAYOUT_TILED) ? ppm_tile_bytes(img_ptr->maxval, img_ptr->channels)
+                                                         : (size_t)band->height*img_ptr->stride;
+    if (bytes > img_ptr->data_size - offset)
+        bytes = img_ptr->data_size - offset;
+
+    memcpy(band->data, cow->src + offset, bytes);
+}
+
+/*
+ * A failed operation goes back to the shared buffer, so the image is left
+ * as it was
+ */
+void ppm_cow_end(PPM_ptr img_ptr, ppm_cow_t *cow, int err) {
+    if (cow->shared == NULL)
+        return;
+
+    if (err != 0) {
+        ppm_dealloc(img_ptr->data, cow->alloc_size);
+        img_ptr->data = cow->shared->data;
+        img_ptr->alloc_size = 0;
+        img_ptr->shared = cow->shared;
+    } else {
+        ppm_shared_drop(cow->shared);
+    }
+
+    cow->shared = NULL;
+    cow->src = NULL;
+}
+
+/*
+ * A private buffer with just the bands of [offset, offset + bytes) copied
+ * from the shared one, which becomes its base
+ */
+static int share_partly(PPM_ptr img_ptr, size_t offset, size_t bytes) {
+    struct ppm_shared *partial = shared_new();
+    if (partial == NULL)
+        return -1;
+
+    size_t band_bytes = (img_ptr->layout == PPM_LAYOUT_TILED) ? ppm_tile_bytes(img_ptr->maxval, img_ptr->channels)
+                                                              : img_ptr->stride;
+    if (img_ptr->layout == PPM_LAYOUT_ROWS && band_bytes < PPM_TILE_BYTES)
+        band_bytes *= PPM_TILE_BYTES / band_bytes;
+
+    uint32_t n_bands = (uint32_t)((img_ptr->data_size + band_bytes - 1) / band_bytes);
+    partial->copied = (uint64_t *)calloc((n_bands + 63) / 64, sizeof(uint64_t));
+    partial->data = (data_t)ppm_alloc(img_ptr->data_size);
+    if (partial->copied == NULL || partial->data == NULL) {
+        if (partial->data != NULL)
+            ppm_dealloc(partial->data, img_ptr->data_size);
+        shared_free(partial);
+        return -1;
+    }
+
+    partial->alloc_size = img_ptr->data_size;
+    partial->map_base = NULL;
+    partial->map_size = 0;
+    partial->band_bytes = band_bytes;
+    partial->n_bands = n_bands;
+    partial->missing = n_bands;
+    atomic_store(&partial->base, img_ptr->shared);  // the image's reference
+
+    img_ptr->data = partial->data;
+    img_ptr->shared = partial;
+    copy_bands(partial, img_ptr->data_size, offset, bytes);
+    return 0;
+}
+
+/*
+ * A view works on its parent's buffer, which copy-on-write may have moved
+ * since the view last used it: it follows it there
+ */
+int ppm_cow_write(PPM_ptr img_ptr, size_t offset, size_t bytes) {
+    if (img_ptr->parent != NULL) {
+        int err = ppm_cow_write(img_ptr->parent, img_ptr->parent_offset + offset, bytes);
+        img_ptr->data = img_ptr->parent->data + img_ptr->parent_offset;
+        return err;
+    }
+
+    struct ppm_shared *shared = img_ptr->shared;
+    if (shared == NULL)
+        return 0;
+
+    if (atomic_load(&shared->refs) > 1)
+        return share_partly(img_ptr, offset, bytes);
+
+    copy_bands(shared, img_ptr->data_size, offset, bytes);
+    if (atomic_load(&shared->base) == NULL)
+        take_back(img_ptr);
+    return 0;
+}
+
+void ppm_cow_read(PPM_ptr img_ptr, size_t offset, size_t bytes) {
+    if (img_ptr->parent != NULL) {
+        ppm_cow_read(img_ptr->parent, img_ptr->parent_offset + offset, bytes);
+        img_ptr->data = img_ptr->parent->data + img_ptr->parent_offset;
+    } else if (img_ptr->shared != NULL) {
+        copy_bands(img_ptr->shared, img_ptr->data_size, offset, bytes);
+    }
+}
+
+void ppm_cow_sync(PPM_ptr img_ptr) {
+    if (img_ptr->data != NULL && img_ptr->height != 0)
+        ppm_cow_read(img_ptr, 0, image_span(img_ptr));
+}
+
+int ppm_unshare(PPM_ptr img_ptr) {
+    if (img_ptr == NULL)
+        return -1;
+
+    ppm_cow_t cow;
+    if (ppm_cow_begin(img_ptr, &cow, 1) < 0)
+        return -1;
+
+    if (cow.src != NULL)
+        memcpy(img_ptr->data, cow.src, img_ptr->data_size);
+
+    ppm_cow_end(img_ptr, &cow, 0);
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Raster codecs for the formats whose samples aren't stored as they are in
+ * memory: plain (ASCII) PBM, PGM and PPM, and PBM bitmaps
+ *
+ * Plain rasters are decimal numbers separated by whitespace, with comments
+ * running from '#' to the end of the line. The text is classified 64 bytes
+ * at a time by the backend's text_mask worker, into a bit mask of digits
+ * and one of bytes that are neither digits nor whitespace; the decoder then
+ * jumps from token to token with count-trailing-zeros instead of looking at
+ * every separator. A number split across two blocks carries over. Digits
+ * are accumulated one by one: samples are at most 5 digits long, so the
+ * work per digit is a multiply-add, and everything else is skipped in bulk.
+ *
+ * PBM stores 1 for black, the opposite of a 1-channel image of maxval 1.
+ */
+
+/*
+ * Samples out, row by row, into the rows of a freshly allocated image
+ */
+typedef struct {
+    uint8_t *row;
+    size_t stride;
+    size_t row_samples, i;  // samples per row, next one in the row
+    uint32_t rows_left;
+    uint16_t maxval;
+    int is16;
+} sample_sink_t;
+
+/*
+ * Store one sample; returns 1 once the image is full, -1 if the sample is
+ * out of range
+ */
+static inline int put_sample(sample_sink_t *sink, uint32_t v) {
+    if (v > sink->maxval)
+        return -1;
+
+    if (sink->is16) {
+        sink->row[2*sink->i] = (uint8_t)(v >> 8);
+        sink->row[2*sink->i + 1] = (uint8_t)v;
+    } else {
+        sink->row[sink->i] = (uint8_t)v;
+    }
+
+    if (++sink->i == sink->row_samples) {
+        sink->i = 0;
+        sink->row += sink->stride;
+        if (--sink->rows_left == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int decode_bits(PPM_ptr img_ptr, const char *raster, size_t size) {
+    size_t row_bytes = ((size_t)img_ptr->width + 7)/8;
+    if (size / row_bytes < img_ptr->height)
+        return -2;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *src = (const uint8_t *)raster + y*row_bytes;
+        uint8_t *dst = (uint8_t *)img_ptr->data + y*img_ptr->stride;
+
+        for (size_t x = 0; x < img_ptr->width; ++x)
+            dst[x] = (uint8_t)(~src[x >> 3] >> (7 - (x & 7)) & 1);
+    }
+
+    return 0;
+}
+
+int ppm_decode_raster(PPM_ptr img_ptr, int format, const char *raster, size_t size) {
+
+    if (format == PPM_FORMAT_PBM)
+        return decode_bits(img_ptr, raster, size);
+
+    sample_sink_t sink = {
+        .row = (uint8_t *)img_ptr->data,
+        .stride = img_ptr->stride,
+        .row_samples = (size_t)img_ptr->width*img_ptr->channels,
+        .rows_left = img_ptr->height,
+        .maxval = img_ptr->maxval,
+        .is16 = img_ptr->maxval > 255,
+    };
+
+    uint64_t (*text_mask)(const char *, uint64_t *) = ppm_ops()->text_mask;
+    const int bitmap = (format == PPM_FORMAT_PBM_PLAIN);
+    uint32_t value = 0;
+    int in_number = 0, in_comment = 0;
+    char pad[64];
+    int full;
+
+    for (size_t pos = 0; pos < size; pos += 64) {
+        const char *block = raster + pos;
+
+        // The last block is padded with whitespace
+        if (size - pos < 64) {
+            memcpy(pad, block, size - pos);
+            memset(pad + (size - pos), ' ', 64 - (size - pos));
+            block = pad;
+        }
+
+        uint64_t other;
+        uint64_t digits = text_mask(block, &other);
+        unsigned b = 0;
+
+        while (b < 64) {
+            if (in_comment) {
+                while (b < 64 && block[b] != '\n' && block[b] != '\r')
+                    b++;
+                if (b == 64)
+                    break;
+                in_comment = 0;
+                continue;
+            }
+
+            if (in_number) {
+                // The bits shifted in from the top end the run at 64 at the latest
+                uint64_t rest = ~(digits >> b);
+                unsigned run = (rest == 0) ? 64 : (unsigned)__builtin_ctzll(rest);
+
+                for (unsigned k = b; k < b + run; ++k) {
+                    value = value*10 + (uint32_t)(block[k] - '0');
+                    if (value > UINT16_MAX)
+                        value = UINT16_MAX + 1;     // sticky, and out of range for any maxval
+                }
+                b += run;
+                if (b == 64)
+                    break;
+
+                in_number = 0;
+                if ((full = put_sample(&sink, value)) != 0)
+                    return (full < 0) ? -1 : 0;
+                continue;
+            }
+
+            uint64_t next = (digits | other) >> b;
+            if (next == 0)
+                break;
+            b += (unsigned)__builtin_ctzll(next);
+
+            if ((other >> b) & 1) {
+                if (block[b] != '#')
+                    return -1;
+                in_comment = 1;
+                b++;
+            } else if (bitmap) {
+                // Plain PBM samples are single digits, not always separated
+                if ((full = put_sample(&sink, (uint32_t)('1' - block[b]))) != 0)
+                    return (full < 0) ? -1 : 0;
+                b++;
+            } else {
+                in_number = 1;
+                value = 0;
+            }
+        }
+    }
+
+    // A number that runs to the very end of the raster
+    if (in_number && (full = put_sample(&sink, value)) != 0)
+        return (full < 0) ? -1 : 0;
+
+    return -2;
+}
+
+/*
+ * Plain output keeps lines to 70 characters, as the format asks, and ends
+ * every row with a newline
+ */
+#define PLAIN_LINE_MAX 70
+
+static inline size_t format_sample(char *p, uint32_t v) {
+    char digits[5];
+    size_t n = 0;
+
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+
+    for (size_t k = 0; k < n; ++k)
+        p[k] = digits[n - 1 - k];
+    return n;
+}
+
+char *ppm_encode_raster(const PPM_img *img_ptr, int format, size_t *size) {
+
+    const size_t samples = (size_t)img_ptr->width*img_ptr->channels;
+    const int is16 = img_ptr->maxval > 255;
+
+    // Every sample and its separator, and a newline per row
+    size_t capacity = (format == PPM_FORMAT_PBM) ? ((size_t)img_ptr->width + 7)/8*img_ptr->height
+                                                 : (samples*6 + 1)*img_ptr->height;
+    char *buf = (char *)malloc(capacity);
+    if (buf == NULL)
+        return NULL;
+
+    char *p = buf;
+    for (uint32_t y = 0; y < img_ptr->height; ++y) {
+        size_t line = 0;
+        uint8_t bits = 0;
+        uint32_t x = 0;
+
+        while (x < img_ptr->width) {
+            uint32_t run;
+            const uint8_t *src = ppm_pixel_run(img_ptr, x, y, &run);
+
+            for (size_t i = 0; i < (size_t)run*img_ptr->channels; ++i) {
+                uint32_t v = is16 ? (uint32_t)((src[2*i] << 8) | src[2*i + 1]) : src[i];
+
+                if (format == PPM_FORMAT_PBM) {
+                    // One channel: i counts pixels
+                    bits = (uint8_t)(bits << 1 | (v == 0));
+                    if (((x + i) & 7) == 7)
+                        *p++ = (char)bits;
+                } else if (format == PPM_FORMAT_PBM_PLAIN) {
+                    if (line == PLAIN_LINE_MAX) {
+                        *p++ = '\n';
+                        line = 0;
+                    }
+                    *p++ = (v == 0) ? '1' : '0';
+                    line++;
+                } else {
+                    char digits[5];
+                    size_t n = format_sample(digits, v);
+                    if (line != 0 && line + 1 + n > PLAIN_LINE_MAX) {
+                        *p++ = '\n';
+                        line = 0;
+                    } else if (line != 0) {
+                        *p++ = ' ';
+                        line++;
+                    }
+                    memcpy(p, digits, n);
+                    p += n;
+                    line += n;
+                }
+            }
+            x += run;
+        }
+
+        if (format == PPM_FORMAT_PBM) {
+            if (img_ptr->width & 7)
+                *p++ = (char)(bits << (8 - (img_ptr->width & 7)));
+        } else {
+            *p++ = '\n';
+        }
+    }
+
+    *size = (size_t)(p - buf);
+    return buf;
+}
@@ -0,0 +1,126 @@
+#include <math.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Lookup table compiler for 8-bit point operations
+ *
+ * Every step maps the current output of the table, so chaining them composes
+ * the operations. All 256 entries are filled, including those above maxval,
+ * so that a table gives the same result as the per-sample operation on any
+ * input byte.
+ */
+
+int ppm_lut_init(PPM_lut *lut, uint16_t maxval) {
+    if (lut == NULL || maxval == 0 || maxval > 255)
+        return -1;
+
+    for (int v = 0; v < 256; ++v)
+        lut->map[v] = (uint8_t)v;
+
+    lut->in_maxval = maxval;
+    lut->maxval = maxval;
+    return 0;
+}
+
+/*
+ * Scale and bias in fixed point: the largest shift in [2, 8] that keeps
+ * scale << (8 + shift) in 16 bits. With at least 2 fraction bits the errors
+ * (1/2 on mul, 1 from mulhi's truncation, 1/2 on add or sub) stay under
+ * 2^(1 - shift) <= 1/2 LSB; adding and subtracting saturate at 0xFFFF, which
+ * >> shift is still >= 255, so the clamps come out the same as in float.
+ */
+int ppm_scale_fixed(ppm_scale_fixed_t *fx, float scale, float bias) {
+    *fx = (ppm_scale_fixed_t){ 0 };
+    if (!(scale >= 0.0f) || !(scale*1024.0f < 65535.5f) || !isfinite(bias))
+        return 0;
+
+    int shift = 8;
+    while (shift > 2 && scale*(float)(1 << (8 + shift)) >= 65535.5f)
+        shift--;
+
+    float b = fabsf(bias)*(float)(1 << shift);
+    uint16_t b16 = (b >= 65535.0f) ? 0xFFFF : (uint16_t)lrintf(b);
+
+    fx->mul = (uint16_t)lrintf(scale*(float)(1 << (8 + shift)));
+    fx->add = (bias >= 0.0f) ? b16 : 0;
+    fx->sub = (bias >= 0.0f) ? 0 : b16;
+    fx->shift = (uint16_t)shift;
+    return 1;
+}
+
+/*
+ * Same fixed-point or float expression and clamp as ppm_scale_scalar, so
+ * both agree exactly
+ */
+int ppm_lut_scale(PPM_lut *lut, float scale, float bias) {
+    if (lut == NULL)
+        return -1;
+
+    ppm_scale_fixed_t fx;
+    if (ppm_scale_fixed(&fx, scale, bias)) {
+        for (int v = 0; v < 256; ++v)
+            lut->map[v] = ppm_scale_fixed_u8(&fx, lut->map[v], lut->maxval);
+        return 0;
+    }
+
+    const float vmax = (float)lut->maxval;
+    for (int v = 0; v < 256; ++v) {
+        float f = lut->map[v]*scale + bias;
+        if (!(f > 0.0f))
+            f = 0.0f;
+        if (f > vmax)
+            f = vmax;
+        lut->map[v] = (uint8_t)f;
+    }
+
+    return 0;
+}
+
+int ppm_lut_convert(PPM_lut *lut, uint16_t new_maxval) {
+    if (lut == NULL || new_maxval == 0 || new_maxval > 255)
+        return -1;
+
+    const uint32_t old_maxval = lut->maxval;
+    for (int v = 0; v < 256; ++v) {
+        uint32_t r = (lut->map[v]*(uint32_t)new_maxval)/old_maxval;
+        lut->map[v] = (uint8_t)((r > new_maxval) ? new_maxval : r);
+    }
+
+    lut->maxval = new_maxval;
+    return 0;
+}
+
+/*
+ * v -> maxval * (v/maxval)^gamma, rounded to nearest
+ */
+int ppm_lut_gamma(PPM_lut *lut, float gamma) {
+    if (lut == NULL || !(gamma > 0.0f))
+        return -1;
+
+    const double vmax = (double)lut->maxval;
+    for (int v = 0; v < 256; ++v) {
+        double x = lut->map[v] / vmax;
+        if (x > 1.0)
+            x = 1.0;
+        lut->map[v] = (uint8_t)(vmax*pow(x, gamma) + 0.5);
+    }
+
+    return 0;
+}
+
+/*
+ * Arbitrary curve, results above maxval are clamped
+ */
+int ppm_lut_curve(PPM_lut *lut, ppm_curve_fn curve, void *ctx) {
+    if (lut == NULL || curve == NULL)
+        return -1;
+
+    for (int v = 0; v < 256; ++v) {
+        uint16_t r = curve(ctx, lut->map[v], lut->maxval);
+        lut->map[v] = (uint8_t)((r > lut->maxval) ? lut->maxval : r);
+    }
+
+    return 0;
+}
@@ -1,54 +1,126 @@
 #include "cachepix.h"
+#include "cachepix_internal.h"
 
 #if defined(__ARM_NEON)
 #include <arm_neon.h>
 
+static inline float clamp_sample(float v, float maxval) {
+    if (!(v > 0.0f))
+        v = 0.0f;
+    if (v > maxval)
+        v = maxval;
+    return v;
+}
+
+/*
+ * x*scale + bias on 4 u32 lanes, clamped to [0, maxval] and truncated
+ * NaN survives the min/max and converts to 0, like the scalar clamp
+ */
+static inline uint32x4_t scale4(uint32x4_t v, float32x4_t vscale, float32x4_t vbias, float32x4_t vmax) {
+    float32x4_t f = vaddq_f32(vmulq_f32(vcvtq_f32_u32(v), vscale), vbias);
+    f = vminq_f32(vmaxq_f32(f, vdupq_n_f32(0.0f)), vmax);
+    return vcvtq_u32_f32(f);
+}
+
+/*
+ * The fixed-point form of the 8-bit scale (see ppm_scale_fixed) on 16
+ * samples: (v*mul) >> 8 through a widening multiply, then 16-bit lanes
+ */
+static inline uint8x16_t scale16_u8_fixed(uint8x16_t v, uint16x4_t vmul, uint16x8_t vadd, uint16x8_t vsub,
+                                          int16x8_t vshift, uint16x8_t vmax) {
+    uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+    uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+
+    lo = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(lo), vmul), 8),
+                      vshrn_n_u32(vmull_u16(vget_high_u16(lo), vmul), 8));
+    hi = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(hi), vmul), 8),
+                      vshrn_n_u32(vmull_u16(vget_high_u16(hi), vmul), 8));
+
+    lo = vqsubq_u16(vqaddq_u16(lo, vadd), vsub);
+    hi = vqsubq_u16(vqaddq_u16(hi, vadd), vsub);
+
+    // a negative shift count shifts right
+    lo = vminq_u16(vshlq_u16(lo, vshift), vmax);
+    hi = vminq_u16(vshlq_u16(hi, vshift), vmax);
+
+    return vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+}
+
+static void scale_row8_fixed(uint8_t *row, size_t n_samples, const ppm_scale_fixed_t *fx, uint16_t maxval) {
+    uint16x4_t vmul  = vdup_n_u16(fx->mul);
+    uint16x8_t vadd  = vdupq_n_u16(fx->add);
+    uint16x8_t vsub  = vdupq_n_u16(fx->sub);
+    int16x8_t vshift = vdupq_n_s16((int16_t)-fx->shift);
+    uint16x8_t vmax  = vdupq_n_u16(maxval);
+
+    size_t i = 0;
+    for (; i + 16 <= n_samples; i += 16)
+        vst1q_u8(row + i, scale16_u8_fixed(vld1q_u8(row + i), vmul, vadd, vsub, vshift, vmax));
+
+    for (; i < n_samples; ++i)
+        row[i] = ppm_scale_fixed_u8(fx, row[i], maxval);
+}
+
 int ppm_scale_neon(PPM_ptr img_ptr, float scale, float bias)
 {
     if (ppm_validate(img_ptr) < 0)
         return -1;
 
-    const size_t row_bytes = img_ptr->width * 3;
+    const size_t n_samples = (size_t)img_ptr->width * img_ptr->channels;
+    const float maxval = (float)img_ptr->maxval;
 
     float32x4_t vscale = vdupq_n_f32(scale);
     float32x4_t vbias  = vdupq_n_f32(bias);
-    float32x4_t vzero  = vdupq_n_f32(0.0f);
-    float32x4_t vmax   = vdupq_n_f32(255.0f);
+    float32x4_t vmax   = vdupq_n_f32(maxval);
+
+    if (img_ptr->maxval > 255) {
+        for (size_t y = 0; y < img_ptr->height; ++y) {
+            uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
+
+            size_t i = 0;
+            for (; i + 8 <= n_samples; i += 8) {
+                // big-endian samples
+                uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(row + i*2)));
+
+                uint32x4_t lo = scale4(vmovl_u16(vget_low_u16(v)), vscale, vbias, vmax);
+                uint32x4_t hi = scale4(vmovl_u16(vget_high_u16(v)), vscale, vbias, vmax);
+
+                v = vcombine_u16(vmovn_u32(lo), vmovn_u32(hi));
+                vst1q_u8(row + i*2, vrev16q_u8(vreinterpretq_u8_u16(v)));
+            }
+
+            // scalar tail
+            for (; i < n_samples; ++i) {
+                uint16_t v = (uint16_t)((row[i*2] << 8) | row[i*2+1]);
+                uint16_t r = (uint16_t)clamp_sample(v * scale + bias, maxval);
+                row[i*2] = (uint8_t)(r >> 8);
+                row[i*2+1] = (uint8_t)r;
+            }
+        }
+        return 0;
+    }
+
+    ppm_scale_fixed_t fx;
+    if (ppm_scale_fixed(&fx, scale, bias)) {
+        for (size_t y = 0; y < img_ptr->height; ++y)
+            scale_row8_fixed((uint8_t*)img_ptr->data + y * img_ptr->stride, n_samples, &fx, img_ptr->maxval);
+        return 0;
+    }
 
     for (size_t y = 0; y < img_ptr->height; ++y) {
-        uint8_t *row = img_ptr->data + y * img_ptr->stride;
+        uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
 
         size_t i = 0;
-        for (; i + 16 <= row_bytes; i += 16) {
+        for (; i + 16 <= n_samples; i += 16) {
             uint8x16_t v = vld1q_u8(row + i);
 
             uint16x8_t lo16 = vmovl_u8(vget_low_u8(v));
             uint16x8_t hi16 = vmovl_u8(vget_high_u8(v));
 
-            uint32x4_t lo32a = vmovl_u16(vget_low_u16(lo16));
-            uint32x4_t lo32b = vmovl_u16(vget_high_u16(lo16));
-            uint32x4_t hi32a = vmovl_u16(vget_low_u16(hi16));
-            uint32x4_t hi32b = vmovl_u16(vget_high_u16(hi16));
-
-            float32x4_t f0 = vcvtq_f32_u32(lo32a);
-            float32x4_t f1 = vcvtq_f32_u32(lo32b);
-            float32x4_t f2 = vcvtq_f32_u32(hi32a);
-            float32x4_t f3 = vcvtq_f32_u32(hi32b);
-
-            f0 = vaddq_f32(vmulq_f32(f0, vscale), vbias);
-            f1 = vaddq_f32(vmulq_f32(f1, vscale), vbias);
-            f2 = vaddq_f32(vmulq_f32(f2, vscale), vbias);
-            f3 = vaddq_f32(vmulq_f32(f3, vscale), vbias);
-
-            f0 = vminq_f32(vmaxq_f32(f0, vzero), vmax);
-            f1 = vminq_f32(vmaxq_f32(f1, vzero), vmax);
-            f2 = vminq_f32(vmaxq_f32(f2, vzero), vmax);
-            f3 = vminq_f32(vmaxq_f32(f3, vzero), vmax);
-
-            lo32a = vcvtq_u32_f32(f0);
-            lo32b = vcvtq_u32_f32(f1);
-            hi32a = vcvtq_u32_f32(f2);
-            hi32b = vcvtq_u32_f32(f3);
+            uint32x4_t lo32a = scale4(vmovl_u16(vget_low_u16(lo16)), vscale, vbias, vmax);
+            uint32x4_t lo32b = scale4(vmovl_u16(vget_high_u16(lo16)), vscale, vbias, vmax);
+            uint32x4_t hi32a = scale4(vmovl_u16(vget_low_u16(hi16)), vscale, vbias, vmax);
+            uint32x4_t hi32b = scale4(vmovl_u16(vget_high_u16(hi16)), vscale, vbias, vmax);
 
             lo16 = vcombine_u16(vmovn_u32(lo32a), vmovn_u32(lo32b));
             hi16 = vcombine_u16(vmovn_u32(hi32a), vmovn_u32(hi32b));
@@ -59,128 +131,991 @@ int ppm_scale_neon(PPM_ptr img_ptr, float scale, float bias)
         }
 
         // scalar tail
-        for (; i < row_bytes; ++i) {
-            float v = row[i] * scale + bias;
-            if (v < 0) v = 0;
-            if (v > 255) v = 255;
-            row[i] = (uint8_t)v;
+        for (; i < n_samples; ++i)
+            row[i] = (uint8_t)clamp_sample(row[i] * scale + bias, maxval);
+    }
+
+    return 0;
+}
+
+/*
+ * Luma of the pixels in R, G, B: (299R + 587G + 114B)/1000, as u32 lanes
+ * sum/1000 == (sum/8)/125, divided by multiplying with a reciprocal
+ * t/125 == (t*33555)>>22 for t <= 31875 (8-bit sums), and
+ * t/125 == (t*8589935)>>30 for t < 2^23 (16-bit sums, widening multiply)
+ */
+static inline uint32x4_t luma8_u32(uint16x4_t r, uint16x4_t g, uint16x4_t b) {
+    uint32x4_t sum = vmull_n_u16(r, 299);
+    sum = vmlal_n_u16(sum, g, 587);
+    sum = vmlal_n_u16(sum, b, 114);
+    return vshrq_n_u32(vmulq_n_u32(vshrq_n_u32(sum, 3), 33555), 22);
+}
+
+static inline uint16x4_t luma16_u16(uint16x4_t r, uint16x4_t g, uint16x4_t b) {
+    const uint32x2_t magic = vdup_n_u32(8589935);
+
+    uint32x4_t sum = vmull_n_u16(r, 299);
+    sum = vmlal_n_u16(sum, g, 587);
+    sum = vmlal_n_u16(sum, b, 114);
+    uint32x4_t t = vshrq_n_u32(sum, 3);
+
+    uint32x2_t lo = vshrn_n_u64(vmull_u32(vget_low_u32(t), magic), 30);
+    uint32x2_t hi = vshrn_n_u64(vmull_u32(vget_high_u32(t), magic), 30);
+    return vmovn_u32(vcombine_u32(lo, hi));
+}
+
+/*
+ * Grayscale rows into out (1 or 3) channels, instantiated per sample size
+ * and out
+ */
+PPM_SPECIALIZE void grayscale_rows(PPM_ptr dst_ptr, const PPM_ptr src_ptr, const int is16, const size_t out)
+{
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        const uint8_t *s = (const uint8_t*)src_ptr->data + y * src_ptr->stride;
+        uint8_t *d = (uint8_t*)dst_ptr->data + y * dst_ptr->stride;
+
+        size_t x = 0;
+        if (is16) {
+            // 8 pixels at a time, deinterleaved by vld3
+            for (; x + 8 <= src_ptr->width; x += 8) {
+                uint16x8x3_t px = vld3q_u16((const uint16_t*)(s + x*6));
+                uint16x8_t r = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(px.val[0])));
+                uint16x8_t g = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(px.val[1])));
+                uint16x8_t b = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(px.val[2])));
+
+                uint16x8_t Y = vcombine_u16(
+                    luma16_u16(vget_low_u16(r), vget_low_u16(g), vget_low_u16(b)),
+                    luma16_u16(vget_high_u16(r), vget_high_u16(g), vget_high_u16(b)));
+                Y = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(Y)));
+
+                if (out == 1) {
+                    vst1q_u16((uint16_t*)(d + x*2), Y);
+                    continue;
+                }
+                px.val[0] = px.val[1] = px.val[2] = Y;
+                vst3q_u16((uint16_t*)(d + x*6), px);
+            }
+        } else {
+            // 16 pixels at a time, deinterleaved by vld3
+            for (; x + 16 <= src_ptr->width; x += 16) {
+                uint8x16x3_t px = vld3q_u8(s + x*3);
+                uint16x8_t r0 = vmovl_u8(vget_low_u8(px.val[0]));
+                uint16x8_t r1 = vmovl_u8(vget_high_u8(px.val[0]));
+                uint16x8_t g0 = vmovl_u8(vget_low_u8(px.val[1]));
+                uint16x8_t g1 = vmovl_u8(vget_high_u8(px.val[1]));
+                uint16x8_t b0 = vmovl_u8(vget_low_u8(px.val[2]));
+                uint16x8_t b1 = vmovl_u8(vget_high_u8(px.val[2]));
+
+                uint16x8_t y0 = vcombine_u16(
+                    vmovn_u32(luma8_u32(vget_low_u16(r0), vget_low_u16(g0), vget_low_u16(b0))),
+                    vmovn_u32(luma8_u32(vget_high_u16(r0), vget_high_u16(g0), vget_high_u16(b0))));
+                uint16x8_t y1 = vcombine_u16(
+                    vmovn_u32(luma8_u32(vget_low_u16(r1), vget_low_u16(g1), vget_low_u16(b1))),
+                    vmovn_u32(luma8_u32(vget_high_u16(r1), vget_high_u16(g1), vget_high_u16(b1))));
+
+                uint8x16_t Y = vcombine_u8(vmovn_u16(y0), vmovn_u16(y1));
+                if (out == 1) {
+                    vst1q_u8(d + x, Y);
+                    continue;
+                }
+                px.val[0] = px.val[1] = px.val[2] = Y;
+                vst3q_u8(d + x*3, px);
+            }
+        }
+
+        // scalar tail
+        for (; x < src_ptr->width; ++x) {
+            uint32_t R, G, B;
+            if (is16) {
+                const uint8_t *p = s + x*6;
+                R = (uint32_t)((p[0] << 8) | p[1]);
+                G = (uint32_t)((p[2] << 8) | p[3]);
+                B = (uint32_t)((p[4] << 8) | p[5]);
+            } else {
+                R = s[x*3 + 0];
+                G = s[x*3 + 1];
+                B = s[x*3 + 2];
+            }
+
+            uint32_t Yv = (299*R + 587*G + 114*B)/1000;
+
+            if (is16) {
+                uint8_t *q = d + x*2*out;
+                q[0] = (uint8_t)(Yv >> 8);
+                q[1] = (uint8_t)Yv;
+                if (out == 3) {
+                    q[2] = q[4] = q[0];
+                    q[3] = q[5] = q[1];
+                }
+            } else {
+                uint8_t *q = d + x*out;
+                q[0] = (uint8_t)Yv;
+                if (out == 3)
+                    q[1] = q[2] = q[0];
+            }
         }
     }
+}
+
+typedef void (*grayscale_fn)(PPM_ptr, const PPM_ptr);
+
+#define GRAYSCALE_KIND(kind, is16, out) \
+    static void grayscale_##kind(PPM_ptr dst_ptr, const PPM_ptr src_ptr) { \
+        grayscale_rows(dst_ptr, src_ptr, is16, out); \
+    }
+PPM_GRAY_KINDS(GRAYSCALE_KIND)
+#undef GRAYSCALE_KIND
+
+#define GRAYSCALE_ENTRY(kind, is16, out) grayscale_##kind,
+static const grayscale_fn grayscale_kinds[PPM_GRAY_KIND_COUNT] = { PPM_GRAY_KINDS(GRAYSCALE_ENTRY) };
+#undef GRAYSCALE_ENTRY
+
+int ppm_rgb_to_grayscale_neon(PPM_ptr dst_ptr, const PPM_ptr src_ptr)
+{
+    if (ppm_validate(src_ptr) < 0 || ppm_validate(dst_ptr) < 0)
+        return -1;
+
+    if (dst_ptr->width != src_ptr->width ||
+            dst_ptr->height != src_ptr->height ||
+            dst_ptr->maxval != src_ptr->maxval ||
+            src_ptr->channels != 3 ||
+            (dst_ptr->channels != 1 && dst_ptr->channels != 3)) {
+        return -2;
+    }
+
+    grayscale_kinds[ppm_gray_kind(src_ptr->maxval, dst_ptr->channels)](dst_ptr, src_ptr);
 
     return 0;
 }
 
-int ppm_rgb_to_grayscale_neon(PPM_ptr dst, const PPM_ptr src)
+#if defined(__aarch64__)
+
+/*
+ * floor(v * new_maxval / old_maxval), capped at new_maxval, for 4 u32 lanes
+ * With an 8-bit side the product is below 2^24, exact in float, and the
+ * correctly rounded quotient floors to the integer one. 16 -> 16 uses doubles.
+ */
+static inline uint32x4_t convert4_f32(uint32x4_t v, float32x4_t vnew, float32x4_t vold) {
+    float32x4_t q = vdivq_f32(vmulq_f32(vcvtq_f32_u32(v), vnew), vold);
+    return vcvtq_u32_f32(vminq_f32(q, vnew));
+}
+
+static inline uint32x4_t convert4_f64(uint32x4_t v, float64x2_t vnew, float64x2_t vold) {
+    float64x2_t lo = vcvtq_f64_u64(vmovl_u32(vget_low_u32(v)));
+    float64x2_t hi = vcvtq_f64_u64(vmovl_u32(vget_high_u32(v)));
+
+    lo = vminq_f64(vdivq_f64(vmulq_f64(lo, vnew), vold), vnew);
+    hi = vminq_f64(vdivq_f64(vmulq_f64(hi, vnew), vold), vnew);
+
+    return vcombine_u32(vmovn_u64(vcvtq_u64_f64(lo)), vmovn_u64(vcvtq_u64_f64(hi)));
+}
+
+int ppm_convert_maxval_neon(PPM_ptr img_ptr, uint16_t new_maxval)
 {
-    if (ppm_validate(src) < 0 || ppm_validate(dst) < 0) 
+    if (ppm_validate(img_ptr) < 0 || new_maxval == 0)
         return -1;
 
-    float32x4_t wR = vdupq_n_f32(0.299f);
-    float32x4_t wG = vdupq_n_f32(0.587f);
-    float32x4_t wB = vdupq_n_f32(0.114f);
+    uint16_t old_maxval = img_ptr->maxval;
+    if (new_maxval == old_maxval)
+        return 0;
 
-    for (size_t y = 0; y < src->height; ++y) {
-        uint8_t *s = src->data + y * src->stride;
-        uint8_t *d = dst->data + y * dst->stride;
+    int old16 = old_maxval > 255;
+    int new16 = new_maxval > 255;
 
-        size_t x = 0;
-        for (; x + 8 <= src->width; x += 8) {
-            uint8_t r[8], g[8], b[8];
+    size_t new_stride;
+    data_t new_data = ppm_convert_target(img_ptr, new_maxval, &new_stride);
+    if (!new_data)
+        return -1;
+
+    const float32x4_t vnew = vdupq_n_f32((float)new_maxval);
+    const float32x4_t vold = vdupq_n_f32((float)old_maxval);
+    const float64x2_t vnew_d = vdupq_n_f64((double)new_maxval);
+    const float64x2_t vold_d = vdupq_n_f64((double)old_maxval);
+    const size_t n_samples = (size_t)img_ptr->width * img_ptr->channels;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *src = (const uint8_t*)img_ptr->data + y * img_ptr->stride;
+        uint8_t *dst = (uint8_t*)new_data + y * new_stride;
 
-            for (int i = 0; i < 8; ++i) {
-                r[i] = s[(x+i)*3 + 0];
-                g[i] = s[(x+i)*3 + 1];
-                b[i] = s[(x+i)*3 + 2];
+        // 8 samples per iteration, as u16 lanes
+        size_t i = 0;
+        for (; i + 8 <= n_samples; i += 8) {
+            uint16x8_t v = old16 ? vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + i*2)))
+                                 : vmovl_u8(vld1_u8(src + i));
+            uint32x4_t lo = vmovl_u16(vget_low_u16(v));
+            uint32x4_t hi = vmovl_u16(vget_high_u16(v));
+
+            if (old16 && new16) {
+                lo = convert4_f64(lo, vnew_d, vold_d);
+                hi = convert4_f64(hi, vnew_d, vold_d);
+            } else {
+                lo = convert4_f32(lo, vnew, vold);
+                hi = convert4_f32(hi, vnew, vold);
+            }
+
+            uint16x8_t r = vcombine_u16(vmovn_u32(lo), vmovn_u32(hi));
+            if (new16)
+                vst1q_u8(dst + i*2, vrev16q_u8(vreinterpretq_u8_u16(r)));
+            else
+                vst1_u8(dst + i, vmovn_u16(r));
+        }
+
+        // scalar tail
+        for (; i < n_samples; ++i) {
+            uint32_t v = old16 ? (uint32_t)((src[i*2] << 8) | src[i*2+1]) : src[i];
+            uint32_t r = (v*new_maxval)/old_maxval;
+            if (r > new_maxval)
+                r = new_maxval;
+
+            if (new16) {
+                dst[i*2] = (uint8_t)(r >> 8);
+                dst[i*2+1] = (uint8_t)r;
+            } else {
+                dst[i] = (uint8_t)r;
             }
+        }
+    }
+
+    ppm_convert_commit(img_ptr, new_data, new_stride, new_maxval);
+    return 0;
+}
+
+#else
+
+/*
+ * ARMv7 NEON has no vector divide; the exact quotient needs one,
+ * so 32-bit ARM converts on the scalar path
+ */
+int ppm_convert_maxval_neon(PPM_ptr img_ptr, uint16_t new_maxval)
+{
+    return ppm_convert_maxval_scalar(img_ptr, new_maxval);
+}
+
+#endif
 
-            uint16x8_t r16 = vmovl_u8(vld1_u8(r));
-            uint16x8_t g16 = vmovl_u8(vld1_u8(g));
-            uint16x8_t b16 = vmovl_u8(vld1_u8(b));
 
-            float32x4_t r0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(r16)));
-            float32x4_t r1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(r16)));
-            float32x4_t g0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(g16)));
-            float32x4_t g1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(g16)));
-            float32x4_t b0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(b16)));
-            float32x4_t b1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(b16)));
+#if defined(__aarch64__)
 
-            float32x4_t y0 = vaddq_f32(
-                                vaddq_f32(vmulq_f32(r0, wR),
-                                          vmulq_f32(g0, wG)),
-                                vmulq_f32(b0, wB));
+/*
+ * 256-entry table lookup, 16 samples per iteration
+ * vqtbl4q covers 64 entries and yields 0 out of range; vqtbx4q keeps the
+ * previous result instead, so four lookups on v, v-64, v-128 and v-192
+ * each fill in their quarter of the table.
+ */
+int ppm_apply_lut_neon(PPM_ptr img_ptr, const uint8_t *map)
+{
+    if (ppm_validate(img_ptr) < 0 || img_ptr->maxval > 255)
+        return -1;
+
+    uint8x16x4_t t[4];
+    for (int q = 0; q < 4; ++q) {
+        for (int k = 0; k < 4; ++k)
+            t[q].val[k] = vld1q_u8(map + 64*q + 16*k);
+    }
+
+    const uint8x16_t step = vdupq_n_u8(64);
+    const size_t n_samples = (size_t)img_ptr->width * img_ptr->channels;
 
-            float32x4_t y1 = vaddq_f32(
-                                vaddq_f32(vmulq_f32(r1, wR),
-                                          vmulq_f32(g1, wG)),
-                                vmulq_f32(b1, wB));
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
 
-            uint16x8_t y16 = vcombine_u16(
-                vmovn_u32(vcvtq_u32_f32(y0)),
-                vmovn_u32(vcvtq_u32_f32(y1))
-            );
+        size_t i = 0;
+        for (; i + 16 <= n_samples; i += 16) {
+            uint8x16_t v = vld1q_u8(row + i);
 
-            vst1_u8(d + x, vmovn_u16(y16));
+            uint8x16_t r = vqtbl4q_u8(t[0], v);
+            v = vsubq_u8(v, step);
+            r = vqtbx4q_u8(r, t[1], v);
+            v = vsubq_u8(v, step);
+            r = vqtbx4q_u8(r, t[2], v);
+            v = vsubq_u8(v, step);
+            r = vqtbx4q_u8(r, t[3], v);
+
+            vst1q_u8(row + i, r);
         }
 
-        for (; x < src->width; ++x) {
-            uint8_t R = s[x*3];
-            uint8_t G = s[x*3+1];
-            uint8_t B = s[x*3+2];
-            d[x] = (uint8_t)(0.299f*R + 0.587f*G + 0.114f*B);
+        // scalar tail
+        for (; i < n_samples; ++i)
+            row[i] = map[row[i]];
+    }
+
+    return 0;
+}
+
+#else
+
+/*
+ * ARMv7 only has 32-entry vtbl lookups, a plain table walk is as fast
+ */
+int ppm_apply_lut_neon(PPM_ptr img_ptr, const uint8_t *map)
+{
+    return ppm_apply_lut_scalar(img_ptr, map);
+}
+
+#endif
+
+/*
+ * Planar images: vld3/vst3 (de)interleave in one instruction, and the
+ * planes themselves need nothing but vertical arithmetic
+ */
+static inline uint16x8_t bswap16x8(uint16x8_t v) {
+    return vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v)));
+}
+
+static int planar_matches(const PPM_ptr img_ptr, const PPM_planar_ptr planar) {
+    return img_ptr->channels == 3 &&
+           img_ptr->width == planar->width &&
+           img_ptr->height == planar->height &&
+           img_ptr->maxval == planar->maxval;
+}
+
+int ppm_planar_unpack_neon(PPM_planar_ptr dst, const PPM_ptr src_ptr)
+{
+    if (ppm_validate(src_ptr) < 0 || ppm_planar_validate(dst) < 0)
+        return -1;
+
+    if (!planar_matches(src_ptr, dst))
+        return -2;
+
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        const uint8_t *s = (const uint8_t*)src_ptr->data + y * src_ptr->stride;
+        uint8_t *r = (uint8_t*)dst->planes[0] + y * dst->stride;
+        uint8_t *g = (uint8_t*)dst->planes[1] + y * dst->stride;
+        uint8_t *b = (uint8_t*)dst->planes[2] + y * dst->stride;
+
+        size_t x = 0;
+        if (src_ptr->maxval > 255) {
+            uint16_t *r16 = (uint16_t*)r, *g16 = (uint16_t*)g, *b16 = (uint16_t*)b;
+
+            for (; x + 8 <= src_ptr->width; x += 8) {
+                uint16x8x3_t px = vld3q_u16((const uint16_t*)(s + x*6));
+                vst1q_u16(r16 + x, bswap16x8(px.val[0]));
+                vst1q_u16(g16 + x, bswap16x8(px.val[1]));
+                vst1q_u16(b16 + x, bswap16x8(px.val[2]));
+            }
+
+            for (; x < src_ptr->width; ++x) {
+                const uint8_t *p = s + x*6;
+                r16[x] = (uint16_t)((p[0] << 8) | p[1]);
+                g16[x] = (uint16_t)((p[2] << 8) | p[3]);
+                b16[x] = (uint16_t)((p[4] << 8) | p[5]);
+            }
+        } else {
+            for (; x + 16 <= src_ptr->width; x += 16) {
+                uint8x16x3_t px = vld3q_u8(s + x*3);
+                vst1q_u8(r + x, px.val[0]);
+                vst1q_u8(g + x, px.val[1]);
+                vst1q_u8(b + x, px.val[2]);
+            }
+
+            for (; x < src_ptr->width; ++x) {
+                r[x] = s[x*3];
+                g[x] = s[x*3 + 1];
+                b[x] = s[x*3 + 2];
+            }
         }
     }
 
     return 0;
 }
 
-int ppm_convert_maxval_neon(PPM_ptr img_ptr, uint16_t new_maxval)
+int ppm_planar_pack_neon(PPM_ptr dst_ptr, const PPM_planar_ptr src)
 {
-    if (ppm_validate(img_ptr) < 0) 
+    if (ppm_validate(dst_ptr) < 0 || ppm_planar_validate(src) < 0)
         return -1;
 
-    float scale = (float)new_maxval / (float)img_ptr->maxval;
+    if (!planar_matches(dst_ptr, src))
+        return -2;
+
+    for (size_t y = 0; y < dst_ptr->height; ++y) {
+        uint8_t *d = (uint8_t*)dst_ptr->data + y * dst_ptr->stride;
+        const uint8_t *r = (const uint8_t*)src->planes[0] + y * src->stride;
+        const uint8_t *g = (const uint8_t*)src->planes[1] + y * src->stride;
+        const uint8_t *b = (const uint8_t*)src->planes[2] + y * src->stride;
+
+        size_t x = 0;
+        if (dst_ptr->maxval > 255) {
+            const uint16_t *r16 = (const uint16_t*)r, *g16 = (const uint16_t*)g, *b16 = (const uint16_t*)b;
+
+            for (; x + 8 <= dst_ptr->width; x += 8) {
+                uint16x8x3_t px;
+                px.val[0] = bswap16x8(vld1q_u16(r16 + x));
+                px.val[1] = bswap16x8(vld1q_u16(g16 + x));
+                px.val[2] = bswap16x8(vld1q_u16(b16 + x));
+                vst3q_u16((uint16_t*)(d + x*6), px);
+            }
+
+            for (; x < dst_ptr->width; ++x) {
+                uint8_t *q = d + x*6;
+                q[0] = (uint8_t)(r16[x] >> 8);
+                q[1] = (uint8_t)r16[x];
+                q[2] = (uint8_t)(g16[x] >> 8);
+                q[3] = (uint8_t)g16[x];
+                q[4] = (uint8_t)(b16[x] >> 8);
+                q[5] = (uint8_t)b16[x];
+            }
+        } else {
+            for (; x + 16 <= dst_ptr->width; x += 16) {
+                uint8x16x3_t px;
+                px.val[0] = vld1q_u8(r + x);
+                px.val[1] = vld1q_u8(g + x);
+                px.val[2] = vld1q_u8(b + x);
+                vst3q_u8(d + x*3, px);
+            }
+
+            for (; x < dst_ptr->width; ++x) {
+                d[x*3] = r[x];
+                d[x*3 + 1] = g[x];
+                d[x*3 + 2] = b[x];
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_scale_neon(PPM_planar_ptr planar, float scale, float bias)
+{
+    if (ppm_planar_validate(planar) < 0)
+        return -1;
+
+    const float maxval = (float)planar->maxval;
     float32x4_t vscale = vdupq_n_f32(scale);
-    float32x4_t vmax   = vdupq_n_f32((float)new_maxval);
+    float32x4_t vbias  = vdupq_n_f32(bias);
+    float32x4_t vmax   = vdupq_n_f32(maxval);
+    ppm_scale_fixed_t fx;
+    int fixed = planar->maxval <= 255 && ppm_scale_fixed(&fx, scale, bias);
+
+    for (int c = 0; c < 3; ++c) {
+        for (size_t y = 0; y < planar->height; ++y) {
+            uint8_t *row = (uint8_t*)planar->planes[c] + y * planar->stride;
+
+            size_t x = 0;
+            if (fixed) {
+                scale_row8_fixed(row, planar->width, &fx, planar->maxval);
+            } else if (planar->maxval > 255) {
+                uint16_t *p = (uint16_t*)row;
+                for (; x + 8 <= planar->width; x += 8) {
+                    uint16x8_t v = vld1q_u16(p + x);
+
+                    uint32x4_t lo = scale4(vmovl_u16(vget_low_u16(v)), vscale, vbias, vmax);
+                    uint32x4_t hi = scale4(vmovl_u16(vget_high_u16(v)), vscale, vbias, vmax);
+
+                    vst1q_u16(p + x, vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+                }
+
+                for (; x < planar->width; ++x)
+                    p[x] = (uint16_t)clamp_sample(p[x] * scale + bias, maxval);
+            } else {
+                for (; x + 16 <= planar->width; x += 16) {
+                    uint8x16_t v = vld1q_u8(row + x);
+
+                    uint16x8_t lo16 = vmovl_u8(vget_low_u8(v));
+                    uint16x8_t hi16 = vmovl_u8(vget_high_u8(v));
+
+                    uint32x4_t lo32a = scale4(vmovl_u16(vget_low_u16(lo16)), vscale, vbias, vmax);
+                    uint32x4_t lo32b = scale4(vmovl_u16(vget_high_u16(lo16)), vscale, vbias, vmax);
+                    uint32x4_t hi32a = scale4(vmovl_u16(vget_low_u16(hi16)), vscale, vbias, vmax);
+                    uint32x4_t hi32b = scale4(vmovl_u16(vget_high_u16(hi16)), vscale, vbias, vmax);
+
+                    lo16 = vcombine_u16(vmovn_u32(lo32a), vmovn_u32(lo32b));
+                    hi16 = vcombine_u16(vmovn_u32(hi32a), vmovn_u32(hi32b));
+
+                    vst1q_u8(row + x, vcombine_u8(vmovn_u16(lo16), vmovn_u16(hi16)));
+                }
+
+                for (; x < planar->width; ++x)
+                    row[x] = (uint8_t)clamp_sample(row[x] * scale + bias, maxval);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_rgb_to_grayscale_neon(PPM_planar_ptr dst, const PPM_planar_ptr src)
+{
+    if (ppm_planar_validate(dst) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (dst->width != src->width ||
+            dst->height != src->height ||
+            dst->maxval != src->maxval) {
+        return -2;
+    }
+
+    const int is16 = src->maxval > 255;
+
+    for (size_t y = 0; y < src->height; ++y) {
+        const uint8_t *r = (const uint8_t*)src->planes[0] + y * src->stride;
+        const uint8_t *g = (const uint8_t*)src->planes[1] + y * src->stride;
+        const uint8_t *b = (const uint8_t*)src->planes[2] + y * src->stride;
+        uint8_t *d0 = (uint8_t*)dst->planes[0] + y * dst->stride;
+        uint8_t *d1 = (uint8_t*)dst->planes[1] + y * dst->stride;
+        uint8_t *d2 = (uint8_t*)dst->planes[2] + y * dst->stride;
+
+        size_t x = 0;
+        if (is16) {
+            for (; x + 8 <= src->width; x += 8) {
+                uint16x8_t R = vld1q_u16((const uint16_t*)r + x);
+                uint16x8_t G = vld1q_u16((const uint16_t*)g + x);
+                uint16x8_t B = vld1q_u16((const uint16_t*)b + x);
+
+                uint16x8_t Y = vcombine_u16(
+                    luma16_u16(vget_low_u16(R), vget_low_u16(G), vget_low_u16(B)),
+                    luma16_u16(vget_high_u16(R), vget_high_u16(G), vget_high_u16(B)));
+
+                vst1q_u16((uint16_t*)d0 + x, Y);
+                vst1q_u16((uint16_t*)d1 + x, Y);
+                vst1q_u16((uint16_t*)d2 + x, Y);
+            }
+        } else {
+            for (; x + 16 <= src->width; x += 16) {
+                uint8x16_t R = vld1q_u8(r + x);
+                uint8x16_t G = vld1q_u8(g + x);
+                uint8x16_t B = vld1q_u8(b + x);
+                uint16x8_t r0 = vmovl_u8(vget_low_u8(R));
+                uint16x8_t r1 = vmovl_u8(vget_high_u8(R));
+                uint16x8_t g0 = vmovl_u8(vget_low_u8(G));
+                uint16x8_t g1 = vmovl_u8(vget_high_u8(G));
+                uint16x8_t b0 = vmovl_u8(vget_low_u8(B));
+                uint16x8_t b1 = vmovl_u8(vget_high_u8(B));
+
+                uint16x8_t y0 = vcombine_u16(
+                    vmovn_u32(luma8_u32(vget_low_u16(r0), vget_low_u16(g0), vget_low_u16(b0))),
+                    vmovn_u32(luma8_u32(vget_high_u16(r0), vget_high_u16(g0), vget_high_u16(b0))));
+                uint16x8_t y1 = vcombine_u16(
+                    vmovn_u32(luma8_u32(vget_low_u16(r1), vget_low_u16(g1), vget_low_u16(b1))),
+                    vmovn_u32(luma8_u32(vget_high_u16(r1), vget_high_u16(g1), vget_high_u16(b1))));
+
+                uint8x16_t Y = vcombine_u8(vmovn_u16(y0), vmovn_u16(y1));
+                vst1q_u8(d0 + x, Y);
+                vst1q_u8(d1 + x, Y);
+                vst1q_u8(d2 + x, Y);
+            }
+        }
+
+        // scalar tail
+        for (; x < src->width; ++x) {
+            uint32_t R, G, B;
+            if (is16) {
+                R = ((const uint16_t*)r)[x];
+                G = ((const uint16_t*)g)[x];
+                B = ((const uint16_t*)b)[x];
+            } else {
+                R = r[x];
+                G = g[x];
+                B = b[x];
+            }
+
+            uint32_t Yv = (299*R + 587*G + 114*B)/1000;
+
+            if (is16) {
+                ((uint16_t*)d0)[x] = ((uint16_t*)d1)[x] = ((uint16_t*)d2)[x] = (uint16_t)Yv;
+            } else {
+                d0[x] = d1[x] = d2[x] = (uint8_t)Yv;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Convolution, 16 samples per iteration in four independent accumulators
+ * Separate multiplies and adds (vmla may fuse) keep every lane's taps in
+ * the scalar loop's order and rounding
+ */
+void ppm_convolve_h_neon(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        float32x4_t w = vdupq_n_f32(weights[0]);
+        float32x4_t a0 = vmulq_f32(w, vld1q_f32(src + i));
+        float32x4_t a1 = vmulq_f32(w, vld1q_f32(src + i + 4));
+        float32x4_t a2 = vmulq_f32(w, vld1q_f32(src + i + 8));
+        float32x4_t a3 = vmulq_f32(w, vld1q_f32(src + i + 12));
+
+        for (uint32_t k = 1; k < taps; ++k) {
+            const float *p = src + i + k*step;
+            w = vdupq_n_f32(weights[k]);
+            a0 = vaddq_f32(a0, vmulq_f32(w, vld1q_f32(p)));
+            a1 = vaddq_f32(a1, vmulq_f32(w, vld1q_f32(p + 4)));
+            a2 = vaddq_f32(a2, vmulq_f32(w, vld1q_f32(p + 8)));
+            a3 = vaddq_f32(a3, vmulq_f32(w, vld1q_f32(p + 12)));
+        }
+
+        vst1q_f32(dst + i, a0);
+        vst1q_f32(dst + i + 4, a1);
+        vst1q_f32(dst + i + 8, a2);
+        vst1q_f32(dst + i + 12, a3);
+    }
+
+    for (; i < n; ++i) {
+        float acc = weights[0]*src[i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*src[i + k*step];
+        dst[i] = acc;
+    }
+}
+
+/*
+ * Round to nearest, clamp to [0, maxval] and truncate, narrowed to u16
+ */
+static inline uint16x4_t round_sample(float32x4_t acc, float32x4_t vmax) {
+    float32x4_t f = vaddq_f32(acc, vdupq_n_f32(0.5f));
+    f = vminq_f32(vmaxq_f32(f, vdupq_n_f32(0.0f)), vmax);
+    return vmovn_u32(vcvtq_u32_f32(f));
+}
+
+void ppm_convolve_v_neon(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval)
+{
+    const float32x4_t vmax = vdupq_n_f32((float)maxval);
+    const int is16 = maxval > 255;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        float32x4_t w = vdupq_n_f32(weights[0]);
+        float32x4_t a0 = vmulq_f32(w, vld1q_f32(rows[0] + i));
+        float32x4_t a1 = vmulq_f32(w, vld1q_f32(rows[0] + i + 4));
+        float32x4_t a2 = vmulq_f32(w, vld1q_f32(rows[0] + i + 8));
+        float32x4_t a3 = vmulq_f32(w, vld1q_f32(rows[0] + i + 12));
+
+        for (uint32_t k = 1; k < taps; ++k) {
+            const float *p = rows[k] + i;
+            w = vdupq_n_f32(weights[k]);
+            a0 = vaddq_f32(a0, vmulq_f32(w, vld1q_f32(p)));
+            a1 = vaddq_f32(a1, vmulq_f32(w, vld1q_f32(p + 4)));
+            a2 = vaddq_f32(a2, vmulq_f32(w, vld1q_f32(p + 8)));
+            a3 = vaddq_f32(a3, vmulq_f32(w, vld1q_f32(p + 12)));
+        }
+
+        uint16x8_t lo = vcombine_u16(round_sample(a0, vmax), round_sample(a1, vmax));
+        uint16x8_t hi = vcombine_u16(round_sample(a2, vmax), round_sample(a3, vmax));
+
+        if (is16) {
+            vst1q_u8(dst + i*2, vrev16q_u8(vreinterpretq_u8_u16(lo)));
+            vst1q_u8(dst + i*2 + 16, vrev16q_u8(vreinterpretq_u8_u16(hi)));
+        } else {
+            vst1q_u8(dst + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+        }
+    }
+
+    for (; i < n; ++i) {
+        float acc = weights[0]*rows[0][i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*rows[k][i];
+
+        uint16_t v = (uint16_t)clamp_sample(acc + 0.5f, (float)maxval);
+        if (is16) {
+            dst[i*2] = (uint8_t)(v >> 8);
+            dst[i*2+1] = (uint8_t)v;
+        } else {
+            dst[i] = (uint8_t)v;
+        }
+    }
+}
+
+/*
+ * Resize, 8-bit samples; 16-bit ones take the scalar kernels
+ * Horizontal: one output pixel at a time, two taps per step, each tap's
+ * [R, G, B] multiplied into the four accumulator lanes
+ */
+static inline uint16x4_t round_fixed(int32x4_t acc) {
+    return vqmovun_s32(vrshrq_n_s32(acc, PPM_RESIZE_BITS));
+}
+
+void ppm_resize_h_neon(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels)
+{
+    if (maxval > 255 || channels != 3) {
+        ppm_resize_h_scalar(dst, src, n, start, weights, taps, maxval, channels);
+        return;
+    }
+
+    const uint8x8_t vmax = vdup_n_u8((uint8_t)maxval);
+
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t *s = src + (size_t)start[i]*3;
+        const int16_t *w = weights + i*taps;
+        int32x4_t acc = vdupq_n_s32(0);
+
+        for (uint32_t k = 0; k < taps; k += 2) {
+            int16x8_t px = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(s + k*3)));
+            acc = vmlal_n_s16(acc, vget_low_s16(px), w[k]);
+            acc = vmlal_n_s16(acc, vget_low_s16(vextq_s16(px, px, 3)), w[k + 1]);
+        }
+
+        uint16x4_t v = round_fixed(acc);
+        uint8x8_t rgb = vmin_u8(vqmovn_u16(vcombine_u16(v, v)), vmax);
+        dst[i*3] = vget_lane_u8(rgb, 0);
+        dst[i*3 + 1] = vget_lane_u8(rgb, 1);
+        dst[i*3 + 2] = vget_lane_u8(rgb, 2);
+    }
+}
+
+void ppm_resize_v_neon(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval)
+{
+    if (maxval > 255) {
+        ppm_resize_v_scalar(dst, rows, n, weights, taps, maxval);
+        return;
+    }
+
+    const uint8x16_t vmax = vdupq_n_u8((uint8_t)maxval);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        int32x4_t a0 = vdupq_n_s32(0), a1 = a0, a2 = a0, a3 = a0;
+
+        for (uint32_t k = 0; k < taps; ++k) {
+            uint8x16_t v = vld1q_u8(rows[k] + i);
+            int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+            int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+            a0 = vmlal_n_s16(a0, vget_low_s16(lo), weights[k]);
+            a1 = vmlal_n_s16(a1, vget_high_s16(lo), weights[k]);
+            a2 = vmlal_n_s16(a2, vget_low_s16(hi), weights[k]);
+            a3 = vmlal_n_s16(a3, vget_high_s16(hi), weights[k]);
+        }
+
+        uint8x8_t lo = vqmovn_u16(vcombine_u16(round_fixed(a0), round_fixed(a1)));
+        uint8x8_t hi = vqmovn_u16(vcombine_u16(round_fixed(a2), round_fixed(a3)));
+        vst1q_u8(dst + i, vminq_u8(vcombine_u8(lo, hi), vmax));
+    }
+
+    for (; i < n; ++i) {
+        int32_t acc = 1 << (PPM_RESIZE_BITS - 1);
+        for (uint32_t k = 0; k < taps; ++k)
+            acc += weights[k]*rows[k][i];
+
+        acc >>= PPM_RESIZE_BITS;
+        dst[i] = (uint8_t)((acc < 0) ? 0 : (acc > maxval) ? maxval : acc);
+    }
+}
+
+/*
+ * Statistics
+ * vld3 deinterleaves and pairwise add-accumulate widens as it sums. 8-bit
+ * sums gather in 16-bit lanes and squares, from vmull_u8, in 32-bit lanes;
+ * both move to 64 bits every STATS_FLUSH_8 blocks (128*2*255 < 2^16,
+ * 128*4*255^2 < 2^32). 16-bit sums gather in 32-bit lanes for
+ * STATS_FLUSH_16 blocks (16384*2*65535 < 2^32) and squares, from
+ * vmull_u16, go straight to 64 bits.
+ */
+#define STATS_FLUSH_8   128
+#define STATS_FLUSH_16  16384
+
+typedef struct {
+    uint16_t lo[3], hi[3];
+    uint64_t sum[3], sum_sq[3];
+} stats_acc_t;
+
+static void stats_tail(stats_acc_t *acc, const uint8_t *row, size_t i, size_t width, int is16) {
+    for (; i < width; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            size_t o = i*3 + c;
+            uint32_t v = is16 ? (uint32_t)((row[o*2] << 8) | row[o*2 + 1]) : row[o];
+            if (v < acc->lo[c])
+                acc->lo[c] = (uint16_t)v;
+            if (v > acc->hi[c])
+                acc->hi[c] = (uint16_t)v;
+            acc->sum[c] += v;
+            acc->sum_sq[c] += (uint64_t)v*v;
+        }
+    }
+}
+
+static void stats_merge(stats_acc_t *acc, int c, const uint16_t *lo, const uint16_t *hi, int lanes,
+                        uint64x2_t vsum, uint64x2_t vsq) {
+    uint64_t sum[2], sq[2];
+    vst1q_u64(sum, vsum);
+    vst1q_u64(sq, vsq);
+
+    for (int k = 0; k < lanes; ++k) {
+        if (lo[k] < acc->lo[c])
+            acc->lo[c] = lo[k];
+        if (hi[k] > acc->hi[c])
+            acc->hi[c] = hi[k];
+    }
+    acc->sum[c] += sum[0] + sum[1];
+    acc->sum_sq[c] += sq[0] + sq[1];
+}
+
+static void stats_rows8(stats_acc_t *acc, const PPM_img *img_ptr) {
+    uint8x16_t vlo[3], vhi[3];
+    uint64x2_t vsum[3], vsq[3];
+    for (int c = 0; c < 3; ++c) {
+        vlo[c] = vdupq_n_u8(0xFF);
+        vhi[c] = vdupq_n_u8(0);
+        vsum[c] = vsq[c] = vdupq_n_u64(0);
+    }
 
     for (size_t y = 0; y < img_ptr->height; ++y) {
-        uint8_t *row = img_ptr->data + y * img_ptr->stride;
+        const uint8_t *row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
+        size_t i = 0;
+
+        while (i + 16 <= img_ptr->width) {
+            size_t blocks = (img_ptr->width - i) / 16;
+            if (blocks > STATS_FLUSH_8)
+                blocks = STATS_FLUSH_8;
+
+            uint16x8_t sum16[3];
+            uint32x4_t sq32[3];
+            for (int c = 0; c < 3; ++c) {
+                sum16[c] = vdupq_n_u16(0);
+                sq32[c] = vdupq_n_u32(0);
+            }
+
+            for (; blocks > 0; --blocks, i += 16) {
+                uint8x16x3_t px = vld3q_u8(row + i*3);
+
+                for (int c = 0; c < 3; ++c) {
+                    uint8x16_t v = px.val[c];
+                    vlo[c] = vminq_u8(vlo[c], v);
+                    vhi[c] = vmaxq_u8(vhi[c], v);
+                    sum16[c] = vpadalq_u8(sum16[c], v);
+                    sq32[c] = vpadalq_u16(sq32[c], vmull_u8(vget_low_u8(v), vget_low_u8(v)));
+                    sq32[c] = vpadalq_u16(sq32[c], vmull_u8(vget_high_u8(v), vget_high_u8(v)));
+                }
+            }
+
+            for (int c = 0; c < 3; ++c) {
+                vsum[c] = vpadalq_u32(vsum[c], vpaddlq_u16(sum16[c]));
+                vsq[c] = vpadalq_u32(vsq[c], sq32[c]);
+            }
+        }
+
+        stats_tail(acc, row, i, img_ptr->width, 0);
+    }
 
+    for (int c = 0; c < 3; ++c) {
+        uint16_t lo[16], hi[16];
+        vst1q_u16(lo, vmovl_u8(vget_low_u8(vlo[c])));
+        vst1q_u16(lo + 8, vmovl_u8(vget_high_u8(vlo[c])));
+        vst1q_u16(hi, vmovl_u8(vget_low_u8(vhi[c])));
+        vst1q_u16(hi + 8, vmovl_u8(vget_high_u8(vhi[c])));
+        stats_merge(acc, c, lo, hi, 16, vsum[c], vsq[c]);
+    }
+}
+
+static void stats_rows16(stats_acc_t *acc, const PPM_img *img_ptr) {
+    uint16x8_t vlo[3], vhi[3];
+    uint64x2_t vsum[3], vsq[3];
+    for (int c = 0; c < 3; ++c) {
+        vlo[c] = vdupq_n_u16(0xFFFF);
+        vhi[c] = vdupq_n_u16(0);
+        vsum[c] = vsq[c] = vdupq_n_u64(0);
+    }
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
         size_t i = 0;
-        for (; i + 16 <= img_ptr->width * 3; i += 16) {
-            uint8x16_t v = vld1q_u8(row + i);
 
-            uint16x8_t lo16 = vmovl_u8(vget_low_u8(v));
-            uint16x8_t hi16 = vmovl_u8(vget_high_u8(v));
+        while (i + 8 <= img_ptr->width) {
+            size_t blocks = (img_ptr->width - i) / 8;
+            if (blocks > STATS_FLUSH_16)
+                blocks = STATS_FLUSH_16;
 
-            float32x4_t f0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo16)));
-            float32x4_t f1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo16)));
-            float32x4_t f2 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi16)));
-            float32x4_t f3 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi16)));
-
-            f0 = vminq_f32(vmulq_f32(f0, vscale), vmax);
-            f1 = vminq_f32(vmulq_f32(f1, vscale), vmax);
-            f2 = vminq_f32(vmulq_f32(f2, vscale), vmax);
-            f3 = vminq_f32(vmulq_f32(f3, vscale), vmax);
-
-            lo16 = vcombine_u16(
-                vmovn_u32(vcvtq_u32_f32(f0)),
-                vmovn_u32(vcvtq_u32_f32(f1))
-            );
-            hi16 = vcombine_u16(
-                vmovn_u32(vcvtq_u32_f32(f2)),
-                vmovn_u32(vcvtq_u32_f32(f3))
-            );
+            uint32x4_t sum32[3];
+            for (int c = 0; c < 3; ++c)
+                sum32[c] = vdupq_n_u32(0);
 
-            v = vcombine_u8(vmovn_u16(lo16), vmovn_u16(hi16));
-            vst1q_u8(row + i, v);
+            for (; blocks > 0; --blocks, i += 8) {
+                uint16x8x3_t px = vld3q_u16((const uint16_t*)(row + i*6));
+
+                for (int c = 0; c < 3; ++c) {
+                    uint16x8_t v = bswap16x8(px.val[c]);
+                    vlo[c] = vminq_u16(vlo[c], v);
+                    vhi[c] = vmaxq_u16(vhi[c], v);
+                    sum32[c] = vpadalq_u16(sum32[c], v);
+                    vsq[c] = vpadalq_u32(vsq[c], vmull_u16(vget_low_u16(v), vget_low_u16(v)));
+                    vsq[c] = vpadalq_u32(vsq[c], vmull_u16(vget_high_u16(v), vget_high_u16(v)));
+                }
+            }
+
+            for (int c = 0; c < 3; ++c)
+                vsum[c] = vpadalq_u32(vsum[c], sum32[c]);
         }
 
-        for (; i < img_ptr->width * 3; ++i)
-            row[i] = (uint8_t)(row[i] * scale);
+        stats_tail(acc, row, i, img_ptr->width, 1);
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        uint16_t lo[8], hi[8];
+        vst1q_u16(lo, vlo[c]);
+        vst1q_u16(hi, vhi[c]);
+        stats_merge(acc, c, lo, hi, 8, vsum[c], vsq[c]);
+    }
+}
+
+int ppm_stats_neon(const PPM_ptr img_ptr, PPM_stats *stats)
+{
+    if (ppm_validate(img_ptr) < 0 || stats == NULL)
+        return -1;
+
+    // The deinterleaving loads below are for RGB
+    if (img_ptr->channels != 3)
+        return ppm_stats_scalar(img_ptr, stats);
+
+    stats_acc_t acc = {
+        .lo = {UINT16_MAX, UINT16_MAX, UINT16_MAX},
+    };
+
+    if (img_ptr->maxval > 255)
+        stats_rows16(&acc, img_ptr);
+    else
+        stats_rows8(&acc, img_ptr);
+
+    stats->count = (uint64_t)img_ptr->width*img_ptr->height;
+    for (int c = 0; c < 3; ++c) {
+        stats->min[c] = acc.lo[c];
+        stats->max[c] = acc.hi[c];
+        stats->sum[c] = acc.sum[c];
+        stats->sum_sq[c] = acc.sum_sq[c];
     }
 
-    img_ptr->maxval = new_maxval;
     return 0;
 }
 
+#if defined(__aarch64__)
+/*
+ * NEON has no movemask: each compare result keeps the bit of its byte
+ * within 8, and three rounds of pairwise adds pack the 64 bytes into 64 bits
+ */
+static inline uint64_t mask64_u8(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3) {
+    const uint8x16_t bits = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+    uint8x16_t s0 = vpaddq_u8(vandq_u8(m0, bits), vandq_u8(m1, bits));
+    uint8x16_t s1 = vpaddq_u8(vandq_u8(m2, bits), vandq_u8(m3, bits));
+    s0 = vpaddq_u8(s0, s1);
+    s0 = vpaddq_u8(s0, s0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+uint64_t ppm_text_mask_neon(const char *text, uint64_t *other)
+{
+    uint8x16_t digits[4], known[4];
+
+    for (int k = 0; k < 4; ++k) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)text + 16*k);
+        digits[k] = vcltq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(10));
+        known[k] = vorrq_u8(digits[k], vorrq_u8(vcltq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(5)),
+                                                vceqq_u8(v, vdupq_n_u8(' '))));
+    }
+
+    *other = ~mask64_u8(known[0], known[1], known[2], known[3]);
+    return mask64_u8(digits[0], digits[1], digits[2], digits[3]);
+}
+
+#else
+
+/*
+ * ARMv7 has no 128-bit pairwise adds to pack the masks with
+ */
+uint64_t ppm_text_mask_neon(const char *text, uint64_t *other)
+{
+    return ppm_text_mask_scalar(text, other);
+}
+
+#endif
+
 #endif
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Fused pipelines
+ *
+ * Instead of walking the whole image once per operation, ppm_pipeline_run
+ * cuts it into strips of a few rows that fit in L1 and runs every stage on a
+ * strip before moving on, so each cache line comes in from memory once and
+ * goes back once. The stages are the selected backend's own kernels.
+ */
+
+#define PPM_PIPELINE_STRIP_BYTES (32*1024)
+
+enum {
+    PPM_OP_CONVERT_MAXVAL,
+    PPM_OP_SCALE,
+    PPM_OP_GRAYSCALE,
+    PPM_OP_LUT,
+};
+
+typedef struct {
+    const PPM_stage *steps;
+    uint32_t n_steps;
+    PPM_ptr img_ptr;
+    data_t out_data;        // rows of the result
+    size_t out_stride;
+    size_t out_row_bytes;
+    size_t out_strip_bytes; // distance between two strips in out_data
+    uint32_t strip_rows;
+    ppm_cow_t cow;          // the steps run in the image's rows, see ppm_cow_begin
+    _Atomic int err;
+} pipeline_job_t;
+
+PPM_pipeline_ptr ppm_pipeline_create(void) {
+    PPM_pipeline_ptr pipe = (PPM_pipeline_ptr)malloc(sizeof(PPM_pipeline));
+    if (pipe == NULL)
+        return NULL;
+
+    pipe->n_stages = 0;
+    return pipe;
+}
+
+void ppm_pipeline_free(PPM_pipeline_ptr pipe) {
+    free(pipe);
+}
+
+static PPM_stage *push_stage(PPM_pipeline_ptr pipe, int op) {
+    if (pipe == NULL || pipe->n_stages == PPM_PIPELINE_MAX_STAGES)
+        return NULL;
+
+    PPM_stage *stage = &pipe->stages[pipe->n_stages++];
+    memset(stage, 0, sizeof(*stage));
+    stage->op = op;
+    return stage;
+}
+
+int ppm_pipeline_convert_maxval(PPM_pipeline_ptr pipe, uint16_t new_maxval) {
+    if (new_maxval == 0)
+        return -1;
+
+    PPM_stage *stage = push_stage(pipe, PPM_OP_CONVERT_MAXVAL);
+    if (stage == NULL)
+        return -1;
+
+    stage->maxval = new_maxval;
+    return 0;
+}
+
+int ppm_pipeline_scale(PPM_pipeline_ptr pipe, float scale, float bias) {
+    PPM_stage *stage = push_stage(pipe, PPM_OP_SCALE);
+    if (stage == NULL)
+        return -1;
+
+    stage->scale = scale;
+    stage->bias = bias;
+    return 0;
+}
+
+int ppm_pipeline_rgb_to_grayscale(PPM_pipeline_ptr pipe) {
+    return push_stage(pipe, PPM_OP_GRAYSCALE) == NULL ? -1 : 0;
+}
+
+int ppm_pipeline_apply_lut(PPM_pipeline_ptr pipe, const PPM_lut *lut) {
+    if (lut == NULL)
+        return -1;
+
+    PPM_stage *stage = push_stage(pipe, PPM_OP_LUT);
+    if (stage == NULL)
+        return -1;
+
+    stage->lut = *lut;
+    stage->maxval = lut->maxval;
+    return 0;
+}
+
+/*
+ * Turn the queued stages into the steps that actually run on each strip
+ * Runs of point operations on 8-bit samples become one table; a lone scale
+ * or conversion keeps its arithmetic kernel if the backend prefers it.
+ * Returns the number of steps and the final maxval, or -1 if a stage can't
+ * apply (table on 16-bit samples) and -2 on a table maxval mismatch.
+ */
+static int compile_steps(const PPM_pipeline_ptr pipe, uint16_t maxval, PPM_stage *steps,
+                         uint16_t *final_maxval, int *uses16) {
+    int n_steps = 0;
+    uint32_t group = 0;         // stages folded into the pending table
+    uint32_t first = 0;         // first of them
+    int group_has_lut = 0;
+    PPM_stage pending;
+
+    *uses16 = maxval > 255;
+
+    for (uint32_t i = 0; i <= pipe->n_stages; ++i) {
+        const PPM_stage *stage = (i < pipe->n_stages) ? &pipe->stages[i] : NULL;
+
+        int point8 = stage != NULL && maxval <= 255 &&
+                     (stage->op == PPM_OP_SCALE || stage->op == PPM_OP_LUT ||
+                      (stage->op == PPM_OP_CONVERT_MAXVAL && stage->maxval <= 255));
+
+        if (point8) {
+            if (group == 0) {
+                memset(&pending, 0, sizeof(pending));
+                pending.op = PPM_OP_LUT;
+                ppm_lut_init(&pending.lut, maxval);
+                first = i;
+                group_has_lut = 0;
+            }
+
+            if (stage->op == PPM_OP_SCALE) {
+                ppm_lut_scale(&pending.lut, stage->scale, stage->bias);
+            } else if (stage->op == PPM_OP_CONVERT_MAXVAL) {
+                ppm_lut_convert(&pending.lut, stage->maxval);
+            } else {
+                if (stage->lut.in_maxval != maxval)
+                    return -2;
+                for (int v = 0; v < 256; ++v)
+                    pending.lut.map[v] = stage->lut.map[pending.lut.map[v]];
+                pending.lut.maxval = stage->lut.maxval;
+                group_has_lut = 1;
+            }
+
+            maxval = pending.lut.maxval;
+            group++;
+            continue;
+        }
+
+        if (group != 0) {
+            if (group > 1 || group_has_lut || ppm_ops()->lut_8bit)
+                steps[n_steps++] = pending;
+            else
+                steps[n_steps++] = pipe->stages[first];
+            group = 0;
+        }
+
+        if (stage == NULL)
+            break;
+
+        if (stage->op == PPM_OP_LUT)
+            return -1;
+
+        if (stage->op == PPM_OP_CONVERT_MAXVAL) {
+            maxval = stage->maxval;
+            if (maxval > 255)
+                *uses16 = 1;
+        }
+
+        steps[n_steps++] = *stage;
+    }
+
+    *final_maxval = maxval;
+    return n_steps;
+}
+
+static int run_step(const PPM_stage *step, PPM_ptr band) {
+    const ppm_ops_t *ops = ppm_ops();
+
+    switch (step->op) {
+    case PPM_OP_CONVERT_MAXVAL:
+        return ops->convert_maxval(band, step->maxval);
+    case PPM_OP_SCALE:
+        return ops->scale(band, step->scale, step->bias);
+    case PPM_OP_GRAYSCALE:
+        // Every grayscale kernel reads a group of pixels before writing it back
+        return ops->rgb_to_grayscale(band, band);
+    case PPM_OP_LUT: {
+        int err = ops->apply_lut(band, step->lut.map);
+        if (err == 0)
+            band->maxval = step->lut.maxval;
+        return err;
+    }
+    }
+
+    return -1;
+}
+
+/*
+ * All steps on one strip
+ * Conversions that change the sample size leave the strip in a buffer of
+ * its own; it is copied to its place in the result while still in cache.
+ */
+static void pipeline_strip(void *ctx, uint32_t strip) {
+    pipeline_job_t *job = (pipeline_job_t *)ctx;
+    PPM_img band = ppm_tile_band(job->img_ptr, strip, job->strip_rows);
+    data_t src_rows = band.data;
+
+    ppm_cow_band(&job->cow, job->img_ptr, &band);
+
+    for (uint32_t i = 0; i < job->n_steps; ++i) {
+        int err = run_step(&job->steps[i], &band);
+        if (err != 0) {
+            atomic_store(&job->err, err);
+            if (band.data != src_rows)
+                ppm_release_data(&band);
+            return;
+        }
+    }
+
+    data_t out_rows = job->out_data + (size_t)strip*job->out_strip_bytes;
+    if (band.data != out_rows) {
+        size_t row_bytes = band.width*(job->out_row_bytes/job->img_ptr->width);
+        for (uint32_t y = 0; y < band.height; ++y)
+            memcpy(out_rows + y*job->out_stride, band.data + y*band.stride, row_bytes);
+        ppm_release_data(&band);
+    }
+}
+
+int ppm_pipeline_run(const PPM_pipeline_ptr pipe, PPM_ptr img_ptr) {
+    if (pipe == NULL || ppm_validate(img_ptr) < 0)
+        return -1;
+
+    if (pipe->n_stages == 0)
+        return 0;
+
+    // Grayscale works on RGB only, fail before anything is written
+    for (uint32_t i = 0; i < pipe->n_stages; ++i) {
+        if (pipe->stages[i].op == PPM_OP_GRAYSCALE && img_ptr->channels != 3)
+            return -1;
+    }
+
+    PPM_stage steps[PPM_PIPELINE_MAX_STAGES];
+    uint16_t final_maxval;
+    int uses16;
+    int n_steps = compile_steps(pipe, img_ptr->maxval, steps, &final_maxval, &uses16);
+    if (n_steps < 0)
+        return n_steps;
+
+    // A view can't take a buffer of another sample size
+    if ((img_ptr->maxval <= 255) != (final_maxval <= 255) && !ppm_owns_data(img_ptr))
+        return -1;
+
+    // The first steps work in the image's rows even when the sample size changes later
+    ppm_cow_t cow;
+    if (ppm_cow_begin(img_ptr, &cow, 1) < 0)
+        return -1;
+
+    // Same sample size at the end: the result goes back into the image's own rows
+    size_t out_bpc = (final_maxval <= 255) ? 1 : 2;
+    size_t out_row_bytes = img_ptr->width*img_ptr->channels*out_bpc;
+    data_t out_data = img_ptr->data;
+    size_t out_stride = img_ptr->stride;
+    size_t out_size = img_ptr->data_size;
+    int tiled = (img_ptr->layout == PPM_LAYOUT_TILED);
+
+    if ((img_ptr->maxval <= 255) != (final_maxval <= 255)) {
+        if (tiled) {
+            out_stride = (size_t)PPM_TILE_PIXELS*img_ptr->channels*out_bpc;
+            out_size = ppm_tiled_data_size(img_ptr->width, img_ptr->height, final_maxval, img_ptr->channels);
+        } else {
+            out_stride = (out_row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+            out_size = out_stride*img_ptr->height;
+        }
+        out_data = (data_t)ppm_alloc(out_size);
+        if (out_data == NULL) {
+            ppm_cow_end(img_ptr, &cow, -1);
+            return -1;
+        }
+    }
+
+    // Strips sized for the widest rows any step works on; a tiled image's strips are its tiles
+    size_t widest = ppm_data_size(img_ptr->width, 1, uses16 ? 65535 : 255, img_ptr->channels);
+    uint32_t strip_rows = (uint32_t)(PPM_PIPELINE_STRIP_BYTES / widest);
+    if (strip_rows == 0)
+        strip_rows = 1;
+    uint32_t n_strips = (img_ptr->height + strip_rows - 1) / strip_rows;
+    size_t out_strip_bytes = (size_t)strip_rows*out_stride;
+
+    if (tiled) {
+        n_strips = ppm_tile_count(img_ptr);
+        out_strip_bytes = ppm_tile_bytes(final_maxval, img_ptr->channels);
+    }
+
+    pipeline_job_t job = {
+        .steps = steps, .n_steps = (uint32_t)n_steps, .img_ptr = img_ptr,
+        .out_data = out_data, .out_stride = out_stride, .out_row_bytes = out_row_bytes,
+        .out_strip_bytes = out_strip_bytes, .strip_rows = strip_rows, .cow = cow,
+    };
+
+    if (ppm_get_threads() > 1 && img_ptr->data_size >= PPM_PARALLEL_MIN_BYTES && n_strips > 1) {
+        ppm_parallel_for(n_strips, pipeline_strip, &job);
+    } else {
+        for (uint32_t strip = 0; strip < n_strips; ++strip)
+            pipeline_strip(&job, strip);
+    }
+
+    int err = atomic_load(&job.err);
+    int in_place = (out_data == img_ptr->data);
+    ppm_cow_end(img_ptr, &job.cow, err);
+
+    if (!in_place) {
+        if (err != 0) {
+            ppm_dealloc(out_data, out_size);
+            return err;
+        }
+        ppm_release_data(img_ptr);
+        img_ptr->data = out_data;
+        img_ptr->stride = out_stride;
+        img_ptr->data_size = out_size;
+        img_ptr->alloc_size = out_size;
+    }
+
+    if (err != 0)
+        return err;
+
+    img_ptr->maxval = final_maxval;
+    return 0;
+}
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Planar images
+ *
+ * One buffer holds the R, G and B planes back to back. Plane rows are padded
+ * to PPM_ALIGNMENT, so every row of every plane starts aligned and the
+ * kernels run the same vertical code over each plane with no shuffles.
+ * Unpacking and packing go tile by tile of the interleaved image, which
+ * also covers tiled images; the planar operations go by row bands.
+ */
+
+typedef struct {
+    PPM_ptr img_ptr;
+    PPM_planar_ptr dst, src;
+    uint32_t tile_rows;
+    int op;
+    float scale, bias;
+    _Atomic int err;
+} planar_job_t;
+
+enum {
+    PLANAR_UNPACK,
+    PLANAR_PACK,
+    PLANAR_SCALE,
+    PLANAR_GRAYSCALE,
+};
+
+PPM_planar_ptr ppm_planar_create(uint32_t width, uint32_t height, uint16_t maxval) {
+    if (width == 0 || height == 0 || maxval == 0)
+        return NULL;
+
+    size_t bytes_per_channel = (maxval <= 255) ? 1 : 2;
+    size_t row_bytes = (size_t)width*bytes_per_channel;
+    size_t stride = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+    size_t plane_size = stride*height;
+
+    data_t data = (data_t)ppm_alloc(3*plane_size);
+    if (data == NULL)
+        return NULL;
+
+    PPM_planar_ptr planar = (PPM_planar_ptr)malloc(sizeof(PPM_planar));
+    if (planar == NULL) {
+        ppm_dealloc(data, 3*plane_size);
+        return NULL;
+    }
+
+    planar->width = width;
+    planar->height = height;
+    planar->maxval = maxval;
+    planar->stride = stride;
+    planar->plane_size = plane_size;
+    planar->alloc_size = 3*plane_size;
+    for (int c = 0; c < 3; ++c)
+        planar->planes[c] = data + c*plane_size;
+
+    return planar;
+}
+
+void ppm_planar_free(PPM_planar_ptr planar) {
+    if (planar == NULL)
+        return;
+
+    if (planar->alloc_size != 0)
+        ppm_dealloc(planar->planes[0], planar->alloc_size);
+    free(planar);
+}
+
+int ppm_planar_validate(const PPM_planar_ptr planar) {
+    if (planar == NULL ||
+            planar->width == 0 ||
+            planar->height == 0 ||
+            planar->maxval == 0) {
+        return -1;
+    }
+
+    for (int c = 0; c < 3; ++c) {
+        if (planar->planes[c] == NULL)
+            return -1;
+    }
+
+    size_t bytes_per_channel = (planar->maxval <= 255) ? 1 : 2;
+    if (planar->stride < (size_t)planar->width*bytes_per_channel)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Planes over a rectangle of a planar image, sharing its buffer
+ */
+static PPM_planar planar_rect(const PPM_planar_ptr planar, uint32_t x0, uint32_t y0,
+                              uint32_t width, uint32_t height) {
+    PPM_planar rect = *planar;
+    size_t bytes_per_channel = (planar->maxval <= 255) ? 1 : 2;
+    size_t offset = (size_t)y0*planar->stride + x0*bytes_per_channel;
+
+    rect.width = width;
+    rect.height = height;
+    rect.alloc_size = 0;
+    for (int c = 0; c < 3; ++c)
+        rect.planes[c] = planar->planes[c] + offset;
+
+    return rect;
+}
+
+/*
+ * Rows per band of a planar job, or 0 if it isn't worth splitting
+ */
+static uint32_t band_rows_for(const PPM_planar_ptr planar) {
+    if (ppm_get_threads() == 1 || 3*planar->stride*planar->height < PPM_PARALLEL_MIN_BYTES)
+        return 0;
+
+    size_t rows = PPM_TILE_BYTES / (3*planar->stride);
+    if (rows == 0)
+        rows = 1;
+    if (rows >= planar->height)
+        return 0;
+
+    return (uint32_t)rows;
+}
+
+/*
+ * One tile of the interleaved image and the planes over the same pixels
+ */
+static void pack_tile(void *ctx, uint32_t tile) {
+    planar_job_t *job = (planar_job_t *)ctx;
+    const PPM_ptr img_ptr = job->img_ptr;
+    PPM_img band = ppm_tile_band(img_ptr, tile, job->tile_rows);
+
+    uint32_t x0 = 0, y0 = tile*job->tile_rows;
+    if (img_ptr->layout == PPM_LAYOUT_TILED) {
+        uint32_t tiles_x = ppm_tiles_x(img_ptr);
+        x0 = (tile % tiles_x)*PPM_TILE_PIXELS;
+        y0 = (tile / tiles_x)*PPM_TILE_PIXELS;
+    }
+
+    const ppm_ops_t *ops = ppm_ops();
+    PPM_planar_ptr planar = (job->op == PLANAR_UNPACK) ? job->dst : job->src;
+    PPM_planar rect = planar_rect(planar, x0, y0, band.width, band.height);
+
+    int err = (job->op == PLANAR_UNPACK) ? ops->planar_unpack(&rect, &band)
+                                         : ops->planar_pack(&band, &rect);
+    if (err != 0)
+        atomic_store(&job->err, err);
+}
+
+static void planar_band(void *ctx, uint32_t tile) {
+    planar_job_t *job = (planar_job_t *)ctx;
+    uint32_t y0 = tile*job->tile_rows;
+    uint32_t rows = job->dst->height - y0;
+    if (rows > job->tile_rows)
+        rows = job->tile_rows;
+
+    const ppm_ops_t *ops = ppm_ops();
+    PPM_planar dst = planar_rect(job->dst, 0, y0, job->dst->width, rows);
+    int err;
+
+    if (job->op == PLANAR_SCALE) {
+        err = ops->planar_scale(&dst, job->scale, job->bias);
+    } else {
+        PPM_planar src = planar_rect(job->src, 0, y0, job->src->width, rows);
+        err = ops->planar_rgb_to_grayscale(&dst, &src);
+    }
+
+    if (err != 0)
+        atomic_store(&job->err, err);
+}
+
+static int run_pack(planar_job_t *job) {
+    const PPM_ptr img_ptr = job->img_ptr;
+    uint32_t count = 1;
+
+    if (img_ptr->layout == PPM_LAYOUT_TILED) {
+        count = ppm_tile_count(img_ptr);
+    } else if (ppm_get_threads() > 1 && img_ptr->data_size >= PPM_PARALLEL_MIN_BYTES) {
+        size_t rows = PPM_TILE_BYTES / img_ptr->stride;
+        job->tile_rows = (rows == 0) ? 1 : (uint32_t)rows;
+        count = (img_ptr->height + job->tile_rows - 1) / job->tile_rows;
+    }
+
+    if (count == 1) {
+        const ppm_ops_t *ops = ppm_ops();
+        return (job->op == PLANAR_UNPACK) ? ops->planar_unpack(job->dst, img_ptr)
+                                          : ops->planar_pack(img_ptr, job->src);
+    }
+
+    if (ppm_get_threads() > 1 && img_ptr->data_size >= PPM_PARALLEL_MIN_BYTES) {
+        ppm_parallel_for(count, pack_tile, job);
+    } else {
+        for (uint32_t tile = 0; tile < count; ++tile)
+            pack_tile(job, tile);
+    }
+
+    return atomic_load(&job->err);
+}
+
+static int same_size(const PPM_ptr img_ptr, const PPM_planar_ptr planar) {
+    return img_ptr->channels == 3 &&
+           img_ptr->width == planar->width &&
+           img_ptr->height == planar->height &&
+           img_ptr->maxval == planar->maxval;
+}
+
+int ppm_planar_unpack(PPM_planar_ptr dst, const PPM_ptr src_ptr) {
+    if (ppm_planar_validate(dst) < 0 || ppm_validate(src_ptr) < 0)
+        return -1;
+
+    if (!same_size(src_ptr, dst))
+        return -2;
+
+    planar_job_t job = { .img_ptr = src_ptr, .dst = dst, .op = PLANAR_UNPACK };
+    return run_pack(&job);
+}
+
+int ppm_planar_pack(PPM_ptr dst_ptr, const PPM_planar_ptr src) {
+    if (ppm_validate(dst_ptr) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (!same_size(dst_ptr, src))
+        return -2;
+
+    // Every sample of dst is overwritten: a shared dst just gets a buffer of its own
+    ppm_cow_t cow;
+    if (ppm_cow_begin(dst_ptr, &cow, 0) < 0)
+        return -1;
+
+    planar_job_t job = { .img_ptr = dst_ptr, .src = src, .op = PLANAR_PACK };
+    int err = run_pack(&job);
+    ppm_cow_end(dst_ptr, &cow, err);
+    return err;
+}
+
+static int run_bands(planar_job_t *job) {
+    uint32_t count = (job->dst->height + job->tile_rows - 1) / job->tile_rows;
+    ppm_parallel_for(count, planar_band, job);
+    return atomic_load(&job->err);
+}
+
+int ppm_planar_scale(PPM_planar_ptr planar, float scale, float bias) {
+    if (ppm_planar_validate(planar) < 0)
+        return -1;
+
+    uint32_t tile_rows = band_rows_for(planar);
+    if (tile_rows == 0)
+        return ppm_ops()->planar_scale(planar, scale, bias);
+
+    planar_job_t job = {
+        .dst = planar, .tile_rows = tile_rows, .op = PLANAR_SCALE,
+        .scale = scale, .bias = bias,
+    };
+    return run_bands(&job);
+}
+
+int ppm_planar_rgb_to_grayscale(PPM_planar_ptr dst, const PPM_planar_ptr src) {
+    if (ppm_planar_validate(dst) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (dst->width != src->width ||
+            dst->height != src->height ||
+            dst->maxval != src->maxval) {
+        return -2;
+    }
+
+    uint32_t tile_rows = band_rows_for(src);
+    if (tile_rows == 0)
+        return ppm_ops()->planar_rgb_to_grayscale(dst, src);
+
+    planar_job_t job = { .dst = dst, .src = src, .tile_rows = tile_rows, .op = PLANAR_GRAYSCALE };
+    return run_bands(&job);
+}
@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Resampling
+ *
+ * Each axis gets a table of fixed-point weights: for every output sample,
+ * the first input sample it reads and taps weights that sum to exactly
+ * 1 << PPM_RESIZE_BITS. Tables depend only on the sizes and the filter, so
+ * the last few are kept and shared between calls and threads.
+ *
+ * The resize itself goes like the convolution: blocks of output rows by
+ * columns, each running the horizontal pass one source row at a time into a
+ * ring of filtered rows that stays in L2, and the vertical pass combining
+ * the ring into output rows. Source rows an output row doesn't reach are
+ * never filtered. All arithmetic is integer, so every backend gives the
+ * same result.
+ */
+
+#define RESIZE_CACHE_SIZE   8
+#define RESIZE_BAND_ROWS    64
+
+typedef struct {
+    uint32_t in_size, out_size;
+    int filter;
+    uint32_t taps;          // weights per output sample, a multiple of 4
+    uint32_t window;        // input samples any output sample spans, at most
+    int32_t *start;         // first input sample of each output sample
+    uint32_t *count;        // weights of each output sample that can be non-zero
+    int16_t *weights;       // taps per output sample
+    _Atomic int refs;
+} resize_axis_t;
+
+typedef struct {
+    const PPM_img *src_ptr;
+    PPM_img *dst_ptr;
+    const resize_axis_t *ax, *ay;
+    uint32_t band_rows;
+    uint32_t slice_px;
+    uint32_t slices;
+    _Atomic int err;
+} resize_job_t;
+
+static struct {
+    pthread_mutex_t lock;
+    resize_axis_t *axes[RESIZE_CACHE_SIZE];     // most recently used first
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double sinc(double x) {
+    if (x == 0.0)
+        return 1.0;
+
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filter_support(int filter) {
+    switch (filter) {
+    case PPM_RESIZE_BILINEAR:
+        return 1.0;
+    case PPM_RESIZE_LANCZOS3:
+        return 3.0;
+    }
+
+    return 0.5;
+}
+
+static double filter_weight(int filter, double x) {
+    switch (filter) {
+    case PPM_RESIZE_BILINEAR:
+        x = fabs(x);
+        return (x < 1.0) ? 1.0 - x : 0.0;
+    case PPM_RESIZE_AREA:
+        return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+    case PPM_RESIZE_LANCZOS3:
+        return (x > -3.0 && x < 3.0) ? sinc(x)*sinc(x / 3.0) : 0.0;
+    }
+
+    return 0.0;
+}
+
+/*
+ * Weights of one output sample, quantized so that they add up to exactly one
+ * Each weight is rounded down, then the units left over go to the weights
+ * that lost the most, so none is off by a unit or more.
+ */
+static void quantize(int16_t *dst, const double *w, uint32_t n, double sum, double *frac) {
+    const int32_t one = 1 << PPM_RESIZE_BITS;
+    int32_t total = 0;
+
+    for (uint32_t k = 0; k < n; ++k) {
+        double v = w[k] / sum * one;
+        dst[k] = (int16_t)floor(v);
+        frac[k] = v - dst[k];
+        total += dst[k];
+    }
+
+    for (; total < one; ++total) {
+        uint32_t best = 0;
+        for (uint32_t k = 1; k < n; ++k) {
+            if (frac[k] > frac[best])
+                best = k;
+        }
+        dst[best]++;
+        frac[best] = -1.0;
+    }
+}
+
+/*
+ * Table for one axis
+ * Output sample i is centred on input coordinate (i + 0.5)*in/out. When
+ * shrinking, the filter is stretched by in/out so that every input sample
+ * contributes. Windows are cut at the edges and their weights renormalized.
+ */
+static resize_axis_t *axis_build(uint32_t in_size, uint32_t out_size, int filter) {
+    double scale = (double)in_size / out_size;
+    double stretch = (scale > 1.0) ? scale : 1.0;
+    double support = filter_support(filter)*stretch;
+
+    uint32_t window = 1;
+    if (filter != PPM_RESIZE_NEAREST)
+        window = (uint32_t)ceil(support)*2 + 1;
+    if (window > in_size)
+        window = in_size;
+    uint32_t taps = (window + 3) & ~3u;
+
+    size_t bytes = sizeof(resize_axis_t) + (size_t)out_size*(sizeof(int32_t) + sizeof(uint32_t)) +
+                   (size_t)out_size*taps*sizeof(int16_t);
+    resize_axis_t *axis = (resize_axis_t *)calloc(1, bytes);
+    double *w = (double *)malloc(2*window*sizeof(double));
+    if (axis == NULL || w == NULL) {
+        free(axis);
+        free(w);
+        return NULL;
+    }
+
+    axis->in_size = in_size;
+    axis->out_size = out_size;
+    axis->filter = filter;
+    axis->taps = taps;
+    axis->window = window;
+    axis->start = (int32_t *)(axis + 1);
+    axis->count = (uint32_t *)(axis->start + out_size);
+    axis->weights = (int16_t *)(axis->count + out_size);
+
+    for (uint32_t i = 0; i < out_size; ++i) {
+        double center = (i + 0.5)*scale;
+        int16_t *dst = axis->weights + (size_t)i*taps;
+
+        if (filter == PPM_RESIZE_NEAREST) {
+            int64_t x = (int64_t)center;
+            axis->start[i] = (int32_t)((x < in_size) ? x : in_size - 1);
+            axis->count[i] = 1;
+            dst[0] = 1 << PPM_RESIZE_BITS;
+            continue;
+        }
+
+        int64_t x0 = (int64_t)floor(center - support + 0.5);
+        int64_t x1 = (int64_t)floor(center + support + 0.5);
+        if (x0 < 0)
+            x0 = 0;
+        if (x1 > in_size)
+            x1 = in_size;
+        if (x1 - x0 > window)
+            x1 = x0 + window;
+
+        uint32_t n = (uint32_t)(x1 - x0);
+        double sum = 0.0;
+        for (uint32_t k = 0; k < n; ++k) {
+            w[k] = filter_weight(filter, (x0 + k - center + 0.5) / stretch);
+            sum += w[k];
+        }
+
+        axis->start[i] = (int32_t)x0;
+        axis->count[i] = n;
+        if (sum != 0.0) {
+            quantize(dst, w, n, sum, w + window);
+        } else {
+            axis->count[i] = 1;
+            dst[0] = 1 << PPM_RESIZE_BITS;
+        }
+    }
+
+    free(w);
+    atomic_init(&axis->refs, 1);
+    return axis;
+}
+
+static void axis_put(resize_axis_t *axis) {
+    if (axis != NULL && atomic_fetch_sub(&axis->refs, 1) == 1)
+        free(axis);
+}
+
+static resize_axis_t *cache_find(uint32_t in_size, uint32_t out_size, int filter) {
+    for (int i = 0; i < RESIZE_CACHE_SIZE; ++i) {
+        resize_axis_t *axis = cache.axes[i];
+        if (axis == NULL)
+            break;
+
+        if (axis->in_size == in_size && axis->out_size == out_size && axis->filter == filter) {
+            memmove(&cache.axes[1], &cache.axes[0], i*sizeof(cache.axes[0]));
+            cache.axes[0] = axis;
+            atomic_fetch_add(&axis->refs, 1);
+            return axis;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Table for an axis, from the cache or built and added to it
+ * The caller holds a reference until axis_put
+ */
+static resize_axis_t *axis_get(uint32_t in_size, uint32_t out_size, int filter) {
+    pthread_mutex_lock(&cache.lock);
+    resize_axis_t *axis = cache_find(in_size, out_size, filter);
+    pthread_mutex_unlock(&cache.lock);
+    if (axis != NULL)
+        return axis;
+
+    // Built unlocked; if another thread got there first, use its table
+    resize_axis_t *built = axis_build(in_size, out_size, filter);
+    if (built == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cache.lock);
+    axis = cache_find(in_size, out_size, filter);
+    if (axis == NULL) {
+        resize_axis_t *evicted = cache.axes[RESIZE_CACHE_SIZE - 1];
+        memmove(&cache.axes[1], &cache.axes[0], (RESIZE_CACHE_SIZE - 1)*sizeof(cache.axes[0]));
+        cache.axes[0] = built;
+        atomic_fetch_add(&built->refs, 1);
+        axis = built;
+        built = NULL;
+        axis_put(evicted);
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    axis_put(built);
+    return axis;
+}
+
+void ppm_resize_trim(void) {
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < RESIZE_CACHE_SIZE; ++i) {
+        axis_put(cache.axes[i]);
+        cache.axes[i] = NULL;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/*
+ * Pixels [x_begin, x_end) of row y, 16-bit samples in native byte order
+ */
+static void load_row(uint8_t *dst, const PPM_img *img_ptr, uint32_t y, uint32_t x_begin, uint32_t x_end) {
+    const int is16 = img_ptr->maxval > 255;
+    const size_t bytes_per_pixel = ppm_pixel_bytes(img_ptr->maxval, img_ptr->channels);
+
+    for (uint32_t x = x_begin; x < x_end; ) {
+        uint32_t run;
+        const uint8_t *p = ppm_pixel_run(img_ptr, x, y, &run);
+        if (run > x_end - x)
+            run = x_end - x;
+
+        uint8_t *out = dst + (size_t)(x - x_begin)*bytes_per_pixel;
+        if (is16) {
+            uint16_t *out16 = (uint16_t *)out;
+            for (size_t i = 0; i < (size_t)run*img_ptr->channels; ++i)
+                out16[i] = (uint16_t)((p[i*2] << 8) | p[i*2+1]);
+        } else {
+            memcpy(out, p, (size_t)run*img_ptr->channels);
+        }
+
+        x += run;
+    }
+}
+
+static void resize_block(void *ctx, uint32_t block) {
+    resize_job_t *job = (resize_job_t *)ctx;
+    const ppm_ops_t *ops = ppm_ops();
+    const PPM_img *src_ptr = job->src_ptr;
+    const resize_axis_t *ax = job->ax, *ay = job->ay;
+    const uint16_t maxval = src_ptr->maxval;
+    const uint16_t channels = src_ptr->channels;
+    const size_t bytes_per_pixel = ppm_pixel_bytes(maxval, channels);
+
+    uint32_t y0 = (block / job->slices)*job->band_rows;
+    uint32_t y1 = y0 + job->band_rows;
+    if (y1 > ay->out_size)
+        y1 = ay->out_size;
+    uint32_t x0 = (block % job->slices)*job->slice_px;
+    uint32_t x1 = x0 + job->slice_px;
+    if (x1 > ax->out_size)
+        x1 = ax->out_size;
+
+    // Source columns the slice reads
+    uint32_t sx0 = (uint32_t)ax->start[x0], sx1 = sx0;
+    for (uint32_t x = x0; x < x1; ++x) {
+        if (ax->start[x] + ax->count[x] > sx1)
+            sx1 = ax->start[x] + ax->count[x];
+    }
+
+    // Source row with room for the zero-weight taps past its end, starts
+    // relative to it, the ring of filtered rows and pointers into it
+    size_t row_bytes = ((size_t)(sx1 - sx0) + ax->taps)*bytes_per_pixel + PPM_ALIGNMENT;
+    row_bytes = (row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+    size_t start_bytes = ((size_t)(x1 - x0)*sizeof(int32_t) + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+    size_t ring_stride = ((size_t)(x1 - x0)*bytes_per_pixel + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT-1));
+    size_t ring_bytes = ring_stride*ay->window;
+    size_t bytes = row_bytes + start_bytes + ring_bytes + ay->window*sizeof(uint8_t *);
+
+    uint8_t *scratch = (uint8_t *)ppm_alloc(bytes);
+    if (scratch == NULL) {
+        atomic_store(&job->err, -1);
+        return;
+    }
+    uint8_t *row = scratch;
+    int32_t *start = (int32_t *)(scratch + row_bytes);
+    uint8_t *ring = scratch + row_bytes + start_bytes;
+    const uint8_t **rows = (const uint8_t **)(ring + ring_bytes);
+
+    memset(row, 0, row_bytes);
+    for (uint32_t x = x0; x < x1; ++x)
+        start[x - x0] = ax->start[x] - (int32_t)sx0;
+
+    // Source row j goes to slot j % window; windows only move down, so the
+    // rows an output row needs are always the last ones filtered
+    uint32_t next = (uint32_t)ay->start[y0];
+
+    for (uint32_t y = y0; y < y1; ++y) {
+        uint32_t sy = (uint32_t)ay->start[y], count = ay->count[y];
+        if (next < sy)
+            next = sy;
+
+        for (; next < sy + count; ++next) {
+            load_row(row, src_ptr, next, sx0, sx1);
+            ops->resize_h(ring + (next % ay->window)*ring_stride, row, x1 - x0, start,
+                          ax->weights + (size_t)x0*ax->taps, ax->taps, maxval, channels);
+        }
+
+        // Output pixels go out in runs that are contiguous in the destination
+        for (uint32_t x = x0; x < x1; ) {
+            uint32_t run;
+            uint8_t *out = ppm_pixel_run(job->dst_ptr, x, y, &run);
+            if (run > x1 - x)
+                run = x1 - x;
+
+            for (uint32_t k = 0; k < count; ++k)
+                rows[k] = ring + ((sy + k) % ay->window)*ring_stride + (size_t)(x - x0)*bytes_per_pixel;
+
+            ops->resize_v(out, rows, (size_t)run*channels, ay->weights + (size_t)y*ay->taps, count, maxval);
+            x += run;
+        }
+    }
+
+    ppm_dealloc(scratch, bytes);
+}
+
+int ppm_resize(PPM_ptr dst_ptr, const PPM_ptr src_ptr, int filter) {
+    if (ppm_validate(dst_ptr) < 0 || ppm_validate(src_ptr) < 0 || dst_ptr == src_ptr)
+        return -1;
+
+    if (filter < PPM_RESIZE_NEAREST || filter > PPM_RESIZE_LANCZOS3)
+        return -1;
+
+    if (dst_ptr->maxval != src_ptr->maxval || dst_ptr->channels != src_ptr->channels)
+        return -2;
+
+    resize_axis_t *ax = axis_get(src_ptr->width, dst_ptr->width, filter);
+    resize_axis_t *ay = axis_get(src_ptr->height, dst_ptr->height, filter);
+    if (ax == NULL || ay == NULL) {
+        axis_put(ax);
+        axis_put(ay);
+        return -1;
+    }
+
+    size_t total = (size_t)src_ptr->data_size + dst_ptr->data_size;
+    int parallel = ppm_get_threads() > 1 && total >= PPM_PARALLEL_MIN_BYTES;
+
+    // Slices keep the ring in L2; bands only exist to feed the pool
+    size_t bytes_per_pixel = ppm_pixel_bytes(src_ptr->maxval, src_ptr->channels);
+    size_t slice_px = PPM_TILE_BYTES / ((size_t)ay->window*bytes_per_pixel);
+    slice_px -= slice_px % PPM_TILE_PIXELS;
+    if (slice_px < PPM_TILE_PIXELS)
+        slice_px = PPM_TILE_PIXELS;
+    if (slice_px > dst_ptr->width)
+        slice_px = dst_ptr->width;
+
+    uint32_t band_rows = parallel ? RESIZE_BAND_ROWS : dst_ptr->height;
+
+    // Every sample of dst is overwritten: a shared dst just gets a buffer of its own
+    ppm_cow_t cow;
+    if (ppm_cow_begin(dst_ptr, &cow, 0) < 0) {
+        axis_put(ax);
+        axis_put(ay);
+        return -1;
+    }
+
+    resize_job_t job = {
+        .src_ptr = src_ptr, .dst_ptr = dst_ptr, .ax = ax, .ay = ay,
+        .band_rows = band_rows, .slice_px = (uint32_t)slice_px,
+        .slices = (uint32_t)((dst_ptr->width + slice_px - 1) / slice_px),
+    };
+    uint32_t count = job.slices*((dst_ptr->height + band_rows - 1) / band_rows);
+
+    if (parallel && count > 1) {
+        ppm_parallel_for(count, resize_block, &job);
+    } else {
+        for (uint32_t block = 0; block < count; ++block)
+            resize_block(&job, block);
+    }
+
+    int err = atomic_load(&job.err);
+    ppm_cow_end(dst_ptr, &cow, err);
+
+    axis_put(ax);
+    axis_put(ay);
+    return err;
+}
@@ -1,10 +1,37 @@
-#include <stdlib.h>
-
 #include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Scalar reference implementations
+ * The SIMD backends are bit-exact against these
+ */
+
+static inline uint16_t load_be16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void store_be16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)(v);
+}
+
+static inline uint32_t convert_sample(uint32_t v, uint32_t new_maxval, uint32_t old_maxval) {
+    uint32_t r = (v*new_maxval)/old_maxval;
+    return (r > new_maxval) ? new_maxval : r;
+}
+
+static inline float clamp_sample(float v, float maxval) {
+    // Written so that NaN ends up at 0 like the SIMD max(v, 0)
+    if (!(v > 0.0f))
+        v = 0.0f;
+    if (v > maxval)
+        v = maxval;
+    return v;
+}
 
 int ppm_convert_maxval_scalar(PPM_ptr img_ptr, uint16_t new_maxval) {
 
-    if (ppm_validate(img_ptr) < 0)
+    if (ppm_validate(img_ptr) < 0 || new_maxval == 0)
         return -1;
 
     uint16_t old_maxval = img_ptr->maxval;
@@ -15,87 +42,71 @@ int ppm_convert_maxval_scalar(PPM_ptr img_ptr, uint16_t new_maxval) {
     size_t old_bpc = (old_maxval <= 255) ? 1 : 2;    
     size_t new_bpc = (new_maxval <= 255) ? 1 : 2;    
 
-    size_t new_row_bytes = img_ptr->width * 3 * new_bpc;
-
-    size_t new_stride = (new_row_bytes + PPM_ALIGNMENT-1) & ~((size_t)(PPM_ALIGNMENT - 1));
+    size_t n_samples = (size_t)img_ptr->width*img_ptr->channels;
 
-    data_t new_data = (data_t)malloc(new_stride*img_ptr->width);
+    size_t new_stride;
+    data_t new_data = ppm_convert_target(img_ptr, new_maxval, &new_stride);
     if (!new_data)
         return -1;
 
     for (size_t y = 0; y < img_ptr->height; ++y) {
-        data_t src_row = img_ptr->data + y*img_ptr->stride;
-        data_t dst_row = new_data + y*new_stride;
+        const uint8_t *src_row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
+        uint8_t *dst_row = (uint8_t *)new_data + y*new_stride;
 
         if (old_bpc == 1 && new_bpc == 1) {
             /* 8 -> 8 */
-            for (size_t i = 0; i < img_ptr->width*3; ++i) {
-                uint32_t v = src_row[i];
-                dst_row[i] = (uint8_t)((v*new_maxval)/old_maxval);
+            for (size_t i = 0; i < n_samples; ++i) {
+                dst_row[i] = (uint8_t)convert_sample(src_row[i], new_maxval, old_maxval);
             }
         } else if (old_bpc == 2 && new_bpc == 2) {
             /* 16 -> 16 */
-            for (size_t i = 0; i < img_ptr->width*3; i++) {
+            for (size_t i = 0; i < n_samples; i++) {
                 size_t o = i*2;
-                uint16_t v = ((uint16_t)src_row[o] << 8) | (uint16_t)src_row[o+1];
-
-                uint16_t r = (uint16_t)((v*new_maxval) / old_maxval);
-                dst_row[o]      = (uint8_t)(r >> 8);
-                dst_row[o+1]    = (uint8_t)(r);
+                uint16_t v = load_be16(src_row + o);
+                store_be16(dst_row + o, (uint16_t)convert_sample(v, new_maxval, old_maxval));
             }
         } else if (old_bpc == 1 && new_bpc == 2) {
             /* 8 -> 16 */
-            for (size_t i = 0; i < img_ptr->width*3; i++) {
-                uint32_t v = src_row[i];
-
-                size_t o = i*2;
-                uint16_t r = (uint16_t)((v*new_maxval) / old_maxval);
-                dst_row[o]      = (uint8_t)(r >> 8);
-                dst_row[o+1]    = (uint8_t)(r);
+            for (size_t i = 0; i < n_samples; i++) {
+                store_be16(dst_row + i*2, (uint16_t)convert_sample(src_row[i], new_maxval, old_maxval));
             }
         } else {
             /* 16 -> 8 */
-            for (size_t i = 0; i < img_ptr->width*3; i++) {
-                size_t o = i*2;
-                uint16_t v = ((uint16_t)src_row[o] << 8) | (uint16_t)src_row[o+1];
-
-                dst_row[i] = (uint8_t)((v*new_maxval)/ old_maxval);
+            for (size_t i = 0; i < n_samples; i++) {
+                uint16_t v = load_be16(src_row + i*2);
+                dst_row[i] = (uint8_t)convert_sample(v, new_maxval, old_maxval);
             }
         }
     }
 
-    free(img_ptr->data);
-    img_ptr->data = new_data;
-    img_ptr->stride = new_stride;
-    img_ptr->maxval = new_maxval;
+    ppm_convert_commit(img_ptr, new_data, new_stride, new_maxval);
 
     return 0;
 }
 
-int ppm_rgb_to_grayscale_scalar(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
+/*
+ * Y goes to every one of the out channels of dst
+ */
+PPM_SPECIALIZE void grayscale_rows(PPM_ptr dst_ptr, const PPM_ptr src_ptr, const int is16, const size_t out) {
 
-    if (ppm_validate(src_ptr) < 0) {
-        return -1;
-    }
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        const uint8_t *src_row = (const uint8_t *)src_ptr->data + y*src_ptr->stride;
+        uint8_t *dst_row = (uint8_t *)dst_ptr->data + y*dst_ptr->stride;
 
-    if (dst_ptr->width != src_ptr->width || 
-            dst_ptr->height != src_ptr->height || 
-            dst_ptr->maxval != src_ptr->maxval || 
-            dst_ptr->data_size != src_ptr->data_size) {
-        return -2;
-    }
+        for (size_t i = 0; i < src_ptr->width; ++i) {
 
-    size_t bytes_per_channel = 1;
-    if (src_ptr->maxval > 255)
-        bytes_per_channel = 2;
+            if (is16) {
+                size_t o = i*6;
 
-    if (bytes_per_channel == 1) {
-        for (size_t y = 0; y < src_ptr->height; ++y) {
-            data_t src_row = src_ptr->data + y*src_ptr->stride;
-            data_t dst_row = dst_ptr->data + y*dst_ptr->stride; 
+                uint32_t R = load_be16(src_row + o);
+                uint32_t G = load_be16(src_row + o+2);
+                uint32_t B = load_be16(src_row + o+4);
 
-            for (size_t i = 0; i < src_ptr->width; ++i) {
-                
+                // Calculate luminance
+                uint16_t Y = (uint16_t)((299*R + 587*G + 114*B)/1000);
+                for (size_t c = 0; c < out; ++c)
+                    store_be16(dst_row + (i*out + c)*2, Y);
+            } else {
                 size_t o = i*3;
 
                 uint8_t R = src_row[o];
@@ -104,40 +115,42 @@ int ppm_rgb_to_grayscale_scalar(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
 
                 // Calculate luminance
                 uint8_t Y = (uint8_t)((299*R + 587*G + 114*B)/1000);
-                dst_row[o] = Y;
-                dst_row[o+1] = Y;
-                dst_row[o+2] = Y;
+                for (size_t c = 0; c < out; ++c)
+                    dst_row[i*out + c] = Y;
             }
-
         }
-    } else {
-        for (size_t y = 0; y < src_ptr->height; ++y) {
-            data_t src_row = src_ptr->data + y*src_ptr->stride;
-            data_t dst_row = dst_ptr->data + y*dst_ptr->stride; 
+    }
+}
 
-            for (size_t i = 0; i < src_ptr->width; ++i) {
-                
-                size_t o = i*6;
+typedef void (*grayscale_fn)(PPM_ptr, const PPM_ptr);
 
-                uint16_t R = (src_row[o] << 8) | src_row[o+1];
-                uint16_t G = (src_row[o+2] << 8) | src_row[o+3];
-                uint16_t B = (src_row[o+4] << 8) | src_row[o+5];
+#define GRAYSCALE_KIND(kind, is16, out) \
+    static void grayscale_##kind(PPM_ptr dst_ptr, const PPM_ptr src_ptr) { \
+        grayscale_rows(dst_ptr, src_ptr, is16, out); \
+    }
+PPM_GRAY_KINDS(GRAYSCALE_KIND)
+#undef GRAYSCALE_KIND
 
-                // Calculate luminance
-                uint16_t Y = (uint16_t)((299*R + 587*G + 114*B)/1000);
-                dst_row[o] = (uint8_t)(Y >> 8);
-                dst_row[o+1] = (uint8_t)(Y);
-                
-                dst_row[o+2] = (uint8_t)(Y >> 8);
-                dst_row[o+3] = (uint8_t)(Y);            
-                
-                dst_row[o+4] = (uint8_t)(Y >> 8);
-                dst_row[o+5] = (uint8_t)(Y);       
-            }
-        }
+#define GRAYSCALE_ENTRY(kind, is16, out) grayscale_##kind,
+static const grayscale_fn grayscale_kinds[PPM_GRAY_KIND_COUNT] = { PPM_GRAY_KINDS(GRAYSCALE_ENTRY) };
+#undef GRAYSCALE_ENTRY
+
+int ppm_rgb_to_grayscale_scalar(PPM_ptr dst_ptr, const PPM_ptr src_ptr) {
 
+    if (ppm_validate(src_ptr) < 0 || ppm_validate(dst_ptr) < 0) {
+        return -1;
     }
 
+    if (dst_ptr->width != src_ptr->width || 
+            dst_ptr->height != src_ptr->height || 
+            dst_ptr->maxval != src_ptr->maxval || 
+            src_ptr->channels != 3 ||
+            (dst_ptr->channels != 1 && dst_ptr->channels != 3)) {
+        return -2;
+    }
+
+    grayscale_kinds[ppm_gray_kind(src_ptr->maxval, dst_ptr->channels)](dst_ptr, src_ptr);
+
     return 0;
 }
 
@@ -150,24 +163,214 @@ int ppm_scale_scalar(PPM_ptr img_ptr, float scale, float bias) {
     if (img_ptr->maxval > 255)
         bytes_per_channel = 2;
 
-    if (bytes_per_channel == 1) {
+    const float vmax = (float)img_ptr->maxval;
+
+    ppm_scale_fixed_t fixed;
+    if (bytes_per_channel == 1 && ppm_scale_fixed(&fixed, scale, bias)) {
+        // A copy whose address doesn't escape, so the row stores can't alias it
+        const ppm_scale_fixed_t fx = fixed;
+        const uint16_t maxval = img_ptr->maxval;
+        const size_t n_samples = (size_t)img_ptr->width*img_ptr->channels;
+
+        for (size_t y = 0; y < img_ptr->height; ++y) {
+            uint8_t *row = (uint8_t *)img_ptr->data + y*img_ptr->stride;
+
+            for (size_t i = 0; i < n_samples; ++i) {
+                row[i] = ppm_scale_fixed_u8(&fx, row[i], maxval);
+            }
+        }
+    } else if (bytes_per_channel == 1) {
         for (size_t y = 0; y < img_ptr->height; ++y) {
-            data_t row = img_ptr->data + y*img_ptr->stride;
+            uint8_t *row = (uint8_t *)img_ptr->data + y*img_ptr->stride;
 
-            for (size_t i = 0; i < img_ptr->width*3; ++i) {
-                row[i] = (uint8_t)(row[i]*scale + bias);
+            for (size_t i = 0; i < (size_t)img_ptr->width*img_ptr->channels; ++i) {
+                row[i] = (uint8_t)clamp_sample(row[i]*scale + bias, vmax);
             }
         }
     } else {
         for (size_t y = 0; y < img_ptr->height; ++y) {
-            data_t row = img_ptr->data + y*img_ptr->stride;
+            uint8_t *row = (uint8_t *)img_ptr->data + y*img_ptr->stride;
 
-            for (size_t i = 0; i < img_ptr->width*6; ++i) {
+            for (size_t i = 0; i < (size_t)img_ptr->width*img_ptr->channels; ++i) {
                 size_t o = i*2;
-                uint16_t val = (row[o] << 8) | row[o+1];
-                uint16_t new_val = (uint16_t)(val*scale + bias);
-                row[o] = (uint8_t)(new_val >> 8);
-                row[o+1] = (uint8_t)(new_val);
+                uint16_t val = load_be16(row + o);
+                store_be16(row + o, (uint16_t)clamp_sample(val*scale + bias, vmax));
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ppm_apply_lut_scalar(PPM_ptr img_ptr, const uint8_t *map) {
+
+    if (ppm_validate(img_ptr) < 0 || img_ptr->maxval > 255)
+        return -1;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        uint8_t *row = (uint8_t *)img_ptr->data + y*img_ptr->stride;
+
+        for (size_t i = 0; i < (size_t)img_ptr->width*img_ptr->channels; ++i) {
+            row[i] = map[row[i]];
+        }
+    }
+
+    return 0;
+}
+
+static int planar_matches(const PPM_ptr img_ptr, const PPM_planar_ptr planar) {
+    return img_ptr->channels == 3 &&
+           img_ptr->width == planar->width &&
+           img_ptr->height == planar->height &&
+           img_ptr->maxval == planar->maxval;
+}
+
+int ppm_planar_unpack_scalar(PPM_planar_ptr dst, const PPM_ptr src_ptr) {
+
+    if (ppm_validate(src_ptr) < 0 || ppm_planar_validate(dst) < 0)
+        return -1;
+
+    if (!planar_matches(src_ptr, dst))
+        return -2;
+
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        const uint8_t *src_row = (const uint8_t *)src_ptr->data + y*src_ptr->stride;
+        size_t o = y*dst->stride;
+
+        if (src_ptr->maxval <= 255) {
+            uint8_t *r = (uint8_t *)dst->planes[0] + o;
+            uint8_t *g = (uint8_t *)dst->planes[1] + o;
+            uint8_t *b = (uint8_t *)dst->planes[2] + o;
+
+            for (size_t i = 0; i < src_ptr->width; ++i) {
+                r[i] = src_row[i*3];
+                g[i] = src_row[i*3+1];
+                b[i] = src_row[i*3+2];
+            }
+        } else {
+            uint16_t *r = (uint16_t *)(dst->planes[0] + o);
+            uint16_t *g = (uint16_t *)(dst->planes[1] + o);
+            uint16_t *b = (uint16_t *)(dst->planes[2] + o);
+
+            for (size_t i = 0; i < src_ptr->width; ++i) {
+                r[i] = load_be16(src_row + i*6);
+                g[i] = load_be16(src_row + i*6+2);
+                b[i] = load_be16(src_row + i*6+4);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_pack_scalar(PPM_ptr dst_ptr, const PPM_planar_ptr src) {
+
+    if (ppm_validate(dst_ptr) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (!planar_matches(dst_ptr, src))
+        return -2;
+
+    for (size_t y = 0; y < dst_ptr->height; ++y) {
+        uint8_t *dst_row = (uint8_t *)dst_ptr->data + y*dst_ptr->stride;
+        size_t o = y*src->stride;
+
+        if (dst_ptr->maxval <= 255) {
+            const uint8_t *r = (const uint8_t *)src->planes[0] + o;
+            const uint8_t *g = (const uint8_t *)src->planes[1] + o;
+            const uint8_t *b = (const uint8_t *)src->planes[2] + o;
+
+            for (size_t i = 0; i < dst_ptr->width; ++i) {
+                dst_row[i*3] = r[i];
+                dst_row[i*3+1] = g[i];
+                dst_row[i*3+2] = b[i];
+            }
+        } else {
+            const uint16_t *r = (const uint16_t *)(src->planes[0] + o);
+            const uint16_t *g = (const uint16_t *)(src->planes[1] + o);
+            const uint16_t *b = (const uint16_t *)(src->planes[2] + o);
+
+            for (size_t i = 0; i < dst_ptr->width; ++i) {
+                store_be16(dst_row + i*6, r[i]);
+                store_be16(dst_row + i*6+2, g[i]);
+                store_be16(dst_row + i*6+4, b[i]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_scale_scalar(PPM_planar_ptr planar, float scale, float bias) {
+
+    if (ppm_planar_validate(planar) < 0)
+        return -1;
+
+    const float vmax = (float)planar->maxval;
+    ppm_scale_fixed_t fixed_init;
+    int fixed = ppm_scale_fixed(&fixed_init, scale, bias);
+    const ppm_scale_fixed_t fx = fixed_init;
+    const uint16_t maxval = planar->maxval;
+    const size_t width = planar->width;
+
+    for (int c = 0; c < 3; ++c) {
+        for (size_t y = 0; y < planar->height; ++y) {
+            char *row = planar->planes[c] + y*planar->stride;
+
+            if (planar->maxval <= 255 && fixed) {
+                uint8_t *p = (uint8_t *)row;
+                for (size_t i = 0; i < width; ++i)
+                    p[i] = ppm_scale_fixed_u8(&fx, p[i], maxval);
+            } else if (planar->maxval <= 255) {
+                uint8_t *p = (uint8_t *)row;
+                for (size_t i = 0; i < planar->width; ++i)
+                    p[i] = (uint8_t)clamp_sample(p[i]*scale + bias, vmax);
+            } else {
+                uint16_t *p = (uint16_t *)row;
+                for (size_t i = 0; i < planar->width; ++i)
+                    p[i] = (uint16_t)clamp_sample(p[i]*scale + bias, vmax);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ppm_planar_rgb_to_grayscale_scalar(PPM_planar_ptr dst, const PPM_planar_ptr src) {
+
+    if (ppm_planar_validate(dst) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (dst->width != src->width ||
+            dst->height != src->height ||
+            dst->maxval != src->maxval) {
+        return -2;
+    }
+
+    for (size_t y = 0; y < src->height; ++y) {
+        size_t so = y*src->stride;
+        size_t d_o = y*dst->stride;
+
+        for (size_t i = 0; i < src->width; ++i) {
+            uint32_t R, G, B;
+            if (src->maxval <= 255) {
+                R = ((const uint8_t *)src->planes[0] + so)[i];
+                G = ((const uint8_t *)src->planes[1] + so)[i];
+                B = ((const uint8_t *)src->planes[2] + so)[i];
+            } else {
+                R = ((const uint16_t *)(src->planes[0] + so))[i];
+                G = ((const uint16_t *)(src->planes[1] + so))[i];
+                B = ((const uint16_t *)(src->planes[2] + so))[i];
+            }
+
+            // Calculate luminance
+            uint32_t Y = (299*R + 587*G + 114*B)/1000;
+
+            for (int c = 0; c < 3; ++c) {
+                if (dst->maxval <= 255)
+                    ((uint8_t *)dst->planes[c] + d_o)[i] = (uint8_t)Y;
+                else
+                    ((uint16_t *)(dst->planes[c] + d_o))[i] = (uint16_t)Y;
             }
         }
     }
@@ -175,4 +378,190 @@ int ppm_scale_scalar(PPM_ptr img_ptr, float scale, float bias) {
     return 0;
 }
 
+/*
+ * dst[i] = sum of weights[k]*src[i + k*step], accumulated in tap order
+ */
+void ppm_convolve_h_scalar(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step) {
 
+    for (size_t i = 0; i < n; ++i) {
+        float acc = weights[0]*src[i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*src[i + k*step];
+        dst[i] = acc;
+    }
+}
+
+/*
+ * Weighted sum of taps rows, rounded to nearest and clamped to [0, maxval]
+ */
+PPM_SPECIALIZE void convolve_v_row(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval, const int is16) {
+
+    const float vmax = (float)maxval;
+
+    for (size_t i = 0; i < n; ++i) {
+        float acc = weights[0]*rows[0][i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*rows[k][i];
+
+        uint16_t v = (uint16_t)clamp_sample(acc + 0.5f, vmax);
+        if (is16)
+            store_be16(dst + i*2, v);
+        else
+            dst[i] = (uint8_t)v;
+    }
+}
+
+void ppm_convolve_v_scalar(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval) {
+    if (maxval > 255)
+        convolve_v_row(dst, rows, n, weights, taps, maxval, 1);
+    else
+        convolve_v_row(dst, rows, n, weights, taps, maxval, 0);
+}
+
+static inline uint16_t round_fixed(int64_t acc, uint16_t maxval) {
+    acc = (acc + (1 << (PPM_RESIZE_BITS - 1))) >> PPM_RESIZE_BITS;
+    return (uint16_t)((acc < 0) ? 0 : (acc > maxval) ? maxval : acc);
+}
+
+/*
+ * Pixel i = sum of weights[i*taps + k]*pixel (start[i] + k), per channel
+ */
+PPM_SPECIALIZE void resize_h_row(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval,
+                                 const int is16, const int channels) {
+
+    for (size_t i = 0; i < n; ++i) {
+        const int16_t *w = weights + i*taps;
+        int64_t acc[PPM_MAX_CHANNELS] = {0, 0, 0, 0};
+
+        for (uint32_t k = 0; k < taps; ++k) {
+            size_t o = ((size_t)start[i] + k)*channels;
+            for (int c = 0; c < channels; ++c)
+                acc[c] += is16 ? w[k]*(int64_t)((const uint16_t *)src)[o + c] : w[k]*src[o + c];
+        }
+
+        for (int c = 0; c < channels; ++c) {
+            if (is16)
+                ((uint16_t *)dst)[i*channels + c] = round_fixed(acc[c], maxval);
+            else
+                dst[i*channels + c] = (uint8_t)round_fixed(acc[c], maxval);
+        }
+    }
+}
+
+typedef void (*resize_h_fn)(uint8_t *, const uint8_t *, size_t, const int32_t *, const int16_t *, uint32_t, uint16_t);
+
+#define RESIZE_H_KIND(kind, is16, channels) \
+    static void resize_h_##kind(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval) { \
+        resize_h_row(dst, src, n, start, weights, taps, maxval, is16, channels); \
+    }
+PPM_PIXEL_KINDS(RESIZE_H_KIND)
+#undef RESIZE_H_KIND
+
+#define RESIZE_H_ENTRY(kind, is16, channels) resize_h_##kind,
+static const resize_h_fn resize_h_kinds[PPM_PIXEL_KIND_COUNT] = { PPM_PIXEL_KINDS(RESIZE_H_ENTRY) };
+#undef RESIZE_H_ENTRY
+
+void ppm_resize_h_scalar(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels) {
+    resize_h_kinds[ppm_pixel_kind(maxval, channels)](dst, src, n, start, weights, taps, maxval);
+}
+
+/*
+ * Weighted sum of taps rows, stored as 8-bit or big-endian 16-bit samples
+ */
+PPM_SPECIALIZE void resize_v_row(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval, const int is16) {
+
+    for (size_t i = 0; i < n; ++i) {
+        int64_t acc = 0;
+
+        if (is16) {
+            for (uint32_t k = 0; k < taps; ++k)
+                acc += weights[k]*(int64_t)((const uint16_t *)rows[k])[i];
+            store_be16(dst + i*2, round_fixed(acc, maxval));
+        } else {
+            for (uint32_t k = 0; k < taps; ++k)
+                acc += weights[k]*rows[k][i];
+            dst[i] = (uint8_t)round_fixed(acc, maxval);
+        }
+    }
+}
+
+void ppm_resize_v_scalar(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval) {
+    if (maxval > 255)
+        resize_v_row(dst, rows, n, weights, taps, maxval, 1);
+    else
+        resize_v_row(dst, rows, n, weights, taps, maxval, 0);
+}
+
+/*
+ * Per-channel min, max, sum and sum of squares
+ */
+PPM_SPECIALIZE void stats_rows(const PPM_img *img_ptr, PPM_stats *stats, const int is16, const int channels) {
+
+    uint16_t lo[PPM_MAX_CHANNELS] = {UINT16_MAX, UINT16_MAX, UINT16_MAX, UINT16_MAX}, hi[PPM_MAX_CHANNELS] = {0, 0, 0, 0};
+    uint64_t sum[PPM_MAX_CHANNELS] = {0, 0, 0, 0}, sum_sq[PPM_MAX_CHANNELS] = {0, 0, 0, 0};
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
+
+        for (size_t i = 0; i < img_ptr->width; ++i) {
+            for (int c = 0; c < channels; ++c) {
+                size_t o = i*channels + c;
+                uint32_t v = is16 ? load_be16(row + o*2) : row[o];
+
+                if (v < lo[c])
+                    lo[c] = (uint16_t)v;
+                if (v > hi[c])
+                    hi[c] = (uint16_t)v;
+                sum[c] += v;
+                sum_sq[c] += (uint64_t)v*v;
+            }
+        }
+    }
+
+    stats->count = (uint64_t)img_ptr->width*img_ptr->height;
+    for (int c = 0; c < channels; ++c) {
+        stats->min[c] = lo[c];
+        stats->max[c] = hi[c];
+        stats->sum[c] = sum[c];
+        stats->sum_sq[c] = sum_sq[c];
+    }
+}
+
+#define STATS_KIND(kind, is16, channels) \
+    static void stats_##kind(const PPM_img *img_ptr, PPM_stats *stats) { \
+        stats_rows(img_ptr, stats, is16, channels); \
+    }
+PPM_PIXEL_KINDS(STATS_KIND)
+#undef STATS_KIND
+
+#define STATS_ENTRY(kind, is16, channels) stats_##kind,
+static void (*const stats_kinds[PPM_PIXEL_KIND_COUNT])(const PPM_img *, PPM_stats *) = { PPM_PIXEL_KINDS(STATS_ENTRY) };
+#undef STATS_ENTRY
+
+int ppm_stats_scalar(const PPM_ptr img_ptr, PPM_stats *stats) {
+
+    if (ppm_validate(img_ptr) < 0 || stats == NULL) {
+        return -1;
+    }
+
+    stats_kinds[ppm_pixel_kind(img_ptr->maxval, img_ptr->channels)](img_ptr, stats);
+    return 0;
+}
+
+/*
+ * Classify 64 bytes of plain PNM text
+ */
+uint64_t ppm_text_mask_scalar(const char *text, uint64_t *other) {
+    uint64_t digits = 0, rest = 0;
+
+    for (int i = 0; i < 64; ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= '0' && c <= '9')
+            digits |= (uint64_t)1 << i;
+        else if (c != ' ' && (c < '\t' || c > '\r'))
+            rest |= (uint64_t)1 << i;
+    }
+
+    *other = rest;
+    return digits;
+}
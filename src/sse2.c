@@ -1,48 +1,162 @@
 
 #include "cachepix.h"
+#include "cachepix_internal.h"
 
 #if defined(__SSE2__)
 #include <emmintrin.h> // SSE2
-#include <smmintrin.h>
+#include <string.h>
 
+/*
+ * 16-bit samples are big-endian; SSE2 has no byte shuffle, so swap with shifts
+ */
+static inline __m128i bswap16(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+/*
+ * Pack u32 lanes holding values up to 65535 into u16
+ * packs_epi32 saturates signed, so bias into the signed range and back
+ */
+static inline __m128i pack_u32_u16(__m128i lo, __m128i hi) {
+    const __m128i bias32 = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    __m128i v = _mm_packs_epi32(_mm_sub_epi32(lo, bias32), _mm_sub_epi32(hi, bias32));
+    return _mm_xor_si128(v, bias16);
+}
+
+static inline float clamp_sample(float v, float maxval) {
+    if (!(v > 0.0f))
+        v = 0.0f;
+    if (v > maxval)
+        v = maxval;
+    return v;
+}
+
+static inline __m128 scale_ps(__m128i v32, __m128 vscale, __m128 vbias, __m128 vmax) {
+    __m128 f = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v32), vscale), vbias);
+    return _mm_min_ps(_mm_max_ps(f, _mm_setzero_ps()), vmax);
+}
+
+/*
+ * x*scale + bias on 8 native u16 samples, clamped and truncated
+ */
+static inline __m128i scale8_u16(__m128i v, __m128 vscale, __m128 vbias, __m128 vmax) {
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128 flo = scale_ps(_mm_unpacklo_epi16(v, zero), vscale, vbias, vmax);
+    __m128 fhi = scale_ps(_mm_unpackhi_epi16(v, zero), vscale, vbias, vmax);
+
+    return pack_u32_u16(_mm_cvttps_epi32(flo), _mm_cvttps_epi32(fhi));
+}
+
+/*
+ * The same on 16 u8 samples
+ */
+static inline __m128i scale16_u8(__m128i bytes, __m128 vscale, __m128 vbias, __m128 vmax) {
+    const __m128i zero = _mm_setzero_si128();
+
+    // unpack u8 -> u16
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+
+    // u16 -> u32 -> float, scale and clamp
+    __m128 f0 = scale_ps(_mm_unpacklo_epi16(lo, zero), vscale, vbias, vmax);
+    __m128 f1 = scale_ps(_mm_unpackhi_epi16(lo, zero), vscale, vbias, vmax);
+    __m128 f2 = scale_ps(_mm_unpacklo_epi16(hi, zero), vscale, vbias, vmax);
+    __m128 f3 = scale_ps(_mm_unpackhi_epi16(hi, zero), vscale, vbias, vmax);
+
+    // values are within [0, 255], signed packs are safe
+    __m128i lo16 = _mm_packs_epi32(_mm_cvttps_epi32(f0), _mm_cvttps_epi32(f1));
+    __m128i hi16 = _mm_packs_epi32(_mm_cvttps_epi32(f2), _mm_cvttps_epi32(f3));
+    return _mm_packus_epi16(lo16, hi16);
+}
+
+/*
+ * The fixed-point form of scale16_u8 (see ppm_scale_fixed)
+ * After the shift the lanes are below 2^14, so the signed min is safe
+ */
+static inline __m128i scale16_u8_fixed(__m128i bytes, __m128i vmul, __m128i vadd, __m128i vsub,
+                                       __m128i vshift, __m128i vmax) {
+    const __m128i zero = _mm_setzero_si128();
+
+    // bytes above a zero byte: v << 8
+    __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, bytes), vmul);
+    __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, bytes), vmul);
+
+    lo = _mm_subs_epu16(_mm_adds_epu16(lo, vadd), vsub);
+    hi = _mm_subs_epu16(_mm_adds_epu16(hi, vadd), vsub);
+
+    lo = _mm_min_epi16(_mm_srl_epi16(lo, vshift), vmax);
+    hi = _mm_min_epi16(_mm_srl_epi16(hi, vshift), vmax);
+
+    return _mm_packus_epi16(lo, hi);
+}
+
+static void scale_row8_fixed(uint8_t *row, size_t n_samples, const ppm_scale_fixed_t *fx, uint16_t maxval) {
+    const __m128i vmul = _mm_set1_epi16((short)fx->mul);
+    const __m128i vadd = _mm_set1_epi16((short)fx->add);
+    const __m128i vsub = _mm_set1_epi16((short)fx->sub);
+    const __m128i vshift = _mm_cvtsi32_si128(fx->shift);
+    const __m128i vmax = _mm_set1_epi16((short)maxval);
+
+    size_t x = 0;
+    for (; x + 16 <= n_samples; x += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *)(row + x));
+        _mm_storeu_si128((__m128i *)(row + x), scale16_u8_fixed(bytes, vmul, vadd, vsub, vshift, vmax));
+    }
+
+    for (; x < n_samples; ++x)
+        row[x] = ppm_scale_fixed_u8(fx, row[x], maxval);
+}
 
 int ppm_scale_sse2(PPM_ptr img_ptr, float scale, float bias) {
     if (ppm_validate(img_ptr) < 0)
         return -1;
 
-    const size_t row_bytes = img_ptr->width*3;
+    const size_t n_samples = (size_t)img_ptr->width*img_ptr->channels;
+    const float maxval = (float)img_ptr->maxval;
     const __m128 vscale = _mm_set1_ps(scale);
     const __m128 vbias = _mm_set1_ps(bias);
+    const __m128 vmax = _mm_set1_ps(maxval);
 
-    for (size_t y = 0; y < img_ptr->height; ++y) {
-        data_t row = img_ptr->data + y * img_ptr->stride;
-        size_t x = 0;
-
-        for (; x + 16 <= row_bytes; x+=16) {
-            __m128i bytes = _mm_load_si128((__m128i *)(row+x));
+    if (img_ptr->maxval > 255) {
+        for (size_t y = 0; y < img_ptr->height; ++y) {
+            uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
+            size_t x = 0;
 
-            // unpack u8 -> u16
-            __m128i lo = _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
-            __m128i hi = _mm_unpackhi_epi8(bytes, _mm_setzero_si128());
-
-            // convert to float
-            __m128 flo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, _mm_setzero_si128()));
-            __m128 fhi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, _mm_setzero_si128()));
+            for (; x + 8 <= n_samples; x += 8) {
+                __m128i v = bswap16(_mm_loadu_si128((__m128i *)(row + x*2)));
+                _mm_storeu_si128((__m128i *)(row + x*2), bswap16(scale8_u16(v, vscale, vbias, vmax)));
+            }
 
-            flo = _mm_add_ps(_mm_mul_ps(flo, vscale), vbias);
-            fhi = _mm_add_ps(_mm_mul_ps(fhi, vscale), vbias);
+            for (; x < n_samples; ++x) {
+                uint16_t v = (uint16_t)((row[x*2] << 8) | row[x*2+1]);
+                uint16_t r = (uint16_t)clamp_sample(v * scale + bias, maxval);
+                row[x*2] = (uint8_t)(r >> 8);
+                row[x*2+1] = (uint8_t)r;
+            }
+        }
+        return 0;
+    }
 
-            __m128i ilo = _mm_cvtps_epi32(flo);
-            __m128i ihi = _mm_cvtps_epi32(fhi);
+    ppm_scale_fixed_t fx;
+    if (ppm_scale_fixed(&fx, scale, bias)) {
+        for (size_t y = 0; y < img_ptr->height; ++y)
+            scale_row8_fixed((uint8_t*)img_ptr->data + y * img_ptr->stride, n_samples, &fx, img_ptr->maxval);
+        return 0;
+    }
 
-            __m128i packed16 = _mm_packus_epi32(ilo, ihi);
-            __m128i packed8 = _mm_packus_epi16(packed16, packed16);
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        uint8_t *row = (uint8_t*)img_ptr->data + y * img_ptr->stride;
+        size_t x = 0;
 
-            _mm_store_si128((__m128i *)(row + x), packed8);
+        for (; x + 16 <= n_samples; x+=16) {
+            __m128i bytes = _mm_loadu_si128((__m128i *)(row+x));
+            _mm_storeu_si128((__m128i *)(row + x), scale16_u8(bytes, vscale, vbias, vmax));
         }
 
-        for (; x < row_bytes; ++x) {
-            row[x] = (uint8_t)(row[x] * scale + bias);
+        for (; x < n_samples; ++x) {
+            row[x] = (uint8_t)clamp_sample(row[x] * scale + bias, maxval);
         }
 
     }
@@ -50,88 +164,861 @@ int ppm_scale_sse2(PPM_ptr img_ptr, float scale, float bias) {
     return 0;
 }
 
+/*
+ * floor(v * new_maxval / old_maxval), capped at new_maxval, for 4 u32 lanes
+ * With an 8-bit side the product is below 2^24, exact in float, and the
+ * correctly rounded quotient floors to the integer one. 16 -> 16 uses doubles.
+ */
+static inline __m128i convert4_ps(__m128i v, __m128 vnew, __m128 vold) {
+    __m128 q = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), vnew), vold);
+    return _mm_cvttps_epi32(_mm_min_ps(q, vnew));
+}
+
+static inline __m128i convert4_pd(__m128i v, __m128d vnew, __m128d vold) {
+    __m128d lo = _mm_cvtepi32_pd(v);
+    __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    lo = _mm_min_pd(_mm_div_pd(_mm_mul_pd(lo, vnew), vold), vnew);
+    hi = _mm_min_pd(_mm_div_pd(_mm_mul_pd(hi, vnew), vold), vnew);
+
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
 int ppm_convert_maxval_sse2(PPM_ptr img_ptr, uint16_t new_maxval) {
-    if (ppm_validate(img_ptr) < 0)
+    if (ppm_validate(img_ptr) < 0 || new_maxval == 0)
+        return -1;
+
+    uint16_t old_maxval = img_ptr->maxval;
+    if (new_maxval == old_maxval)
+        return 0;
+
+    int old16 = old_maxval > 255;
+    int new16 = new_maxval > 255;
+
+    size_t new_stride;
+    data_t new_data = ppm_convert_target(img_ptr, new_maxval, &new_stride);
+    if (!new_data)
         return -1;
-    double scale = (double)new_maxval / (double)img_ptr->maxval;
-    ppm_scale_sse2(img_ptr, scale, 0.0);
-    img_ptr->maxval = new_maxval;
+
+    const __m128 vnew = _mm_set1_ps((float)new_maxval);
+    const __m128 vold = _mm_set1_ps((float)old_maxval);
+    const __m128d vnew_d = _mm_set1_pd((double)new_maxval);
+    const __m128d vold_d = _mm_set1_pd((double)old_maxval);
+    const __m128i zero = _mm_setzero_si128();
+    const size_t n_samples = (size_t)img_ptr->width * img_ptr->channels;
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *src = (const uint8_t*)img_ptr->data + y * img_ptr->stride;
+        uint8_t *dst = (uint8_t*)new_data + y * new_stride;
+
+        // 8 samples per iteration, as u16 lanes
+        size_t i = 0;
+        for (; i + 8 <= n_samples; i += 8) {
+            __m128i v = old16 ? bswap16(_mm_loadu_si128((const __m128i*)(src + i*2)))
+                              : _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i)), zero);
+            __m128i lo = _mm_unpacklo_epi16(v, zero);
+            __m128i hi = _mm_unpackhi_epi16(v, zero);
+
+            if (old16 && new16) {
+                lo = convert4_pd(lo, vnew_d, vold_d);
+                hi = convert4_pd(hi, vnew_d, vold_d);
+            } else {
+                lo = convert4_ps(lo, vnew, vold);
+                hi = convert4_ps(hi, vnew, vold);
+            }
+
+            __m128i r = pack_u32_u16(lo, hi);
+            if (new16)
+                _mm_storeu_si128((__m128i*)(dst + i*2), bswap16(r));
+            else
+                _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(r, r));
+        }
+
+        // scalar tail
+        for (; i < n_samples; ++i) {
+            uint32_t v = old16 ? (uint32_t)((src[i*2] << 8) | src[i*2+1]) : src[i];
+            uint32_t r = (v*new_maxval)/old_maxval;
+            if (r > new_maxval)
+                r = new_maxval;
+
+            if (new16) {
+                dst[i*2] = (uint8_t)(r >> 8);
+                dst[i*2+1] = (uint8_t)r;
+            } else {
+                dst[i] = (uint8_t)r;
+            }
+        }
+    }
+
+    ppm_convert_commit(img_ptr, new_data, new_stride, new_maxval);
     return 0;
 }
 
+/*
+ * Full 32-bit products of 8 u16 samples with 8 u16 weights
+ */
+static inline void mul_u16_u32(__m128i v, __m128i w, __m128i *lo, __m128i *hi) {
+    __m128i pl = _mm_mullo_epi16(v, w);
+    __m128i ph = _mm_mulhi_epu16(v, w);
+    *lo = _mm_unpacklo_epi16(pl, ph);
+    *hi = _mm_unpackhi_epi16(pl, ph);
+}
+
+/*
+ * Luma of 4 pixels from their 12 samples (u16 lanes: v0 = samples 0..7, v1 = 8..11)
+ * Without byte shuffles the channels are never separated: every sample is
+ * multiplied by its channel weight, then the 12 products are transposed 3-way
+ * so that each lane adds up one pixel.
+ */
+static inline __m128i luma4(__m128i v0, __m128i v1) {
+    const __m128i w0 = _mm_setr_epi16(299, 587, 114, 299, 587, 114, 299, 587);
+    const __m128i w1 = _mm_setr_epi16(114, 299, 587, 114, 0, 0, 0, 0);
+    const __m128 v125 = _mm_set1_ps(125.0f);
+
+    __m128i a, b, c, unused;
+    mul_u16_u32(v0, w0, &a, &b);
+    mul_u16_u32(v1, w1, &c, &unused);
+
+    __m128 A = _mm_castsi128_ps(a);     // P0  P1  P2  P3
+    __m128 B = _mm_castsi128_ps(b);     // P4  P5  P6  P7
+    __m128 C = _mm_castsi128_ps(c);     // P8  P9  P10 P11
+
+    __m128 x = _mm_shuffle_ps(A, _mm_shuffle_ps(B, C, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+    __m128 y = _mm_shuffle_ps(_mm_shuffle_ps(A, B, _MM_SHUFFLE(0, 0, 1, 1)),
+                              _mm_shuffle_ps(B, C, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 z = _mm_shuffle_ps(_mm_shuffle_ps(A, B, _MM_SHUFFLE(1, 1, 2, 2)),
+                              _mm_shuffle_ps(C, C, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+    __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_castps_si128(x), _mm_castps_si128(y)), _mm_castps_si128(z));
+
+    // sum/1000 == (sum/8)/125, and sum/8 < 2^23 divides exactly in float
+    __m128 t = _mm_cvtepi32_ps(_mm_srli_epi32(sum, 3));
+    return _mm_cvttps_epi32(_mm_div_ps(t, v125));
+}
+
+/*
+ * Grayscale rows into out (1 or 3) channels, instantiated per sample size
+ * and out
+ */
+PPM_SPECIALIZE void grayscale_rows(PPM_ptr dst_ptr, const PPM_ptr src_ptr, const int is16, const size_t out)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    for (size_t y = 0; y < src_ptr->height; ++y) {
+        const uint8_t *srow = (const uint8_t*)src_ptr->data + y * src_ptr->stride;
+        uint8_t *drow = (uint8_t*)dst_ptr->data + y * dst_ptr->stride;
+
+        size_t x = 0;
+
+        // 4 pixels (12 samples) at a time
+        for (; x + 4 <= src_ptr->width; x += 4) {
+            __m128i v0, v1;
+
+            if (is16) {
+                const uint8_t *p = srow + x*6;
+                v0 = bswap16(_mm_loadu_si128((const __m128i*)p));
+                v1 = bswap16(_mm_loadl_epi64((const __m128i*)(p + 16)));
+            } else {
+                const uint8_t *p = srow + x*3;
+                int32_t tail;
+                memcpy(&tail, p + 8, sizeof(tail));
+                v0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+                v1 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(tail), zero);
+            }
+
+            uint32_t Y[4];
+            _mm_storeu_si128((__m128i*)Y, luma4(v0, v1));
+
+            for (int k = 0; k < 4; ++k) {
+                if (is16) {
+                    uint8_t *q = drow + (x + k)*2*out;
+                    q[0] = (uint8_t)(Y[k] >> 8);
+                    q[1] = (uint8_t)Y[k];
+                    if (out == 3) {
+                        q[2] = q[4] = q[0];
+                        q[3] = q[5] = q[1];
+                    }
+                } else {
+                    uint8_t *q = drow + (x + k)*out;
+                    q[0] = (uint8_t)Y[k];
+                    if (out == 3)
+                        q[1] = q[2] = q[0];
+                }
+            }
+        }
+
+        // scalar tail
+        for (; x < src_ptr->width; ++x) {
+            uint32_t R, G, B;
+            if (is16) {
+                const uint8_t *p = srow + x*6;
+                R = (uint32_t)((p[0] << 8) | p[1]);
+                G = (uint32_t)((p[2] << 8) | p[3]);
+                B = (uint32_t)((p[4] << 8) | p[5]);
+            } else {
+                R = srow[x*3 + 0];
+                G = srow[x*3 + 1];
+                B = srow[x*3 + 2];
+            }
+
+            uint32_t Yv = (299*R + 587*G + 114*B)/1000;
+
+            if (is16) {
+                uint8_t *q = drow + x*2*out;
+                q[0] = (uint8_t)(Yv >> 8);
+                q[1] = (uint8_t)Yv;
+                if (out == 3) {
+                    q[2] = q[4] = q[0];
+                    q[3] = q[5] = q[1];
+                }
+            } else {
+                uint8_t *q = drow + x*out;
+                q[0] = (uint8_t)Yv;
+                if (out == 3)
+                    q[1] = q[2] = q[0];
+            }
+        }
+    }
+}
+
+typedef void (*grayscale_fn)(PPM_ptr, const PPM_ptr);
+
+#define GRAYSCALE_KIND(kind, is16, out) \
+    static void grayscale_##kind(PPM_ptr dst_ptr, const PPM_ptr src_ptr) { \
+        grayscale_rows(dst_ptr, src_ptr, is16, out); \
+    }
+PPM_GRAY_KINDS(GRAYSCALE_KIND)
+#undef GRAYSCALE_KIND
+
+#define GRAYSCALE_ENTRY(kind, is16, out) grayscale_##kind,
+static const grayscale_fn grayscale_kinds[PPM_GRAY_KIND_COUNT] = { PPM_GRAY_KINDS(GRAYSCALE_ENTRY) };
+#undef GRAYSCALE_ENTRY
+
 int ppm_rgb_to_grayscale_sse2(PPM_ptr dst_ptr, const PPM_ptr src_ptr)
 {
     if (ppm_validate(dst_ptr) < 0 || ppm_validate(src_ptr) < 0)
         return -1;
 
-    //const size_t row_bytes = src_ptr->width * 3;
+    if (dst_ptr->width != src_ptr->width ||
+            dst_ptr->height != src_ptr->height ||
+            dst_ptr->maxval != src_ptr->maxval ||
+            src_ptr->channels != 3 ||
+            (dst_ptr->channels != 1 && dst_ptr->channels != 3)) {
+        return -2;
+    }
 
-    // fixed-point weights (Q8) to avoid float math
-    const __m128i wR = _mm_set1_epi16(77);   // 0.299 * 256 ≈ 77
-    const __m128i wG = _mm_set1_epi16(150);  // 0.587 * 256 ≈ 150
-    const __m128i wB = _mm_set1_epi16(29);   // 0.114 * 256 ≈ 29
+    grayscale_kinds[ppm_gray_kind(src_ptr->maxval, dst_ptr->channels)](dst_ptr, src_ptr);
 
-    for (size_t y = 0; y < src_ptr->height; ++y) {
-        data_t srow = src_ptr->data + y * src_ptr->stride;
-        data_t drow = dst_ptr->data + y * dst_ptr->stride;
+    return 0;
+}
 
-        size_t x = 0;
+/*
+ * Planar images need no shuffles: the channels already sit in planes of
+ * their own, so both operations run straight down the rows
+ */
+int ppm_planar_scale_sse2(PPM_planar_ptr planar, float scale, float bias) {
+    if (ppm_planar_validate(planar) < 0)
+        return -1;
+
+    const float maxval = (float)planar->maxval;
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vbias = _mm_set1_ps(bias);
+    const __m128 vmax = _mm_set1_ps(maxval);
+    ppm_scale_fixed_t fx;
+    int fixed = planar->maxval <= 255 && ppm_scale_fixed(&fx, scale, bias);
+
+    for (int c = 0; c < 3; ++c) {
+        for (size_t y = 0; y < planar->height; ++y) {
+            uint8_t *row = (uint8_t*)planar->planes[c] + y * planar->stride;
+            size_t x = 0;
 
-        // Process 16 pixels at a time (16 * 3 = 48 bytes)
-        for (; x + 16 <= src_ptr->width; x += 16) {
-            // Load 48 bytes (16 RGB pixels) in three 16-byte chunks
-            __m128i r_chunk, g_chunk, b_chunk;
-            uint8_t rvals[16], gvals[16], bvals[16];
+            if (fixed) {
+                scale_row8_fixed(row, planar->width, &fx, planar->maxval);
+            } else if (planar->maxval > 255) {
+                uint16_t *p = (uint16_t*)row;
+                for (; x + 8 <= planar->width; x += 8) {
+                    __m128i v = _mm_loadu_si128((__m128i *)(p + x));
+                    _mm_storeu_si128((__m128i *)(p + x), scale8_u16(v, vscale, vbias, vmax));
+                }
 
-            for (int i = 0; i < 16; ++i) {
-                rvals[i] = srow[(x + i) * 3 + 0];
-                gvals[i] = srow[(x + i) * 3 + 1];
-                bvals[i] = srow[(x + i) * 3 + 2];
+                for (; x < planar->width; ++x)
+                    p[x] = (uint16_t)clamp_sample(p[x] * scale + bias, maxval);
+            } else {
+                for (; x + 16 <= planar->width; x += 16) {
+                    __m128i v = _mm_loadu_si128((__m128i *)(row + x));
+                    _mm_storeu_si128((__m128i *)(row + x), scale16_u8(v, vscale, vbias, vmax));
+                }
+
+                for (; x < planar->width; ++x)
+                    row[x] = (uint8_t)clamp_sample(row[x] * scale + bias, maxval);
             }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Luma of 8 8-bit pixels (u16 lanes)
+ * The weights split as 8*hi + lo: p1 = 37R + 73G + 14B, p2 = 3R + 3G + 2B,
+ * sum/1000 == (p1 + (p2>>3))/125, and t/125 == mulhi(t, 33555)>>6 for t <= 31875
+ */
+static inline __m128i luma8_u16(__m128i R, __m128i G, __m128i B) {
+    __m128i p1 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(37)),
+                                             _mm_mullo_epi16(G, _mm_set1_epi16(73))),
+                               _mm_mullo_epi16(B, _mm_set1_epi16(14)));
+    __m128i p2 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(3)),
+                                             _mm_mullo_epi16(G, _mm_set1_epi16(3))),
+                               _mm_slli_epi16(B, 1));
+    __m128i t = _mm_add_epi16(p1, _mm_srli_epi16(p2, 3));
+    return _mm_srli_epi16(_mm_mulhi_epu16(t, _mm_set1_epi16((short)33555)), 6);
+}
+
+/*
+ * Luma of 8 16-bit pixels (native u16 lanes)
+ */
+static inline __m128i luma8_u16_16(__m128i R, __m128i G, __m128i B) {
+    const __m128 v125 = _mm_set1_ps(125.0f);
+    __m128i r_lo, r_hi, g_lo, g_hi, b_lo, b_hi;
+
+    mul_u16_u32(R, _mm_set1_epi16(299), &r_lo, &r_hi);
+    mul_u16_u32(G, _mm_set1_epi16(587), &g_lo, &g_hi);
+    mul_u16_u32(B, _mm_set1_epi16(114), &b_lo, &b_hi);
 
-            r_chunk = _mm_loadu_si128((__m128i*)rvals);
-            g_chunk = _mm_loadu_si128((__m128i*)gvals);
-            b_chunk = _mm_loadu_si128((__m128i*)bvals);
+    __m128i lo = _mm_add_epi32(_mm_add_epi32(r_lo, g_lo), b_lo);
+    __m128i hi = _mm_add_epi32(_mm_add_epi32(r_hi, g_hi), b_hi);
 
-            // unpack to 16-bit integers
-            __m128i r_lo = _mm_unpacklo_epi8(r_chunk, _mm_setzero_si128());
-            __m128i r_hi = _mm_unpackhi_epi8(r_chunk, _mm_setzero_si128());
-            __m128i g_lo = _mm_unpacklo_epi8(g_chunk, _mm_setzero_si128());
-            __m128i g_hi = _mm_unpackhi_epi8(g_chunk, _mm_setzero_si128());
-            __m128i b_lo = _mm_unpacklo_epi8(b_chunk, _mm_setzero_si128());
-            __m128i b_hi = _mm_unpackhi_epi8(b_chunk, _mm_setzero_si128());
+    // sum/1000 == (sum/8)/125, and sum/8 < 2^23 divides exactly in float
+    lo = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(_mm_srli_epi32(lo, 3)), v125));
+    hi = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(_mm_srli_epi32(hi, 3)), v125));
+    return pack_u32_u16(lo, hi);
+}
+
+int ppm_planar_rgb_to_grayscale_sse2(PPM_planar_ptr dst, const PPM_planar_ptr src) {
+    if (ppm_planar_validate(dst) < 0 || ppm_planar_validate(src) < 0)
+        return -1;
+
+    if (dst->width != src->width ||
+            dst->height != src->height ||
+            dst->maxval != src->maxval) {
+        return -2;
+    }
+
+    const int is16 = src->maxval > 255;
+    const __m128i zero = _mm_setzero_si128();
 
-            // multiply by fixed-point weights
-            __m128i gray_lo = _mm_add_epi16(
-                                  _mm_add_epi16(_mm_mullo_epi16(r_lo, wR),
-                                                _mm_mullo_epi16(g_lo, wG)),
-                                  _mm_mullo_epi16(b_lo, wB));
-            __m128i gray_hi = _mm_add_epi16(
-                                  _mm_add_epi16(_mm_mullo_epi16(r_hi, wR),
-                                                _mm_mullo_epi16(g_hi, wG)),
-                                  _mm_mullo_epi16(b_hi, wB));
+    for (size_t y = 0; y < src->height; ++y) {
+        const uint8_t *r = (const uint8_t*)src->planes[0] + y * src->stride;
+        const uint8_t *g = (const uint8_t*)src->planes[1] + y * src->stride;
+        const uint8_t *b = (const uint8_t*)src->planes[2] + y * src->stride;
+        uint8_t *d0 = (uint8_t*)dst->planes[0] + y * dst->stride;
+        uint8_t *d1 = (uint8_t*)dst->planes[1] + y * dst->stride;
+        uint8_t *d2 = (uint8_t*)dst->planes[2] + y * dst->stride;
 
-            // shift back down (divide by 256)
-            gray_lo = _mm_srli_epi16(gray_lo, 8);
-            gray_hi = _mm_srli_epi16(gray_hi, 8);
+        size_t x = 0;
+        if (is16) {
+            for (; x + 8 <= src->width; x += 8) {
+                __m128i Y = luma8_u16_16(_mm_loadu_si128((const __m128i*)(r + x*2)),
+                                         _mm_loadu_si128((const __m128i*)(g + x*2)),
+                                         _mm_loadu_si128((const __m128i*)(b + x*2)));
+                _mm_storeu_si128((__m128i*)(d0 + x*2), Y);
+                _mm_storeu_si128((__m128i*)(d1 + x*2), Y);
+                _mm_storeu_si128((__m128i*)(d2 + x*2), Y);
+            }
+        } else {
+            for (; x + 16 <= src->width; x += 16) {
+                __m128i R = _mm_loadu_si128((const __m128i*)(r + x));
+                __m128i G = _mm_loadu_si128((const __m128i*)(g + x));
+                __m128i B = _mm_loadu_si128((const __m128i*)(b + x));
 
-            // pack back to 8-bit
-            __m128i gray = _mm_packus_epi16(gray_lo, gray_hi);
+                __m128i y_lo = luma8_u16(_mm_unpacklo_epi8(R, zero), _mm_unpacklo_epi8(G, zero),
+                                         _mm_unpacklo_epi8(B, zero));
+                __m128i y_hi = luma8_u16(_mm_unpackhi_epi8(R, zero), _mm_unpackhi_epi8(G, zero),
+                                         _mm_unpackhi_epi8(B, zero));
+                __m128i Y = _mm_packus_epi16(y_lo, y_hi);
 
-            // store to dst_ptr row
-            _mm_storeu_si128((__m128i*)(drow + x), gray);
+                _mm_storeu_si128((__m128i*)(d0 + x), Y);
+                _mm_storeu_si128((__m128i*)(d1 + x), Y);
+                _mm_storeu_si128((__m128i*)(d2 + x), Y);
+            }
         }
 
         // scalar tail
-        for (; x < src_ptr->width; ++x) {
-            uint8_t R = srow[x*3 + 0];
-            uint8_t G = srow[x*3 + 1];
-            uint8_t B = srow[x*3 + 2];
-            drow[x] = (uint8_t)((77*R + 150*G + 29*B) >> 8);
+        for (; x < src->width; ++x) {
+            uint32_t R, G, B;
+            if (is16) {
+                R = ((const uint16_t*)r)[x];
+                G = ((const uint16_t*)g)[x];
+                B = ((const uint16_t*)b)[x];
+            } else {
+                R = r[x];
+                G = g[x];
+                B = b[x];
+            }
+
+            uint32_t Yv = (299*R + 587*G + 114*B)/1000;
+
+            if (is16) {
+                ((uint16_t*)d0)[x] = ((uint16_t*)d1)[x] = ((uint16_t*)d2)[x] = (uint16_t)Yv;
+            } else {
+                d0[x] = d1[x] = d2[x] = (uint8_t)Yv;
+            }
         }
     }
 
     return 0;
 }
 
+/*
+ * Convolution, 16 samples per iteration in four independent accumulators
+ * Each lane adds its taps in order, like the scalar loop
+ */
+void ppm_convolve_h_sse2(float *dst, const float *src, size_t n, const float *weights, uint32_t taps, uint32_t step) {
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128 w = _mm_set1_ps(weights[0]);
+        __m128 a0 = _mm_mul_ps(w, _mm_loadu_ps(src + i));
+        __m128 a1 = _mm_mul_ps(w, _mm_loadu_ps(src + i + 4));
+        __m128 a2 = _mm_mul_ps(w, _mm_loadu_ps(src + i + 8));
+        __m128 a3 = _mm_mul_ps(w, _mm_loadu_ps(src + i + 12));
+
+        for (uint32_t k = 1; k < taps; ++k) {
+            const float *p = src + i + k*step;
+            w = _mm_set1_ps(weights[k]);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(w, _mm_loadu_ps(p)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(w, _mm_loadu_ps(p + 4)));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(w, _mm_loadu_ps(p + 8)));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(w, _mm_loadu_ps(p + 12)));
+        }
+
+        _mm_storeu_ps(dst + i, a0);
+        _mm_storeu_ps(dst + i + 4, a1);
+        _mm_storeu_ps(dst + i + 8, a2);
+        _mm_storeu_ps(dst + i + 12, a3);
+    }
+
+    for (; i < n; ++i) {
+        float acc = weights[0]*src[i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*src[i + k*step];
+        dst[i] = acc;
+    }
+}
+
+/*
+ * Round to nearest, clamp to [0, maxval] and truncate to u32 lanes
+ */
+static inline __m128i round_sample(__m128 acc, __m128 vmax) {
+    __m128 f = _mm_add_ps(acc, _mm_set1_ps(0.5f));
+    return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(f, _mm_setzero_ps()), vmax));
+}
+
+void ppm_convolve_v_sse2(uint8_t *dst, const float *const *rows, size_t n, const float *weights, uint32_t taps, uint16_t maxval) {
+    const __m128 vmax = _mm_set1_ps((float)maxval);
+    const int is16 = maxval > 255;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128 w = _mm_set1_ps(weights[0]);
+        __m128 a0 = _mm_mul_ps(w, _mm_loadu_ps(rows[0] + i));
+        __m128 a1 = _mm_mul_ps(w, _mm_loadu_ps(rows[0] + i + 4));
+        __m128 a2 = _mm_mul_ps(w, _mm_loadu_ps(rows[0] + i + 8));
+        __m128 a3 = _mm_mul_ps(w, _mm_loadu_ps(rows[0] + i + 12));
+
+        for (uint32_t k = 1; k < taps; ++k) {
+            const float *p = rows[k] + i;
+            w = _mm_set1_ps(weights[k]);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(w, _mm_loadu_ps(p)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(w, _mm_loadu_ps(p + 4)));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(w, _mm_loadu_ps(p + 8)));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(w, _mm_loadu_ps(p + 12)));
+        }
+
+        __m128i v0 = round_sample(a0, vmax), v1 = round_sample(a1, vmax);
+        __m128i v2 = round_sample(a2, vmax), v3 = round_sample(a3, vmax);
+
+        if (is16) {
+            _mm_storeu_si128((__m128i *)(dst + i*2), bswap16(pack_u32_u16(v0, v1)));
+            _mm_storeu_si128((__m128i *)(dst + i*2 + 16), bswap16(pack_u32_u16(v2, v3)));
+        } else {
+            // values are within [0, 255], signed packs are safe
+            __m128i lo = _mm_packs_epi32(v0, v1);
+            __m128i hi = _mm_packs_epi32(v2, v3);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+        }
+    }
+
+    for (; i < n; ++i) {
+        float acc = weights[0]*rows[0][i];
+        for (uint32_t k = 1; k < taps; ++k)
+            acc = acc + weights[k]*rows[k][i];
+
+        uint16_t v = (uint16_t)clamp_sample(acc + 0.5f, (float)maxval);
+        if (is16) {
+            dst[i*2] = (uint8_t)(v >> 8);
+            dst[i*2+1] = (uint8_t)v;
+        } else {
+            dst[i] = (uint8_t)v;
+        }
+    }
+}
+
+/*
+ * Resize, 8-bit samples; 16-bit ones take the scalar kernels
+ * Horizontal: one output pixel at a time, two taps per step, their R, G
+ * and B paired up for madd so the sums come out as [R, G, B, junk]
+ */
+static inline __m128i load_pixel16(const uint8_t *p) {
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), _mm_setzero_si128());
+}
+
+/*
+ * Two weights side by side in a 32-bit lane, as madd pairs them
+ */
+static inline int32_t weight_pair(int16_t w0, int16_t w1) {
+    return (int32_t)((uint32_t)(uint16_t)w0 | (uint32_t)(uint16_t)w1 << 16);
+}
+
+static inline uint32_t round_fixed8(__m128i acc, __m128i vmax) {
+    acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << (PPM_RESIZE_BITS - 1))), PPM_RESIZE_BITS);
+    acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_min_epu8(acc, vmax));
+}
+
+void ppm_resize_h_sse2(uint8_t *dst, const uint8_t *src, size_t n, const int32_t *start, const int16_t *weights, uint32_t taps, uint16_t maxval, uint16_t channels) {
+    if (maxval > 255 || channels != 3) {
+        ppm_resize_h_scalar(dst, src, n, start, weights, taps, maxval, channels);
+        return;
+    }
+
+    const __m128i vmax = _mm_set1_epi8((char)maxval);
+
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t *s = src + (size_t)start[i]*3;
+        const int16_t *w = weights + i*taps;
+        __m128i acc = _mm_setzero_si128();
+
+        for (uint32_t k = 0; k < taps; k += 2) {
+            __m128i px = _mm_unpacklo_epi16(load_pixel16(s + k*3), load_pixel16(s + k*3 + 3));
+            __m128i wv = _mm_set1_epi32(weight_pair(w[k], w[k + 1]));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, wv));
+        }
+
+        uint32_t rgb = round_fixed8(acc, vmax);
+        dst[i*3] = (uint8_t)rgb;
+        dst[i*3 + 1] = (uint8_t)(rgb >> 8);
+        dst[i*3 + 2] = (uint8_t)(rgb >> 16);
+    }
+}
+
+/*
+ * Two rows per madd: their samples interleaved as 16-bit pairs against a
+ * pair of weights. Packing the sums back undoes the interleave.
+ */
+static inline void resize_v_step(__m128i acc[4], const uint8_t *a, const uint8_t *b, __m128i w) {
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vb = (b != NULL) ? _mm_loadu_si128((const __m128i *)b) : _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    __m128i a_lo = _mm_unpacklo_epi8(va, zero), a_hi = _mm_unpackhi_epi8(va, zero);
+    __m128i b_lo = _mm_unpacklo_epi8(vb, zero), b_hi = _mm_unpackhi_epi8(vb, zero);
+
+    acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w));
+    acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w));
+    acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w));
+    acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w));
+}
+
+void ppm_resize_v_sse2(uint8_t *dst, const uint8_t *const *rows, size_t n, const int16_t *weights, uint32_t taps, uint16_t maxval) {
+    if (maxval > 255) {
+        ppm_resize_v_scalar(dst, rows, n, weights, taps, maxval);
+        return;
+    }
+
+    const __m128i round = _mm_set1_epi32(1 << (PPM_RESIZE_BITS - 1));
+    const __m128i vmax = _mm_set1_epi8((char)maxval);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i acc[4] = { round, round, round, round };
+        uint32_t k = 0;
+
+        for (; k + 2 <= taps; k += 2) {
+            __m128i w = _mm_set1_epi32(weight_pair(weights[k], weights[k + 1]));
+            resize_v_step(acc, rows[k] + i, rows[k + 1] + i, w);
+        }
+        if (k < taps)
+            resize_v_step(acc, rows[k] + i, NULL, _mm_set1_epi32(weight_pair(weights[k], 0)));
+
+        for (int j = 0; j < 4; ++j)
+            acc[j] = _mm_srai_epi32(acc[j], PPM_RESIZE_BITS);
+        __m128i lo = _mm_packs_epi32(acc[0], acc[1]);
+        __m128i hi = _mm_packs_epi32(acc[2], acc[3]);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_min_epu8(_mm_packus_epi16(lo, hi), vmax));
+    }
+
+    for (; i < n; ++i) {
+        int32_t acc = 1 << (PPM_RESIZE_BITS - 1);
+        for (uint32_t k = 0; k < taps; ++k)
+            acc += weights[k]*rows[k][i];
+
+        acc >>= PPM_RESIZE_BITS;
+        dst[i] = (uint8_t)((acc < 0) ? 0 : (acc > maxval) ? maxval : acc);
+    }
+}
+
+/*
+ * Statistics
+ * Without a byte shuffle the samples stay interleaved: 16 pixels are three
+ * vectors in which sample j of vector v belongs to channel (16v + j) % 3 for
+ * 8-bit and (8v + j) % 3 for 16-bit. Min and max are kept per lane and
+ * sorted into channels at the end, 16-bit sums and squares once per row.
+ * 8-bit sums and squares go through a per-channel mask, sums by sad and
+ * squares by madd into 32-bit lanes that STATS_FLUSH_8 blocks can't
+ * overflow (4096*12*255^2 < 2^32).
+ */
+#define STATS_FLUSH_8   4096
+#define STATS_FLUSH_16  65536
+
+typedef struct {
+    uint16_t lo[3], hi[3];
+    uint64_t sum[3], sum_sq[3];
+} stats_acc_t;
+
+static void stats_tail(stats_acc_t *acc, const uint8_t *row, size_t i, size_t width, int is16) {
+    for (; i < width; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            size_t o = i*3 + c;
+            uint32_t v = is16 ? (uint32_t)((row[o*2] << 8) | row[o*2 + 1]) : row[o];
+            if (v < acc->lo[c])
+                acc->lo[c] = (uint16_t)v;
+            if (v > acc->hi[c])
+                acc->hi[c] = (uint16_t)v;
+            acc->sum[c] += v;
+            acc->sum_sq[c] += (uint64_t)v*v;
+        }
+    }
+}
+
+static inline uint64_t hsum_u32(__m128i v) {
+    uint32_t t[4];
+    _mm_storeu_si128((__m128i*)t, v);
+    return (uint64_t)t[0] + t[1] + t[2] + t[3];
+}
+
+static inline uint64_t hsum_u64(__m128i v) {
+    uint64_t t[2];
+    _mm_storeu_si128((__m128i*)t, v);
+    return t[0] + t[1];
+}
+
+static void stats_rows8(stats_acc_t *acc, const PPM_img *img_ptr) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i mask[3][3], vlo[3], vhi[3], vsum[3];
+
+    for (int v = 0; v < 3; ++v) {
+        uint8_t m[3][16];
+        for (int j = 0; j < 16; ++j)
+            for (int c = 0; c < 3; ++c)
+                m[c][j] = ((16*v + j) % 3 == c) ? 0xFF : 0;
+        for (int c = 0; c < 3; ++c)
+            mask[v][c] = _mm_loadu_si128((const __m128i*)m[c]);
+
+        vlo[v] = _mm_set1_epi8(-1);
+        vhi[v] = zero;
+        vsum[v] = zero;
+    }
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
+        size_t i = 0;
+
+        while (i + 16 <= img_ptr->width) {
+            size_t blocks = (img_ptr->width - i) / 16;
+            if (blocks > STATS_FLUSH_8)
+                blocks = STATS_FLUSH_8;
+
+            __m128i sq32[3] = {zero, zero, zero};
+            for (; blocks > 0; --blocks, i += 16) {
+                for (int v = 0; v < 3; ++v) {
+                    __m128i x = _mm_loadu_si128((const __m128i*)(row + i*3 + 16*v));
+                    __m128i l = _mm_unpacklo_epi8(x, zero);
+                    __m128i h = _mm_unpackhi_epi8(x, zero);
+                    vlo[v] = _mm_min_epu8(vlo[v], x);
+                    vhi[v] = _mm_max_epu8(vhi[v], x);
+
+                    for (int c = 0; c < 3; ++c) {
+                        __m128i m = mask[v][c];
+                        vsum[c] = _mm_add_epi64(vsum[c], _mm_sad_epu8(_mm_and_si128(x, m), zero));
+                        sq32[c] = _mm_add_epi32(sq32[c], _mm_madd_epi16(_mm_and_si128(l, _mm_unpacklo_epi8(m, m)), l));
+                        sq32[c] = _mm_add_epi32(sq32[c], _mm_madd_epi16(_mm_and_si128(h, _mm_unpackhi_epi8(m, m)), h));
+                    }
+                }
+            }
+
+            for (int c = 0; c < 3; ++c)
+                acc->sum_sq[c] += hsum_u32(sq32[c]);
+        }
+
+        stats_tail(acc, row, i, img_ptr->width, 0);
+    }
+
+    for (int v = 0; v < 3; ++v) {
+        uint8_t lo[16], hi[16];
+        _mm_storeu_si128((__m128i*)lo, vlo[v]);
+        _mm_storeu_si128((__m128i*)hi, vhi[v]);
+
+        for (int j = 0; j < 16; ++j) {
+            int c = (16*v + j) % 3;
+            if (lo[j] < acc->lo[c])
+                acc->lo[c] = lo[j];
+            if (hi[j] > acc->hi[c])
+                acc->hi[c] = hi[j];
+        }
+        acc->sum[v] += hsum_u64(vsum[v]);
+    }
+}
+
+/*
+ * SSE2 only compares signed 16-bit lanes; flipping the top bit orders
+ * unsigned samples the same way
+ */
+static void stats_rows16(stats_acc_t *acc, const PPM_img *img_ptr) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    __m128i vlo[3], vhi[3];
+
+    for (int v = 0; v < 3; ++v) {
+        vlo[v] = _mm_set1_epi16(0x7FFF);
+        vhi[v] = sign;
+    }
+
+    for (size_t y = 0; y < img_ptr->height; ++y) {
+        const uint8_t *row = (const uint8_t *)img_ptr->data + y*img_ptr->stride;
+        size_t i = 0;
+
+        while (i + 8 <= img_ptr->width) {
+            size_t blocks = (img_ptr->width - i) / 8;
+            if (blocks > STATS_FLUSH_16)
+                blocks = STATS_FLUSH_16;
+
+            // Per lane: sums of samples 0-3 and 4-7, squares of the even and odd ones of each
+            __m128i sum32[3][2], sq64[3][4];
+            for (int v = 0; v < 3; ++v) {
+                sum32[v][0] = sum32[v][1] = zero;
+                sq64[v][0] = sq64[v][1] = sq64[v][2] = sq64[v][3] = zero;
+            }
+
+            for (; blocks > 0; --blocks, i += 8) {
+                for (int v = 0; v < 3; ++v) {
+                    __m128i x = bswap16(_mm_loadu_si128((const __m128i*)(row + i*6 + 16*v)));
+                    __m128i s = _mm_xor_si128(x, sign);
+                    __m128i l = _mm_unpacklo_epi16(x, zero);
+                    __m128i h = _mm_unpackhi_epi16(x, zero);
+                    __m128i lo = _mm_srli_epi64(l, 32), ho = _mm_srli_epi64(h, 32);
+                    vlo[v] = _mm_min_epi16(vlo[v], s);
+                    vhi[v] = _mm_max_epi16(vhi[v], s);
+                    sum32[v][0] = _mm_add_epi32(sum32[v][0], l);
+                    sum32[v][1] = _mm_add_epi32(sum32[v][1], h);
+                    sq64[v][0] = _mm_add_epi64(sq64[v][0], _mm_mul_epu32(l, l));
+                    sq64[v][1] = _mm_add_epi64(sq64[v][1], _mm_mul_epu32(lo, lo));
+                    sq64[v][2] = _mm_add_epi64(sq64[v][2], _mm_mul_epu32(h, h));
+                    sq64[v][3] = _mm_add_epi64(sq64[v][3], _mm_mul_epu32(ho, ho));
+                }
+            }
+
+            for (int v = 0; v < 3; ++v) {
+                uint32_t sum[8];
+                uint64_t sq[4][2];
+                _mm_storeu_si128((__m128i*)sum, sum32[v][0]);
+                _mm_storeu_si128((__m128i*)(sum + 4), sum32[v][1]);
+                for (int k = 0; k < 4; ++k)
+                    _mm_storeu_si128((__m128i*)sq[k], sq64[v][k]);
+
+                // sq[k][n] holds lane 4*(k/2) + 2*n + k%2
+                for (int j = 0; j < 8; ++j) {
+                    int c = (8*v + j) % 3;
+                    acc->sum[c] += sum[j];
+                    acc->sum_sq[c] += sq[(j/4)*2 + j%2][(j%4)/2];
+                }
+            }
+        }
+
+        stats_tail(acc, row, i, img_ptr->width, 1);
+    }
+
+    for (int v = 0; v < 3; ++v) {
+        uint16_t lo[8], hi[8];
+        _mm_storeu_si128((__m128i*)lo, _mm_xor_si128(vlo[v], sign));
+        _mm_storeu_si128((__m128i*)hi, _mm_xor_si128(vhi[v], sign));
+
+        for (int j = 0; j < 8; ++j) {
+            int c = (8*v + j) % 3;
+            if (lo[j] < acc->lo[c])
+                acc->lo[c] = lo[j];
+            if (hi[j] > acc->hi[c])
+                acc->hi[c] = hi[j];
+        }
+    }
+}
+
+int ppm_stats_sse2(const PPM_ptr img_ptr, PPM_stats *stats) {
+
+    if (ppm_validate(img_ptr) < 0 || stats == NULL) {
+        return -1;
+    }
+
+    // The shuffles below are for RGB
+    if (img_ptr->channels != 3)
+        return ppm_stats_scalar(img_ptr, stats);
+
+    stats_acc_t acc = {
+        .lo = {UINT16_MAX, UINT16_MAX, UINT16_MAX},
+    };
+
+    if (img_ptr->maxval > 255)
+        stats_rows16(&acc, img_ptr);
+    else
+        stats_rows8(&acc, img_ptr);
+
+    stats->count = (uint64_t)img_ptr->width*img_ptr->height;
+    for (int c = 0; c < 3; ++c) {
+        stats->min[c] = acc.lo[c];
+        stats->max[c] = acc.hi[c];
+        stats->sum[c] = acc.sum[c];
+        stats->sum_sq[c] = acc.sum_sq[c];
+    }
+
+    return 0;
+}
+
+/*
+ * Digits are '0'..'9', whitespace is ' ' and '\t'..'\r'; a 16-byte
+ * compare per class, 4 movemasks per 64 bytes
+ */
+uint64_t ppm_text_mask_sse2(const char *text, uint64_t *other) {
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i digit_max = _mm_set1_epi8((char)(0x80 + 9));
+    const __m128i ctrl_max = _mm_set1_epi8((char)(0x80 + '\r' - '\t'));
+    uint64_t digits = 0, rest = 0;
+
+    for (int k = 0; k < 4; ++k) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(text + 16*k));
+        // Unsigned range checks as signed compares on bytes offset by 0x80
+        __m128i d = _mm_cmpgt_epi8(_mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8('0')), bias), digit_max);
+        __m128i w = _mm_cmpgt_epi8(_mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8('\t')), bias), ctrl_max);
+        w = _mm_andnot_si128(w, _mm_set1_epi8(-1));
+        w = _mm_or_si128(w, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        uint64_t dm = (uint16_t)~_mm_movemask_epi8(d);
+        uint64_t wm = (uint16_t)_mm_movemask_epi8(w);
+        digits |= dm << (16*k);
+        rest |= (~(dm | wm) & 0xFFFF) << (16*k);
+    }
+
+    *other = rest;
+    return digits;
+}
+
 #endif
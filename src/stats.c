@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Histograms and statistics
+ *
+ * Both split the image into pieces: row bands on a row-major image, its own
+ * tiles on a tiled one. ppm_stats runs the backend's reduction over each
+ * piece and merges the partial results, which only takes adding sums and
+ * comparing extremes.
+ *
+ * Histograms are counted in plain C, since scattered increments don't
+ * vectorize; what limits them is the store-to-load dependency between two
+ * increments of the same bin. 8-bit pixels rotate through four
+ * sub-histograms so that runs of equal samples hit four different counters.
+ * 16-bit histograms already spread over 65536 bins and four copies would no
+ * longer fit in L2, so they count into one. Each thread counts its share of
+ * the pieces into a partial histogram and the partials are then summed bin
+ * range by bin range, also in parallel. The counting loop is instantiated
+ * per sample size and channel count (PPM_PIXEL_KINDS).
+ */
+
+#define HIST_SUBS       4
+#define HIST_MERGE_BINS 4096
+
+typedef struct {
+    PPM_ptr img_ptr;
+    uint32_t tile_rows;
+    uint32_t pieces;
+    uint32_t chunks;
+    uint32_t bins;
+    uint32_t channels;
+    PPM_stats *parts;
+    uint32_t **hists;
+    _Atomic int err;
+} stats_job_t;
+
+/*
+ * Pieces of the image, and whether they are worth spreading over the pool
+ */
+static int split(stats_job_t *job) {
+    const PPM_ptr img_ptr = job->img_ptr;
+    int parallel = ppm_get_threads() > 1 && img_ptr->data_size >= PPM_PARALLEL_MIN_BYTES;
+
+    job->tile_rows = img_ptr->height;
+    job->pieces = 1;
+
+    if (img_ptr->layout == PPM_LAYOUT_TILED) {
+        job->pieces = ppm_tile_count(img_ptr);
+    } else if (parallel) {
+        size_t rows = PPM_TILE_BYTES / img_ptr->stride;
+        job->tile_rows = (rows == 0) ? 1 : (uint32_t)rows;
+        job->pieces = (img_ptr->height + job->tile_rows - 1) / job->tile_rows;
+    }
+
+    return parallel && job->pieces > 1;
+}
+
+static void run(uint32_t count, ppm_tile_fn fn, stats_job_t *job, int parallel) {
+    if (parallel && count > 1) {
+        ppm_parallel_for(count, fn, job);
+    } else {
+        for (uint32_t i = 0; i < count; ++i)
+            fn(job, i);
+    }
+}
+
+static void stats_piece(void *ctx, uint32_t piece) {
+    stats_job_t *job = (stats_job_t *)ctx;
+    PPM_img band = ppm_tile_band(job->img_ptr, piece, job->tile_rows);
+
+    int err = ppm_ops()->stats(&band, &job->parts[piece]);
+    if (err != 0)
+        atomic_store(&job->err, err);
+}
+
+int ppm_stats(const PPM_ptr img_ptr, PPM_stats *stats) {
+    if (ppm_validate(img_ptr) < 0 || stats == NULL)
+        return -1;
+
+    stats_job_t job = { .img_ptr = img_ptr };
+    int parallel = split(&job);
+
+    // Zeroed, so that the channels the image doesn't have stay at 0
+    job.parts = (PPM_stats *)calloc(job.pieces, sizeof(PPM_stats));
+    if (job.parts == NULL)
+        return -1;
+
+    run(job.pieces, stats_piece, &job, parallel);
+
+    int err = atomic_load(&job.err);
+    if (err == 0) {
+        *stats = job.parts[0];
+        for (uint32_t p = 1; p < job.pieces; ++p) {
+            const PPM_stats *part = &job.parts[p];
+            stats->count += part->count;
+            for (int c = 0; c < img_ptr->channels; ++c) {
+                if (part->min[c] < stats->min[c])
+                    stats->min[c] = part->min[c];
+                if (part->max[c] > stats->max[c])
+                    stats->max[c] = part->max[c];
+                stats->sum[c] += part->sum[c];
+                stats->sum_sq[c] += part->sum_sq[c];
+            }
+        }
+
+        for (int c = 0; c < img_ptr->channels; ++c) {
+            double n = (double)stats->count;
+            double mean = (double)stats->sum[c] / n;
+            double variance = (double)stats->sum_sq[c] / n - mean*mean;
+
+            stats->mean[c] = mean;
+            stats->variance[c] = (variance > 0.0) ? variance : 0.0;
+        }
+    }
+
+    free(job.parts);
+    return err;
+}
+
+/*
+ * 8-bit pixels count into the sub-histograms, 16-bit ones straight into hist
+ */
+PPM_SPECIALIZE void count_band(uint32_t *hist, uint32_t sub[HIST_SUBS][PPM_MAX_CHANNELS*256], const PPM_img *band,
+                               const int is16, const int channels) {
+    for (size_t y = 0; y < band->height; ++y) {
+        const uint8_t *p = (const uint8_t *)band->data + y*band->stride;
+        size_t i = 0;
+
+        if (is16) {
+            for (; i < band->width; ++i, p += 2*channels) {
+                for (int c = 0; c < channels; ++c)
+                    hist[c*65536 + ((p[2*c] << 8) | p[2*c + 1])]++;
+            }
+            continue;
+        }
+
+        for (; i + HIST_SUBS <= band->width; i += HIST_SUBS) {
+            for (int s = 0; s < HIST_SUBS; ++s, p += channels) {
+                for (int c = 0; c < channels; ++c)
+                    sub[s][c*256 + p[c]]++;
+            }
+        }
+
+        for (; i < band->width; ++i, p += channels) {
+            for (int c = 0; c < channels; ++c)
+                sub[0][c*256 + p[c]]++;
+        }
+    }
+}
+
+typedef void (*count_fn)(uint32_t *, uint32_t [HIST_SUBS][PPM_MAX_CHANNELS*256], const PPM_img *);
+
+#define COUNT_KIND(kind, is16, channels) \
+    static void count_##kind(uint32_t *hist, uint32_t sub[HIST_SUBS][PPM_MAX_CHANNELS*256], const PPM_img *band) { \
+        count_band(hist, sub, band, is16, channels); \
+    }
+PPM_PIXEL_KINDS(COUNT_KIND)
+#undef COUNT_KIND
+
+#define COUNT_ENTRY(kind, is16, channels) count_##kind,
+static const count_fn count_kinds[PPM_PIXEL_KIND_COUNT] = { PPM_PIXEL_KINDS(COUNT_ENTRY) };
+#undef COUNT_ENTRY
+
+/*
+ * Count pieces [chunk*pieces/chunks, (chunk + 1)*pieces/chunks) into the
+ * chunk's partial histogram
+ */
+static void hist_chunk(void *ctx, uint32_t chunk) {
+    stats_job_t *job = (stats_job_t *)ctx;
+    uint32_t *hist = job->hists[chunk];
+    uint32_t begin = (uint32_t)((uint64_t)chunk*job->pieces / job->chunks);
+    uint32_t end = (uint32_t)((uint64_t)(chunk + 1)*job->pieces / job->chunks);
+
+    memset(hist, 0, (size_t)job->channels*job->bins*sizeof(uint32_t));
+
+    const PPM_img *img_ptr = job->img_ptr;
+    const count_fn count = count_kinds[ppm_pixel_kind(img_ptr->maxval, img_ptr->channels)];
+
+    if (job->bins == 256) {
+        uint32_t sub[HIST_SUBS][PPM_MAX_CHANNELS*256];
+        memset(sub, 0, sizeof(sub));
+
+        for (uint32_t piece = begin; piece < end; ++piece) {
+            PPM_img band = ppm_tile_band(job->img_ptr, piece, job->tile_rows);
+            count(hist, sub, &band);
+        }
+
+        for (size_t b = 0; b < (size_t)job->channels*256; ++b) {
+            for (int s = 0; s < HIST_SUBS; ++s)
+                hist[b] += sub[s][b];
+        }
+    } else {
+        for (uint32_t piece = begin; piece < end; ++piece) {
+            PPM_img band = ppm_tile_band(job->img_ptr, piece, job->tile_rows);
+            count(hist, NULL, &band);
+        }
+    }
+}
+
+static void hist_merge(void *ctx, uint32_t range) {
+    stats_job_t *job = (stats_job_t *)ctx;
+    uint32_t *hist = job->hists[0];
+    size_t begin = (size_t)range*HIST_MERGE_BINS;
+    size_t end = begin + HIST_MERGE_BINS;
+    if (end > (size_t)job->channels*job->bins)
+        end = (size_t)job->channels*job->bins;
+
+    for (uint32_t chunk = 1; chunk < job->chunks; ++chunk) {
+        const uint32_t *part = job->hists[chunk];
+        for (size_t b = begin; b < end; ++b)
+            hist[b] += part[b];
+    }
+}
+
+int ppm_histogram(const PPM_ptr img_ptr, uint32_t *hist) {
+    if (ppm_validate(img_ptr) < 0 || hist == NULL)
+        return -1;
+
+    stats_job_t job = { .img_ptr = img_ptr, .bins = PPM_HISTOGRAM_BINS(img_ptr->maxval), .channels = img_ptr->channels };
+    int parallel = split(&job);
+
+    job.chunks = 1;
+    if (parallel) {
+        job.chunks = (uint32_t)ppm_get_threads();
+        if (job.chunks > job.pieces)
+            job.chunks = job.pieces;
+    }
+
+    job.hists = (uint32_t **)malloc(job.chunks*sizeof(uint32_t *));
+    if (job.hists == NULL)
+        return -1;
+
+    // The first chunk counts straight into hist
+    size_t bytes = (size_t)job.channels*job.bins*sizeof(uint32_t);
+    job.hists[0] = hist;
+
+    int err = 0;
+    uint32_t chunks = 1;
+    for (; chunks < job.chunks; ++chunks) {
+        job.hists[chunks] = (uint32_t *)ppm_alloc(bytes);
+        if (job.hists[chunks] == NULL) {
+            err = -1;
+            break;
+        }
+    }
+
+    if (err == 0) {
+        run(job.chunks, hist_chunk, &job, parallel);
+        run((uint32_t)(((size_t)job.channels*job.bins + HIST_MERGE_BINS - 1) / HIST_MERGE_BINS), hist_merge, &job, parallel);
+    }
+
+    for (uint32_t chunk = 1; chunk < chunks; ++chunk)
+        ppm_dealloc(job.hists[chunk], bytes);
+    free(job.hists);
+
+    return err;
+}
@@ -0,0 +1,224 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+static size_t stream_row_bytes(const PPM_stream_ptr stream) {
+    return (size_t)stream->width*ppm_pixel_bytes(stream->maxval, stream->channels);
+}
+
+/*
+ * Open a PGM, PPM or PAM file for reading in row bands
+ * Only the header is read; the raster is pulled in by ppm_stream_read
+ */
+PPM_stream_ptr ppm_stream_open(const char *file_name) {
+
+    FILE *fp = fopen(file_name, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: Could not open file.\n", file_name);
+        return NULL;
+    }
+
+    char header[PPM_HEADER_MAX];
+    size_t n = fread(header, sizeof(char), sizeof(header), fp);
+
+    PPM_img meta = {0};
+    int format = 0;
+    int header_size = (n > 3) ? token_consume_header(&meta, &format, header, n) : -1;
+
+    if (header_size < 0) {
+        fprintf(stderr, "%s: error parsing header: Could not read file format. Only PNM (P1-P6) and PAM (P7) are supported.\n", file_name);
+        fclose(fp);
+        return NULL;
+    }
+
+    // Rows of plain text or bits can't be read straight into a band
+    if (!ppm_format_direct(format)) {
+        fprintf(stderr, "%s: plain and PBM rasters can't be streamed.\n", file_name);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (fseeko(fp, header_size, SEEK_SET) != 0) {
+        perror(file_name);
+        fclose(fp);
+        return NULL;
+    }
+
+    PPM_stream_ptr stream = (PPM_stream_ptr)malloc(sizeof(PPM_stream));
+    if (stream == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    stream->fp = fp;
+    stream->width = meta.width;
+    stream->height = meta.height;
+    stream->maxval = meta.maxval;
+    stream->channels = meta.channels;
+    stream->row = 0;
+    stream->writing = 0;
+
+    return stream;
+}
+
+/*
+ * Create a PPM file to be written in row bands, top to bottom
+ * Same overwrite rules as ppm_save_image
+ */
+PPM_stream_ptr ppm_stream_create(const char *file_name, uint32_t width, uint32_t height, uint16_t maxval, int force) {
+
+    if (width == 0 || height == 0 || maxval == 0) {
+        return NULL;
+    }
+
+    if (!file_empty(file_name) && !force) {
+        fprintf(stderr, "ERR: ppm_stream_create: file already exists and is not empty. (toggle the force option to overwrite it)\n");
+        return NULL;
+    }
+
+    FILE *fp = fopen(file_name, "wb");
+    if (fp == NULL) {
+        perror(file_name);
+        return NULL;
+    }
+
+    if (fprintf(fp, "P6%c%u %u%c%u%c", WHITESPACE_CHAR, width, height, WHITESPACE_CHAR, maxval, WHITESPACE_CHAR) < 0) {
+        perror(file_name);
+        fclose(fp);
+        return NULL;
+    }
+
+    PPM_stream_ptr stream = (PPM_stream_ptr)malloc(sizeof(PPM_stream));
+    if (stream == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    stream->fp = fp;
+    stream->width = width;
+    stream->height = height;
+    stream->maxval = maxval;
+    stream->channels = 3;
+    stream->row = 0;
+    stream->writing = 1;
+
+    return stream;
+}
+
+/*
+ * Allocate a band image of the stream's width, maxval and channels holding up to rows rows
+ * The band is a regular aligned PPM_img, so every bulk operation runs on it
+ */
+PPM_ptr ppm_stream_band(const PPM_stream_ptr stream, uint32_t rows) {
+    if (stream == NULL)
+        return NULL;
+
+    return ppm_create_channels(stream->width, rows, stream->maxval, stream->channels);
+}
+
+/*
+ * Read the next band of rows into band, straight into its strided rows
+ * band must match the stream's width, maxval and channels; its height is the band size.
+ * The last band may be shorter, in which case band's height is reduced to it.
+ * Returns the number of rows read, 0 at the end of the image, negative on error
+ */
+int ppm_stream_read(PPM_stream_ptr stream, PPM_ptr band) {
+
+    if (stream == NULL || stream->writing || ppm_validate(band) < 0) {
+        return -1;
+    }
+
+    if (band->width != stream->width || band->maxval != stream->maxval ||
+            band->channels != stream->channels || band->layout != PPM_LAYOUT_ROWS) {
+        return -2;
+    }
+
+    uint32_t rows = stream->height - stream->row;
+    if (rows == 0)
+        return 0;
+    if (rows > band->height)
+        rows = band->height;
+
+    if (ppm_unshare(band) < 0)
+        return -1;
+
+    size_t row_bytes = stream_row_bytes(stream);
+
+    for (uint32_t y = 0; y < rows; ++y) {
+        data_t dst_row = band->data + y*band->stride;
+
+        if (fread(dst_row, sizeof(char), row_bytes, stream->fp) != row_bytes) {
+            fprintf(stderr, "ERROR: ppm_stream_read: file is truncated at row %u.\n", stream->row + y);
+            return -1;
+        }
+    }
+
+    if (rows < band->height) {
+        band->height = rows;
+        band->data_size = ppm_data_size(band->width, rows, band->maxval, band->channels);
+    }
+
+    stream->row += rows;
+    return (int)rows;
+}
+
+/*
+ * Append the rows of band to the file
+ * Returns the number of rows written, negative on error
+ */
+int ppm_stream_write(PPM_stream_ptr stream, const PPM_ptr band) {
+
+    if (stream == NULL || !stream->writing || ppm_validate(band) < 0) {
+        return -1;
+    }
+
+    if (band->width != stream->width || band->maxval != stream->maxval ||
+            band->channels != stream->channels || band->layout != PPM_LAYOUT_ROWS) {
+        return -2;
+    }
+
+    if (band->height > stream->height - stream->row) {
+        return -3;
+    }
+
+    size_t row_bytes = stream_row_bytes(stream);
+
+    for (uint32_t y = 0; y < band->height; ++y) {
+        data_t src_row = band->data + y*band->stride;
+
+        if (fwrite(src_row, sizeof(char), row_bytes, stream->fp) != row_bytes) {
+            fprintf(stderr, "ERROR: ppm_stream_write: couldn't write row %u to stream.\n", stream->row + y);
+            return -1;
+        }
+    }
+
+    stream->row += band->height;
+    return (int)band->height;
+}
+
+/*
+ * Close the stream and free it
+ * Fails if a written image is missing rows or the final flush fails
+ */
+int ppm_stream_close(PPM_stream_ptr stream) {
+
+    if (stream == NULL)
+        return -1;
+
+    int err = 0;
+    if (stream->writing && stream->row != stream->height) {
+        fprintf(stderr, "ERROR: ppm_stream_close: only %u of %u rows written.\n", stream->row, stream->height);
+        err = -1;
+    }
+
+    if (fclose(stream->fp) != 0)
+        err = -1;
+
+    free(stream);
+    return err;
+}
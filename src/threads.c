@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+/*
+ * Persistent worker pool for the bulk operations
+ *
+ * A job is a range of tiles. Every participant (the workers plus the calling
+ * thread) starts with an even share and pops tiles from the front of it.
+ * A participant that runs dry steals the back half of another participant's
+ * share, so a slow or descheduled core doesn't hold up the whole job.
+ */
+
+/*
+ * A share of tiles, [begin, end) packed as (end << 32 | begin) so that the
+ * owner and thieves can update it with a single CAS
+ * One per cache line to keep the owners from false sharing
+ */
+typedef struct {
+    _Alignas(64) _Atomic uint64_t range;
+} tile_share_t;
+
+static struct {
+    pthread_mutex_t submit;     // one job at a time
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+
+    pthread_t *workers;
+    int n_threads;              // participants, the calling thread included
+    int stop;
+    unsigned long generation;
+    int active;                 // workers still on the current job
+    int configured;             // sized by ppm_set_threads or ppm_init
+
+    ppm_tile_fn fn;
+    void *ctx;
+    tile_share_t *shares;
+} pool = {
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .finish = PTHREAD_COND_INITIALIZER,
+    .n_threads = 1,
+};
+
+static inline uint64_t pack_range(uint32_t begin, uint32_t end) {
+    return ((uint64_t)end << 32) | begin;
+}
+
+static int share_pop(tile_share_t *share, uint32_t *tile) {
+    uint64_t cur = atomic_load_explicit(&share->range, memory_order_relaxed);
+
+    for (;;) {
+        uint32_t begin = (uint32_t)cur, end = (uint32_t)(cur >> 32);
+        if (begin >= end)
+            return 0;
+
+        if (atomic_compare_exchange_weak(&share->range, &cur, pack_range(begin + 1, end))) {
+            *tile = begin;
+            return 1;
+        }
+    }
+}
+
+static int share_steal(tile_share_t *share, uint32_t *stolen_begin, uint32_t *stolen_end) {
+    uint64_t cur = atomic_load_explicit(&share->range, memory_order_relaxed);
+
+    for (;;) {
+        uint32_t begin = (uint32_t)cur, end = (uint32_t)(cur >> 32);
+        if (begin >= end)
+            return 0;
+
+        uint32_t half = (end - begin + 1) / 2;
+        if (atomic_compare_exchange_weak(&share->range, &cur, pack_range(begin, end - half))) {
+            *stolen_begin = end - half;
+            *stolen_end = end;
+            return 1;
+        }
+    }
+}
+
+static void run_participant(int self) {
+    tile_share_t *own = &pool.shares[self];
+    uint32_t tile, begin, end;
+
+    for (;;) {
+        while (share_pop(own, &tile))
+            pool.fn(pool.ctx, tile);
+
+        int stole = 0;
+        for (int i = 1; i < pool.n_threads && !stole; i++) {
+            int victim = (self + i) % pool.n_threads;
+            if (share_steal(&pool.shares[victim], &begin, &end)) {
+                // Park the loot in our own share so it can be stolen in turn
+                atomic_store(&own->range, pack_range(begin, end));
+                stole = 1;
+            }
+        }
+
+        if (!stole)
+            return;
+    }
+}
+
+static void *worker_main(void *arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.stop && pool.generation == seen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+
+        if (pool.stop) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_participant(self);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active == 0)
+            pthread_cond_signal(&pool.finish);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static void stop_workers(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 1; i < pool.n_threads; i++)
+        pthread_join(pool.workers[i], NULL);
+
+    free(pool.workers);
+    free(pool.shares);
+    pool.workers = NULL;
+    pool.shares = NULL;
+    pool.n_threads = 1;
+    pool.stop = 0;
+    pool.generation = 0;
+}
+
+/*
+ * Resize the pool to n_threads participants (the calling thread included)
+ * n_threads <= 0 uses one per online CPU. 1 runs everything on the caller.
+ */
+int ppm_set_threads(int n_threads) {
+
+    if (n_threads <= 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpus > 0) ? (int)n_cpus : 1;
+    }
+
+    pthread_mutex_lock(&pool.submit);
+    pool.configured = 1;
+
+    if (n_threads == pool.n_threads) {
+        pthread_mutex_unlock(&pool.submit);
+        return 0;
+    }
+
+    stop_workers();
+
+    if (n_threads == 1) {
+        pthread_mutex_unlock(&pool.submit);
+        return 0;
+    }
+
+    pool.workers = (pthread_t *)calloc(n_threads, sizeof(pthread_t));
+    pool.shares = (tile_share_t *)aligned_alloc(_Alignof(tile_share_t), n_threads*sizeof(tile_share_t));
+    if (pool.workers == NULL || pool.shares == NULL) {
+        free(pool.workers);
+        free(pool.shares);
+        pool.workers = NULL;
+        pool.shares = NULL;
+        pthread_mutex_unlock(&pool.submit);
+        return -1;
+    }
+
+    // Keep whatever did start if thread creation fails part way
+    for (int i = 1; i < n_threads; i++) {
+        if (pthread_create(&pool.workers[i], NULL, worker_main, (void *)(intptr_t)i) != 0)
+            break;
+        pool.n_threads = i + 1;
+    }
+
+    int err = (pool.n_threads == n_threads) ? 0 : -1;
+    pthread_mutex_unlock(&pool.submit);
+    return err;
+}
+
+int ppm_get_threads(void) {
+    return pool.n_threads;
+}
+
+/*
+ * Size the pool on ppm_init unless the application already did
+ * CACHEPIX_THREADS overrides the one-per-CPU default
+ */
+void ppm_threads_init(void) {
+    if (pool.configured)
+        return;
+
+    const char *env = getenv("CACHEPIX_THREADS");
+    ppm_set_threads(env != NULL ? atoi(env) : 0);
+}
+
+/*
+ * Run fn(ctx, tile) for every tile in [0, n_tiles) across the pool
+ * Returns when all tiles are done. Runs on the caller alone when the pool
+ * has a single thread or is busy with another job.
+ */
+void ppm_parallel_for(uint32_t n_tiles, ppm_tile_fn fn, void *ctx) {
+
+    if (pool.n_threads == 1 || n_tiles < 2 || pthread_mutex_trylock(&pool.submit) != 0) {
+        for (uint32_t t = 0; t < n_tiles; t++)
+            fn(ctx, t);
+        return;
+    }
+
+    int n = pool.n_threads;
+    for (int i = 0; i < n; i++) {
+        uint32_t begin = (uint32_t)(((uint64_t)n_tiles * i) / n);
+        uint32_t end = (uint32_t)(((uint64_t)n_tiles * (i + 1)) / n);
+        atomic_store(&pool.shares[i].range, pack_range(begin, end));
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.active = n - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_participant(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active > 0)
+        pthread_cond_wait(&pool.finish, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.submit);
+}
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cachepix.h"
+#include "cachepix_internal.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PPM_HAVE_URING 1
+#endif
+
+/*
+ * Minimal io_uring driver on the raw system calls (no liburing)
+ * Only what the batch loader and the direct writer need: a single ring,
+ * plain reads and writes, one waiter.
+ */
+
+#ifdef PPM_HAVE_URING
+
+void ppm_ring_close(ppm_ring_t *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+int ppm_ring_open(ppm_ring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ppm_ring_close(ring);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ppm_ring_close(ring);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ppm_ring_close(ring);
+        return -1;
+    }
+
+    char *sq = (char *)ring->sq_ring;
+    char *cq = (char *)ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    ring->entries = p.sq_entries;
+
+    return 0;
+}
+
+/*
+ * Queue one request; callers never have more than the ring's entries in flight
+ */
+void ppm_ring_queue(ppm_ring_t *ring, int op, int fd, void *addr, uint32_t len,
+                    uint64_t offset, uint64_t user_data) {
+    static const uint8_t opcodes[] = {
+        [PPM_RING_READ] = IORING_OP_READ,
+        [PPM_RING_READV] = IORING_OP_READV,
+        [PPM_RING_WRITE] = IORING_OP_WRITE,
+    };
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcodes[op];
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+int ppm_ring_submit_and_wait(ppm_ring_t *ring) {
+    for (;;) {
+        int r = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r >= 0) {
+            ring->to_submit -= (unsigned)r;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+    }
+}
+
+int ppm_ring_reap(ppm_ring_t *ring, uint64_t *user_data, int32_t *res) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    const struct io_uring_cqe *cqe = &((const struct io_uring_cqe *)ring->cqes)[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#else
+
+int ppm_ring_open(ppm_ring_t *ring, unsigned entries) {
+    (void)entries;
+    memset(ring, 0, sizeof(*ring));
+    return -1;
+}
+
+void ppm_ring_close(ppm_ring_t *ring) {
+    (void)ring;
+}
+
+void ppm_ring_queue(ppm_ring_t *ring, int op, int fd, void *addr, uint32_t len,
+                    uint64_t offset, uint64_t user_data) {
+    (void)ring; (void)op; (void)fd; (void)addr; (void)len; (void)offset; (void)user_data;
+}
+
+int ppm_ring_submit_and_wait(ppm_ring_t *ring) {
+    (void)ring;
+    return -1;
+}
+
+int ppm_ring_reap(ppm_ring_t *ring, uint64_t *user_data, int32_t *res) {
+    (void)ring; (void)user_data; (void)res;
+    return 0;
+}
+
+#endif